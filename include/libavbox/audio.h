@@ -2,11 +2,14 @@
 #define __MB_AUDIO_H__
 
 #include <stdint.h>
+#include <sys/types.h>
 
 
 #define AVBOX_AUDIOSTREAM_UNDERRUN		(1)
 #define AVBOX_AUDIOSTREAM_CRITICAL_ERROR	(2)
-#define AVBOX_AUDIOSTREAM_PACKET_RELEASED	(3)
+
+/* the frames are IEC 61937 bursts for a digital receiver */
+#define AVBOX_AUDIOSTREAM_PASSTHROUGH		(0x1)
 
 
 /**
@@ -69,11 +72,43 @@ avbox_audiostream_resume(struct avbox_audiostream * const inst);
 
 
 /**
- * Writes n_frames audio frames to the stream.
+ * Gets a contiguous span of free space on the ring. If the
+ * ring is full it waits once and returns NULL with errno set
+ * to EAGAIN if it's still full. The frames are queued by
+ * avbox_audiostream_commit().
  */
-int
+uint8_t *
+avbox_audiostream_getbuffer(struct avbox_audiostream * const stream,
+	size_t * const n_frames);
+
+
+/**
+ * Queues n_frames frames written to the buffer returned
+ * by avbox_audiostream_getbuffer().
+ */
+void
+avbox_audiostream_commit(struct avbox_audiostream * const stream,
+	const size_t n_frames);
+
+
+/**
+ * Copies up to n_frames audio frames to the stream. Returns
+ * the number of frames copied or -1 with errno set to EAGAIN
+ * if the ring is full.
+ */
+ssize_t
 avbox_audiostream_write(struct avbox_audiostream * const stream,
-	uint8_t * const data, const size_t n_frames, void * const callback_handle);
+	const uint8_t * const data, const size_t n_frames);
+
+
+/**
+ * Sets the stream's frame rate and flags. The frames are
+ * always interleaved S16 stereo. This must be called before
+ * the stream is started or any frames are written to it.
+ */
+int
+avbox_audiostream_setformat(struct avbox_audiostream * const stream,
+	const unsigned int framerate, const int flags);
 
 
 /**
@@ -84,7 +119,7 @@ avbox_audiostream_ispaused(const struct avbox_audiostream * const stream);
 
 
 /**
- * Get the number of frames buffered.
+ * Get the number of frames and control packets buffered.
  */
 unsigned int
 avbox_audiostream_count(struct avbox_audiostream * const stream);
@@ -97,6 +132,14 @@ unsigned int
 avbox_audiostream_size(struct avbox_audiostream * const stream);
 
 
+/**
+ * Get the number of frames the stream can buffer at
+ * its current frame rate.
+ */
+unsigned int
+avbox_audiostream_capacity(struct avbox_audiostream * const stream);
+
+
 /**
  * Starts the stream playback.
  */
@@ -113,10 +156,11 @@ avbox_audiostream_drain(struct avbox_audiostream * const inst);
 
 
 /**
- * Create a new sound stream.
+ * Create a new sound stream with a ring buffer of
+ * buffer_msecs.
  */
 struct avbox_audiostream *
-avbox_audiostream_new(int max_frames,
+avbox_audiostream_new(const int buffer_msecs,
 	avbox_audiostream_callback underrun_callback,
 	void * const callback_context);
 
@@ -0,0 +1,84 @@
+/**
+ * avbox - Toolkit for Embedded Multimedia Applications
+ * Copyright (C) 2016-2017 Fernando Rodriguez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License Version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+
+#ifndef __AVBOX_AUDIOCLOCK__
+#define __AVBOX_AUDIOCLOCK__
+
+#include <stdint.h>
+
+#include "compiler.h"
+
+
+/**
+ * A clock sample published by the audio thread. It is
+ * protected by a sequence lock so it can be read from any
+ * thread without locking or making syscalls. Only one thread
+ * may publish at a time.
+ */
+struct avbox_audioclock
+{
+	unsigned int seq;
+	int running;
+	int64_t time;	/* audio time at anchor */
+	int64_t anchor;	/* monotonic time of the sample */
+	int64_t limit;	/* end of the audio written so far */
+} CACHELINE_ALIGNED;
+
+
+/**
+ * Gets the monotonic time in microseconds.
+ */
+int64_t
+avbox_audioclock_now(void);
+
+
+/**
+ * Initialize a stopped clock.
+ */
+void
+avbox_audioclock_init(struct avbox_audioclock * const clock,
+	const int64_t time);
+
+
+/**
+ * Publish a running clock sample. The clock advances from
+ * time at anchor until it reaches limit.
+ */
+void
+avbox_audioclock_set(struct avbox_audioclock * const clock,
+	const int64_t time, const int64_t anchor, const int64_t limit);
+
+
+/**
+ * Publish a stopped clock.
+ */
+void
+avbox_audioclock_stop(struct avbox_audioclock * const clock,
+	const int64_t time);
+
+
+/**
+ * Gets the clock time at now.
+ */
+int64_t
+avbox_audioclock_gettime(const struct avbox_audioclock * const clock,
+	const int64_t now);
+
+#endif
@@ -72,5 +72,6 @@
 
 #include "torrent_stream.h"
 #include "torrent_in.h"
+#include "streamcache.h"
 
 #endif
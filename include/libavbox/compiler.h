@@ -47,6 +47,13 @@
 #define ATOMIC_INC(addr) (__sync_fetch_and_add(addr, 1))
 #define ATOMIC_DEC(addr) (__sync_fetch_and_sub(addr, 1))
 #define MEMORY_BARRIER() __sync_synchronize()
+#define ATOMIC_LOAD_ACQUIRE(addr) (__atomic_load_n(addr, __ATOMIC_ACQUIRE))
+#define ATOMIC_STORE_RELEASE(addr, val) (__atomic_store_n(addr, val, __ATOMIC_RELEASE))
+
+/* used to keep data written by different threads on
+ * separate cache lines */
+#define CACHELINE_SIZE		(64)
+#define CACHELINE_ALIGNED	__attribute__ ((aligned(CACHELINE_SIZE)))
 
 /*
  * Access modifiers.
@@ -1,6 +1,11 @@
 #ifndef __AVBOX_DBUTIL__
 #define __AVBOX_DBUTIL__
 
+#include <stdint.h>
+
+struct sqlite3;
+struct sqlite3_stmt;
+
 
 /**
  * Request a filename in the writable partiton.
@@ -16,4 +21,74 @@ avbox_dbutil_getdbfile(const char * const filename);
 char *
 avbox_dbutil_escapesql(const char * const sql);
 
+
+/**
+ * Gets the calling thread's connection to a database in the
+ * writable partition. Connections are opened in WAL mode on
+ * first use and stay open until the thread exits or it calls
+ * avbox_dbutil_close(). Don't close it.
+ */
+struct sqlite3 *
+avbox_dbutil_getdb(const char * const filename);
+
+
+/**
+ * Gets a prepared statement from the calling thread's cache,
+ * preparing it the first time. Bind the parameters, step it,
+ * and call avbox_dbutil_done() when done with it. Don't
+ * finalize it.
+ */
+struct sqlite3_stmt *
+avbox_dbutil_prepare(const char * const filename, const char * const sql);
+
+
+/**
+ * Steps a statement, retrying a few times while the database
+ * is busy. Returns the sqlite3_step() result (SQLITE_BUSY if
+ * it's still busy after the last retry).
+ */
+int
+avbox_dbutil_step(struct sqlite3_stmt * const stmt);
+
+
+/**
+ * Resets a statement and clears its bindings.
+ */
+void
+avbox_dbutil_done(struct sqlite3_stmt * const stmt);
+
+
+/**
+ * Runs a statement that doesn't return rows and resets
+ * it. Returns 0 on success or -1 on error (errno is EBUSY
+ * if the database stayed locked).
+ */
+int
+avbox_dbutil_exec(struct sqlite3_stmt * const stmt);
+
+
+/**
+ * Runs a query and stores the first column of the first row
+ * in value. Returns -1 with errno set to ENOENT if there are
+ * no rows.
+ */
+int
+avbox_dbutil_getint64(struct sqlite3_stmt * const stmt, int64_t * const value);
+
+
+/**
+ * Runs a query and returns a copy of the first column of the
+ * first row that must be freed. Returns NULL with errno set to
+ * ENOENT if there are no rows.
+ */
+char *
+avbox_dbutil_gettext(struct sqlite3_stmt * const stmt);
+
+
+/**
+ * Closes the calling thread's connections.
+ */
+void
+avbox_dbutil_close(void);
+
 #endif
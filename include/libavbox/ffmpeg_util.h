@@ -36,6 +36,7 @@
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libswscale/swscale.h>
+#include <libswresample/swresample.h>
 #include <libavfilter/avfiltergraph.h>
 #include <libavfilter/buffersink.h>
 #include <libavfilter/buffersrc.h>
@@ -50,6 +51,9 @@ avbox_pixfmt_from_libav(enum AVPixelFormat pix_fmt)
 	switch (pix_fmt) {
 	case AV_PIX_FMT_YUV420P: return AVBOX_PIXFMT_YUV420P;
 	case AV_PIX_FMT_BGRA: return AVBOX_PIXFMT_BGRA;
+	case AV_PIX_FMT_NV12: return AVBOX_PIXFMT_NV12;
+	case AV_PIX_FMT_P010LE: return AVBOX_PIXFMT_P010;
+	case AV_PIX_FMT_YUV420P10LE: return AVBOX_PIXFMT_YUV420P10;
 	default: return AVBOX_PIXFMT_UNKNOWN;
 	}
 }
@@ -59,17 +63,67 @@ static inline enum AVPixelFormat
 avbox_pixfmt_to_libav(enum avbox_pixel_format pix_fmt)
 {
 	switch (pix_fmt) {
-	case AVBOX_PIXFMT_UNKNOWN: return (enum AVPixelFormat) 0;
+	case AVBOX_PIXFMT_UNKNOWN: return AV_PIX_FMT_NONE;
 	case AVBOX_PIXFMT_BGRA: return AV_PIX_FMT_BGRA;
 	case AVBOX_PIXFMT_YUV420P: return AV_PIX_FMT_YUV420P;
-	case AVBOX_PIXFMT_MMAL: return (enum AVPixelFormat) 0;
+	case AVBOX_PIXFMT_MMAL: return AV_PIX_FMT_NONE;
+	case AVBOX_PIXFMT_NV12: return AV_PIX_FMT_NV12;
+	case AVBOX_PIXFMT_P010: return AV_PIX_FMT_P010LE;
+	case AVBOX_PIXFMT_YUV420P10: return AV_PIX_FMT_YUV420P10LE;
 	}
-	return (enum AVPixelFormat) 0;
+	return AV_PIX_FMT_NONE;
 }
 
 
 /**
- * Initialize ffmpeg's filter graph
+ * A cached swscale context. The context is reused for as
+ * long as the conversion parameters don't change.
+ */
+struct avbox_swscache
+{
+	struct SwsContext *ctx;
+	int src_w;
+	int src_h;
+	enum AVPixelFormat src_fmt;
+	int dst_w;
+	int dst_h;
+	enum AVPixelFormat dst_fmt;
+	int flags;
+	unsigned int hits;
+	unsigned int misses;
+};
+
+
+/**
+ * Initialize a swscale context cache.
+ */
+void
+avbox_ffmpegutil_swscache_init(struct avbox_swscache * const cache);
+
+
+/**
+ * Get a swscale context for the given conversion. If the
+ * cached context matches it is returned, otherwise it is
+ * replaced.
+ */
+struct SwsContext *
+avbox_ffmpegutil_swscache_get(struct avbox_swscache * const cache,
+	const int src_w, const int src_h, const enum AVPixelFormat src_fmt,
+	const int dst_w, const int dst_h, const enum AVPixelFormat dst_fmt,
+	const int flags);
+
+
+/**
+ * Free the cached swscale context.
+ */
+void
+avbox_ffmpegutil_swscache_free(struct avbox_swscache * const cache);
+
+
+/**
+ * Initialize ffmpeg's filter graph. The decoded frames are
+ * in src_fmt, which is not always the decoder's pix_fmt
+ * (ie. when hardware frames are downloaded).
  */
 int
 avbox_ffmpegutil_initvideofilters(
@@ -78,6 +132,7 @@ avbox_ffmpegutil_initvideofilters(
 	AVFilterContext **buffersink_ctx,
 	AVFilterContext **buffersrc_ctx,
 	AVFilterGraph **filter_graph,
+	enum AVPixelFormat src_fmt,
 	enum AVPixelFormat pix_fmt,
 	const char *filters_descr,
 	int stream_index);
@@ -95,8 +150,18 @@ avbox_ffmpegutil_initaudiofilters(
 	const char *sample_fmt_name);
 
 
+/* flags for avbox_ffmpegutil_opencodeccontext() */
+#define AVBOX_CODECFLAGS_NONE		(0x0)
+#define AVBOX_CODECFLAGS_EXPORT_MVS	(0x1)
+
+
+/**
+ * Opens a decoder for a stream. If threads is 0 the
+ * decoder uses one thread per CPU core.
+ */
 AVCodecContext *
 avbox_ffmpegutil_opencodeccontext(int *stream_idx,
-	AVFormatContext *fmt_ctx, enum AVMediaType type);
+	AVFormatContext *fmt_ctx, enum AVMediaType type,
+	int threads, const int flags);
 
 #endif
@@ -23,6 +23,12 @@
 
 #include <inttypes.h>
 
+
+/* queue flags */
+#define AVBOX_QUEUEFLAGS_NONE	(0x0)
+#define AVBOX_QUEUEFLAGS_SPSC	(0x1)
+
+
 /**
  * Represents a queue object.
  */
@@ -82,7 +88,9 @@ avbox_queue_timedpeek(struct avbox_queue * const inst, const int64_t timeout);
  * Sets the queue size limit. NOTE: If the queue is currently
  * above the newly set limit all calls to avbox_queue_put() will
  * continue to block until the size is reduced bellow the new
- * size */
+ * size. The ring of an SPSC queue cannot grow so its limit is
+ * capped at twice the size it was created with.
+ */
 void
 avbox_queue_setsize(struct avbox_queue * const inst, size_t sz);
 
@@ -119,9 +127,15 @@ avbox_queue_setname(struct avbox_queue * const inst, const char * const name);
 
 /**
  * Creates a new queue object.
+ *
+ * If AVBOX_QUEUEFLAGS_SPSC is set the queue is a lock-free ring
+ * that only supports one producer and one consumer thread at a
+ * time. The ring holds up to twice the initial size so that the
+ * limit can later be raised with avbox_queue_setsize(). SPSC queues
+ * must be bounded.
  */
 struct avbox_queue *
-avbox_queue_new(size_t sz);
+avbox_queue_new(size_t sz, const int flags);
 
 
 /**
@@ -24,6 +24,8 @@
 
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <sys/types.h>
 
 
 struct avbox_httpstream;
@@ -52,9 +54,47 @@ avbox_httpstream_read(struct avbox_httpstream * const file,
 
 
 /**
- * Seek the network stream
+ * Gets the size of the remote file or -1 if the server
+ * doesn't say.
  */
-void
+int64_t
+avbox_httpstream_size(struct avbox_httpstream * const file);
+
+
+/**
+ * Fetch a byte range in the background using a separate
+ * HTTP Range request. Several ranges are fetched in parallel
+ * and the last few are kept in memory.
+ */
+int
+avbox_httpstream_prefetch(struct avbox_httpstream * const file,
+	int64_t offset, size_t len);
+
+
+/**
+ * Gets the end offset of the prefetched range that
+ * covers offset or -1 if there's none.
+ */
+int64_t
+avbox_httpstream_prefetched(struct avbox_httpstream * const file,
+	int64_t offset);
+
+
+/**
+ * Reads prefetched data at offset without moving the stream. If
+ * the range is still being fetched this waits for the data. Returns
+ * 0 if the offset is not covered by a prefetched range.
+ */
+ssize_t
+avbox_httpstream_pread(struct avbox_httpstream * const file,
+	void *ptr, size_t size, int64_t offset);
+
+
+/**
+ * Seek the network stream. Returns -1 and sets
+ * errno on failure.
+ */
+int
 avbox_httpstream_seek(struct avbox_httpstream * const file,
 	off_t offset);
 
@@ -0,0 +1,76 @@
+/**
+ * avbox - Toolkit for Embedded Multimedia Applications
+ * Copyright (C) 2016-2017 Fernando Rodriguez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License Version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+
+#ifndef __AVBOX_STREAMCACHE__
+#define __AVBOX_STREAMCACHE__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "avbox.h"
+
+
+/**
+ * A byte source for the stream cache. read() and seek() are
+ * called from the cache thread and close() after that thread
+ * exits. read() returns 0 on EOF and -1 on error. size() returns
+ * -1 if the size is not known.
+ *
+ * Sources that can fetch ranges out of band (ie. HTTP Range
+ * requests) also set prefetch(), prefetched() and pread(). These
+ * are called from the reader and must not touch the stream
+ * position. prefetched() returns the end of the prefetched data
+ * at pos or -1, and pread() returns 0 if there is none.
+ */
+struct avbox_streamcache_source
+{
+	void *self;
+	ssize_t (*read)(void *self, void *buf, size_t bufsz);
+	int (*seek)(void *self, int64_t pos);
+	int64_t (*size)(void *self);
+	void (*close)(void *self);
+
+	int (*prefetch)(void *self, int64_t pos, size_t len);
+	int64_t (*prefetched)(void *self, int64_t pos);
+	ssize_t (*pread)(void *self, void *buf, size_t bufsz, int64_t pos);
+};
+
+
+/**
+ * Opens a stream through the read-ahead cache. Paths starting
+ * with http:// or https:// are fetched with curl, everything else
+ * is opened as a local file.
+ */
+struct avbox_player_stream *
+avbox_streamcache_open(const char * const path,
+	struct avbox_player * const player,
+	struct avbox_player_stream * const stream);
+
+
+/**
+ * Opens any byte source through the read-ahead cache. On success
+ * the cache takes ownership of the source.
+ */
+struct avbox_player_stream *
+avbox_streamcache_opensource(const struct avbox_streamcache_source * const source,
+	struct avbox_player * const player,
+	struct avbox_player_stream * const stream);
+
+#endif
@@ -56,6 +56,14 @@ EXPORT const char *
 avbox_torrent_id(const struct avbox_torrent * const inst);
 
 
+/**
+ * Prewarm the pieces at a likely seek target.
+ */
+EXPORT void
+avbox_torrent_prefetch(struct avbox_torrent * const inst,
+	const int64_t offset, const int64_t len);
+
+
 /**
  * Move the torrent to the specified location when
  * finished and then close the stream
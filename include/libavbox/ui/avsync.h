@@ -0,0 +1,153 @@
+/**
+ * avbox - Toolkit for Embedded Multimedia Applications
+ * Copyright (C) 2016-2017 Fernando Rodriguez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License Version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+
+#ifndef __AVBOX_AVSYNC__
+#define __AVBOX_AVSYNC__
+
+#include <stdint.h>
+#include <pthread.h>
+
+
+/* A/V offset histogram. Bins are 10ms wide and centered
+ * on zero. The first and last bins take everything beyond */
+#define AVBOX_AVSYNC_HISTOGRAM_BINS	(11)
+#define AVBOX_AVSYNC_HISTOGRAM_WIDTH	(10LL * 1000LL)
+
+
+/**
+ * What to do with a video frame.
+ */
+enum avbox_avsync_action
+{
+	AVBOX_AVSYNC_PRESENT,
+	AVBOX_AVSYNC_WAIT,
+	AVBOX_AVSYNC_DROP
+};
+
+
+/**
+ * Sync statistics. All times in microseconds. A positive
+ * offset means that the video is behind the master clock.
+ */
+struct avbox_avsync_stats
+{
+	unsigned int presented;
+	unsigned int dropped;
+	unsigned int repeated;
+	unsigned int late;
+	int64_t offset;
+	int64_t latency;
+	int64_t frame_duration;
+	unsigned int histogram[AVBOX_AVSYNC_HISTOGRAM_BINS];
+};
+
+
+/**
+ * A/V sync controller state.
+ */
+struct avbox_avsync
+{
+	pthread_mutex_t lock;
+	int clock_valid;
+	int64_t clock_offset;
+	int64_t last_frame_time;
+	int64_t wait_frame_time;
+	int64_t submit_time;
+	int submit_pending;
+	int drop_credit;
+	int consecutive_drops;
+	struct avbox_avsync_stats stats;
+};
+
+
+/**
+ * Gets the monotonic time in microseconds.
+ */
+int64_t
+avbox_avsync_now(void);
+
+
+/**
+ * Initialize the sync controller.
+ */
+void
+avbox_avsync_init(struct avbox_avsync * const sync);
+
+
+/**
+ * Forget the clock and frame history (ie. after a seek). The
+ * statistics are kept.
+ */
+void
+avbox_avsync_reset(struct avbox_avsync * const sync);
+
+
+/**
+ * Smooth the master clock. The audio clock advances in steps
+ * as periods are consumed by the device so we track it's offset
+ * from the monotonic clock and filter that instead. Large jumps
+ * (seeks, underruns) resync immediately.
+ */
+int64_t
+avbox_avsync_clock(struct avbox_avsync * const sync,
+	const int64_t master_time, const int64_t now);
+
+
+/**
+ * Decide what to do with a frame given the smoothed clock. If
+ * the frame is early the time to wait is returned on delay and
+ * the caller should call this again after waiting.
+ */
+enum avbox_avsync_action
+avbox_avsync_decide(struct avbox_avsync * const sync,
+	const int64_t frame_time, const int64_t clock, int64_t * const delay);
+
+
+/**
+ * Record the time that a frame was handed to the display.
+ */
+void
+avbox_avsync_submitted(struct avbox_avsync * const sync, const int64_t time);
+
+
+/**
+ * Record the time of a completed page flip. This is used
+ * to estimate the presentation latency.
+ */
+void
+avbox_avsync_flipped(struct avbox_avsync * const sync, const int64_t time);
+
+
+/**
+ * Get a copy of the statistics.
+ */
+void
+avbox_avsync_getstats(struct avbox_avsync * const sync,
+	struct avbox_avsync_stats * const stats);
+
+
+/**
+ * Destroy the sync controller.
+ */
+void
+avbox_avsync_destroy(struct avbox_avsync * const sync);
+
+
+#endif
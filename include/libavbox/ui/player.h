@@ -23,6 +23,7 @@
 
 #include "video.h"
 #include "input.h"
+#include "avsync.h"
 #include "../linkedlist.h"
 #include "../dispatch.h"
 #include "../ffmpeg_util.h"
@@ -58,6 +59,7 @@
 #define AVBOX_PLAYERCTL_SET_POSITION			(0x15)
 #define AVBOX_PLAYERCTL_UPDATE				(0x16)
 #define AVBOX_PLAYERCTL_BUFFER_UPDATE			(0x17)
+#define AVBOX_PLAYERCTL_AUDIO_RECONFIGURE		(0x18)
 
 
 struct avbox_player;
@@ -78,6 +80,7 @@ struct avbox_player_stream
 	void (*close)(void *self);
 	void (*destroy)(void *self);
 	void (*buffer_state)(void *self, int64_t * const count, int64_t * const capacity);
+	void (*prefetch)(void *self, int64_t pos, int64_t len);
 
 	int (*underrun_expected)(void *self);
 	int (*can_pause)(void *self);
@@ -226,6 +229,14 @@ unsigned int
 avbox_player_bufferstate(struct avbox_player *inst);
 
 
+/**
+ * Get the A/V sync statistics.
+ */
+void
+avbox_player_getsyncstats(struct avbox_player * const inst,
+	struct avbox_avsync_stats * const stats);
+
+
 /**
  * Seek to a chapter.
  */
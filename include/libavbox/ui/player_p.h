@@ -2,6 +2,7 @@
 #define __AVBOX_PLAYER_PRIVATE__
 
 #include "../avbox.h"
+#include "videodec.h"
 
 
 /* flush flags */
@@ -69,6 +70,7 @@ struct avbox_player
 	struct avbox_rational aspect_ratio;
 	struct avbox_player_state_info state_info;
 	struct avbox_player_stream stream;
+	struct avbox_avsync avsync;
 
 	const char *media_file;
 	const char *next_file;
@@ -81,6 +83,8 @@ struct avbox_player
 	int audio_stream_id;
 	int audio_stream_index;
 	int video_stream_index;
+	unsigned int audio_passthrough;	/* IEC 61937 rate or 0 */
+	unsigned int audio_passthrough_failed; /* rate that could not be set */
 	int play_state;
 	int stream_quit;
 	int stream_percent;
@@ -95,7 +99,13 @@ struct avbox_player
 
 	avbox_player_time_fn getmastertime;
 	AVFormatContext *fmt_ctx;
+	const struct avbox_videodec *video_decoder;
 	struct avbox_av_frame *last_video_frame;
+	int video_window_stale;
+	int direct_render_disabled;
+	int overlay_active;
+	int overlay_stale;
+	int overlay_disabled;
 	pthread_mutex_t state_lock;
 	LIST subscribers;
 
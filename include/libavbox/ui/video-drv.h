@@ -21,6 +21,8 @@
 #ifndef __MB_VIDEO_DRV_H__
 #define __MB_VIDEO_DRV_H__
 
+#include <time.h>
+
 /**
  * Abstract handle to a surface
  */
@@ -93,12 +95,31 @@ typedef int (*mbv_drv_surface_scaleblit)(
 	struct mbv_surface * const src,
 	unsigned int flags, int x, int y, int w, int h);
 
+/**
+ * Convert and scale a C buffer into a surface in
+ * a single pass.
+ */
+typedef int (*mbv_drv_surface_scaleblitbuf)(
+	struct mbv_surface * const surface,
+	unsigned int pix_fmt, void **buf, int *pitch, unsigned int flags,
+	int src_w, int src_h, int x, int y, int w, int h);
+
 /**
  * Update a surface.
  */
 typedef void (*mbv_drv_surface_update)(
 	struct mbv_surface * const surface, int blitflags, int update);
 
+/**
+ * Update a rectangle of a surface. For the root surface this
+ * copies the rectangle to the screen. For other surfaces it is
+ * blitted to the root surface. Coordinates are relative to the
+ * surface.
+ */
+typedef void (*mbv_drv_surface_updaterect)(
+	struct mbv_surface * const surface, int blitflags,
+	int x, int y, int w, int h);
+
 
 /**
  * Destroys a surface and release all it's
@@ -108,6 +129,29 @@ typedef void (*mbv_drv_surface_destroy)(
 	struct mbv_surface * const surface);
 
 
+/**
+ * Gets the time and sequence number of the last
+ * vertical blank.
+ */
+typedef int (*mbv_drv_getvblank)(
+	struct timespec * const time, unsigned int * const seq);
+
+
+/**
+ * Show a video frame on a hardware overlay. The display
+ * controller does the colorspace conversion and scaling.
+ */
+typedef int (*mbv_drv_overlay_present)(
+	unsigned int pix_fmt, void **buf, int *pitch,
+	int src_w, int src_h, int x, int y, int w, int h);
+
+
+/**
+ * Hide the hardware overlay.
+ */
+typedef void (*mbv_drv_overlay_hide)(void);
+
+
 /**
  * Shutdown the video device.
  */
@@ -129,9 +173,14 @@ struct mbv_drv_funcs
 		int x, int y, int w, int h);
 	mbv_drv_surface_blit surface_blit;
 	mbv_drv_surface_scaleblit surface_scaleblit;
+	mbv_drv_surface_scaleblitbuf surface_scaleblitbuf;
 	mbv_drv_surface_update surface_update;
+	mbv_drv_surface_updaterect surface_updaterect;
 	mbv_drv_surface_destroy surface_destroy;
 	int (*surface_doublebuffered)(const struct mbv_surface * const);
+	mbv_drv_getvblank getvblank;
+	mbv_drv_overlay_present overlay_present;
+	mbv_drv_overlay_hide overlay_hide;
 	mbv_drv_shutdown shutdown;
 };
 
@@ -12,4 +12,12 @@ avbox_video_glinit(
 	int width, const int height,
 	void (*swap_buffers_fn)(void));
 
+
+/**
+ * Release the resources used by the opengl driver. Must
+ * be called while the GL context is still current.
+ */
+void
+avbox_video_glshutdown(void);
+
 #endif
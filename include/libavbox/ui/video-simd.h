@@ -0,0 +1,157 @@
+/**
+ * avbox - Toolkit for Embedded Multimedia Applications
+ * Copyright (C) 2016-2017 Fernando Rodriguez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License Version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+
+#ifndef __AVBOX_VIDEO_SIMD__
+#define __AVBOX_VIDEO_SIMD__
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+/**
+ * Instruction sets that may be used by the
+ * pixel kernels.
+ */
+#define AVBOX_SIMD_SCALAR	(0x00)
+#define AVBOX_SIMD_SSE2		(0x01)
+#define AVBOX_SIMD_AVX2		(0x02)
+#define AVBOX_SIMD_NEON		(0x04)
+#define AVBOX_SIMD_ALL		(0xFF)
+
+
+/**
+ * Scratch state for the scaler. It holds the line
+ * buffers and is reused across frames.
+ */
+struct avbox_video_scaler
+{
+	uint8_t *buf;
+	size_t bufsz;
+	uint8_t *rows[2];
+	uint8_t *src_row;
+	uint8_t *yuv_row;
+	int row_y[2];
+};
+
+
+/**
+ * Pick the best pixel kernels supported by the CPU. Only
+ * the instruction sets in the allowed mask are considered.
+ * Returns the instruction set selected.
+ */
+unsigned int
+avbox_video_simd_init(const unsigned int allowed);
+
+
+/**
+ * Gets the name of the kernels in use.
+ */
+const char *
+avbox_video_simd_name(void);
+
+
+/**
+ * Convert a YUV420P image to BGRA.
+ */
+void
+avbox_video_simd_yuv420p2bgra(uint8_t *dst, const int dst_pitch,
+	const uint8_t * const * const planes, const int * const pitches,
+	const int w, const int h);
+
+
+/**
+ * Convert a YUV 4:2:0 image (YUV420P, NV12, P010 or
+ * YUV420P10) to BGRA. The 10 bit formats are truncated to
+ * 8 bits. The scaler is only used for it's scratch buffer.
+ * Returns -1 and sets errno to ENOTSUP if the pixel format
+ * is not supported.
+ */
+int
+avbox_video_simd_yuv2bgra(struct avbox_video_scaler * const scaler,
+	uint8_t *dst, const int dst_pitch, const unsigned int pix_fmt,
+	const uint8_t * const * const planes, const int * const pitches,
+	const int w, const int h);
+
+
+/**
+ * Reduce a plane of 16 bit samples to 8 bits by shifting
+ * them right. Use 2 for YUV420P10 and 8 for P010.
+ */
+void
+avbox_video_simd_shift16(uint8_t *dst, const int dst_pitch,
+	const uint8_t *src, const int src_pitch, const int n, const int h,
+	const int shift);
+
+
+/**
+ * Reduce 16 bit U and V planes of n samples per row
+ * to an interleaved (NV12) 8 bit plane.
+ */
+void
+avbox_video_simd_mergeuv16(uint8_t *uv, const int uv_pitch,
+	const uint8_t *u, const int u_pitch, const uint8_t *v, const int v_pitch,
+	const int n, const int h, const int shift);
+
+
+/**
+ * Deinterleave an NV12 chroma plane of n
+ * samples per row into U and V planes.
+ */
+void
+avbox_video_simd_splituv(uint8_t *u, const int u_pitch,
+	uint8_t *v, const int v_pitch, const uint8_t *uv, const int uv_pitch,
+	const int n, const int h);
+
+
+/**
+ * Alpha blend a premultiplied BGRA image into another.
+ */
+void
+avbox_video_simd_blend(uint8_t *dst, const int dst_pitch,
+	const uint8_t *src, const int src_pitch, const int w, const int h);
+
+
+/**
+ * Bilinear scale a BGRA or YUV 4:2:0 image into a BGRA
+ * buffer. Returns -1 and sets errno to ENOTSUP if the pixel
+ * format is not supported.
+ */
+int
+avbox_video_simd_scale(struct avbox_video_scaler * const scaler,
+	uint8_t *dst, const int dst_pitch, const int dst_w, const int dst_h,
+	const unsigned int pix_fmt, const uint8_t * const * const planes,
+	const int * const pitches, const int src_w, const int src_h);
+
+
+/**
+ * Initialize a scaler.
+ */
+void
+avbox_video_scaler_init(struct avbox_video_scaler * const scaler);
+
+
+/**
+ * Free the scaler's line buffers.
+ */
+void
+avbox_video_scaler_free(struct avbox_video_scaler * const scaler);
+
+
+#endif
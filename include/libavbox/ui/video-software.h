@@ -3,12 +3,16 @@
 
 
 /**
- * Initialize the software renderer
+ * Initialize the software renderer. The swap_buffers function
+ * flips the back buffer in and replaces the front and back
+ * pointers with the new ones. The wait_for_vsync function is
+ * optional.
  */
 struct mbv_surface *
 avbox_video_softinit(struct mbv_drv_funcs * const funcs,
 	uint8_t *front_pixels, uint8_t *back_pixels, const int w, const int h, const int pitch,
-	void (*wait_for_vsync_fn)(void), void (*swap_buffers_fn)(void));
+	void (*wait_for_vsync_fn)(void),
+	void (*swap_buffers_fn)(uint8_t ** const front, uint8_t ** const back));
 
 
 #endif
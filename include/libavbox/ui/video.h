@@ -29,6 +29,7 @@
 #include "../delegate.h"
 #include "video-drv.h"
 #include "video-software.h"
+#include "video-simd.h"
 
 #ifdef ENABLE_DIRECTFB
 #	include "video-directfb.h"
@@ -98,7 +99,10 @@ enum avbox_pixel_format
 	AVBOX_PIXFMT_UNKNOWN = 0,
 	AVBOX_PIXFMT_BGRA = 1,
 	AVBOX_PIXFMT_YUV420P = 2,
-	AVBOX_PIXFMT_MMAL = 3
+	AVBOX_PIXFMT_MMAL = 3,
+	AVBOX_PIXFMT_NV12 = 4,
+	AVBOX_PIXFMT_P010 = 5,
+	AVBOX_PIXFMT_YUV420P10 = 6
 };
 
 
@@ -277,6 +281,15 @@ int
 avbox_window_damaged(struct avbox_window * const window);
 
 
+/**
+ * Marks a rectangle of the window as changed so that
+ * the next update only flips that area to the screen.
+ */
+void
+avbox_window_damagerect(struct avbox_window * const window,
+	int x, int y, int w, int h);
+
+
 int
 avbox_window_blitbuf(
 	struct avbox_window *window,
@@ -284,6 +297,44 @@ avbox_window_blitbuf(
 	int x, int y);
 
 
+/**
+ * Convert and scale a buffer into a window in a single
+ * pass. If the driver cannot do it it returns -1 and sets
+ * errno to ENOTSUP.
+ */
+int
+avbox_window_scaleblitbuf(
+	struct avbox_window *window,
+	unsigned int pix_fmt, void **buf, int *pitch, int src_w, int src_h,
+	int x, int y, int w, int h);
+
+
+/**
+ * Show a video frame on a hardware overlay over the given
+ * area of the window. Returns -1 and sets errno to ENOTSUP
+ * if the driver has no overlay or cannot show the frame.
+ */
+int
+avbox_window_overlaybuf(struct avbox_window * const window,
+	unsigned int pix_fmt, void **buf, int *pitch, int src_w, int src_h,
+	int x, int y, int w, int h);
+
+
+/**
+ * Hide the hardware video overlay.
+ */
+void
+avbox_video_hideoverlay(void);
+
+
+/**
+ * Checks if any visible window stacked above this
+ * one overlaps it.
+ */
+int
+avbox_window_obscured(struct avbox_window * const window);
+
+
 struct avbox_window*
 avbox_window_new(
 	struct avbox_window *parent,
@@ -310,6 +361,16 @@ struct avbox_window*
 avbox_video_getrootwindow(int screen);
 
 
+/**
+ * Gets the CLOCK_MONOTONIC time and sequence number of
+ * the last vertical blank. Returns -1 and sets errno to
+ * ENOTSUP if the driver cannot report it or EAGAIN if no
+ * frame has been flipped yet.
+ */
+int
+avbox_video_getvblank(struct timespec * const time, unsigned int * const seq);
+
+
 /**
  * avbox_window_clear() -- Clear the window surface
  */
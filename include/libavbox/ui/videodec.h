@@ -0,0 +1,205 @@
+/**
+ * avbox - Toolkit for Embedded Multimedia Applications
+ * Copyright (C) 2016-2017 Fernando Rodriguez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License Version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+
+#ifndef __AVBOX_VIDEODEC__
+#define __AVBOX_VIDEODEC__
+
+#include "../ffmpeg_util.h"
+
+
+/**
+ * A video decoder backend.
+ *
+ * Backends that run their own decoding loop (ie. MMAL) set
+ * the decode function and are started directly on the decoder
+ * thread. All others set open() and are driven by the player's
+ * ffmpeg decode loop. If the frames they output are not in
+ * system memory they also set getframe() to download them.
+ */
+struct avbox_videodec
+{
+	const char *name;
+	int (*supported)(const AVCodecParameters * const par);
+	void *(*decode)(void *arg);
+	AVCodecContext *(*open)(AVFormatContext * const fmt_ctx,
+		const int stream_idx, const int threads);
+	int (*getframe)(AVCodecContext * const ctx, AVFrame * const frame);
+};
+
+
+/* max packets kept for resending to the software decoder */
+#define AVBOX_VIDEODEC_REPLAY_MAX	(64)
+
+
+/**
+ * Packets sent to a hardware decoder since the last keyframe.
+ * They are kept until the decoder outputs its first frame so
+ * that if it fails the software decoder can start from the
+ * keyframe. If there are too many the oldest are dropped and
+ * needs_key is set so the caller can skip to the next keyframe.
+ */
+struct avbox_videodec_replay
+{
+	AVPacket *packets[AVBOX_VIDEODEC_REPLAY_MAX];
+	int count;
+	int pos;
+	int active;
+	int needs_key;
+};
+
+
+/**
+ * Initialize a replay buffer.
+ */
+void
+avbox_videodec_replay_init(struct avbox_videodec_replay * const replay);
+
+
+/**
+ * Records a packet before it is sent to the decoder.
+ */
+int
+avbox_videodec_replay_add(struct avbox_videodec_replay * const replay,
+	const AVPacket * const packet);
+
+
+/**
+ * Starts resending the recorded packets.
+ */
+void
+avbox_videodec_replay_start(struct avbox_videodec_replay * const replay);
+
+
+/**
+ * Gets the next packet to resend without removing it
+ * or NULL if there's none left.
+ */
+AVPacket *
+avbox_videodec_replay_peek(struct avbox_videodec_replay * const replay);
+
+
+/**
+ * Frees the packet returned by avbox_videodec_replay_peek()
+ * once it has been sent and moves on to the next one.
+ */
+void
+avbox_videodec_replay_pop(struct avbox_videodec_replay * const replay);
+
+
+/**
+ * Frees all recorded packets.
+ */
+void
+avbox_videodec_replay_clear(struct avbox_videodec_replay * const replay);
+
+
+/**
+ * State of an ffmpeg based decoder. The avbox_videodec_send()
+ * and avbox_videodec_receive() functions work like their
+ * libavcodec counterparts but if a hardware decoder fails before
+ * outputing its first frame they replace it with the software
+ * decoder and resend the packets since the last keyframe.
+ */
+struct avbox_videodec_state
+{
+	const struct avbox_videodec *backend;
+	AVCodecContext *ctx;
+	AVFormatContext *fmt_ctx;
+	int stream_idx;
+	int threads;
+	int got_frame;
+	struct avbox_videodec_replay replay;
+};
+
+
+/**
+ * Opens the decoder using the first backend, starting with
+ * the one given, that can be opened.
+ */
+int
+avbox_videodec_open(struct avbox_videodec_state * const state,
+	AVFormatContext * const fmt_ctx, const int stream_idx,
+	const struct avbox_videodec *backend, const int threads);
+
+
+/**
+ * Checks if there are packets waiting to be resent to the
+ * software decoder. While there are avbox_videodec_send()
+ * must be called with a NULL packet.
+ */
+int
+avbox_videodec_replaying(struct avbox_videodec_state * const state);
+
+
+/**
+ * Sends a packet to the decoder. Returns 0 if the packet was
+ * consumed, AVERROR(EAGAIN) if it must be sent again and
+ * AVERROR_EXIT if the decoder failed and could not be replaced.
+ */
+int
+avbox_videodec_send(struct avbox_videodec_state * const state,
+	const AVPacket * const packet);
+
+
+/**
+ * Gets a decoded frame in system memory. Returns 0 on success,
+ * AVERROR(EAGAIN) or AVERROR_EOF like avcodec_receive_frame(),
+ * AVERROR_EXIT if the decoder failed and could not be replaced
+ * or any other error if the decoder returned one.
+ */
+int
+avbox_videodec_receive(struct avbox_videodec_state * const state,
+	AVFrame * const frame);
+
+
+/**
+ * Resets the decoder after it has been drained.
+ */
+void
+avbox_videodec_flush(struct avbox_videodec_state * const state);
+
+
+/**
+ * Closes the decoder.
+ */
+void
+avbox_videodec_close(struct avbox_videodec_state * const state);
+
+
+/**
+ * Gets the next backend that can decode the stream, in order
+ * of preference, starting after prev (or from the top if prev
+ * is NULL). If the video_decoder setting names a backend only that
+ * one and the software decoder are considered. The software decoder
+ * is always last so this only returns NULL after it.
+ */
+const struct avbox_videodec *
+avbox_videodec_next(const AVCodecParameters * const par,
+	const struct avbox_videodec * const prev);
+
+
+/**
+ * Gets the software decoder backend.
+ */
+const struct avbox_videodec *
+avbox_videodec_software(void);
+
+
+#endif
@@ -38,35 +38,31 @@
 #include "time_util.h"
 #include "math_util.h"
 #include "queue.h"
+#include "audioclock.h"
 #include "audio.h"
 
 #define NONBLOCK			(0)
 
-#define AVBOX_AUDIOSTREAM_DATA_PACKET	(1)
-#define AVBOX_AUDIOSTREAM_CLOCK_SET	(2)
-
+/* the default rate. The player resamples PCM to this
+ * rate. Passthrough streams may use others */
+#define AVBOX_AUDIOSTREAM_FRAMERATE	(48000)
 
-struct avbox_audiostream_data_packet
-{
-	size_t n_frames;
-	uint8_t *data;
-	void* callback_handle;
-};
+#define AVBOX_AUDIOSTREAM_CLOCK_SET	(2)
 
 
 struct avbox_audiostream_clock_set
 {
 	int64_t value;
+	int64_t position;	/* ring position where it takes effect */
 };
 
 
 /**
- * Structure for storing audio packets.
+ * Structure for storing audio control packets.
  */
 LISTABLE_STRUCT(avbox_audio_packet,
 	int type;
 	union {
-		struct avbox_audiostream_data_packet data_packet;
 		struct avbox_audiostream_clock_set clock_set;
 	};
 );
@@ -82,23 +78,34 @@ struct avbox_audiostream
 	pthread_cond_t io_wake;
 	pthread_mutex_t queue_lock;
 	pthread_cond_t queue_wake;
+	pthread_cond_t data_wake;
 	pthread_mutex_t pool_lock;
 	pthread_t thread;
 	int quit;
 	int paused;
 	int running;
 	int started;
-	int max_frames;
 	int queued_frames;
 	int blocking;
+	int mmap;
+	int flags;
+	int buffer_msecs;
 	int64_t frames;
 	int64_t clock_start;
 	int64_t clock_offset;
-	int64_t last_audio_time;
-	struct timespec last_system_time;
+	struct avbox_audioclock clock;
 	snd_pcm_uframes_t buffer_size;
 	unsigned int framerate;
 	struct avbox_queue *packets;
+
+	/* interleaved PCM ring. head and tail are the total
+	 * number of frames written and played and are protected
+	 * by queue_lock */
+	uint8_t *ring;
+	size_t ring_frames;
+	int64_t ring_head;
+	int64_t ring_tail;
+
 	avbox_audiostream_callback callback;
 	void *callback_context;
 	LIST packet_pool;
@@ -137,13 +144,6 @@ static void
 release_packet(struct avbox_audiostream * const inst,
 	struct avbox_audio_packet * const packet)
 {
-	if (packet->type == AVBOX_AUDIOSTREAM_DATA_PACKET) {
-		if (packet->data_packet.callback_handle != NULL && inst->callback != NULL) {
-			inst->callback(inst, AVBOX_AUDIOSTREAM_PACKET_RELEASED,
-				packet->data_packet.callback_handle, inst->callback_context);
-			packet->data_packet.callback_handle = NULL;
-		}
-	}
 	pthread_mutex_lock(&inst->pool_lock);
 	LIST_ADD(&inst->packet_pool, packet);
 	pthread_mutex_unlock(&inst->pool_lock);
@@ -166,6 +166,57 @@ avbox_audiostream_frames2size(struct avbox_audiostream * const stream,
 }
 
 
+/**
+ * Publish a clock sample. Called with the io lock held
+ * every time we write to the PCM or change its state so that
+ * avbox_audiostream_gettime() doesn't need to query ALSA.
+ */
+static void
+avbox_audiostream_updateclock(struct avbox_audiostream * const inst)
+{
+	int err;
+	snd_pcm_status_t *status;
+	const int64_t written = inst->clock_start +
+		(inst->framerate ? FRAMES2TIME(inst, inst->frames) : 0);
+
+	if (inst->pcm_handle == NULL || inst->paused || inst->frames == 0) {
+		avbox_audioclock_stop(&inst->clock, written);
+		return;
+	}
+
+	snd_pcm_status_alloca(&status);
+	if ((err = snd_pcm_status(inst->pcm_handle, status)) < 0) {
+		LOG_VPRINT_ERROR("Stream status error: %s", snd_strerror(err));
+		avbox_audioclock_stop(&inst->clock, written);
+		return;
+	}
+
+	switch (snd_pcm_status_get_state(status)) {
+	case SND_PCM_STATE_RUNNING:
+	case SND_PCM_STATE_DRAINING:
+	{
+		/* the audio being played right now is the last
+		 * frame written minus whatever is still buffered */
+		int64_t anchor;
+#ifdef HAVE_SND_PCM_TSTAMP_TYPE_MONOTONIC
+		snd_htimestamp_t ts;
+		snd_pcm_status_get_htstamp(status, &ts);
+		anchor = SEC2USEC((int64_t) ts.tv_sec) + NSEC2USEC(ts.tv_nsec);
+#else
+		anchor = avbox_audioclock_now();
+#endif
+		avbox_audioclock_set(&inst->clock, written -
+			FRAMES2TIME(inst, snd_pcm_status_get_delay(status)),
+			anchor, written);
+		break;
+	}
+	default:
+		avbox_audioclock_stop(&inst->clock, written);
+		break;
+	}
+}
+
+
 /**
  * Recover from ALSA errors
  */
@@ -175,9 +226,8 @@ avbox_audiostream_recover(struct avbox_audiostream * const inst, snd_pcm_sframes
 	LOG_VPRINT_ERROR("Recovering from ALSA error: %s",
 		snd_strerror(err));
 
-	/* update the offset and invalidate last time */
+	/* update the offset */
 	inst->clock_offset = FRAMES2TIME(inst, inst->frames);
-	inst->last_audio_time = -1;
 
 	/* attempt to recover */
 	if (UNLIKELY((err = snd_pcm_recover(inst->pcm_handle, err, 1)) < 0)) {
@@ -228,23 +278,25 @@ avbox_audiostream_pcm_drain(struct avbox_audiostream * const inst)
 
 
 /**
- * Flush the queue
+ * Flush the ring and the control queue. Called with
+ * the io lock held.
  */
 static void
 __avbox_audiostream_drop(struct avbox_audiostream * const stream)
 {
 	DEBUG_PRINT("audio", "Dropping queue");
 	struct avbox_audio_packet *packet;
+
+	pthread_mutex_lock(&stream->queue_lock);
 	while (avbox_queue_count(stream->packets) > 0) {
 		packet = avbox_queue_get(stream->packets);
-		if (packet->type == AVBOX_AUDIOSTREAM_DATA_PACKET) {
-			ASSERT(packet != NULL);
-			stream->queued_frames -= packet->data_packet.n_frames;
-		}
+		ASSERT(packet != NULL);
 		release_packet(stream, packet);
 	}
-	ASSERT(stream->queued_frames == 0);
-
+	stream->ring_tail = stream->ring_head;
+	stream->queued_frames = 0;
+	pthread_cond_broadcast(&stream->queue_wake);
+	pthread_mutex_unlock(&stream->queue_lock);
 }
 
 
@@ -257,6 +309,7 @@ avbox_audiostream_drop(struct avbox_audiostream * const inst)
 	pthread_mutex_lock(&inst->io_lock);
 	avbox_audiostream_pcm_drain(inst);
 	__avbox_audiostream_drop(inst);
+	avbox_audiostream_updateclock(inst);
 	pthread_cond_signal(&inst->io_wake);
 	pthread_mutex_unlock(&inst->io_lock);
 }
@@ -293,100 +346,12 @@ avbox_pcm_state_getstring(snd_pcm_state_t state)
 int64_t
 avbox_audiostream_gettime(struct avbox_audiostream * const stream)
 {
-	int err = 0;
-	snd_pcm_sframes_t avail;
-	snd_pcm_status_t *status;
-
-	if (stream->pcm_handle == NULL) {
-		goto end;
-	}
-
-	/* if the stream is pause or hasn't started return
-	 * the internal offset */
-	if (stream->paused || stream->frames == 0) {
-		goto end;
-	}
-
-	/* try to aquire the io mutex. If we can't then return
-	 * an approximation.
-	 * NOTE: It may not be necessary to lock here if libasound is
-	 * compiled with thread safety but we still want to do it here
-	 * because our io mutex has PTHREAD_PRIO_INHERIT to solve the
-	 * priority inversion problem when the video output thread has
-	 * to wait for this mutex (it gets preempted by the decoder threads
-	 * resulting in latencies in the 100s of ms). Now we're returning an
-	 * approximation when the mutex is lock so this call should never
-	 * cause a context switch (to another thread).
-	 */
-	if ((err = pthread_mutex_trylock(&stream->io_lock)) != 0) {
-		if (err == EBUSY) {
-			if (1 || stream->last_audio_time < 0) {
-				pthread_mutex_lock(&stream->io_lock);
-			} else {
-				struct timespec now;
-				clock_gettime(CLOCK_MONOTONIC, &now);
-				const int64_t time = stream->last_audio_time +
-					utimediff(&now, &stream->last_system_time);
-				return MAX(time, stream->clock_start +
-					FRAMES2TIME(stream, stream->frames));
-			}
-		} else {
-			ABORT("Mutex trylock returned error!");
-		}
-	}
-
-	/* make sure we're not in xrun */
-	if ((avail = snd_pcm_avail(stream->pcm_handle)) < 0) {
-		if (!avbox_audiostream_recover(stream, avail)) {
-			ABORT("Could not recover from ALSA error!");
-		}
-		pthread_mutex_unlock(&stream->io_lock);
-		goto end;
-	}
-
-	/* get the status */
-	snd_pcm_status_alloca(&status);
-	if ((err = snd_pcm_status(stream->pcm_handle, status)) < 0) {
-		LOG_VPRINT_ERROR("Stream status error: %s", snd_strerror(err));
-		pthread_mutex_unlock(&stream->io_lock);
-		goto end;
-	}
-
-	pthread_mutex_unlock(&stream->io_lock);
-
-	/* if the stream is running calculate it's runtime
-	 * based on the internal offset + timestamp - trigger timestamp */
-	switch (snd_pcm_status_get_state(status)) {
-	case SND_PCM_STATE_XRUN:
-	case SND_PCM_STATE_OPEN:
-	case SND_PCM_STATE_SETUP:
-	case SND_PCM_STATE_PREPARED:
-	case SND_PCM_STATE_PAUSED:
-	case SND_PCM_STATE_SUSPENDED:
-	case SND_PCM_STATE_DISCONNECTED:
-		break;
-	case SND_PCM_STATE_RUNNING:
-	case SND_PCM_STATE_DRAINING:
-	{
-		int64_t time;
-		snd_timestamp_t ts, tts;
-		snd_pcm_status_get_trigger_tstamp(status, &tts);
-		snd_pcm_status_get_tstamp(status, &ts);
-		time = stream->clock_start + stream->clock_offset;
-		time += SEC2USEC(ts.tv_sec) + ts.tv_usec;
-		time -= SEC2USEC(tts.tv_sec) + tts.tv_usec;
-		/* clock_gettime(CLOCK_MONOTONIC, &stream->last_system_time); 
-		return stream->last_audio_time = MAX(time, stream->last_audio_time); */
-		return time;
-	}
-	default:
-		DEBUG_VPRINT("audio", "Unknown ALSA state (state=%i)",
-			snd_pcm_status_get_state(status));
-		abort();
-	}
-end:
-	return stream->clock_start +
-		(stream->framerate ? FRAMES2TIME(stream, stream->frames) : 0);
+	/* the audio thread publishes a clock sample after every
+	 * write so we just extrapolate from the last one. This
+	 * doesn't lock or make any syscalls (clock_gettime() is
+	 * in the vDSO) so it's cheap to call on every frame */
+	return avbox_audioclock_gettime(&stream->clock,
+		avbox_audioclock_now());
 }
 
 
@@ -406,6 +371,7 @@ avbox_audiostream_pause(struct avbox_audiostream * const inst)
 
 	if (!inst->pcm_handle) {
 		inst->paused = 1;
+		avbox_audioclock_stop(&inst->clock, inst->clock_start);
 		return 0;
 	}
 
@@ -483,7 +449,7 @@ avbox_audiostream_pause(struct avbox_audiostream * const inst)
 	}
 
 end:
-	inst->last_audio_time = -1;
+	avbox_audiostream_updateclock(inst);
 	pthread_mutex_unlock(&inst->io_lock);
 	return ret;
 }
@@ -508,7 +474,7 @@ avbox_audiostream_resume(struct avbox_audiostream * const inst)
 	}
 
 	inst->paused = 0;
-	inst->last_audio_time = -1;
+	avbox_audiostream_updateclock(inst);
 	ret = 0;
 end:
 	/* signal IO thread */
@@ -522,6 +488,116 @@ end:
 }
 
 
+/**
+ * Waits until there are frames or a control packet to
+ * play. If timeout (in usecs) is not positive it waits
+ * forever.
+ */
+static int
+avbox_audiostream_waitdata(struct avbox_audiostream * const inst,
+	const int64_t timeout)
+{
+	int ret = 0;
+	struct timespec tv;
+
+	if (timeout > 0) {
+		tv.tv_sec = 0;
+		tv.tv_nsec = 0;
+		timeaddu(&tv, timeout);
+		delay2abstime(&tv);
+	}
+
+	pthread_mutex_lock(&inst->queue_lock);
+	while (inst->ring_head == inst->ring_tail &&
+		avbox_queue_count(inst->packets) == 0) {
+		if (inst->quit) {
+			errno = ESHUTDOWN;
+			ret = -1;
+			break;
+		}
+		if (timeout > 0) {
+			if (pthread_cond_timedwait(&inst->data_wake, &inst->queue_lock, &tv) == ETIMEDOUT) {
+				if (inst->ring_head == inst->ring_tail &&
+					avbox_queue_count(inst->packets) == 0) {
+					errno = EAGAIN;
+					ret = -1;
+				}
+				break;
+			}
+		} else {
+			pthread_cond_wait(&inst->data_wake, &inst->queue_lock);
+		}
+	}
+	pthread_mutex_unlock(&inst->queue_lock);
+	return ret;
+}
+
+
+/**
+ * Write frames to the PCM. When the device was opened with
+ * mmap access the frames are copied straight into the hardware
+ * ring, otherwise this is just snd_pcm_writei(). Returns the
+ * number of frames written (which may be 0 if there's no room)
+ * or a negative error code. Called with io_lock held.
+ */
+static snd_pcm_sframes_t
+avbox_audiostream_pcm_write(struct avbox_audiostream * const inst,
+	const uint8_t *buf, const snd_pcm_uframes_t n_frames)
+{
+	const snd_pcm_channel_area_t *areas;
+	snd_pcm_uframes_t offset, frames, written = 0;
+	snd_pcm_sframes_t ret;
+
+	if (!inst->mmap) {
+		return snd_pcm_writei(inst->pcm_handle, buf, n_frames);
+	}
+
+	/* snd_pcm_mmap_begin() needs the hw pointer
+	 * to be up to date */
+	if (UNLIKELY((ret = snd_pcm_avail_update(inst->pcm_handle)) < 0)) {
+		return ret;
+	}
+
+	/* the span may wrap around the end of the hardware
+	 * ring so it may take two copies */
+	while (written < n_frames) {
+		frames = n_frames - written;
+		if (UNLIKELY((ret = snd_pcm_mmap_begin(inst->pcm_handle, &areas, &offset, &frames)) < 0)) {
+			return (written > 0) ? (snd_pcm_sframes_t) written : ret;
+		}
+		if (frames == 0) {
+			break;
+		}
+
+		/* the format is interleaved so the first area
+		 * covers all channels */
+		ASSERT(areas[0].step == avbox_audiostream_frames2size(inst, 1) * 8);
+		memcpy((uint8_t*) areas[0].addr + (areas[0].first / 8) +
+			avbox_audiostream_frames2size(inst, offset),
+			buf + avbox_audiostream_frames2size(inst, written),
+			avbox_audiostream_frames2size(inst, frames));
+
+		if (UNLIKELY((ret = snd_pcm_mmap_commit(inst->pcm_handle, offset, frames)) < 0)) {
+			return (written > 0) ? (snd_pcm_sframes_t) written : ret;
+		}
+		written += ret;
+		if (UNLIKELY((snd_pcm_uframes_t) ret != frames)) {
+			break;
+		}
+	}
+
+	/* unlike snd_pcm_writei() committing frames does not
+	 * honor the start threshold so start the PCM ourselves */
+	if (written > 0 && snd_pcm_state(inst->pcm_handle) == SND_PCM_STATE_PREPARED) {
+		if (UNLIKELY((ret = snd_pcm_start(inst->pcm_handle)) < 0)) {
+			return ret;
+		}
+	}
+
+	return written;
+}
+
+
 /**
  * This is the main playback loop.
  */
@@ -563,13 +639,16 @@ avbox_audiostream_output(void *arg)
 	snd_pcm_hw_params_alloca(&params);
 	snd_pcm_sw_params_alloca(&swparams);
 
-	inst->framerate = 48000;
-
 	(void) avbox_gainroot();
 
 	/* if ALSA_DEVICE is set on the environment use that
-	 * instead of the default device */
-	if ((device = getenv("ALSA_DEVICE")) == NULL) {
+	 * instead of the default device. Passthrough streams need
+	 * a digital output with the non-audio bit set */
+	if (inst->flags & AVBOX_AUDIOSTREAM_PASSTHROUGH) {
+		if ((device = getenv("ALSA_PASSTHROUGH_DEVICE")) == NULL) {
+			device = "iec958:AES0=0x6";
+		}
+	} else if ((device = getenv("ALSA_DEVICE")) == NULL) {
 		device = "default";
 	}
 
@@ -582,9 +661,19 @@ avbox_audiostream_output(void *arg)
 		LOG_VPRINT_ERROR("Broken ALSA configuration: none available. %s", snd_strerror(ret));
 		goto end;
 	}
-	if ((ret = snd_pcm_hw_params_set_access(inst->pcm_handle, params, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0) {
-		LOG_VPRINT_ERROR("INTERLEAVED RW access not available. %s", snd_strerror(ret));
-		goto end;
+	/* prefer mmap access unless ALSA_NO_MMAP is set on the
+	 * environment (for drivers with broken mmap support) */
+	if (getenv("ALSA_NO_MMAP") == NULL &&
+		(ret = snd_pcm_hw_params_set_access(inst->pcm_handle, params, SND_PCM_ACCESS_MMAP_INTERLEAVED)) == 0) {
+		inst->mmap = 1;
+	} else {
+		DEBUG_VPRINT(LOG_MODULE, "INTERLEAVED MMAP access not available (%s). Using RW",
+			(getenv("ALSA_NO_MMAP") != NULL) ? "disabled" : snd_strerror(ret));
+		inst->mmap = 0;
+		if ((ret = snd_pcm_hw_params_set_access(inst->pcm_handle, params, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0) {
+			LOG_VPRINT_ERROR("INTERLEAVED RW access not available. %s", snd_strerror(ret));
+			goto end;
+		}
 	}
 	if ((ret = snd_pcm_hw_params_set_format(inst->pcm_handle, params, SND_PCM_FORMAT_S16_LE)) < 0) {
 		LOG_VPRINT_ERROR("Format S16_LE not supported. %s", snd_strerror(ret));
@@ -594,8 +683,16 @@ avbox_audiostream_output(void *arg)
 		LOG_VPRINT_ERROR("2 Channels not available. %s", snd_strerror(ret));
 		goto end;
 	}
-	if ((ret = snd_pcm_hw_params_set_rate_near(inst->pcm_handle, params, &inst->framerate, &dir)) < 0) {
-		LOG_VPRINT_ERROR("48000Hz not available. %s", snd_strerror(ret));
+	if (inst->flags & AVBOX_AUDIOSTREAM_PASSTHROUGH) {
+		/* IEC 61937 bursts cannot be resampled */
+		if ((ret = snd_pcm_hw_params_set_rate_resample(inst->pcm_handle, params, 0)) < 0 ||
+			(ret = snd_pcm_hw_params_set_rate(inst->pcm_handle, params, inst->framerate, 0)) < 0) {
+			LOG_VPRINT_ERROR("%uHz not available for passthrough. %s",
+				inst->framerate, snd_strerror(ret));
+			goto end;
+		}
+	} else if ((ret = snd_pcm_hw_params_set_rate_near(inst->pcm_handle, params, &inst->framerate, &dir)) < 0) {
+		LOG_VPRINT_ERROR("%uHz not available. %s", inst->framerate, snd_strerror(ret));
 		goto end;
 	}
 	if ((ret = snd_pcm_hw_params_set_period_size_near(inst->pcm_handle, params, &period, &dir)) < 0) {
@@ -639,7 +736,7 @@ avbox_audiostream_output(void *arg)
 	if ((ret = snd_pcm_sw_params_set_tstamp_mode(inst->pcm_handle, swparams, SND_PCM_TSTAMP_ENABLE)) < 0) {
 		LOG_VPRINT_ERROR("Could not enable timestamps: %s", snd_strerror(ret));
 	}
-	if ((ret = snd_pcm_sw_params_set_avail_min(inst->pcm_handle, swparams, 0)) < 0) {
+	if ((ret = snd_pcm_sw_params_set_avail_min(inst->pcm_handle, swparams, period)) < 0) {
 		LOG_VPRINT_ERROR("Could not set ALSA avail_min: %s", snd_strerror(ret));
 		goto end;
 	}
@@ -671,6 +768,9 @@ avbox_audiostream_output(void *arg)
 	DEBUG_VPRINT("audio", "ALSA buffer size: %ld frames", (unsigned long) inst->buffer_size);
 	DEBUG_VPRINT("audio", "ALSA period size: %ld frames", (unsigned long) period);
 	DEBUG_VPRINT("audio", "ALSA period time: %ld usecs", period_usecs);
+	DEBUG_VPRINT("audio", "ALSA access: %s", inst->mmap ? "MMAP" : "RW");
+	DEBUG_VPRINT("audio", "ALSA device: %s%s", device,
+		(inst->flags & AVBOX_AUDIOSTREAM_PASSTHROUGH) ? " (passthrough)" : "");
 	DEBUG_VPRINT("audio", "ALSA framerate: %u Hz", inst->framerate);
 	DEBUG_VPRINT("audio", "ALSA frame size: %" PRIi64 " bytes",
 		(int64_t) avbox_audiostream_frames2size(inst, 1));
@@ -706,11 +806,13 @@ avbox_audiostream_output(void *arg)
 
 	/* start audio IO */
 	while (1) {
-		/* get the next packet */
+		int64_t tail;
+
+		/* wait for data */
 		if (LIKELY(!underrun)) {
 
 			/* calculate how long until the stream dries out
-			 * and wait up to that long for new packets */
+			 * and wait up to that long for more frames */
 			pthread_mutex_lock(&inst->io_lock);
 			if (UNLIKELY((avail = snd_pcm_avail(inst->pcm_handle)) < 0)) {
 				pthread_mutex_unlock(&inst->io_lock);
@@ -723,7 +825,7 @@ avbox_audiostream_output(void *arg)
 			}
 			pthread_mutex_unlock(&inst->io_lock);
 
-			if (UNLIKELY((packet = avbox_queue_timedpeek(inst->packets, timeout)) == NULL)) {
+			if (UNLIKELY(avbox_audiostream_waitdata(inst, timeout) == -1)) {
 				if (errno == EAGAIN) {
 					snd_pcm_state_t state;
 
@@ -740,9 +842,9 @@ avbox_audiostream_output(void *arg)
 					if (UNLIKELY(inst->frames == 0 || state == SND_PCM_STATE_RUNNING ||
 						state == SND_PCM_STATE_PAUSED ||
 						state == SND_PCM_STATE_SUSPENDED)) {
-						DEBUG_VPRINT(LOG_MODULE, "PCM state after timedpeek: %s. "
-							"Still waiting (timeout=%"PRIi64" frames=%"PRIi64")",
-							avbox_pcm_state_getstring(state), timeout, frames);
+						DEBUG_VPRINT(LOG_MODULE, "PCM state after waitdata: %s. "
+							"Still waiting (timeout=%"PRIi64")",
+							avbox_pcm_state_getstring(state), timeout);
 						usleep(5LL * 1000LL);
 						continue;
 					}
@@ -754,45 +856,59 @@ avbox_audiostream_output(void *arg)
 					}
 
 					continue;
-				} else if (errno == ESHUTDOWN) {
-					goto end;
 				} else {
-					LOG_VPRINT_ERROR("Could not timedpeek packet from queue: %s",
-						strerror(errno));
+					ASSERT(errno == ESHUTDOWN);
 					goto end;
 				}
 			}
 		} else {
-			if (UNLIKELY((packet = avbox_queue_peek(inst->packets, 1)) == NULL)) {
-				switch (errno) {
-				case EAGAIN: continue;
-				case ESHUTDOWN: goto end;
-				default:
-					LOG_VPRINT_ERROR("Could not peek packet from queue: %s",
-						strerror(errno));
-					goto end;
-				}
+			if (UNLIKELY(avbox_audiostream_waitdata(inst, -1) == -1)) {
+				ASSERT(errno == ESHUTDOWN);
+				goto end;
 			}
 			underrun = 0;
 		}
 
-		/* if this is a control packet handle it */
-		if (UNLIKELY(packet->type != AVBOX_AUDIOSTREAM_DATA_PACKET)) {
+		/* Find the next contiguous span. It ends at the end of the
+		 * ring or at the next clock packet, whichever comes first */
+		pthread_mutex_lock(&inst->queue_lock);
+		tail = inst->ring_tail;
+		n_frames = MIN(period, inst->ring_head - tail);
+		n_frames = MIN(n_frames, inst->ring_frames - (tail % inst->ring_frames));
+		if ((packet = avbox_queue_peek(inst->packets, 0)) != NULL) {
+			n_frames = MIN(n_frames, packet->clock_set.position - tail);
+		}
+		pthread_mutex_unlock(&inst->queue_lock);
+
+		/* if the clock packet is due handle it */
+		if (UNLIKELY(n_frames == 0)) {
+			if (packet == NULL) {
+				/* the stream was flushed after waitdata()
+				 * returned so go back to waiting */
+				continue;
+			}
 			switch (packet->type) {
 			case AVBOX_AUDIOSTREAM_CLOCK_SET:
 			{
-				snd_pcm_status_t *status;
-				snd_pcm_status_alloca(&status);
-
 				DEBUG_VPRINT(LOG_MODULE, "Resetting clock to %d (was %li)",
 					packet->clock_set.value, avbox_audiostream_gettime(inst));
 
 				/* reset the clock */
 				pthread_mutex_lock(&inst->io_lock);
+				if (UNLIKELY(avbox_queue_peek(inst->packets, 0) != packet)) {
+					/* flushed while we weren't looking */
+					pthread_mutex_unlock(&inst->io_lock);
+					continue;
+				}
 				avbox_audiostream_pcm_drain(inst);
 				inst->clock_start = packet->clock_set.value;
 				inst->clock_offset = 0;
 				inst->frames = ret = 0;
+				avbox_audiostream_updateclock(inst);
+				if (avbox_queue_get(inst->packets) != packet) {
+					LOG_PRINT_ERROR("Peeked one packet but got a different one. Aborting");
+					abort();
+				}
 				pthread_mutex_unlock(&inst->io_lock);
 				break;
 			}
@@ -801,27 +917,14 @@ avbox_audiostream_output(void *arg)
 			}
 
 			/* free the packet and continue */
-			if (avbox_queue_get(inst->packets) != packet) {
-				LOG_PRINT_ERROR("Peeked one packet but got a different one. Aborting");
-				abort();
-			}
 			release_packet(inst, packet);
 			continue;
 		}
 
-		/* calculate the number of frames to use from this packet */
-		n_frames = MIN(period, packet->data_packet.n_frames);
-
-		/* set the avail_min to the number of frames we're trying to write */
-		if ((ret = snd_pcm_sw_params_set_avail_min(inst->pcm_handle, swparams, n_frames)) < 0) {
-			LOG_VPRINT_ERROR("Could not set ALSA avail_min: %s", snd_strerror(ret));
-			goto end;
-		}
-
 		/* only wait if this is not the first frame after recovery */
 		if (inst->clock_offset != FRAMES2TIME(inst, inst->frames)) {
 			/* wait until there's room on the ring buffer */
-			if (UNLIKELY((avail = snd_pcm_avail(inst->pcm_handle)) > 0 && avail < n_frames)) {
+			if (UNLIKELY((avail = snd_pcm_avail(inst->pcm_handle)) >= 0 && avail < n_frames)) {
 				if (!snd_pcm_wait(inst->pcm_handle, -1)) {
 					continue;
 				}
@@ -843,16 +946,17 @@ avbox_audiostream_output(void *arg)
 			pthread_cond_wait(&inst->io_wake, &inst->io_lock);
 			pthread_mutex_unlock(&inst->io_lock);
 			continue;
-		} else if (UNLIKELY(avbox_queue_peek(inst->packets, 0) != packet)) {
-			/* the packet changed. Mostlikely because the stream was
-			 * flushed while we waited for the PCM */
+		} else if (UNLIKELY(inst->ring_tail != tail)) {
+			/* the stream was flushed while we waited
+			 * for the PCM */
 			pthread_mutex_unlock(&inst->io_lock);
-			usleep(5LL * 1000LL);
 			continue;
 		}
 
-		/* write fragment to ring buffer */
-		if (UNLIKELY((frames = snd_pcm_writei(inst->pcm_handle, packet->data_packet.data, n_frames)) < 0)) {
+		/* write span to the PCM */
+		if (UNLIKELY((frames = avbox_audiostream_pcm_write(inst,
+			inst->ring + avbox_audiostream_frames2size(inst, tail % inst->ring_frames),
+			n_frames)) < 0)) {
 			if (NONBLOCK && (frames == -EAGAIN || frames == -EBUSY)) {
 				pthread_mutex_unlock(&inst->io_lock);
 				usleep(10LL * 1000LL);
@@ -863,31 +967,29 @@ avbox_audiostream_output(void *arg)
 				pthread_mutex_unlock(&inst->io_lock);
 				goto end;
 			}
+			pthread_mutex_unlock(&inst->io_lock);
+			continue;
+		} else if (UNLIKELY(frames == 0)) {
+			/* the PCM was full. Wait up to a period
+			 * for room */
+			pthread_mutex_unlock(&inst->io_lock);
+			snd_pcm_wait(inst->pcm_handle, (int) MAX(1, FRAMES2TIME(inst, period) / 1000));
+			continue;
 		}
 
 		/* update frame counts */
 		inst->frames += frames;
-		packet->data_packet.data += avbox_audiostream_frames2size(inst, frames);
-		packet->data_packet.n_frames -= frames;
-
-		/* we got some samples in so be nice */
-		pthread_mutex_unlock(&inst->io_lock);
+		avbox_audiostream_updateclock(inst);
 
-		/* update the queue stats and signal any thread
-		 * waiting to write */
+		/* free the space and signal any thread waiting
+		 * to write */
 		pthread_mutex_lock(&inst->queue_lock);
-		inst->queued_frames -= frames;
+		inst->ring_tail += frames;
+		inst->queued_frames = inst->ring_head - inst->ring_tail;
 		pthread_cond_signal(&inst->queue_wake);
 		pthread_mutex_unlock(&inst->queue_lock);
 
-		/* if there's no frames left in the packet then
-		 * remove it from the queue and free it */
-		if (LIKELY(packet->data_packet.n_frames == 0)) {
-			if (UNLIKELY(avbox_queue_get(inst->packets) != packet)) {
-				abort();
-			}
-			release_packet(inst, packet);
-		}
+		pthread_mutex_unlock(&inst->io_lock);
 	}
 
 end:
@@ -929,13 +1031,19 @@ avbox_audiostream_setclock(struct avbox_audiostream * const inst,
 	packet->type = AVBOX_AUDIOSTREAM_CLOCK_SET;
 	packet->clock_set.value = time;
 
-	/* add packet to queue */
+	/* the clock is reset when playback reaches the
+	 * current end of the ring */
+	pthread_mutex_lock(&inst->queue_lock);
+	packet->clock_set.position = inst->ring_head;
 	if (avbox_queue_put(inst->packets, packet) == -1) {
+		pthread_mutex_unlock(&inst->queue_lock);
 		LOG_VPRINT_ERROR("Could not add packet to queue: %s",
 			strerror(errno));
 		release_packet(inst, packet);
 		return -1;
 	}
+	pthread_cond_signal(&inst->data_wake);
+	pthread_mutex_unlock(&inst->queue_lock);
 
 	return 0;
 }
@@ -952,62 +1060,88 @@ avbox_audiostream_blocking(struct avbox_audiostream * const stream)
 
 
 /**
- * Writes n_frames audio frames to the stream.
+ * Gets a contiguous span of free space on the ring. If the
+ * ring is full it waits once and returns NULL with errno set
+ * to EAGAIN if it's still full. The frames are queued by
+ * avbox_audiostream_commit().
  */
-int
-avbox_audiostream_write(struct avbox_audiostream * const stream,
-	uint8_t * const data, const size_t n_frames, void * const callback_handle)
+uint8_t *
+avbox_audiostream_getbuffer(struct avbox_audiostream * const stream,
+	size_t * const n_frames)
 {
-	struct avbox_audio_packet *packet;
+	size_t free_frames;
+	int64_t head;
 
 	ASSERT(stream != NULL);
-
-	if (n_frames == 0) {
-		return 0;
-	}
+	ASSERT(n_frames != NULL);
 
 	pthread_mutex_lock(&stream->queue_lock);
-
-	/* if the queue is full wait once and return EAGAIN
-	 * if it's still full */
-	if ((stream->queued_frames) > stream->max_frames) {
+	if ((free_frames = stream->ring_frames - (stream->ring_head - stream->ring_tail)) == 0) {
 		stream->blocking = 1;
 		pthread_cond_wait(&stream->queue_wake, &stream->queue_lock);
 		stream->blocking = 0;
-		if ((stream->queued_frames) > stream->max_frames) {
+		if ((free_frames = stream->ring_frames - (stream->ring_head - stream->ring_tail)) == 0) {
 			pthread_mutex_unlock(&stream->queue_lock);
 			errno = EAGAIN;
-			return -1;
+			return NULL;
 		}
 	}
+	head = stream->ring_head;
+	pthread_mutex_unlock(&stream->queue_lock);
+
+	/* only the writer moves the head so the space can
+	 * only grow after we unlock */
+	*n_frames = MIN(free_frames, stream->ring_frames - (head % stream->ring_frames));
+	return stream->ring + avbox_audiostream_frames2size(stream, head % stream->ring_frames);
+}
 
-	/* allocate memory for packet */
-	if ((packet = alloc_packet(stream)) == NULL) {
-		pthread_mutex_unlock(&stream->queue_lock);
-		LOG_PRINT_ERROR("Could not allocate packet");
-		errno = ENOMEM;
-		return -1;
-	}
 
-	/* we can consider the packet as queued already */
-	stream->queued_frames += n_frames;
+/**
+ * Queues n_frames frames written to the buffer returned
+ * by avbox_audiostream_getbuffer().
+ */
+void
+avbox_audiostream_commit(struct avbox_audiostream * const stream,
+	const size_t n_frames)
+{
+	pthread_mutex_lock(&stream->queue_lock);
+	ASSERT(stream->ring_head - stream->ring_tail + n_frames <= stream->ring_frames);
+	stream->ring_head += n_frames;
+	stream->queued_frames = stream->ring_head - stream->ring_tail;
+	pthread_cond_signal(&stream->data_wake);
 	pthread_mutex_unlock(&stream->queue_lock);
+}
 
-	/* copy samples */
-	packet->type = AVBOX_AUDIOSTREAM_DATA_PACKET;
-	packet->data_packet.n_frames = n_frames;
-	packet->data_packet.data = data;
-	packet->data_packet.callback_handle = callback_handle;
 
-	/* add packet to queue */
-	if (avbox_queue_put(stream->packets, packet) == -1) {
-		LOG_VPRINT_ERROR("Could not add packet to queue: %s",
-			strerror(errno));
-		release_packet(stream, packet);
-		return -1;
+/**
+ * Copies up to n_frames audio frames to the stream. Returns
+ * the number of frames copied or -1 with errno set to EAGAIN
+ * if the ring is full.
+ */
+ssize_t
+avbox_audiostream_write(struct avbox_audiostream * const stream,
+	const uint8_t * const data, const size_t n_frames)
+{
+	uint8_t *buf;
+	size_t written = 0, len;
+
+	ASSERT(stream != NULL);
+
+	while (written < n_frames) {
+		if ((buf = avbox_audiostream_getbuffer(stream, &len)) == NULL) {
+			if (written > 0) {
+				break;
+			}
+			return -1;
+		}
+		len = MIN(len, n_frames - written);
+		memcpy(buf, data + avbox_audiostream_frames2size(stream, written),
+			avbox_audiostream_frames2size(stream, len));
+		avbox_audiostream_commit(stream, len);
+		written += len;
 	}
 
-	return 0;
+	return written;
 }
 
 
@@ -1051,13 +1185,68 @@ end:
 
 
 /**
- * Get the number of frames buffered.
+ * Sets the stream's frame rate and flags. The frames are
+ * always interleaved S16 stereo. This must be called before
+ * the stream is started or any frames are written to it.
+ */
+int
+avbox_audiostream_setformat(struct avbox_audiostream * const stream,
+	const unsigned int framerate, const int flags)
+{
+	uint8_t *ring;
+	size_t ring_frames;
+
+	ASSERT(stream != NULL);
+	ASSERT(framerate > 0);
+
+	ring_frames = MAX(1, ((int64_t) framerate * stream->buffer_msecs) / 1000);
+
+	pthread_mutex_lock(&stream->io_lock);
+	pthread_mutex_lock(&stream->queue_lock);
+
+	if (stream->started || stream->ring_head != 0) {
+		pthread_mutex_unlock(&stream->queue_lock);
+		pthread_mutex_unlock(&stream->io_lock);
+		errno = EBUSY;
+		return -1;
+	}
+
+	/* resize the ring so it holds the same amount of time */
+	if (ring_frames != stream->ring_frames) {
+		if ((ring = realloc(stream->ring, avbox_audiostream_frames2size(stream, ring_frames))) == NULL) {
+			pthread_mutex_unlock(&stream->queue_lock);
+			pthread_mutex_unlock(&stream->io_lock);
+			errno = ENOMEM;
+			return -1;
+		}
+		stream->ring = ring;
+		stream->ring_frames = ring_frames;
+	}
+
+	DEBUG_VPRINT(LOG_MODULE, "Audio stream format: %uHz flags=0x%x",
+		framerate, flags);
+
+	stream->framerate = framerate;
+	stream->flags = flags;
+
+	pthread_mutex_unlock(&stream->queue_lock);
+	pthread_mutex_unlock(&stream->io_lock);
+	return 0;
+}
+
+
+/**
+ * Get the number of frames and control packets buffered.
  */
 unsigned int
 avbox_audiostream_count(struct avbox_audiostream * const stream)
 {
+	unsigned int count;
 	assert(stream != NULL);
-	return avbox_queue_count(stream->packets);
+	pthread_mutex_lock(&stream->queue_lock);
+	count = stream->queued_frames + avbox_queue_count(stream->packets);
+	pthread_mutex_unlock(&stream->queue_lock);
+	return count;
 }
 
 
@@ -1072,6 +1261,18 @@ avbox_audiostream_size(struct avbox_audiostream * const stream)
 }
 
 
+/**
+ * Get the number of frames the stream can buffer at
+ * its current frame rate.
+ */
+unsigned int
+avbox_audiostream_capacity(struct avbox_audiostream * const stream)
+{
+	ASSERT(stream != NULL);
+	return stream->ring_frames;
+}
+
+
 
 /**
  * Check if the audio stream is paused.
@@ -1091,7 +1292,7 @@ avbox_audiostream_ispaused(const struct avbox_audiostream * const stream)
 int
 avbox_audiostream_drain(struct avbox_audiostream * const inst)
 {
-	while (avbox_queue_count(inst->packets)) {
+	while (avbox_audiostream_count(inst)) {
 		usleep(10L * 1000L);
 	}
 	return avbox_audiostream_pause(inst);
@@ -1099,10 +1300,11 @@ avbox_audiostream_drain(struct avbox_audiostream * const inst)
 
 
 /**
- * Create a new sound stream
+ * Create a new sound stream with a ring buffer of
+ * buffer_msecs.
  */
 struct avbox_audiostream *
-avbox_audiostream_new(int max_frames,
+avbox_audiostream_new(const int buffer_msecs,
 	avbox_audiostream_callback callback,
 	void * const callback_context)
 {
@@ -1120,29 +1322,42 @@ avbox_audiostream_new(int max_frames,
 
 	/* initialize stream object */
 	memset(stream, 0, sizeof(struct avbox_audiostream));
-	stream->packets = avbox_queue_new(0);
+	stream->packets = avbox_queue_new(0, AVBOX_QUEUEFLAGS_NONE);
 	if (stream->packets == NULL) {
 		free(stream);
 		return NULL;
 	}
 
+	/* allocate the ring buffer */
+	stream->framerate = AVBOX_AUDIOSTREAM_FRAMERATE;
+	stream->buffer_msecs = buffer_msecs;
+	stream->ring_frames = MAX(1, ((int64_t) AVBOX_AUDIOSTREAM_FRAMERATE * buffer_msecs) / 1000);
+	if ((stream->ring = malloc(avbox_audiostream_frames2size(stream, stream->ring_frames))) == NULL) {
+		LOG_PRINT_ERROR("Could not allocate audio ring. Out of memory");
+		avbox_queue_destroy(stream->packets);
+		free(stream);
+		errno = ENOMEM;
+		return NULL;
+	}
+
 	/* initialize pthread primitives */
 	pthread_mutexattr_init(&lockattr);
 	pthread_mutexattr_setprotocol(&lockattr, PTHREAD_PRIO_INHERIT);
 	if (pthread_mutex_init(&stream->io_lock, &lockattr) != 0 ||
 		pthread_mutex_init(&stream->queue_lock, NULL) != 0 ||
 		pthread_cond_init(&stream->queue_wake, NULL) != 0 ||
+		pthread_cond_init(&stream->data_wake, NULL) != 0 ||
 		pthread_cond_init(&stream->io_wake, NULL) != 0) {
+		free(stream->ring);
 		free(stream);
 		errno = EFAULT;
 		return NULL;
 	}
 
-	stream->max_frames = max_frames;
 	stream->queued_frames = 0;
 	stream->callback = callback;
 	stream->callback_context = callback_context;
-	stream->last_audio_time = -1;
+	avbox_audioclock_init(&stream->clock, 0);
 	LIST_INIT(&stream->packet_pool);
 	return stream;
 }
@@ -1163,7 +1378,10 @@ avbox_audiostream_destroy(struct avbox_audiostream * const stream)
 	/* wait for IO thread */
 	pthread_mutex_lock(&stream->io_lock);
 	if (stream->running) {
+		pthread_mutex_lock(&stream->queue_lock);
 		stream->quit = 1;
+		pthread_cond_signal(&stream->data_wake);
+		pthread_mutex_unlock(&stream->queue_lock);
 		avbox_queue_close(stream->packets);
 		pthread_cond_signal(&stream->io_wake);
 		pthread_mutex_unlock(&stream->io_lock);
@@ -1182,6 +1400,7 @@ avbox_audiostream_destroy(struct avbox_audiostream * const stream)
 	});
 
 	/* free stream object */
+	free(stream->ring);
 	free(stream);
 }
 
@@ -0,0 +1,126 @@
+/**
+ * avbox - Toolkit for Embedded Multimedia Applications
+ * Copyright (C) 2016-2017 Fernando Rodriguez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License Version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#       include <libavbox/config.h>
+#endif
+
+#include <time.h>
+
+#include "time_util.h"
+#include "math_util.h"
+#include "compiler.h"
+#include "audioclock.h"
+
+
+/**
+ * Gets the monotonic time in microseconds.
+ */
+int64_t
+avbox_audioclock_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return SEC2USEC((int64_t) now.tv_sec) + NSEC2USEC(now.tv_nsec);
+}
+
+
+/**
+ * Writes a sample. The sequence number is odd while
+ * the write is in progress.
+ */
+static void
+avbox_audioclock_write(struct avbox_audioclock * const clock,
+	const int running, const int64_t time, const int64_t anchor,
+	const int64_t limit)
+{
+	const unsigned int seq = __atomic_load_n(&clock->seq, __ATOMIC_RELAXED);
+	__atomic_store_n(&clock->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&clock->running, running, __ATOMIC_RELAXED);
+	__atomic_store_n(&clock->time, time, __ATOMIC_RELAXED);
+	__atomic_store_n(&clock->anchor, anchor, __ATOMIC_RELAXED);
+	__atomic_store_n(&clock->limit, limit, __ATOMIC_RELAXED);
+	__atomic_store_n(&clock->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * Initialize a stopped clock.
+ */
+void
+avbox_audioclock_init(struct avbox_audioclock * const clock,
+	const int64_t time)
+{
+	clock->seq = 0;
+	avbox_audioclock_write(clock, 0, time, 0, time);
+}
+
+
+/**
+ * Publish a running clock sample. The clock advances from
+ * time at anchor until it reaches limit.
+ */
+void
+avbox_audioclock_set(struct avbox_audioclock * const clock,
+	const int64_t time, const int64_t anchor, const int64_t limit)
+{
+	avbox_audioclock_write(clock, 1, time, anchor, limit);
+}
+
+
+/**
+ * Publish a stopped clock.
+ */
+void
+avbox_audioclock_stop(struct avbox_audioclock * const clock,
+	const int64_t time)
+{
+	avbox_audioclock_write(clock, 0, time, 0, time);
+}
+
+
+/**
+ * Gets the clock time at now.
+ */
+int64_t
+avbox_audioclock_gettime(const struct avbox_audioclock * const clock,
+	const int64_t now)
+{
+	unsigned int seq;
+	int running;
+	int64_t time, anchor, limit;
+
+	do {
+		while (UNLIKELY((seq = __atomic_load_n(&clock->seq, __ATOMIC_ACQUIRE)) & 1)) {
+			/* the writer is in the middle of an update */
+		}
+		running = __atomic_load_n(&clock->running, __ATOMIC_RELAXED);
+		time = __atomic_load_n(&clock->time, __ATOMIC_RELAXED);
+		anchor = __atomic_load_n(&clock->anchor, __ATOMIC_RELAXED);
+		limit = __atomic_load_n(&clock->limit, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (UNLIKELY(__atomic_load_n(&clock->seq, __ATOMIC_RELAXED) != seq));
+
+	if (!running || now <= anchor) {
+		return time;
+	}
+	return MIN(time + (now - anchor), limit);
+}
@@ -107,3 +107,330 @@ avbox_dbutil_escapesql(const char * const sql)
 	*psafesql = '\0';
 	return safesql;
 }
+
+
+/* how long to wait for a lock before giving up (msecs) */
+#define AVBOX_DBUTIL_BUSY_TIMEOUT	(5000)
+#define AVBOX_DBUTIL_BUSY_RETRIES	(3)
+
+
+LISTABLE_STRUCT(avbox_dbutil_stmt,
+	char *sql;
+	sqlite3_stmt *stmt;
+);
+
+
+LISTABLE_STRUCT(avbox_dbutil_conn,
+	char *filename;
+	sqlite3 *db;
+	LIST stmts;
+);
+
+
+static pthread_key_t dbutil_key;
+static pthread_once_t dbutil_once = PTHREAD_ONCE_INIT;
+
+
+/**
+ * Close a connection and finalize all its statements.
+ */
+static void
+avbox_dbutil_freeconn(struct avbox_dbutil_conn * const conn)
+{
+	struct avbox_dbutil_stmt *stmt;
+	LIST_FOREACH_SAFE(struct avbox_dbutil_stmt*, stmt, &conn->stmts, {
+		LIST_REMOVE(stmt);
+		sqlite3_finalize(stmt->stmt);
+		free(stmt->sql);
+		free(stmt);
+	});
+	if (conn->db != NULL) {
+		sqlite3_close(conn->db);
+	}
+	free(conn->filename);
+	free(conn);
+}
+
+
+/**
+ * Close all the connections of a thread. This is the
+ * thread-specific data destructor.
+ */
+static void
+avbox_dbutil_freeconns(void * const data)
+{
+	LIST * const conns = data;
+	struct avbox_dbutil_conn *conn;
+	LIST_FOREACH_SAFE(struct avbox_dbutil_conn*, conn, conns, {
+		LIST_REMOVE(conn);
+		avbox_dbutil_freeconn(conn);
+	});
+	free(conns);
+}
+
+
+static void
+avbox_dbutil_initkey(void)
+{
+	if (pthread_key_create(&dbutil_key, avbox_dbutil_freeconns) != 0) {
+		ABORT("Could not create thread key!");
+	}
+}
+
+
+/**
+ * Gets the list of connections of the calling thread.
+ */
+static LIST *
+avbox_dbutil_conns(void)
+{
+	LIST *conns;
+	pthread_once(&dbutil_once, avbox_dbutil_initkey);
+	if ((conns = pthread_getspecific(dbutil_key)) == NULL) {
+		if ((conns = malloc(sizeof(LIST))) == NULL) {
+			ASSERT(errno == ENOMEM);
+			return NULL;
+		}
+		LIST_INIT(conns);
+		if (pthread_setspecific(dbutil_key, conns) != 0) {
+			free(conns);
+			errno = ENOMEM;
+			return NULL;
+		}
+	}
+	return conns;
+}
+
+
+/**
+ * Gets the calling thread's connection to a database in the
+ * state directory.
+ */
+static struct avbox_dbutil_conn *
+avbox_dbutil_getconn(const char * const filename)
+{
+	int res;
+	char *path;
+	struct avbox_dbutil_conn *conn;
+	LIST * const conns = avbox_dbutil_conns();
+
+	if (conns == NULL) {
+		return NULL;
+	}
+
+	LIST_FOREACH(struct avbox_dbutil_conn*, conn, conns) {
+		if (!strcmp(conn->filename, filename)) {
+			return conn;
+		}
+	}
+
+	if ((conn = malloc(sizeof(struct avbox_dbutil_conn))) == NULL) {
+		ASSERT(errno == ENOMEM);
+		return NULL;
+	}
+	memset(conn, 0, sizeof(struct avbox_dbutil_conn));
+	LIST_INIT(&conn->stmts);
+
+	if ((conn->filename = strdup(filename)) == NULL ||
+		(path = avbox_dbutil_getdbfile(filename)) == NULL) {
+		ASSERT(errno == ENOMEM);
+		avbox_dbutil_freeconn(conn);
+		return NULL;
+	}
+
+	if ((res = sqlite3_open_v2(path, &conn->db,
+		SQLITE_OPEN_READWRITE, NULL)) != SQLITE_OK) {
+		LOG_VPRINT_ERROR("Could not open database '%s': %s (%d)",
+			path, sqlite3_errmsg(conn->db), res);
+		free(path);
+		avbox_dbutil_freeconn(conn);
+		errno = EIO;
+		return NULL;
+	}
+	free(path);
+
+	/* WAL lets readers and the writer run concurrently and
+	 * with it synchronous=NORMAL is still safe */
+	sqlite3_busy_timeout(conn->db, AVBOX_DBUTIL_BUSY_TIMEOUT);
+	if (sqlite3_exec(conn->db, "PRAGMA journal_mode=WAL;"
+		"PRAGMA synchronous=NORMAL;", NULL, NULL, NULL) != SQLITE_OK) {
+		LOG_VPRINT_ERROR("Could not enable WAL on '%s': %s",
+			filename, sqlite3_errmsg(conn->db));
+	}
+
+	LIST_APPEND(conns, conn);
+	return conn;
+}
+
+
+/**
+ * Gets the calling thread's connection to a database.
+ */
+sqlite3 *
+avbox_dbutil_getdb(const char * const filename)
+{
+	struct avbox_dbutil_conn * const conn = avbox_dbutil_getconn(filename);
+	if (conn == NULL) {
+		return NULL;
+	}
+	return conn->db;
+}
+
+
+/**
+ * Gets a cached prepared statement.
+ */
+sqlite3_stmt *
+avbox_dbutil_prepare(const char * const filename, const char * const sql)
+{
+	int res;
+	struct avbox_dbutil_stmt *stmt;
+	struct avbox_dbutil_conn * const conn = avbox_dbutil_getconn(filename);
+
+	if (conn == NULL) {
+		return NULL;
+	}
+
+	LIST_FOREACH(struct avbox_dbutil_stmt*, stmt, &conn->stmts) {
+		if (!strcmp(stmt->sql, sql)) {
+			return stmt->stmt;
+		}
+	}
+
+	if ((stmt = malloc(sizeof(struct avbox_dbutil_stmt))) == NULL) {
+		ASSERT(errno == ENOMEM);
+		return NULL;
+	}
+	if ((stmt->sql = strdup(sql)) == NULL) {
+		ASSERT(errno == ENOMEM);
+		free(stmt);
+		return NULL;
+	}
+	if ((res = sqlite3_prepare_v2(conn->db, sql, -1, &stmt->stmt, NULL)) != SQLITE_OK) {
+		LOG_VPRINT_ERROR("Could not prepare SQL statement: %s", sql);
+		LOG_VPRINT_ERROR("SQL Error: %s (%d)", sqlite3_errmsg(conn->db), res);
+		free(stmt->sql);
+		free(stmt);
+		errno = EFAULT;
+		return NULL;
+	}
+
+	LIST_APPEND(&conn->stmts, stmt);
+	return stmt->stmt;
+}
+
+
+/**
+ * Steps a statement.
+ */
+int
+avbox_dbutil_step(sqlite3_stmt * const stmt)
+{
+	int res, retries = 0;
+	while ((res = sqlite3_step(stmt)) == SQLITE_BUSY) {
+		/* the busy handler already waited AVBOX_DBUTIL_BUSY_TIMEOUT
+		 * msecs. If we're not in a transaction try again a few times */
+		if (!sqlite3_get_autocommit(sqlite3_db_handle(stmt)) ||
+			retries == AVBOX_DBUTIL_BUSY_RETRIES) {
+			break;
+		}
+		LOG_VPRINT_WARN("Database busy. Retrying (%d/%d): %s",
+			++retries, AVBOX_DBUTIL_BUSY_RETRIES, sqlite3_sql(stmt));
+		sqlite3_reset(stmt);
+	}
+	if (res != SQLITE_ROW && res != SQLITE_DONE) {
+		LOG_VPRINT_ERROR("SQLite Error: %s (%d)",
+			sqlite3_errmsg(sqlite3_db_handle(stmt)), res);
+	}
+	return res;
+}
+
+
+/**
+ * Resets a statement after use.
+ */
+void
+avbox_dbutil_done(sqlite3_stmt * const stmt)
+{
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+}
+
+
+/**
+ * Runs a statement that doesn't return rows.
+ */
+int
+avbox_dbutil_exec(sqlite3_stmt * const stmt)
+{
+	const int res = avbox_dbutil_step(stmt);
+	avbox_dbutil_done(stmt);
+	if (res != SQLITE_DONE && res != SQLITE_ROW) {
+		errno = (res == SQLITE_BUSY) ? EBUSY : EIO;
+		return -1;
+	}
+	return 0;
+}
+
+
+/**
+ * Runs a query and gets the integer on the first column
+ * of the first row.
+ */
+int
+avbox_dbutil_getint64(sqlite3_stmt * const stmt, int64_t * const value)
+{
+	int ret = -1;
+	const int res = avbox_dbutil_step(stmt);
+	if (res == SQLITE_ROW) {
+		*value = sqlite3_column_int64(stmt, 0);
+		ret = 0;
+	} else if (res == SQLITE_DONE) {
+		errno = ENOENT;
+	} else {
+		errno = EIO;
+	}
+	avbox_dbutil_done(stmt);
+	return ret;
+}
+
+
+/**
+ * Runs a query and gets a copy of the text on the
+ * first column of the first row.
+ */
+char *
+avbox_dbutil_gettext(sqlite3_stmt * const stmt)
+{
+	char *ret = NULL;
+	const int res = avbox_dbutil_step(stmt);
+	if (res == SQLITE_ROW) {
+		const char * const text = (const char*) sqlite3_column_text(stmt, 0);
+		if (text == NULL) {
+			errno = ENOENT;
+		} else if ((ret = strdup(text)) == NULL) {
+			ASSERT(errno == ENOMEM);
+		}
+	} else if (res == SQLITE_DONE) {
+		errno = ENOENT;
+	} else {
+		errno = EIO;
+	}
+	avbox_dbutil_done(stmt);
+	return ret;
+}
+
+
+/**
+ * Close the calling thread's connections.
+ */
+void
+avbox_dbutil_close(void)
+{
+	LIST *conns;
+	pthread_once(&dbutil_once, avbox_dbutil_initkey);
+	if ((conns = pthread_getspecific(dbutil_key)) != NULL) {
+		pthread_setspecific(dbutil_key, NULL);
+		avbox_dbutil_freeconns(conns);
+	}
+}
@@ -546,7 +546,7 @@ avbox_dispatch_init()
 		assert(errno == ENOMEM);
 		return NULL;
 	}
-	if ((q->queue = avbox_queue_new(10)) == NULL) {
+	if ((q->queue = avbox_queue_new(10, AVBOX_QUEUEFLAGS_NONE)) == NULL) {
 		assert(errno == ENOMEM || errno == EPERM);
 		free(q);
 		return NULL;
@@ -22,6 +22,9 @@
 #       include <libavbox/config.h>
 #endif
 
+#include <string.h>
+#include <unistd.h>
+
 #ifdef ENABLE_DVD
 #	include <dvdnav/dvdnav.h>
 #endif
@@ -31,6 +34,79 @@
 #include <libavbox/avbox.h>
 
 
+/**
+ * Initialize a swscale context cache.
+ */
+INTERNAL void
+avbox_ffmpegutil_swscache_init(struct avbox_swscache * const cache)
+{
+	memset(cache, 0, sizeof(struct avbox_swscache));
+}
+
+
+/**
+ * Get a swscale context for the given conversion. If the
+ * cached context matches it is returned, otherwise it is
+ * replaced.
+ */
+INTERNAL struct SwsContext *
+avbox_ffmpegutil_swscache_get(struct avbox_swscache * const cache,
+	const int src_w, const int src_h, const enum AVPixelFormat src_fmt,
+	const int dst_w, const int dst_h, const enum AVPixelFormat dst_fmt,
+	const int flags)
+{
+	if (LIKELY(cache->ctx != NULL &&
+		cache->src_w == src_w && cache->src_h == src_h &&
+		cache->src_fmt == src_fmt && cache->dst_w == dst_w &&
+		cache->dst_h == dst_h && cache->dst_fmt == dst_fmt &&
+		cache->flags == flags)) {
+		cache->hits++;
+		return cache->ctx;
+	}
+
+	cache->misses++;
+
+	DEBUG_VPRINT(LOG_MODULE, "swscale cache miss: %dx%d (%s) -> %dx%d (%s) "
+		"(hits=%u misses=%u)",
+		src_w, src_h, av_get_pix_fmt_name(src_fmt),
+		dst_w, dst_h, av_get_pix_fmt_name(dst_fmt),
+		cache->hits, cache->misses);
+
+	/* sws_getCachedContext() frees the old context if
+	 * the parameters don't match */
+	if ((cache->ctx = sws_getCachedContext(cache->ctx,
+		src_w, src_h, src_fmt, dst_w, dst_h, dst_fmt,
+		flags, NULL, NULL, NULL)) == NULL) {
+		LOG_PRINT_ERROR("Could not create swscale context!");
+		return NULL;
+	}
+
+	cache->src_w = src_w;
+	cache->src_h = src_h;
+	cache->src_fmt = src_fmt;
+	cache->dst_w = dst_w;
+	cache->dst_h = dst_h;
+	cache->dst_fmt = dst_fmt;
+	cache->flags = flags;
+	return cache->ctx;
+}
+
+
+/**
+ * Free the cached swscale context.
+ */
+INTERNAL void
+avbox_ffmpegutil_swscache_free(struct avbox_swscache * const cache)
+{
+	if (cache->ctx != NULL) {
+		DEBUG_VPRINT(LOG_MODULE, "Freeing swscale cache (hits=%u misses=%u)",
+			cache->hits, cache->misses);
+		sws_freeContext(cache->ctx);
+		cache->ctx = NULL;
+	}
+}
+
+
 /**
  * Initialize ffmpeg's filter graph
  */
@@ -41,6 +117,7 @@ avbox_ffmpegutil_initvideofilters(
 	AVFilterContext **buffersink_ctx,
 	AVFilterContext **buffersrc_ctx,
 	AVFilterGraph **filter_graph,
+	enum AVPixelFormat src_fmt,
 	enum AVPixelFormat pix_fmt,
 	const char *filters_descr,
 	int stream_index)
@@ -57,7 +134,7 @@ avbox_ffmpegutil_initvideofilters(
 
 	snprintf(args, sizeof(args),
 		"video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d",
-		dec_ctx->width, dec_ctx->height, dec_ctx->pix_fmt,
+		dec_ctx->width, dec_ctx->height, src_fmt,
 		time_base.num, time_base.den,
 		dec_ctx->sample_aspect_ratio.num, dec_ctx->sample_aspect_ratio.den);
 	DEBUG_VPRINT(LOG_MODULE, "Video filter args: %s", args);
@@ -262,7 +339,8 @@ end:
 
 INTERNAL AVCodecContext *
 avbox_ffmpegutil_opencodeccontext(int *stream_idx,
-	AVFormatContext *fmt_ctx, enum AVMediaType type)
+	AVFormatContext *fmt_ctx, enum AVMediaType type,
+	int threads, const int flags)
 {
 	int ret;
 	AVStream *st;
@@ -313,13 +391,35 @@ avbox_ffmpegutil_opencodeccontext(int *stream_idx,
 		return NULL;
 	}
 
-	/* Init the video decoder */
-	av_dict_set(&opts, "flags2", "+export_mvs", 0);
+	/* use frame and slice threading. The decoder picks
+	 * whichever the codec supports */
+	if (threads == 0) {
+		if ((threads = sysconf(_SC_NPROCESSORS_ONLN)) < 1) {
+			threads = 1;
+		}
+	}
+	dec_ctx->thread_count = threads;
+	dec_ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+
+	/* motion vectors are expensive to export so only
+	 * do it when asked to */
+	if (flags & AVBOX_CODECFLAGS_EXPORT_MVS) {
+		av_dict_set(&opts, "flags2", "+export_mvs", 0);
+	}
+
+	/* Init the decoder */
 	if ((ret = avcodec_open2(dec_ctx, dec, &opts)) < 0) {
 		LOG_VPRINT_ERROR("Failed to open '%s' codec!",
 			av_get_media_type_string(type));
+		av_dict_free(&opts);
 		return NULL;
 	}
+	av_dict_free(&opts);
+
+	DEBUG_VPRINT(LOG_MODULE, "Opened %s decoder with %i thread(s) (%s)",
+		av_get_media_type_string(type), dec_ctx->thread_count,
+		(dec_ctx->active_thread_type & FF_THREAD_FRAME) ? "frame" :
+		(dec_ctx->active_thread_type & FF_THREAD_SLICE) ? "slice" : "none");
 
 	return dec_ctx;
 }
@@ -25,18 +25,49 @@
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <limits.h>
 #include <pthread.h>
+#include <linux/futex.h>
 
 #define LOG_MODULE "queue"
 
+/* number of times to poll a ring before sleeping */
+#define AVBOX_QUEUE_SPIN	(256)
+
 #include <libavbox/avbox.h>
 
 
+/**
+ * Lock-free ring used by single-producer/single-consumer
+ * queues. The indices are free running and each one is only
+ * written by one side and lives on its own cache line. A side
+ * only sleeps (on a futex) when the ring is empty or full and
+ * the other side only makes a syscall to wake it up.
+ */
+struct avbox_queue_ring
+{
+	/* written by the producer */
+	volatile uint32_t head CACHELINE_ALIGNED;
+	volatile int prod_waiting;
+	volatile int prod_seq;
+
+	/* written by the consumer */
+	volatile uint32_t tail CACHELINE_ALIGNED;
+	volatile int cons_waiting;
+	volatile int cons_seq;
+
+	uint32_t mask CACHELINE_ALIGNED;
+	int spin;
+	void **items;
+};
+
+
 /**
  * Represents a queue object.
  */
 struct avbox_queue
 {
+	struct avbox_queue_ring *ring;
 	pthread_mutex_t lock;
 	pthread_mutex_t pool_lock;
 	pthread_cond_t cond;
@@ -93,12 +124,191 @@ release_node(struct avbox_queue * const inst, struct avbox_queue_node * const no
 }
 
 
+static inline void
+avbox_futex_wait(volatile int * const addr, const int val, const int64_t timeout)
+{
+	struct timespec ts;
+	if (timeout > 0) {
+		ts.tv_sec = timeout / 1000000LL;
+		ts.tv_nsec = (timeout % 1000000LL) * 1000L;
+	}
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val,
+		(timeout > 0) ? &ts : NULL, NULL, 0);
+}
+
+
+static inline void
+avbox_futex_wake(volatile int * const addr)
+{
+	ATOMIC_INC(addr);
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+
+/**
+ * Spin for a short while waiting for the other side of a ring
+ * to catch up. This is usually much cheaper than a trip to the
+ * kernel when both sides are running.
+ */
+static inline int
+avbox_queue_ring_spin(struct avbox_queue_ring * const ring,
+	volatile uint32_t * const idx, const uint32_t val)
+{
+	int i;
+	for (i = 0; i < ring->spin; i++) {
+		if (ATOMIC_LOAD_ACQUIRE(idx) != val) {
+			return 1;
+		}
+#if defined(__i386__) || defined(__x86_64__)
+		__builtin_ia32_pause();
+#endif
+	}
+	return 0;
+}
+
+
+/**
+ * Wake both sides of a ring.
+ */
+static void
+avbox_queue_ring_wake(struct avbox_queue_ring * const ring)
+{
+	avbox_futex_wake(&ring->cons_seq);
+	avbox_futex_wake(&ring->prod_seq);
+}
+
+
+/**
+ * Gets the next item on a ring without dequeueing it. Like
+ * avbox_queue_getnode() it sleeps at most once and returns
+ * EAGAIN if the ring is still empty when it wakes.
+ */
+static void *
+avbox_queue_ring_peek(struct avbox_queue * const inst,
+	const int block, const int64_t timeout)
+{
+	int seq;
+	struct avbox_queue_ring * const ring = inst->ring;
+	const uint32_t tail = ring->tail;
+
+	if (UNLIKELY(ATOMIC_LOAD_ACQUIRE(&ring->head) == tail)) {
+		if (ATOMIC_LOAD_ACQUIRE(&inst->closed)) {
+			/* the producer may have put an item between the
+			 * time we checked the ring and closed the queue */
+			if (ATOMIC_LOAD_ACQUIRE(&ring->head) != tail) {
+				return ring->items[tail & ring->mask];
+			}
+			errno = ESHUTDOWN;
+			return NULL;
+		}
+		if (!block) {
+			errno = EAGAIN;
+			return NULL;
+		}
+		if (avbox_queue_ring_spin(ring, &ring->head, tail)) {
+			return ring->items[tail & ring->mask];
+		}
+
+		/* the sequence must be read before checking the ring
+		 * again, otherwise we could miss a wake up */
+		ATOMIC_INC(&inst->waiters);
+		seq = ATOMIC_LOAD_ACQUIRE(&ring->cons_seq);
+		ring->cons_waiting = 1;
+		MEMORY_BARRIER();
+		if (ATOMIC_LOAD_ACQUIRE(&ring->head) == tail &&
+			!ATOMIC_LOAD_ACQUIRE(&inst->closed)) {
+			avbox_futex_wait(&ring->cons_seq, seq, timeout);
+		}
+		ring->cons_waiting = 0;
+		ATOMIC_DEC(&inst->waiters);
+
+		if (UNLIKELY(ATOMIC_LOAD_ACQUIRE(&ring->head) == tail)) {
+			errno = EAGAIN;
+			return NULL;
+		}
+	}
+	return ring->items[tail & ring->mask];
+}
+
+
+/**
+ * Dequeues the next item from a ring.
+ */
+static void *
+avbox_queue_ring_get(struct avbox_queue * const inst)
+{
+	void *ret;
+	struct avbox_queue_ring * const ring = inst->ring;
+
+	if (UNLIKELY((ret = avbox_queue_ring_peek(inst, 1, 0)) == NULL)) {
+		return NULL;
+	}
+
+	ATOMIC_STORE_RELEASE(&ring->tail, ring->tail + 1);
+	MEMORY_BARRIER();
+	if (UNLIKELY(ring->prod_waiting) &&
+		__sync_lock_test_and_set(&ring->prod_waiting, 0)) {
+		avbox_futex_wake(&ring->prod_seq);
+	}
+	return ret;
+}
+
+
+/**
+ * Adds an item to a ring. If the ring is full it waits
+ * once and returns EAGAIN if it's still full.
+ */
+static int
+avbox_queue_ring_put(struct avbox_queue * const inst, void * const item)
+{
+	int seq;
+	struct avbox_queue_ring * const ring = inst->ring;
+	const uint32_t head = ring->head;
+	const uint32_t limit = inst->sz;
+
+	if (UNLIKELY((head - ATOMIC_LOAD_ACQUIRE(&ring->tail)) >= limit)) {
+		if (ATOMIC_LOAD_ACQUIRE(&inst->closed)) {
+			errno = ESHUTDOWN;
+			return -1;
+		}
+
+		ATOMIC_INC(&inst->waiters);
+		seq = ATOMIC_LOAD_ACQUIRE(&ring->prod_seq);
+		ring->prod_waiting = 1;
+		MEMORY_BARRIER();
+		if ((head - ATOMIC_LOAD_ACQUIRE(&ring->tail)) >= limit &&
+			!ATOMIC_LOAD_ACQUIRE(&inst->closed)) {
+			avbox_futex_wait(&ring->prod_seq, seq, 0);
+		}
+		ring->prod_waiting = 0;
+		ATOMIC_DEC(&inst->waiters);
+
+		if ((head - ATOMIC_LOAD_ACQUIRE(&ring->tail)) >= limit) {
+			errno = EAGAIN;
+			return -1;
+		}
+	}
+
+	ring->items[head & ring->mask] = item;
+	ATOMIC_STORE_RELEASE(&ring->head, head + 1);
+	MEMORY_BARRIER();
+	if (UNLIKELY(ring->cons_waiting) &&
+		__sync_lock_test_and_set(&ring->cons_waiting, 0)) {
+		avbox_futex_wake(&ring->cons_seq);
+	}
+	return 0;
+}
+
+
 /**
  * Wake all threads waiting on queue.
  */
 void
 avbox_queue_wake(struct avbox_queue * inst)
 {
+	if (inst->ring != NULL) {
+		avbox_queue_ring_wake(inst->ring);
+	}
 	pthread_mutex_lock(&inst->lock);
 	pthread_cond_broadcast(&inst->cond);
 	pthread_mutex_unlock(&inst->lock);
@@ -134,6 +344,10 @@ size_t
 avbox_queue_count(struct avbox_queue * const inst)
 {
 	assert(inst != NULL);
+	if (inst->ring != NULL) {
+		return ATOMIC_LOAD_ACQUIRE(&inst->ring->head) -
+			ATOMIC_LOAD_ACQUIRE(&inst->ring->tail);
+	}
 	return inst->cnt;
 }
 
@@ -191,6 +405,9 @@ avbox_queue_peek(struct avbox_queue * const inst, const int block)
 {
 	void *ret = NULL;
 	struct avbox_queue_node *node;
+	if (inst->ring != NULL) {
+		return avbox_queue_ring_peek(inst, block, 0);
+	}
 	pthread_mutex_lock(&inst->lock);
 	if (UNLIKELY((node = avbox_queue_getnode(inst, block, 0)) == NULL)) {
 		goto end;
@@ -210,6 +427,9 @@ avbox_queue_timedpeek(struct avbox_queue * const inst, const int64_t timeout)
 {
 	void *ret = NULL;
 	struct avbox_queue_node *node;
+	if (inst->ring != NULL) {
+		return avbox_queue_ring_peek(inst, 1, timeout);
+	}
 	pthread_mutex_lock(&inst->lock);
 	if (UNLIKELY((node = avbox_queue_getnode(inst, 1, timeout)) == NULL)) {
 		goto end;
@@ -242,6 +462,10 @@ avbox_queue_get(struct avbox_queue *inst)
 	struct avbox_queue_node *node;
 	assert(inst != NULL);
 
+	if (inst->ring != NULL) {
+		return avbox_queue_ring_get(inst);
+	}
+
 	pthread_mutex_lock(&inst->lock);
 
 	if (UNLIKELY((node = avbox_queue_getnode(inst, 1, 0)) == NULL)) {
@@ -277,6 +501,10 @@ avbox_queue_put(struct avbox_queue *inst, void *item)
 	assert(inst != NULL);
 	assert(item != NULL);
 
+	if (inst->ring != NULL) {
+		return avbox_queue_ring_put(inst, item);
+	}
+
 	/* allocate memory for a queue node */
 	if (UNLIKELY((node = acquire_node(inst)) == NULL)) {
 		LOG_VPRINT_ERROR("Could not allocate node: %s",
@@ -334,10 +562,17 @@ avbox_queue_isclosed(struct avbox_queue * const inst)
  * Sets the queue size limit. NOTE: If the queue is currently
  * above the newly set limit all calls to avbox_queue_put() will
  * continue to block until the size is reduced bellow the new
- * size */
+ * size. The ring of an SPSC queue cannot grow so its limit is
+ * capped at twice the size it was created with.
+ */
 void
 avbox_queue_setsize(struct avbox_queue * const inst, size_t sz)
 {
+	if (inst->ring != NULL && (sz == 0 || sz > inst->ring->mask + 1)) {
+		LOG_VPRINT_WARN("Queue '%s' cannot hold %zu items. Capping at %u",
+			inst->name, sz, inst->ring->mask + 1);
+		sz = inst->ring->mask + 1;
+	}
 	inst->sz = sz;
 }
 
@@ -368,16 +603,57 @@ avbox_queue_setname(struct avbox_queue * const inst, const char * const name)
 }
 
 
+/**
+ * Allocates the ring for an SPSC queue.
+ */
+static struct avbox_queue_ring *
+avbox_queue_ring_new(const size_t sz)
+{
+	uint32_t cap = 1;
+	void *mem;
+	struct avbox_queue_ring *ring;
+
+	/* make room to grow the queue to twice it's
+	 * size with avbox_queue_setsize() */
+	while (cap < (sz * 2)) {
+		cap <<= 1;
+	}
+
+	if (posix_memalign(&mem, CACHELINE_SIZE, sizeof(struct avbox_queue_ring)) != 0) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	ring = mem;
+	memset(ring, 0, sizeof(struct avbox_queue_ring));
+	ring->mask = cap - 1;
+
+	/* spinning only helps if the other side
+	 * can run at the same time */
+	ring->spin = (sysconf(_SC_NPROCESSORS_ONLN) > 1) ? AVBOX_QUEUE_SPIN : 0;
+	if ((ring->items = malloc(sizeof(void*) * cap)) == NULL) {
+		free(ring);
+		return NULL;
+	}
+	return ring;
+}
+
+
 /**
  * Creates a new queue object.
  */
 struct avbox_queue *
-avbox_queue_new(const size_t sz)
+avbox_queue_new(const size_t sz, const int flags)
 {
 	int res;
 	struct avbox_queue *inst;
 	pthread_mutexattr_t lockattr;
 
+	if ((flags & AVBOX_QUEUEFLAGS_SPSC) && sz == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
 	/* allocate memory for queue */
 	if ((inst = malloc(sizeof(struct avbox_queue))) == NULL) {
 		LOG_VPRINT_ERROR("Could not create queue: %s",
@@ -397,8 +673,16 @@ avbox_queue_new(const size_t sz)
 		return NULL;
 	}
 
-	/* initialize pre-allocated node pool */
-	if (sz) {
+	/* allocate the ring or pre-allocate the node pool */
+	if (flags & AVBOX_QUEUEFLAGS_SPSC) {
+		if ((inst->ring = avbox_queue_ring_new(sz)) == NULL) {
+			LOG_VPRINT_ERROR("Could not allocate queue ring: %s",
+				strerror(errno));
+			free(inst->name);
+			free(inst);
+			return NULL;
+		}
+	} else if (sz) {
 		size_t i;
 		for (i = 0; i < sz; i++) {
 			struct avbox_queue_node * const node =
@@ -420,6 +704,10 @@ avbox_queue_new(const size_t sz)
 			strerror(errno));
 		assert(res == ENOMEM || res == EPERM);
 		errno = res;
+		if (inst->ring != NULL) {
+			free(inst->ring->items);
+			free(inst->ring);
+		}
 		free(inst);
 		return NULL;
 	}
@@ -440,7 +728,8 @@ void
 avbox_queue_close(struct avbox_queue * inst)
 {
 	assert(inst != NULL);
-	inst->closed = 1;
+	ATOMIC_STORE_RELEASE(&inst->closed, 1);
+	MEMORY_BARRIER();
 	avbox_queue_wake(inst);
 }
 
@@ -456,13 +745,26 @@ avbox_queue_destroy(struct avbox_queue *inst)
 	/* wake any threads waiting on queue */
 	pthread_mutex_lock(&inst->lock);
 	inst->closed = 1;
+	MEMORY_BARRIER();
 	while (inst->waiters > 0) {
+		if (inst->ring != NULL) {
+			avbox_queue_ring_wake(inst->ring);
+		}
 		pthread_cond_broadcast(&inst->cond);
 		pthread_mutex_unlock(&inst->lock);
 		usleep(10LL * 1000LL);
 		pthread_mutex_lock(&inst->lock);
 	}
 
+	if (inst->ring != NULL) {
+		if (avbox_queue_count(inst) > 0) {
+			LOG_VPRINT_ERROR("LEAK!: Destroying queue with %zu items!",
+				avbox_queue_count(inst));
+		}
+		free(inst->ring->items);
+		free(inst->ring);
+	}
+
 	/* if the queue still has any items in it
 	 * print a warning */
 	if (LIST_SIZE(&inst->items) > 0) {
@@ -44,26 +44,7 @@
 static pthread_mutex_t dblock;
 
 
-#define SQLBUFLEN	(1024)
-
-
-/**
- * Callback function to get getstring() result.
- */
-static int
-avbox_settings_getstring_callback(void *data,
-	int argc, char **argv, char **azColName)
-{
-	char **value = (char**) data;
-	ASSERT(argc <= 1);
-	ASSERT(data != NULL);
-
-	if ((*value = strdup(argv[0])) == NULL) {
-		LOG_VPRINT_ERROR("Could not strdup() query result '%s'",
-			argv[0]);
-	}
-	return 0;
-}
+#define SETTINGS_DB	("settings.db")
 
 
 /**
@@ -73,55 +54,86 @@ avbox_settings_getstring_callback(void *data,
 char *
 avbox_settings_getstring(const char * const key)
 {
-	int res;
-	char *value = NULL, sql[SQLBUFLEN];
-	sqlite3 *db = NULL;
-	char *safekey, *filename = NULL;
+	sqlite3_stmt *stmt;
 
 	DEBUG_VPRINT(LOG_MODULE, "Entering settings_getstring(\"%s\")",
 		key);
 
 	ASSERT(key != NULL);
 
-	if ((safekey = avbox_dbutil_escapesql(key)) == NULL) {
-		errno = ENOMEM;
+	if ((stmt = avbox_dbutil_prepare(SETTINGS_DB,
+		"SELECT value FROM settings WHERE key = ? LIMIT 1")) == NULL) {
 		return NULL;
 	}
-
-	if ((filename = avbox_dbutil_getdbfile("settings.db")) == NULL) {
-		ASSERT(errno == ENOMEM);
-		free(safekey);
+	if (sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC) != SQLITE_OK) {
+		LOG_VPRINT_ERROR("Binding failed: %s",
+			sqlite3_errmsg(sqlite3_db_handle(stmt)));
+		avbox_dbutil_done(stmt);
 		return NULL;
 	}
+	return avbox_dbutil_gettext(stmt);
+}
 
-	/* build sql statement */
-	snprintf(sql, SQLBUFLEN, "SELECT value FROM settings WHERE key = '%s' LIMIT 1;",
-		safekey);
 
-	/* open db and exec statement */
-	if ((res = sqlite3_open_v2(filename,
-		&db, SQLITE_OPEN_READONLY, NULL)) != SQLITE_OK) {
-		LOG_VPRINT_ERROR("Could not open database '%s': %s (%d)",
-			filename, sqlite3_errmsg(db), res);
-		goto end;
+/**
+ * Checks if a setting exists.
+ */
+static int
+avbox_settings_exists(const char * const key)
+{
+	int64_t count = 0;
+	sqlite3_stmt *stmt;
+
+	if ((stmt = avbox_dbutil_prepare(SETTINGS_DB,
+		"SELECT COUNT(*) FROM settings WHERE key = ?")) == NULL) {
+		return -1;
 	}
-	if ((res = sqlite3_exec(db, sql,
-		&avbox_settings_getstring_callback, &value, NULL)) != SQLITE_OK) {
-		LOG_VPRINT_ERROR("Query '%s' failed (%d)",
-			sql, res);
-		goto end;
+	if (sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC) != SQLITE_OK) {
+		avbox_dbutil_done(stmt);
+		return -1;
 	}
-end:
-	if (safekey != NULL) {
-		free(safekey);
+	if (avbox_dbutil_getint64(stmt, &count) == -1) {
+		return -1;
 	}
-	if (filename != NULL) {
-		free(filename);
+	return count > 0;
+}
+
+
+/**
+ * Prepares the statement to insert, update or delete a setting
+ * and binds the key. The value is left for the caller to bind
+ * as the 1st parameter.
+ */
+static sqlite3_stmt *
+avbox_settings_preparewrite(const char * const key, const int delete)
+{
+	int exists;
+	sqlite3_stmt *stmt;
+	const char *sql;
+
+	if ((exists = avbox_settings_exists(key)) == -1) {
+		return NULL;
 	}
-	if (db != NULL) {
-		sqlite3_close(db);
+
+	if (delete) {
+		sql = "DELETE FROM settings WHERE key = ?2";
+	} else if (exists) {
+		sql = "UPDATE settings SET value = ?1 WHERE key = ?2";
+	} else {
+		sql = "INSERT INTO settings (value, key) VALUES (?1, ?2)";
+	}
+
+	if ((stmt = avbox_dbutil_prepare(SETTINGS_DB, sql)) == NULL) {
+		return NULL;
 	}
-	return value;
+	if (sqlite3_bind_text(stmt, 2, key, -1, SQLITE_STATIC) != SQLITE_OK) {
+		LOG_VPRINT_ERROR("Binding failed: %s",
+			sqlite3_errmsg(sqlite3_db_handle(stmt)));
+		avbox_dbutil_done(stmt);
+		errno = EFAULT;
+		return NULL;
+	}
+	return stmt;
 }
 
 
@@ -132,81 +144,27 @@ int
 avbox_settings_setstring(const char * const key,
 	const char * const value)
 {
-	int ret = -1, res;
-	sqlite3 *db = NULL;
-	char *existing = NULL, *filename = NULL;
-	char sql[SQLBUFLEN];
+	int ret = -1;
+	sqlite3_stmt *stmt;
 
 	DEBUG_VPRINT(LOG_MODULE, "Entering settings_setstring(\"%s\", \"%s\")",
 		key, value);
 
 	ASSERT(key != NULL);
 
-	char * const safekey = avbox_dbutil_escapesql(key);
-	char * const safevalue = avbox_dbutil_escapesql(value);
-	if (safekey == NULL || safevalue == NULL) {
-		errno = ENOMEM;
-		goto end;
-	}
-
 	pthread_mutex_lock(&dblock);
 
-	existing = avbox_settings_getstring(key);
-
-	if (existing == NULL) {
-		/* doesn't exist and value is NULL */
-		if (value == NULL) {
-			goto end;
-		}
-		snprintf(sql, SQLBUFLEN,
-			"INSERT INTO settings (key, value) VALUES ('%s', '%s');",
-			safekey, safevalue);
-	} else {
-		if (value == NULL) {
-			snprintf(sql, SQLBUFLEN,
-				"DELETE FROM settings WHERE key = '%s';",
-				safekey);
-		} else {
-			snprintf(sql, SQLBUFLEN,
-				"UPDATE settings SET value = '%s' WHERE key = '%s';",
-				safevalue, safekey);
-		}
-	}
-
-	if ((filename = avbox_dbutil_getdbfile("settings.db")) == NULL) {
-		ASSERT(errno == ENOMEM);
+	if ((stmt = avbox_settings_preparewrite(key, value == NULL)) == NULL) {
 		goto end;
 	}
-
-	/* open db and exec query */
-	if ((res = sqlite3_open_v2(filename, &db,
-		SQLITE_OPEN_READWRITE, NULL)) != SQLITE_OK) {
-		LOG_VPRINT_ERROR("Could not open database '%s': %s (%d)",
-			filename, sqlite3_errmsg(db), res);
-	}
-	if ((res = sqlite3_exec(db, sql, NULL, NULL, NULL)) != SQLITE_OK) {
-		LOG_VPRINT_ERROR("Could not exec query '%s' (%d)",
-			sql, res);
+	if (value != NULL && sqlite3_bind_text(stmt, 1, value, -1, SQLITE_STATIC) != SQLITE_OK) {
+		LOG_VPRINT_ERROR("Binding failed: %s",
+			sqlite3_errmsg(sqlite3_db_handle(stmt)));
+		avbox_dbutil_done(stmt);
 		goto end;
 	}
-
-	ret = 0;
+	ret = avbox_dbutil_exec(stmt);
 end:
-	if (safekey != NULL) {
-		free(safekey);
-	}
-	if (safevalue != NULL) {
-		free(safevalue);
-	}
-	if (existing != NULL) {
-		free(existing);
-	}
-	if (db != NULL) {
-		sqlite3_close(db);
-	}
-	if (filename != NULL) {
-		free(filename);
-	}
 	pthread_mutex_unlock(&dblock);
 	return ret;
 }
@@ -267,11 +225,23 @@ avbox_settings_setbool(const char * const key, const int value)
 int
 avbox_settings_setint(const char * const key, const int value)
 {
-	char svalue[32];
+	int ret = -1;
+	sqlite3_stmt *stmt;
+
 	DEBUG_VPRINT(LOG_MODULE, "Entering settings_setint(\"%s\", %i)",
 		key, value);
-	sprintf(svalue, "%d", value);
-	return avbox_settings_setstring(key, svalue);
+
+	pthread_mutex_lock(&dblock);
+	if ((stmt = avbox_settings_preparewrite(key, 0)) != NULL) {
+		if (sqlite3_bind_int(stmt, 1, value) != SQLITE_OK) {
+			avbox_dbutil_done(stmt);
+			errno = EFAULT;
+		} else {
+			ret = avbox_dbutil_exec(stmt);
+		}
+	}
+	pthread_mutex_unlock(&dblock);
+	return ret;
 }
 
 
@@ -281,15 +251,24 @@ avbox_settings_setint(const char * const key, const int value)
 int
 avbox_settings_getint(const char * key, const int defvalue)
 {
-	char *svalue;
-	int ret = defvalue;
+	int64_t value;
+	sqlite3_stmt *stmt;
+
 	DEBUG_VPRINT(LOG_MODULE, "Entering settings_getint(\"%s\", %d)",
 		key, defvalue);
-	if ((svalue = avbox_settings_getstring(key)) != NULL) {
-		ret = atoi(svalue);
-		free(svalue);
+
+	if ((stmt = avbox_dbutil_prepare(SETTINGS_DB,
+		"SELECT value FROM settings WHERE key = ? AND value IS NOT NULL LIMIT 1")) == NULL) {
+		return defvalue;
 	}
-	return ret;
+	if (sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC) != SQLITE_OK) {
+		avbox_dbutil_done(stmt);
+		return defvalue;
+	}
+	if (avbox_dbutil_getint64(stmt, &value) == -1) {
+		return defvalue;
+	}
+	return (int) value;
 }
 
 
@@ -400,4 +379,5 @@ avbox_settings_init()
 void
 avbox_settings_shutdown()
 {
+	avbox_dbutil_close();
 }
@@ -25,6 +25,7 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
 #include <sys/time.h>
 #include <stdlib.h>
@@ -48,6 +49,23 @@
 #define READAHEAD_TRESHOLD	(5)
 #define READAHEAD_FSEEK_MAX   	(64 * KB)
 #define RETRIES_MAX		(3)
+#define PREFETCH_RANGES_MAX	(8)
+#define PREFETCH_POLL_MS	(100)
+#define PREFETCH_TIMEOUT	(30)
+
+
+/* A byte range fetched in the background */
+LISTABLE_STRUCT(avbox_httpstream_range,
+	struct avbox_httpstream *file;
+	CURL*           handle;
+	char*           buf;
+	int64_t         offset;
+	size_t          len;
+	size_t          filled;
+	int             started;
+	int             done;
+	int             failed;
+);
 
 
 /* Stream handle */
@@ -76,11 +94,22 @@ LISTABLE_STRUCT(avbox_httpstream,
 	size_t          ra_wants;
 	off_t           ra_seekto;
 	off_t           ra_offset;
+	int             ra_seekret;
 	int             ra_running;
 	unsigned int    ra_reads;
 	int             ra_abort;
 	int             ra_growbuf;
 	const char*     ra_bufend;
+
+	/* prefetch stuff */
+	char*           url;
+	CURLM*          pf_multi;
+	pthread_t       pf_thread;
+	pthread_mutex_t pf_lock;
+	pthread_cond_t  pf_signal;
+	LIST            pf_ranges;
+	int             pf_running;
+	int             pf_quit;
 );
 
 
@@ -123,6 +152,23 @@ avbox_httpstream_removefromlist(struct avbox_httpstream *stream)
 }
 
 
+/**
+ * Free's a prefetched range.
+ */
+static void
+avbox_httpstream_freerange(struct avbox_httpstream_range * const range)
+{
+	if (range->handle != NULL) {
+		if (range->file->pf_multi != NULL) {
+			curl_multi_remove_handle(range->file->pf_multi, range->handle);
+		}
+		curl_easy_cleanup(range->handle);
+	}
+	free(range->buf);
+	free(range);
+}
+
+
 /**
  * Free's a stream handle and all it's
  * associated buffers.
@@ -139,6 +185,17 @@ avbox_httpstream_free(struct avbox_httpstream *file)
 	if (file->buf != NULL) {
 		free(file->buf);
 	}
+	if (file->url != NULL) {
+		struct avbox_httpstream_range *range;
+		LIST_FOREACH_SAFE(struct avbox_httpstream_range*, range, &file->pf_ranges, {
+			LIST_REMOVE(range);
+			avbox_httpstream_freerange(range);
+		});
+		if (file->pf_multi != NULL) {
+			curl_multi_cleanup(file->pf_multi);
+		}
+		free(file->url);
+	}
 	free(file);
 }
 
@@ -174,7 +231,10 @@ avbox_httpstream_writecb(char *buffer, size_t size, size_t nitems, void *userp)
 	size_t bytes_to_copy;
 	size_t sz = (size = (size * nitems));
 
-	ASSERT(file->bufcnt == 0);
+	/* curl may call us more than once per transfer so we
+	 * may already have leftovers, but only after the
+	 * request has been satisfied */
+	ASSERT(file->bufcnt == 0 || cbdata->rem == 0);
 
 	/* get what we need */
 	if (LIKELY(cbdata->rem > 0)) {
@@ -345,19 +405,26 @@ avbox_httpstream_fillbuf(struct avbox_httpstream *file, char *buffer, size_t siz
 /**
  * Actually seek.
  */
-void
+int
 avbox_httpstream_doseek(struct avbox_httpstream * const file,
 	off_t offset)
 {
+	CURLMcode mret;
 	curl_multi_remove_handle(file->multi_handle, file->handle);
 	curl_easy_setopt(file->handle, CURLOPT_RESUME_FROM, (long) offset);
-	curl_multi_add_handle(file->multi_handle, file->handle);
+	if ((mret = curl_multi_add_handle(file->multi_handle, file->handle)) != CURLM_OK) {
+		LOG_VPRINT_ERROR("Could not seek stream: %s",
+			curl_multi_strerror(mret));
+		errno = EIO;
+		return -1;
+	}
 	file->bufcnt = 0;
 	file->ptr = file->buf;
 	file->connected = 0;
 	file->eof = 0;
 	file->offset = offset;
 	file->ra_offset = offset;
+	return 0;
 }
 
 
@@ -504,6 +571,7 @@ THREAD_EXIT:
 				file->ra_avail -= bytes_to_skip;
 				file->offset = file->ra_seekto;
 				file->ra_seekto = -1;
+				file->ra_seekret = 0;
 				file->ra_abort = 0;
 				pthread_mutex_unlock(&file->ra_lock);
 				goto READAHEAD_START;
@@ -522,6 +590,7 @@ THREAD_EXIT:
 				ASSERT(bytes_to_skip > 0);
 
 				if ((bytes_read = avbox_httpstream_fillbuf(file, NULL, bytes_to_skip)) == -1) {
+					file->ra_seekret = -1;
 					pthread_mutex_unlock(&file->ra_lock);
 					goto THREAD_EXIT;
 				}
@@ -532,7 +601,7 @@ THREAD_EXIT:
 			}
 		}
 		file->ra_running = 0;
-		avbox_httpstream_doseek(file, file->ra_seekto);
+		file->ra_seekret = avbox_httpstream_doseek(file, file->ra_seekto);
 		READAHEAD_INIT();
 		pthread_mutex_unlock(&file->ra_lock);
 		goto READAHEAD_START;
@@ -573,6 +642,14 @@ avbox_httpstream_open(const char *url)
 	if (UNLIKELY((file = malloc(sizeof(struct avbox_httpstream))) == NULL)) {
 		LOG_PRINT_ERROR("avbox_httpstream_open(): Out of memory");
 		return NULL;
+	} else {
+		memset(file, 0, sizeof(struct avbox_httpstream));
+	}
+
+	if (UNLIKELY((file->url = strdup(url)) == NULL)) {
+		LOG_PRINT_ERROR("avbox_httpstream_open(): Out of memory");
+		free(file);
+		return NULL;
 	}
 
 	ASSERT(CURLE_OK == 0);
@@ -583,7 +660,9 @@ avbox_httpstream_open(const char *url)
 	pthread_mutex_init(&file->read_lock, NULL);
 	pthread_mutex_init(&file->ra_lock, NULL);
 	pthread_cond_init(&file->ra_signal, NULL);
-	pthread_cond_init(&file->ra_signal, NULL);
+	pthread_mutex_init(&file->pf_lock, NULL);
+	pthread_cond_init(&file->pf_signal, NULL);
+	LIST_INIT(&file->pf_ranges);
 
 	if (UNLIKELY(file->handle == NULL || file->multi_handle == NULL)) {
 		LOG_PRINT_ERROR("curl_easy_init() or curl_multi_init() failed");
@@ -597,17 +676,349 @@ avbox_httpstream_open(const char *url)
 	curl_easy_setopt (file->handle, CURLOPT_NOSIGNAL, 1L);
 	curl_easy_setopt (file->handle, CURLOPT_WRITEFUNCTION, avbox_httpstream_writecb);
 	curl_easy_setopt (file->handle, CURLOPT_USERAGENT, "avmount/0.8");
+	curl_easy_setopt (file->handle, CURLOPT_FOLLOWLOCATION, 1L);
 	curl_multi_add_handle(file->multi_handle, file->handle);
 	return file;
 }
 
 
+/**
+ * Gets the size of the remote file.
+ */
+int64_t
+avbox_httpstream_size(struct avbox_httpstream * const file)
+{
+	CURL *handle;
+#if LIBCURL_VERSION_NUM >= 0x073700
+	curl_off_t len = -1;
+	const CURLINFO info = CURLINFO_CONTENT_LENGTH_DOWNLOAD_T;
+#else
+	double len = -1;
+	const CURLINFO info = CURLINFO_CONTENT_LENGTH_DOWNLOAD;
+#endif
+
+	ASSERT(file != NULL);
+
+	/* ask with a HEAD request on a new handle */
+	if ((handle = curl_easy_init()) == NULL) {
+		return -1;
+	}
+	curl_easy_setopt(handle, CURLOPT_URL, file->url);
+	curl_easy_setopt(handle, CURLOPT_NOBODY, 1L);
+	curl_easy_setopt(handle, CURLOPT_NOSIGNAL, 1L);
+	curl_easy_setopt(handle, CURLOPT_FOLLOWLOCATION, 1L);
+	curl_easy_setopt(handle, CURLOPT_USERAGENT, "avmount/0.8");
+	if (curl_easy_perform(handle) != CURLE_OK ||
+		curl_easy_getinfo(handle, info, &len) != CURLE_OK) {
+		len = -1;
+	}
+	curl_easy_cleanup(handle);
+
+	DEBUG_VPRINT(LOG_MODULE, "avbox_httpstream_size(%lx) = %" PRIi64,
+		(unsigned long) file, (int64_t) len);
+
+	return (len < 0) ? -1 : (int64_t) len;
+}
+
+
+/**
+ * cURL callback for prefetched ranges.
+ */
+static size_t
+avbox_httpstream_rangecb(char *buffer, size_t size, size_t nitems, void *userp)
+{
+	long code = 0;
+	struct avbox_httpstream_range * const range = userp;
+	struct avbox_httpstream * const file = range->file;
+	const size_t sz = size * nitems;
+	const size_t n = MIN(sz, range->len - range->filled);
+
+	/* if the server ignores the range it would send the
+	 * whole file so bail */
+	if (UNLIKELY(range->filled == 0)) {
+		curl_easy_getinfo(range->handle, CURLINFO_RESPONSE_CODE, &code);
+		if (code != 206) {
+			DEBUG_VPRINT(LOG_MODULE, "Range request returned %li",
+				code);
+			return 0;
+		}
+	}
+
+	/* the reader never looks past filled so we can
+	 * copy without the lock */
+	memcpy(range->buf + range->filled, buffer, n);
+
+	pthread_mutex_lock(&file->pf_lock);
+	range->filled += n;
+	pthread_cond_broadcast(&file->pf_signal);
+	pthread_mutex_unlock(&file->pf_lock);
+
+	return (n == sz) ? sz : 0;
+}
+
+
+/**
+ * Starts the transfer for a range. Called with
+ * pf_lock held.
+ */
+static int
+avbox_httpstream_startrange(struct avbox_httpstream * const file,
+	struct avbox_httpstream_range * const range)
+{
+	char spec[64];
+
+	if ((range->handle = curl_easy_init()) == NULL) {
+		return -1;
+	}
+
+	snprintf(spec, sizeof(spec), "%" PRIi64 "-%" PRIi64,
+		range->offset, range->offset + (int64_t) range->len - 1);
+
+	curl_easy_setopt(range->handle, CURLOPT_URL, file->url);
+	curl_easy_setopt(range->handle, CURLOPT_RANGE, spec);
+	curl_easy_setopt(range->handle, CURLOPT_NOSIGNAL, 1L);
+	curl_easy_setopt(range->handle, CURLOPT_FOLLOWLOCATION, 1L);
+	curl_easy_setopt(range->handle, CURLOPT_USERAGENT, "avmount/0.8");
+	curl_easy_setopt(range->handle, CURLOPT_CONNECTTIMEOUT, (long) PREFETCH_TIMEOUT);
+	curl_easy_setopt(range->handle, CURLOPT_LOW_SPEED_LIMIT, 1L);
+	curl_easy_setopt(range->handle, CURLOPT_LOW_SPEED_TIME, (long) PREFETCH_TIMEOUT);
+	curl_easy_setopt(range->handle, CURLOPT_WRITEFUNCTION, avbox_httpstream_rangecb);
+	curl_easy_setopt(range->handle, CURLOPT_WRITEDATA, range);
+	curl_easy_setopt(range->handle, CURLOPT_PRIVATE, range);
+
+	if (curl_multi_add_handle(file->pf_multi, range->handle) != CURLM_OK) {
+		curl_easy_cleanup(range->handle);
+		range->handle = NULL;
+		return -1;
+	}
+	range->started = 1;
+	return 0;
+}
+
+
+/**
+ * Runs all range transfers in parallel.
+ */
+static void*
+avbox_httpstream_prefetcher(void *f)
+{
+	int still_running = 0;
+	struct avbox_httpstream * const file = f;
+	struct avbox_httpstream_range *range;
+
+	DEBUG_SET_THREAD_NAME("httpprefetch");
+
+	pthread_mutex_lock(&file->pf_lock);
+	while (!file->pf_quit) {
+		CURLMsg *m;
+		int msgcnt, numfds;
+
+		/* start new requests */
+		LIST_FOREACH(struct avbox_httpstream_range*, range, &file->pf_ranges) {
+			if (!range->started && !range->done) {
+				if (avbox_httpstream_startrange(file, range) == -1) {
+					range->done = range->failed = 1;
+				} else {
+					still_running++;
+				}
+			}
+		}
+
+		/* sleep until there's something to do */
+		if (still_running == 0) {
+			pthread_cond_broadcast(&file->pf_signal);
+			pthread_cond_wait(&file->pf_signal, &file->pf_lock);
+			continue;
+		}
+
+		pthread_mutex_unlock(&file->pf_lock);
+		curl_multi_wait(file->pf_multi, NULL, 0, PREFETCH_POLL_MS, &numfds);
+		curl_multi_perform(file->pf_multi, &still_running);
+		pthread_mutex_lock(&file->pf_lock);
+
+		/* reap finished transfers */
+		while ((m = curl_multi_info_read(file->pf_multi, &msgcnt)) != NULL) {
+			if (m->msg != CURLMSG_DONE) {
+				continue;
+			}
+			curl_easy_getinfo(m->easy_handle, CURLINFO_PRIVATE, (char**) &range);
+			DEBUG_VPRINT(LOG_MODULE, "Prefetch of %zu bytes at %" PRIi64
+				" done (result=%i filled=%zu)", range->len, range->offset,
+				m->data.result, range->filled);
+			/* keep whatever we got (ie. ranges past EOF are short) */
+			range->failed = (range->filled == 0);
+			range->len = range->filled;
+			range->done = 1;
+			curl_multi_remove_handle(file->pf_multi, range->handle);
+			curl_easy_cleanup(range->handle);
+			range->handle = NULL;
+		}
+		pthread_cond_broadcast(&file->pf_signal);
+	}
+	pthread_mutex_unlock(&file->pf_lock);
+
+	return NULL;
+}
+
+
+/**
+ * Fetch a byte range in the background.
+ */
+int
+avbox_httpstream_prefetch(struct avbox_httpstream * const file,
+	int64_t offset, size_t len)
+{
+	int count = 0;
+	struct avbox_httpstream_range *range, *oldest = NULL;
+
+	ASSERT(file != NULL);
+
+	if (offset < 0 || len == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&file->pf_lock);
+
+	/* if we already have it there's nothing to do. Otherwise
+	 * make room by dropping the oldest finished range */
+	LIST_FOREACH(struct avbox_httpstream_range*, range, &file->pf_ranges) {
+		if (!range->failed && offset >= range->offset &&
+			(offset + (int64_t) len) <= (range->offset + (int64_t) range->len)) {
+			pthread_mutex_unlock(&file->pf_lock);
+			return 0;
+		}
+		if (oldest == NULL && range->done) {
+			oldest = range;
+		}
+		count++;
+	}
+	if (count >= PREFETCH_RANGES_MAX) {
+		if (oldest == NULL) {
+			pthread_mutex_unlock(&file->pf_lock);
+			errno = EBUSY;
+			return -1;
+		}
+		LIST_REMOVE(oldest);
+		avbox_httpstream_freerange(oldest);
+	}
+
+	if ((range = malloc(sizeof(struct avbox_httpstream_range))) == NULL) {
+		pthread_mutex_unlock(&file->pf_lock);
+		return -1;
+	} else {
+		memset(range, 0, sizeof(struct avbox_httpstream_range));
+	}
+	if ((range->buf = malloc(len)) == NULL) {
+		pthread_mutex_unlock(&file->pf_lock);
+		free(range);
+		return -1;
+	}
+	range->file = file;
+	range->offset = offset;
+	range->len = len;
+
+	/* start the transfers thread */
+	if (!file->pf_running) {
+		if (file->pf_multi == NULL && (file->pf_multi = curl_multi_init()) == NULL) {
+			goto fail;
+		}
+		if (pthread_create(&file->pf_thread, NULL, avbox_httpstream_prefetcher, file) != 0) {
+			goto fail;
+		}
+		file->pf_running = 1;
+	}
+
+	DEBUG_VPRINT(LOG_MODULE, "Prefetching %zu bytes at %" PRIi64,
+		len, offset);
+
+	LIST_APPEND(&file->pf_ranges, range);
+	pthread_cond_broadcast(&file->pf_signal);
+	pthread_mutex_unlock(&file->pf_lock);
+	return 0;
+
+fail:
+	pthread_mutex_unlock(&file->pf_lock);
+	free(range->buf);
+	free(range);
+	errno = ENOMEM;
+	return -1;
+}
+
+
+/**
+ * Finds the prefetched range that covers an offset. Called
+ * with pf_lock held.
+ */
+static struct avbox_httpstream_range *
+avbox_httpstream_findrange(struct avbox_httpstream * const file,
+	const int64_t offset)
+{
+	struct avbox_httpstream_range *range;
+	LIST_FOREACH(struct avbox_httpstream_range*, range, &file->pf_ranges) {
+		if (!range->failed && offset >= range->offset &&
+			offset < (range->offset + (int64_t) range->len)) {
+			return range;
+		}
+	}
+	return NULL;
+}
+
+
+/**
+ * Gets the end of the prefetched data at offset.
+ */
+int64_t
+avbox_httpstream_prefetched(struct avbox_httpstream * const file,
+	int64_t offset)
+{
+	int64_t ret = -1;
+	struct avbox_httpstream_range *range;
+	pthread_mutex_lock(&file->pf_lock);
+	if ((range = avbox_httpstream_findrange(file, offset)) != NULL) {
+		ret = range->offset + range->len;
+	}
+	pthread_mutex_unlock(&file->pf_lock);
+	return ret;
+}
+
+
+/**
+ * Reads prefetched data.
+ */
+ssize_t
+avbox_httpstream_pread(struct avbox_httpstream * const file,
+	void *ptr, size_t size, int64_t offset)
+{
+	ssize_t ret = 0;
+	struct avbox_httpstream_range *range;
+
+	pthread_mutex_lock(&file->pf_lock);
+	while ((range = avbox_httpstream_findrange(file, offset)) != NULL) {
+		const size_t start = offset - range->offset;
+		if (start < range->filled) {
+			ret = MIN(size, range->filled - start);
+			memcpy(ptr, range->buf + start, ret);
+			break;
+		}
+		if (range->done) {
+			break;
+		}
+		pthread_cond_wait(&file->pf_signal, &file->pf_lock);
+	}
+	pthread_mutex_unlock(&file->pf_lock);
+	return ret;
+}
+
+
 /**
  * Seek to an offset in the stream.
  */
-void
+int
 avbox_httpstream_seek(struct avbox_httpstream *file, off_t offset)
 {
+	int ret;
+
 	DEBUG_VPRINT(LOG_MODULE, "avbox_httpstream_seek(%lx, %zd)",
 		(unsigned long) file, offset);
 
@@ -622,6 +1033,7 @@ avbox_httpstream_seek(struct avbox_httpstream *file, off_t offset)
 		if (LIKELY(file->ra_running)) {
 			file->ra_abort = 1;
 			file->ra_seekto = offset;
+			file->ra_seekret = 0;
 			pthread_cond_signal(&file->ra_signal);
 			pthread_mutex_unlock(&file->ra_lock);
 			while (UNLIKELY(file->ra_seekto != -1)) {
@@ -632,13 +1044,19 @@ avbox_httpstream_seek(struct avbox_httpstream *file, off_t offset)
 				}
 				pthread_mutex_unlock(&file->ra_lock);
 			}
-			return;
+			pthread_mutex_lock(&file->ra_lock);
+			ret = file->ra_seekret;
+			pthread_mutex_unlock(&file->ra_lock);
+			if (ret == -1) {
+				errno = EIO;
+			}
+			return ret;
 		} else {
 			pthread_mutex_unlock(&file->ra_lock);
 		}
 	}
 
-	avbox_httpstream_doseek(file, offset);
+	return avbox_httpstream_doseek(file, offset);
 }
 
 
@@ -796,6 +1214,14 @@ avbox_httpstream_close(struct avbox_httpstream *file)
 		ASSERT(file->ra_abort == 0);
 	}
 
+	if (file->pf_running) {
+		pthread_mutex_lock(&file->pf_lock);
+		file->pf_quit = 1;
+		pthread_cond_broadcast(&file->pf_signal);
+		pthread_mutex_unlock(&file->pf_lock);
+		pthread_join(file->pf_thread, NULL);
+	}
+
 	avbox_httpstream_removefromlist(file);
 	avbox_httpstream_free(file);
 }
@@ -0,0 +1,844 @@
+/**
+ * avbox - Toolkit for Embedded Multimedia Applications
+ * Copyright (C) 2016-2017 Fernando Rodriguez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License Version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#       include <libavbox/config.h>
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <libavformat/avio.h>
+
+#define LOG_MODULE "streamcache"
+
+#include <libavbox/avbox.h>
+#include <libavbox/stream.h>
+#include <libavbox/streamcache.h>
+
+
+#define AVBOX_STREAMCACHE_CHUNK		(64 * 1024)
+#define AVBOX_STREAMCACHE_AVIOBUF	(32 * 1024)
+
+/* forward seeks shorter than this are served by reading
+ * through instead of restarting the source */
+#define AVBOX_STREAMCACHE_SKIP_MAX	(256 * 1024)
+
+/* defaults for the stream_cache_* settings */
+#define AVBOX_STREAMCACHE_RAM		(16)		/* MiB */
+#define AVBOX_STREAMCACHE_DISK		(256)		/* MiB */
+#define AVBOX_STREAMCACHE_PREBUFFER	(2048)		/* KiB */
+#define AVBOX_STREAMCACHE_TAIL		(2048)		/* KiB */
+
+
+/**
+ * The cache keeps a single contiguous window of the stream. The
+ * newest part (ring_start to ring_end) lives in the RAM ring. As the
+ * ring fills up the oldest bytes (that have already been read) are
+ * written to a spill file so the window extends back to spill_start.
+ * The spill file is itself a ring of spill_max bytes (bytes are
+ * stored at their stream offset modulo spill_max) so it never
+ * grows past that.
+ *
+ * The spill file is read without holding the lock. spill_gen is
+ * bumped whenever spilled bytes are discarded (before they are
+ * overwritten) so the reader can tell if what it read is still
+ * good, and the file is only closed by destroy() so it stays valid
+ * while the reader uses it.
+ */
+struct avbox_streamcache
+{
+	struct avbox_streamcache_source source;
+	struct avbox_player *player;
+	AVIOContext *avio_ctx;
+	uint8_t *avio_ctx_buffer;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int thread_running;
+
+	uint8_t *ring;
+	size_t ring_sz;
+	int64_t ring_start;
+	int64_t ring_end;
+	int64_t spill_start;
+	int64_t spill_max;
+	int spill_fd;
+	int spill_failed;
+	unsigned int spill_gen;
+
+	int64_t pos;
+	int64_t seek_to;
+	int64_t size;
+	int64_t prebuffer;
+
+	int eof;
+	int error;
+	int closed;
+	int quit;
+	int blocking;
+};
+
+
+/**
+ * Copies data out of the ring.
+ */
+static void
+avbox_streamcache_ringget(const struct avbox_streamcache * const inst,
+	uint8_t *dst, const int64_t offset, size_t n)
+{
+	const size_t start = offset % inst->ring_sz;
+	const size_t n1 = MIN(n, inst->ring_sz - start);
+	memcpy(dst, inst->ring + start, n1);
+	if (n1 < n) {
+		memcpy(dst + n1, inst->ring, n - n1);
+	}
+}
+
+
+/**
+ * Copies data into the ring.
+ */
+static void
+avbox_streamcache_ringput(struct avbox_streamcache * const inst,
+	const uint8_t *src, const int64_t offset, size_t n)
+{
+	const size_t start = offset % inst->ring_sz;
+	const size_t n1 = MIN(n, inst->ring_sz - start);
+	memcpy(inst->ring + start, src, n1);
+	if (n1 < n) {
+		memcpy(inst->ring, src + n1, n - n1);
+	}
+}
+
+
+/**
+ * Writes a piece of the ring to the spill file.
+ */
+static int
+avbox_streamcache_spillwrite(struct avbox_streamcache * const inst,
+	int64_t offset, size_t n)
+{
+	while (n > 0) {
+		const size_t start = offset % inst->ring_sz;
+		const int64_t file_offset = offset % inst->spill_max;
+		const size_t len = MIN(MIN(n, inst->ring_sz - start),
+			(size_t) (inst->spill_max - file_offset));
+		const ssize_t ret = pwrite(inst->spill_fd,
+			inst->ring + start, len, file_offset);
+		if (ret == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		offset += ret;
+		n -= ret;
+	}
+	return 0;
+}
+
+
+/**
+ * Moves bytes from the head of the ring to the spill file
+ * (or just drops them if we're not spilling). Called with
+ * the lock held.
+ */
+static void
+avbox_streamcache_evict(struct avbox_streamcache * const inst, const size_t n)
+{
+	const int64_t offset = inst->ring_start;
+
+	inst->ring_start += n;
+
+	if (inst->spill_fd == -1 || inst->spill_failed) {
+		inst->spill_start = inst->ring_start;
+		return;
+	}
+
+	/* discard the bytes that are about to be overwritten
+	 * before writing so the reader doesn't use them */
+	if ((inst->ring_start - inst->spill_start) > inst->spill_max) {
+		inst->spill_start = inst->ring_start - inst->spill_max;
+		inst->spill_gen++;
+	}
+
+	if (avbox_streamcache_spillwrite(inst, offset, n) == -1) {
+		LOG_VPRINT_WARN("Could not write spill file: %s. Disabling",
+			strerror(errno));
+		inst->spill_failed = 1;
+		inst->spill_gen++;
+		inst->spill_start = inst->ring_start;
+	}
+}
+
+
+/**
+ * Fills the cache from the source.
+ */
+static void *
+avbox_streamcache_filler(void *arg)
+{
+	uint8_t *buf;
+	struct avbox_streamcache * const inst = arg;
+
+	DEBUG_SET_THREAD_NAME("streamcache");
+
+	if ((buf = malloc(AVBOX_STREAMCACHE_CHUNK)) == NULL) {
+		LOG_PRINT_ERROR("Could not allocate read buffer!");
+		pthread_mutex_lock(&inst->lock);
+		inst->error = 1;
+		pthread_cond_broadcast(&inst->cond);
+		pthread_mutex_unlock(&inst->lock);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&inst->lock);
+	while (!inst->quit) {
+		int64_t offset;
+		ssize_t ret;
+		size_t n;
+
+		/* restart the source at the new position */
+		if (inst->seek_to != -1) {
+			const int64_t target = inst->seek_to;
+			inst->seek_to = -1;
+			pthread_mutex_unlock(&inst->lock);
+
+			DEBUG_VPRINT(LOG_MODULE, "Restarting source at %" PRIi64,
+				target);
+			ret = inst->source.seek(inst->source.self, target);
+
+			pthread_mutex_lock(&inst->lock);
+			if (inst->seek_to != -1) {
+				continue;
+			}
+			inst->ring_start = inst->ring_end = inst->spill_start = target;
+			inst->spill_gen++;
+			inst->eof = 0;
+			inst->error = (ret == -1);
+			pthread_cond_broadcast(&inst->cond);
+			continue;
+		}
+
+		if (inst->eof || inst->error || inst->closed) {
+			pthread_cond_wait(&inst->cond, &inst->lock);
+			continue;
+		}
+
+		/* if the ring is full make room by evicting what's
+		 * already been read, otherwise wait for the reader */
+		if ((inst->ring_end - inst->ring_start) == (int64_t) inst->ring_sz) {
+			if (inst->ring_start < inst->pos) {
+				avbox_streamcache_evict(inst, MIN(inst->pos - inst->ring_start,
+					AVBOX_STREAMCACHE_CHUNK));
+			} else {
+				pthread_cond_wait(&inst->cond, &inst->lock);
+				continue;
+			}
+		}
+
+		n = MIN(AVBOX_STREAMCACHE_CHUNK,
+			inst->ring_sz - (inst->ring_end - inst->ring_start));
+		offset = inst->ring_end;
+		pthread_mutex_unlock(&inst->lock);
+
+		ret = inst->source.read(inst->source.self, buf, n);
+
+		pthread_mutex_lock(&inst->lock);
+
+		/* if the reader moved while we were reading
+		 * the data is no good */
+		if (inst->seek_to != -1 || offset != inst->ring_end) {
+			continue;
+		}
+
+		if (ret == -1) {
+			LOG_VPRINT_ERROR("Could not read source: %s",
+				strerror(errno));
+			inst->error = 1;
+		} else if (ret == 0) {
+			DEBUG_VPRINT(LOG_MODULE, "EOF at %" PRIi64, offset);
+			inst->eof = 1;
+		} else {
+			ASSERT(ret <= n);
+			avbox_streamcache_ringput(inst, buf, offset, ret);
+			inst->ring_end += ret;
+		}
+		pthread_cond_broadcast(&inst->cond);
+	}
+	pthread_mutex_unlock(&inst->lock);
+
+	free(buf);
+	return NULL;
+}
+
+
+/**
+ * AVIO read_packet callback.
+ */
+static int
+avbox_streamcache_read(void *opaque, uint8_t *buf, int bufsz)
+{
+	int ret = 0;
+	struct avbox_streamcache * const inst = opaque;
+
+	pthread_mutex_lock(&inst->lock);
+	while (1) {
+		if (inst->closed || (inst->size != -1 && inst->pos >= inst->size)) {
+			ret = AVERROR_EOF;
+			break;
+		}
+
+		/* serve from RAM */
+		if (inst->pos >= inst->ring_start && inst->pos < inst->ring_end) {
+			ret = MIN(bufsz, inst->ring_end - inst->pos);
+			avbox_streamcache_ringget(inst, buf, inst->pos, ret);
+			inst->pos += ret;
+			pthread_cond_broadcast(&inst->cond);
+			break;
+		}
+
+		/* serve from the spill file */
+		if (inst->spill_fd != -1 && !inst->spill_failed &&
+			inst->pos >= inst->spill_start && inst->pos < inst->ring_start) {
+			const int64_t pos = inst->pos;
+			const unsigned int gen = inst->spill_gen;
+			const int64_t file_offset = pos % inst->spill_max;
+			const size_t len = MIN(MIN(bufsz, inst->ring_start - pos),
+				inst->spill_max - file_offset);
+
+			pthread_mutex_unlock(&inst->lock);
+			ret = pread(inst->spill_fd, buf, len, file_offset);
+			pthread_mutex_lock(&inst->lock);
+
+			/* if the filler discarded spilled data while
+			 * we were reading try again */
+			if (inst->spill_gen != gen) {
+				continue;
+			}
+			if (ret > 0) {
+				inst->pos = pos + ret;
+				break;
+			}
+			LOG_VPRINT_WARN("Could not read spill file: %s",
+				(ret == -1) ? strerror(errno) : "Short read");
+			inst->spill_failed = 1;
+			inst->spill_gen++;
+			inst->spill_start = inst->ring_start;
+			continue;
+		}
+
+		/* serve from a prefetched range */
+		if (inst->source.pread != NULL) {
+			const int64_t pos = inst->pos;
+			const int64_t end = inst->source.prefetched(inst->source.self, pos);
+			if (end != -1) {
+				pthread_mutex_unlock(&inst->lock);
+				ret = inst->source.pread(inst->source.self, buf, bufsz, pos);
+				pthread_mutex_lock(&inst->lock);
+				if (ret > 0) {
+					inst->pos = pos + ret;
+
+					/* when we get close to the end of the range
+					 * get the source going from there */
+					if ((end - inst->pos) < AVBOX_STREAMCACHE_SKIP_MAX &&
+						(inst->size == -1 || end < inst->size) &&
+						(end < inst->spill_start || end > inst->ring_end) &&
+						inst->seek_to != end) {
+						inst->seek_to = end;
+						pthread_cond_broadcast(&inst->cond);
+					}
+					break;
+				}
+				continue;
+			}
+		}
+
+		/* wait for a pending restart */
+		if (inst->seek_to != -1) {
+			inst->blocking = 1;
+			pthread_cond_wait(&inst->cond, &inst->lock);
+			continue;
+		}
+
+		/* wait for data */
+		if (inst->pos >= inst->ring_end &&
+			inst->pos - inst->ring_end < AVBOX_STREAMCACHE_SKIP_MAX) {
+			if (inst->eof) {
+				ret = AVERROR_EOF;
+				break;
+			} else if (inst->error) {
+				ret = AVERROR(EIO);
+				break;
+			}
+			inst->blocking = 1;
+			pthread_cond_wait(&inst->cond, &inst->lock);
+			continue;
+		}
+
+		/* outside the window */
+		inst->seek_to = inst->pos;
+		pthread_cond_broadcast(&inst->cond);
+	}
+	inst->blocking = 0;
+	pthread_mutex_unlock(&inst->lock);
+
+	return ret;
+}
+
+
+/**
+ * AVIO seek callback. We only move the read position here,
+ * the source is restarted by the first read outside the window.
+ */
+static int64_t
+avbox_streamcache_seek(void *opaque, int64_t pos, int whence)
+{
+	int64_t ret;
+	struct avbox_streamcache * const inst = opaque;
+
+	pthread_mutex_lock(&inst->lock);
+	switch (whence & ~AVSEEK_FORCE) {
+	case AVSEEK_SIZE:
+		pthread_mutex_unlock(&inst->lock);
+		return inst->size;
+	case SEEK_SET:
+		ret = pos;
+		break;
+	case SEEK_CUR:
+		ret = inst->pos + pos;
+		break;
+	case SEEK_END:
+		ret = (inst->size == -1) ? -1 : inst->size + pos;
+		break;
+	default:
+		ret = -1;
+	}
+	if (ret < 0) {
+		ret = -1;
+	} else {
+		inst->pos = ret;
+	}
+	pthread_mutex_unlock(&inst->lock);
+	return ret;
+}
+
+
+static void
+play(struct avbox_streamcache * const inst, const int skip_to_menu)
+{
+	(void) inst;
+	(void) skip_to_menu;
+}
+
+
+/**
+ * Check is we're currently blocking the IO thread.
+ */
+static int
+is_blocking(struct avbox_streamcache * const inst)
+{
+	return inst->blocking;
+}
+
+
+static int
+underrun_expected(const struct avbox_streamcache * const inst)
+{
+	return 0;
+}
+
+
+static int
+can_pause(const struct avbox_streamcache * const inst)
+{
+	return 1;
+}
+
+
+/**
+ * Reports the bytes buffered ahead of the read position
+ * against the prebuffer size. Once the source is exhausted
+ * we report full so the player doesn't wait for it.
+ */
+static void
+buffer_state(struct avbox_streamcache * const inst,
+	int64_t * const count, int64_t * const capacity)
+{
+	pthread_mutex_lock(&inst->lock);
+	*capacity = inst->prebuffer;
+	if (inst->eof || inst->error || inst->closed) {
+		*count = inst->prebuffer;
+	} else if (inst->seek_to == -1 && inst->pos >= inst->spill_start &&
+		inst->pos <= inst->ring_end) {
+		*count = MIN(inst->ring_end - inst->pos, inst->prebuffer);
+	} else {
+		*count = 0;
+	}
+	pthread_mutex_unlock(&inst->lock);
+}
+
+
+/**
+ * Fetches a range that we expect to read soon (ie. a
+ * seek target) if the source can do it.
+ */
+static void
+prefetch(struct avbox_streamcache * const inst,
+	const int64_t pos, const int64_t len)
+{
+	int cached;
+
+	if (inst->source.prefetch == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&inst->lock);
+	cached = (pos >= inst->spill_start &&
+		pos < inst->ring_end + AVBOX_STREAMCACHE_SKIP_MAX);
+	pthread_mutex_unlock(&inst->lock);
+
+	if (!cached && inst->source.prefetch(inst->source.self, pos, len) == -1) {
+		DEBUG_VPRINT(LOG_MODULE, "Could not prefetch %" PRIi64 ": %s",
+			pos, strerror(errno));
+	}
+}
+
+
+/**
+ * Unblocks the reader. Further reads return EOF.
+ */
+static void
+close_stream(struct avbox_streamcache * const inst)
+{
+	DEBUG_PRINT(LOG_MODULE, "Closing cached stream");
+	pthread_mutex_lock(&inst->lock);
+	inst->closed = 1;
+	pthread_cond_broadcast(&inst->cond);
+	pthread_mutex_unlock(&inst->lock);
+}
+
+
+static void
+destroy(struct avbox_streamcache * const inst)
+{
+	if (inst->thread_running) {
+		pthread_mutex_lock(&inst->lock);
+		inst->quit = 1;
+		pthread_cond_broadcast(&inst->cond);
+		pthread_mutex_unlock(&inst->lock);
+		pthread_join(inst->thread, NULL);
+	}
+	if (inst->source.close != NULL) {
+		inst->source.close(inst->source.self);
+	}
+	if (inst->spill_fd != -1) {
+		close(inst->spill_fd);
+	}
+	if (inst->avio_ctx != NULL) {
+		av_freep(&inst->avio_ctx->buffer);
+		av_free(inst->avio_ctx);
+	} else if (inst->avio_ctx_buffer != NULL) {
+		av_free(inst->avio_ctx_buffer);
+	}
+	if (inst->ring != NULL) {
+		free(inst->ring);
+	}
+	pthread_cond_destroy(&inst->cond);
+	pthread_mutex_destroy(&inst->lock);
+	free(inst);
+}
+
+
+/**
+ * Creates an unlinked file in the state directory
+ * to spill the cache to.
+ */
+static int
+avbox_streamcache_mkspill(void)
+{
+	int fd;
+	char *statedir;
+	char path[PATH_MAX];
+
+	if ((statedir = getstatedir()) == NULL) {
+		return -1;
+	}
+	snprintf(path, sizeof(path), "%s/cache", statedir);
+	free(statedir);
+	mkdir_p(path, S_IRWXU);
+	strncat(path, "/streamXXXXXX", sizeof(path) - strlen(path) - 1);
+
+	if ((fd = mkstemp(path)) == -1) {
+		LOG_VPRINT_WARN("Could not create spill file %s: %s",
+			path, strerror(errno));
+		return -1;
+	}
+	(void) unlink(path);
+	return fd;
+}
+
+
+/**
+ * Opens any byte source through the read-ahead cache.
+ */
+struct avbox_player_stream *
+avbox_streamcache_opensource(const struct avbox_streamcache_source * const source,
+	struct avbox_player * const player,
+	struct avbox_player_stream * const stream)
+{
+	struct avbox_streamcache *inst;
+
+	ASSERT(source != NULL);
+	ASSERT(source->read != NULL && source->seek != NULL);
+
+	/* clear the function table */
+	memset(stream, 0, sizeof(struct avbox_player_stream));
+
+	if ((inst = malloc(sizeof(struct avbox_streamcache))) == NULL) {
+		return NULL;
+	} else {
+		memset(inst, 0, sizeof(struct avbox_streamcache));
+	}
+
+	pthread_mutex_init(&inst->lock, NULL);
+	pthread_cond_init(&inst->cond, NULL);
+	inst->source = *source;
+	inst->player = player;
+	inst->spill_fd = -1;
+	inst->seek_to = -1;
+	inst->size = (source->size != NULL) ? source->size(source->self) : -1;
+	inst->ring_sz = MAX(1, avbox_settings_getint("stream_cache_ram",
+		AVBOX_STREAMCACHE_RAM)) * 1024 * 1024;
+	inst->spill_max = (int64_t) MAX(0, avbox_settings_getint("stream_cache_disk",
+		AVBOX_STREAMCACHE_DISK)) * 1024 * 1024;
+	inst->prebuffer = MIN(inst->ring_sz / 2,
+		(size_t) MAX(1, avbox_settings_getint("stream_cache_prebuffer",
+		AVBOX_STREAMCACHE_PREBUFFER)) * 1024);
+
+	if ((inst->ring = malloc(inst->ring_sz)) == NULL) {
+		LOG_VPRINT_ERROR("Could not allocate %zu bytes cache",
+			inst->ring_sz);
+		goto end;
+	}
+
+	if (inst->spill_max > 0) {
+		inst->spill_fd = avbox_streamcache_mkspill();
+	}
+
+	/* initialize avio context */
+	if ((inst->avio_ctx_buffer = av_malloc(AVBOX_STREAMCACHE_AVIOBUF)) == NULL) {
+		goto end;
+	}
+	if ((inst->avio_ctx = avio_alloc_context(inst->avio_ctx_buffer,
+		AVBOX_STREAMCACHE_AVIOBUF, 0, inst, avbox_streamcache_read, NULL,
+		avbox_streamcache_seek)) == NULL) {
+		goto end;
+	}
+	if (pthread_create(&inst->thread, NULL, avbox_streamcache_filler, inst) != 0) {
+		LOG_PRINT_ERROR("Could not start cache thread!");
+		goto end;
+	}
+	inst->thread_running = 1;
+
+	DEBUG_VPRINT(LOG_MODULE, "Opened cache (size=%" PRIi64 " ram=%zu spill=%s)",
+		inst->size, inst->ring_sz, (inst->spill_fd != -1) ? "yes" : "no");
+
+	/* the filler starts at the head. Containers often keep
+	 * their index at the end of the file so get that too */
+	if (inst->source.prefetch != NULL && inst->size != -1) {
+		const int64_t tail = (int64_t) MAX(0, avbox_settings_getint(
+			"stream_prefetch_tail", AVBOX_STREAMCACHE_TAIL)) * 1024;
+		if (tail > 0 && inst->size > (int64_t) inst->ring_sz) {
+			prefetch(inst, inst->size - tail, tail);
+		}
+	}
+
+	/* fill the funtion table */
+	stream->self = inst;
+	stream->avio = inst->avio_ctx;
+	stream->manages_position = 0;
+	stream->must_flush_before_play = 0;
+	stream->buffer_state = (void*) &buffer_state;
+	stream->play = (void*) &play;
+	stream->close = (void*) &close_stream;
+	stream->destroy = (void*) &destroy;
+	stream->underrun_expected = (void*) &underrun_expected;
+	stream->can_pause = (void*) &can_pause;
+	stream->is_blocking = (void*) &is_blocking;
+	stream->prefetch = (void*) &prefetch;
+	return stream;
+
+end:
+	/* the caller still owns the source */
+	inst->source.close = NULL;
+	destroy(inst);
+	return NULL;
+}
+
+
+/**
+ * HTTP source.
+ */
+static ssize_t
+avbox_streamcache_httpread(void *self, void *buf, size_t bufsz)
+{
+	return avbox_httpstream_read(self, buf, bufsz);
+}
+
+
+static int
+avbox_streamcache_httpseek(void *self, int64_t pos)
+{
+	return avbox_httpstream_seek(self, pos);
+}
+
+
+static int64_t
+avbox_streamcache_httpsize(void *self)
+{
+	return avbox_httpstream_size(self);
+}
+
+
+static int
+avbox_streamcache_httpprefetch(void *self, int64_t pos, size_t len)
+{
+	return avbox_httpstream_prefetch(self, pos, len);
+}
+
+
+static int64_t
+avbox_streamcache_httpprefetched(void *self, int64_t pos)
+{
+	return avbox_httpstream_prefetched(self, pos);
+}
+
+
+static ssize_t
+avbox_streamcache_httppread(void *self, void *buf, size_t bufsz, int64_t pos)
+{
+	return avbox_httpstream_pread(self, buf, bufsz, pos);
+}
+
+
+static void
+avbox_streamcache_httpclose(void *self)
+{
+	avbox_httpstream_close(self);
+}
+
+
+/**
+ * Local file source.
+ */
+static ssize_t
+avbox_streamcache_fileread(void *self, void *buf, size_t bufsz)
+{
+	ssize_t ret;
+	while ((ret = read((int)(intptr_t) self, buf, bufsz)) == -1 && errno == EINTR);
+	return ret;
+}
+
+
+static int
+avbox_streamcache_fileseek(void *self, int64_t pos)
+{
+	return (lseek((int)(intptr_t) self, pos, SEEK_SET) == -1) ? -1 : 0;
+}
+
+
+static int64_t
+avbox_streamcache_filesize(void *self)
+{
+	struct stat st;
+	if (fstat((int)(intptr_t) self, &st) == -1 || !S_ISREG(st.st_mode)) {
+		return -1;
+	}
+	return st.st_size;
+}
+
+
+static void
+avbox_streamcache_fileclose(void *self)
+{
+	close((int)(intptr_t) self);
+}
+
+
+/**
+ * Opens a stream through the read-ahead cache.
+ */
+struct avbox_player_stream *
+avbox_streamcache_open(const char * const path,
+	struct avbox_player * const player,
+	struct avbox_player_stream * const stream)
+{
+	struct avbox_streamcache_source source;
+
+	DEBUG_VPRINT(LOG_MODULE, "Opening cached stream: %s", path);
+
+	ASSERT(path != NULL);
+
+	memset(&source, 0, sizeof(struct avbox_streamcache_source));
+
+	if (!strncmp("http://", path, 7) || !strncmp("https://", path, 8)) {
+		struct avbox_httpstream *http;
+		if ((http = avbox_httpstream_open(path)) == NULL) {
+			return NULL;
+		}
+		source.self = http;
+		source.read = avbox_streamcache_httpread;
+		source.seek = avbox_streamcache_httpseek;
+		source.size = avbox_streamcache_httpsize;
+		source.close = avbox_streamcache_httpclose;
+		source.prefetch = avbox_streamcache_httpprefetch;
+		source.prefetched = avbox_streamcache_httpprefetched;
+		source.pread = avbox_streamcache_httppread;
+	} else {
+		int fd;
+		const char * const file = strncmp("file://", path, 7) ? path : path + 7;
+		if ((fd = open(file, O_RDONLY)) == -1) {
+			LOG_VPRINT_ERROR("Could not open '%s': %s",
+				file, strerror(errno));
+			return NULL;
+		}
+		source.self = (void*)(intptr_t) fd;
+		source.read = avbox_streamcache_fileread;
+		source.seek = avbox_streamcache_fileseek;
+		source.size = avbox_streamcache_filesize;
+		source.close = avbox_streamcache_fileclose;
+	}
+
+	if (avbox_streamcache_opensource(&source, player, stream) == NULL) {
+		source.close(source.self);
+		return NULL;
+	}
+	return stream;
+}
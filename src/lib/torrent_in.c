@@ -112,6 +112,17 @@ can_pause(const struct avbox_torrentin * const inst)
 }
 
 
+/**
+ * Prewarm the torrent pieces at a seek target.
+ */
+static void
+prefetch(const struct avbox_torrentin * const inst,
+	const int64_t pos, const int64_t len)
+{
+	avbox_torrent_prefetch(inst->stream, pos, len);
+}
+
+
 static void
 buffer_state(const struct avbox_torrentin * const inst,
 	int64_t * const count, int64_t * const capacity)
@@ -307,6 +318,7 @@ avbox_torrentin_open(const char * const path, struct avbox_player * const player
 	stream->manages_position = 0;
 	stream->must_flush_before_play = 0;
 	stream->buffer_state = (void*) buffer_state;
+	stream->prefetch = (void*) &prefetch;
 	stream->play = (void*) &play;
 	stream->close = (void*) &close_stream;
 	stream->destroy = (void*) &destroy;
@@ -3,6 +3,7 @@
 #endif
 
 #include <queue>
+#include <algorithm>
 #include <libtorrent/session.hpp>
 #include <libtorrent/add_torrent_params.hpp>
 #include <libtorrent/torrent_handle.hpp>
@@ -13,6 +14,8 @@
 #include <libtorrent/torrent_info.hpp>
 #include <libtorrent/file_storage.hpp>
 #include <libtorrent/extensions.hpp>
+#include <libtorrent/magnet_uri.hpp>
+#include <libtorrent/bdecode.hpp>
 
 
 #define LOG_MODULE "torrent_stream"
@@ -22,6 +25,7 @@ extern "C" {
 	#include <inttypes.h>
 	#include <sys/types.h>
 	#include <sys/stat.h>
+	#include <sys/mman.h>
 	#include <unistd.h>
 	#include <fcntl.h>
 	#include <pthread.h>
@@ -33,9 +37,16 @@ extern "C" {
 #define STRINGIZE(x)    STRINGIZE2(x)
 
 #define READAHEAD_TAIL	(1024 * 1024 * 5)	/* bytes to read from end of file during warmup */
-#define READAHEAD_MIN	(1024 * 1024 * 15)	/* bytes to try to keep on readahead */
+#define READAHEAD_MIN	(1024 * 1024 * 15)	/* bytes to try to keep on readahead (torrent_readahead, MiB) */
+#define SCHEDULE_WINDOW	(30)			/* seconds of stream to keep deadlines on */
+#define PREWARM_PIECES	(2)			/* max pieces to prewarm per seek target */
+#define RATE_INTERVAL	(1000LL * 1000LL)	/* rate estimate sampling interval (usecs) */
+#define RATE_WEIGHT	(4)			/* rate estimate filter weight (1/n) */
+#define RESUME_INTERVAL	(60)			/* seconds between resume data saves */
+#define RESUME_TIMEOUT	(10)			/* seconds to wait for resume data on shutdown */
 
 #define AVBOX_TORRENTMSG_METADATA_RECEIVED	(AVBOX_MESSAGETYPE_USER)
+#define AVBOX_TORRENTMSG_CHECKED		(AVBOX_MESSAGETYPE_USER + 1)
 
 
 namespace lt = libtorrent;
@@ -49,9 +60,31 @@ struct alerts_observer_plugin : lt::plugin
 };
 
 
+/**
+ * A piece on the readahead queue. The piece data is mapped
+ * directly from the downloaded file so that we don't allocate
+ * and copy every piece. If mmap() fails we fall back to reading
+ * it into a heap buffer. data points to the first byte of the
+ * piece that we've read, which is at offset start within the
+ * piece.
+ */
 struct piece_header
 {
-	boost::shared_array<char> buffer;
+	piece_header() : map(nullptr), map_len(0), heap(nullptr), data(nullptr),
+		start(0), size(0), index(0) {}
+	~piece_header()
+	{
+		if (map != nullptr) {
+			munmap(map, map_len);
+		}
+		free(heap);
+	}
+
+	void *map;
+	size_t map_len;
+	char *heap;
+	const char *data;
+	int start;
 	int size;
 	int index;
 };
@@ -89,11 +122,19 @@ LISTABLE_STRUCT(avbox_torrent,
 	int warmed;				/* this flag is set to true after the stream has warmed up */
 	int n_avail_pieces;			/* the number of pieces downloaded */
 	int bitrate;				/* bitrate hint */
+	int sched_first;			/* first piece of the deadline window */
+	int sched_last;				/* one past the last piece with a deadline */
+	int64_t read_bytes;			/* bytes read since rate_time */
+	int64_t dl_bytes;			/* bytes downloaded since rate_time */
+	int64_t read_rate;			/* measured read rate (bytes/sec) */
+	int64_t dl_rate;			/* measured download rate (bytes/sec) */
+	struct timespec rate_time;		/* last rates update */
 	unsigned int flags;			/* flags */
 
 	pthread_cond_t readahead_cond;		/* used for waking the readahead thread */
 	pthread_cond_t user_cond;		/* used for waking the user thread */
 	std::vector<piece_status> avail_pieces;	/* list of downloaded pieces */
+	std::vector<int> prewarmed_pieces;	/* pieces given a deadline by avbox_torrent_prefetch() */
 	piece_queue_t readahead_pieces;		/* the readahead queue */
 	struct avbox_thread *readahead_thread;	/* the readahead thread */
 	struct avbox_delegate *readahead_fn;	/* the readahead worker */
@@ -113,9 +154,13 @@ static int quit = 0;
 static lt::session *session = nullptr;
 static LIST torrents;
 static pthread_mutex_t session_lock;
+static pthread_cond_t resume_cond;
+static int resume_pending = 0;
+static int resume_timer = -1;
 
 static const std::string storage_path(STRINGIZE(LOCALSTATEDIR) "/lib/mediabox/store/downloads");
 static const std::string torrents_path(std::string(STRINGIZE(LOCALSTATEDIR)) + "/lib/mediabox/torrents/");
+static const std::string session_state_file(torrents_path + "session.state");
 
 
 static int
@@ -185,6 +230,125 @@ cleanup_temp_directory()
 }
 
 
+static std::string
+resume_file(const std::string& info_hash)
+{
+	return torrents_path + info_hash + ".fastresume";
+}
+
+
+/**
+ * Load a whole file into a buffer.
+ */
+static int
+load_file(const std::string& filename, std::vector<char>& buf)
+{
+	FILE *f;
+	long sz;
+
+	if ((f = fopen(filename.c_str(), "rb")) == NULL) {
+		return -1;
+	}
+	if (fseek(f, 0, SEEK_END) == -1 || (sz = ftell(f)) <= 0 ||
+		fseek(f, 0, SEEK_SET) == -1) {
+		fclose(f);
+		errno = EINVAL;
+		return -1;
+	}
+	buf.resize(sz);
+	if (fread(&buf[0], 1, sz, f) != (size_t) sz) {
+		fclose(f);
+		buf.clear();
+		errno = EIO;
+		return -1;
+	}
+	fclose(f);
+	return 0;
+}
+
+
+/**
+ * Bencode an entry and save it. The file is written to a
+ * temporary file first and then renamed so that we never
+ * leave a truncated file behind if we lose power.
+ */
+static int
+save_entry(const std::string& filename, const lt::entry& e)
+{
+	FILE *f;
+	std::vector<char> buf;
+	const std::string tmp = filename + ".tmp";
+
+	bencode(std::back_inserter(buf), e);
+
+	if ((f = fopen(tmp.c_str(), "wb")) == NULL) {
+		return -1;
+	}
+	if (fwrite(&buf[0], 1, buf.size(), f) != buf.size() ||
+		fflush(f) != 0 || fsync(fileno(f)) == -1) {
+		const int err = errno;
+		fclose(f);
+		unlink(tmp.c_str());
+		errno = err;
+		return -1;
+	}
+	fclose(f);
+	if (rename(tmp.c_str(), filename.c_str()) == -1) {
+		const int err = errno;
+		unlink(tmp.c_str());
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+
+/**
+ * Request resume data for all open torrents. Must be called
+ * with the session lock held and never from the libtorrent
+ * thread.
+ */
+static void
+request_resume_data(const int flags)
+{
+	struct avbox_torrent *inst;
+	LIST_FOREACH(struct avbox_torrent*, inst, &torrents) {
+		if (!inst->closed && inst->handle.is_valid()) {
+			inst->handle.save_resume_data(flags);
+			resume_pending++;
+		}
+	}
+}
+
+
+static enum avbox_timer_result
+resume_timer_handler(int id, void *data)
+{
+	(void) id;
+	(void) data;
+	pthread_mutex_lock(&session_lock);
+	request_resume_data(lt::torrent_handle::save_info_dict |
+		lt::torrent_handle::only_if_modified);
+	pthread_mutex_unlock(&session_lock);
+	return AVBOX_TIMER_CALLBACK_RESULT_CONTINUE;
+}
+
+
+/**
+ * Called when a resume data request completes.
+ */
+static void
+resume_data_done(void)
+{
+	pthread_mutex_lock(&session_lock);
+	if (resume_pending > 0) {
+		resume_pending--;
+	}
+	pthread_cond_broadcast(&resume_cond);
+	pthread_mutex_unlock(&session_lock);
+}
+
+
 /**
  * Gets the number of bytes that are already available
  * on disk starting from the current stream position.
@@ -312,58 +476,139 @@ warmed(struct avbox_torrent * const inst)
 }
 
 
+/**
+ * Update the consumption and download rate estimates. Must be
+ * called with the torrent lock held.
+ */
+static void
+update_rates(struct avbox_torrent * const inst)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (inst->rate_time.tv_sec == 0 && inst->rate_time.tv_nsec == 0) {
+		inst->rate_time = now;
+		return;
+	}
+
+	const int64_t elapsed = utimediff(&now, &inst->rate_time);
+	if (elapsed < RATE_INTERVAL) {
+		return;
+	}
+
+	const int64_t read_rate = (inst->read_bytes * 1000LL * 1000LL) / elapsed;
+	const int64_t dl_rate = (inst->dl_bytes * 1000LL * 1000LL) / elapsed;
+	inst->read_rate += (read_rate - inst->read_rate) / RATE_WEIGHT;
+	inst->dl_rate += (dl_rate - inst->dl_rate) / RATE_WEIGHT;
+	inst->read_bytes = 0;
+	inst->dl_bytes = 0;
+	inst->rate_time = now;
+}
+
+
+/**
+ * Gets the number of bytes per second that we're consuming. This
+ * is the bitrate hint or the measured rate if it's higher.
+ */
+static int64_t
+stream_byte_rate(const struct avbox_torrent * const inst)
+{
+	return MAX(1, MAX(((int64_t) inst->bitrate) / 8, inst->read_rate));
+}
+
+
+/**
+ * Gets the deadline (in msecs) of a piece based on how long
+ * it will take us to get to it at the current rate.
+ */
+static int
+piece_deadline(const struct avbox_torrent * const inst, const int index)
+{
+	const int64_t piece_pos = (((int64_t) index) * inst->piece_size) - inst->file_offset;
+	const int64_t ahead = MAX(0, piece_pos - inst->pos);
+	return (int) MIN((ahead * 1000LL) / stream_byte_rate(inst), INT_MAX);
+}
+
+
+/**
+ * Set deadlines on the pieces at the end of the file. Most containers
+ * keep the index there so we need them to start playing.
+ */
 static void
-adjust_priorities(struct avbox_torrent * const inst)
+schedule_tail(struct avbox_torrent * const inst)
 {
 	ASSERT(inst->have_metadata);
 	ASSERT(inst->handle.is_valid());
 
-	const double bytes_per_sec = (double)inst->bitrate / 8;
-	const int piece_duration = (int)(1000.0 / (bytes_per_sec / (double)inst->piece_size));
 	const int stream_n_pieces = offset_to_piece_index(inst, inst->filesize - 1) + 1;
-	int deadline = piece_duration, piece_index, first_piece;
-
-	DEBUG_VPRINT(LOG_MODULE, "Adjusting piece priorities (piece_duration=%i)",
-		piece_duration);
-
-	/* prioritize pieces at the end */
-	first_piece = MAX(0, stream_n_pieces -
+	const int first_piece = MAX(0, stream_n_pieces -
 		((READAHEAD_TAIL + inst->piece_size - 1) / inst->piece_size) - 1);
-	DEBUG_VPRINT(LOG_MODULE, "Prioritizing pieces %d to %d",
+
+	DEBUG_VPRINT(LOG_MODULE, "Prioritizing tail pieces %d to %d",
 		first_piece, stream_n_pieces - 1);
-	for (piece_index = first_piece;
-		piece_index >= 0 && piece_index < stream_n_pieces; piece_index++) {
+
+	for (int piece_index = first_piece; piece_index < stream_n_pieces; piece_index++) {
 		if (!have_piece(inst, piece_index)) {
-			inst->handle.set_piece_deadline(piece_index, deadline, 0);
-			deadline += piece_duration;
+			inst->handle.set_piece_deadline(piece_index, 0, 0);
 		}
 	}
+}
+
 
-	/* next prioritize pieces starting at the current stream position */
-	if (inst->pos < inst->filesize) {
-		const int last_piece = first_piece;
-		DEBUG_VPRINT(LOG_MODULE, "Prioritizing pieces %d to %d",
-			offset_to_piece_index(inst, inst->pos), last_piece - 1);
-		for (piece_index = first_piece = offset_to_piece_index(inst, inst->pos);
-			piece_index < last_piece; piece_index++) {
-			if (!have_piece(inst, piece_index)) {
-				inst->handle.set_piece_deadline(piece_index, deadline, 0);
-				deadline += piece_duration;
+/**
+ * Keep deadlines on a window of pieces ahead of the stream position.
+ * The window covers SCHEDULE_WINDOW seconds at the stream or download
+ * rate (whichever is higher) but never less than twice the readahead.
+ * Pieces that already have a deadline are not touched unless reset
+ * is set, in which case the deadlines that fall outside the new window
+ * (including those of prewarmed pieces) are cancelled and the window
+ * is rescheduled (ie. after a seek). The pieces outside the window are
+ * left to libtorrent. Must be called with the torrent lock held.
+ */
+static void
+schedule_window(struct avbox_torrent * const inst, const int reset)
+{
+	ASSERT(inst->have_metadata);
+	ASSERT(inst->handle.is_valid());
+
+	const int stream_n_pieces = offset_to_piece_index(inst, inst->filesize - 1) + 1;
+	const int64_t rate = MAX(stream_byte_rate(inst), inst->dl_rate);
+	const int64_t window = MAX(inst->readahead_min * 2LL, rate * SCHEDULE_WINDOW);
+	const int first = MIN(offset_to_piece_index(inst, inst->pos), stream_n_pieces);
+	const int last = MIN(offset_to_piece_index(inst,
+		MIN(inst->filesize, inst->pos + window) - 1) + 1, stream_n_pieces);
+	int piece_index;
+
+	if (reset) {
+		/* cancel the deadlines that we no longer need */
+		for (piece_index = inst->sched_first; piece_index < inst->sched_last; piece_index++) {
+			if ((piece_index < first || piece_index >= last) && !have_piece(inst, piece_index)) {
+				inst->handle.reset_piece_deadline(piece_index);
 			}
 		}
+		for (const int prewarmed : inst->prewarmed_pieces) {
+			if ((prewarmed < inst->sched_first || prewarmed >= inst->sched_last) &&
+				(prewarmed < first || prewarmed >= last) && !have_piece(inst, prewarmed)) {
+				inst->handle.reset_piece_deadline(prewarmed);
+			}
+		}
+		inst->prewarmed_pieces.clear();
+		inst->sched_last = first;
 	}
 
-	/* finally prioritize any remaining pieces */
-	if (first_piece > 0) {
-		DEBUG_VPRINT(LOG_MODULE, "Prioritizing pieces 0 to %d",
-			first_piece - 1);
-		for (piece_index = 0; piece_index < first_piece; piece_index++) {
-			if (!have_piece(inst, piece_index)) {
-				inst->handle.set_piece_deadline(piece_index, deadline, 0);
-				deadline += piece_duration;
-			}
+	piece_index = MAX(first, inst->sched_last);
+	if (piece_index < last) {
+		DEBUG_VPRINT(LOG_MODULE, "Prioritizing pieces %d to %d (rate=%" PRIi64 ")",
+			piece_index, last - 1, rate);
+	}
+	for (; piece_index < last; piece_index++) {
+		if (!have_piece(inst, piece_index)) {
+			inst->handle.set_piece_deadline(piece_index,
+				piece_deadline(inst, piece_index), 0);
 		}
 	}
+
+	inst->sched_first = first;
+	inst->sched_last = MAX(inst->sched_last, last);
 }
 
 
@@ -403,12 +648,11 @@ static void
 check_and_signal_piece_ready(struct avbox_torrent * inst, const int index)
 {
 	struct piece_status& piece = get_piece_status(inst, index);
-	if (!inst->have_metadata || !piece.check_passed ||
+	if (!inst->have_metadata || piece.ready || !piece.check_passed ||
 		piece.blocks_finished < blocks_in_piece(inst, index)) {
 		return;
 	}
 
-	ASSERT(!piece.ready);
 	piece.ready = 1;
 	inst->n_avail_pieces++;
 	ASSERT(inst->n_avail_pieces <= inst->n_pieces);
@@ -422,6 +666,33 @@ check_and_signal_piece_ready(struct avbox_torrent * inst, const int index)
 }
 
 
+/**
+ * Mark the pieces that libtorrent already has as ready. When a
+ * torrent is resumed the pieces that are already on disk don't
+ * get any block or piece alerts. Must be called with the torrent
+ * lock held, pieces is the bitfield from torrent_status.
+ */
+static void
+load_pieces(struct avbox_torrent * const inst, const lt::bitfield& pieces)
+{
+	int n = 0;
+	ASSERT(inst->have_metadata);
+	for (int i = 0; i < pieces.size() && i < inst->n_pieces; i++) {
+		if (pieces.get_bit(i) && !have_piece(inst, i)) {
+			struct piece_status& piece = get_piece_status(inst, i);
+			piece.blocks_finished = blocks_in_piece(inst, i);
+			piece.check_passed = 1;
+			check_and_signal_piece_ready(inst, i);
+			n++;
+		}
+	}
+	if (n > 0) {
+		DEBUG_VPRINT(LOG_MODULE, "Resumed %i pieces for %s",
+			n, inst->info_hash.c_str());
+	}
+}
+
+
 static void
 metadata_received(struct avbox_torrent * const inst)
 {
@@ -432,6 +703,7 @@ metadata_received(struct avbox_torrent * const inst)
 	FILE *f;
 	std::string torrent_file;
 	boost::shared_ptr<lt::torrent_info const> ti = inst->handle.torrent_file();
+	const lt::torrent_status status = inst->handle.status(lt::torrent_handle::query_pieces);
 
 
 	/* save the torrent file */
@@ -473,8 +745,9 @@ metadata_received(struct avbox_torrent * const inst)
 	inst->last_piece_size = ti->piece_size(inst->n_pieces - 1);
 	inst->file_offset = fs.file_offset(index);
 	inst->filesize = fs.file_size(index);
-	inst->readahead_min = READAHEAD_MIN;
-	inst->block_size = inst->handle.status().block_size;
+	inst->readahead_min = MAX(1, avbox_settings_getint("torrent_readahead",
+		READAHEAD_MIN / (1024 * 1024))) * 1024 * 1024;
+	inst->block_size = status.block_size;
 	inst->blocks_per_piece = (inst->piece_size + inst->block_size - 1) / inst->block_size;
 	inst->name = ti->name();
 
@@ -503,7 +776,11 @@ metadata_received(struct avbox_torrent * const inst)
 		check_and_signal_piece_ready(inst, i);
 	}
 
-	adjust_priorities(inst);
+	/* and the pieces that we already had if we're resuming */
+	load_pieces(inst, status.pieces);
+
+	schedule_tail(inst);
+	schedule_window(inst, 1);
 
 	pthread_cond_signal(&inst->readahead_cond);
 	pthread_mutex_unlock(&inst->lock);
@@ -534,9 +811,11 @@ alerts_observer_plugin::on_alert(lt::alert const * a)
 		if (inst != nullptr) {
 			pthread_mutex_lock(&inst->lock);
 			struct piece_status& piece = get_piece_status(inst, alert->piece_index);
-			piece.blocks_finished++;
-			ASSERT(!inst->have_metadata || piece.blocks_finished <= blocks_in_piece(inst, alert->piece_index));
-			check_and_signal_piece_ready(inst, alert->piece_index);
+			if (!piece.ready) {
+				piece.blocks_finished++;
+				ASSERT(!inst->have_metadata || piece.blocks_finished <= blocks_in_piece(inst, alert->piece_index));
+				check_and_signal_piece_ready(inst, alert->piece_index);
+			}
 			pthread_mutex_unlock(&inst->lock);
 		} else {
 			DEBUG_PRINT(LOG_MODULE, "Could not find stream (block_finished_alert)!");
@@ -565,6 +844,9 @@ alerts_observer_plugin::on_alert(lt::alert const * a)
 			pthread_mutex_lock(&inst->lock);
 			struct piece_status& piece = get_piece_status(inst, alert->piece_index);
 			piece.check_passed = 1;
+			if (inst->have_metadata) {
+				inst->dl_bytes += piece_size(inst, alert->piece_index);
+			}
 			check_and_signal_piece_ready(inst, alert->piece_index);
 			pthread_mutex_unlock(&inst->lock);
 		} else {
@@ -643,6 +925,7 @@ alerts_observer_plugin::on_alert(lt::alert const * a)
 		if (inst != nullptr) {
 			DEBUG_VPRINT(LOG_MODULE, "Storage moved: %s",
 				inst->info_hash.c_str());
+			unlink(resume_file(inst->info_hash).c_str());
 			if (inst->flags & AVBOX_TORRENTFLAGS_AUTOCLOSE) {
 				DEBUG_PRINT(LOG_MODULE, "Moving storage automatically");
 				avbox_torrent_close(inst);
@@ -667,6 +950,54 @@ alerts_observer_plugin::on_alert(lt::alert const * a)
 		}
 	}
 
+	/* resume data ready */
+	else if (auto alert = lt::alert_cast<lt::save_resume_data_alert>(a)) {
+		struct avbox_torrent * const inst = find_stream(alert->handle);
+		if (inst != nullptr && !inst->closed && alert->resume_data) {
+			if (save_entry(resume_file(inst->info_hash), *alert->resume_data) == -1) {
+				LOG_VPRINT_ERROR("Could not save resume data for %s: %s",
+					inst->info_hash.c_str(), strerror(errno));
+			} else {
+				DEBUG_VPRINT(LOG_MODULE, "Saved resume data for %s",
+					inst->info_hash.c_str());
+			}
+		}
+		resume_data_done();
+	}
+
+	/* resume data not saved. This also happens when nothing
+	 * changed since the last save or we don't have metadata */
+	else if (auto alert = lt::alert_cast<lt::save_resume_data_failed_alert>(a)) {
+		if (alert->error != lt::errors::resume_data_not_modified &&
+			alert->error != lt::errors::no_metadata) {
+			LOG_VPRINT_ERROR("Could not get resume data (%s): %s",
+				alert->torrent_name(), alert->error.message().c_str());
+		}
+		resume_data_done();
+	}
+
+	/* resume data rejected. The pieces will be checked */
+	else if (auto alert = lt::alert_cast<lt::fastresume_rejected_alert>(a)) {
+		LOG_VPRINT_ERROR("Resume data rejected (%s): %s",
+			alert->torrent_name(), alert->error.message().c_str());
+	}
+
+	/* the resume data or files have been checked */
+	else if (auto alert = lt::alert_cast<lt::torrent_checked_alert>(a)) {
+		struct avbox_torrent * const inst = find_stream(alert->handle);
+		DEBUG_VPRINT(LOG_MODULE, "Torrent checked: %s",
+			alert->message().c_str());
+		if (inst != nullptr) {
+			if (avbox_object_sendmsg(&inst->object,
+				AVBOX_TORRENTMSG_CHECKED, AVBOX_DISPATCH_UNICAST, inst) == nullptr) {
+				LOG_VPRINT_ERROR("Could not send CHECKED message: %s",
+					strerror(errno));
+			}
+		} else {
+			DEBUG_PRINT(LOG_MODULE, "Could not find stream (torrent_checked_alert)!");
+		}
+	}
+
 	/* torrent removed */
 	else if (auto alert = lt::alert_cast<lt::torrent_removed_alert>(a)) {
 		struct avbox_torrent *inst =
@@ -704,11 +1035,6 @@ alerts_observer_plugin::on_alert(lt::alert const * a)
 			alert->message().c_str());
 	}
 
-	else if (auto alert = lt::alert_cast<lt::torrent_checked_alert>(a)) {
-		DEBUG_VPRINT(LOG_MODULE, "Torrent checked: %s",
-			alert->message().c_str());
-	}
-
 	else if (auto alert = lt::alert_cast<lt::file_completed_alert>(a)) {
 		DEBUG_VPRINT(LOG_MODULE, "File completed: %s",
 			alert->message().c_str());
@@ -743,6 +1069,8 @@ static void*
 readahead(void *arg)
 {
 	int fd = -1;
+	struct stat st;
+	const long page_size = sysconf(_SC_PAGESIZE);
 	struct avbox_torrent * const inst = (struct avbox_torrent*) arg;
 
 	DEBUG_SET_THREAD_NAME("readahead");
@@ -805,7 +1133,6 @@ readahead(void *arg)
 
 			/* open the file if necessary */
 			if (fd == -1) {
-				struct stat st;
 				std::string filename = inst->files_path + "/" + inst->filename;
 
 				/* if the file does not exist yet keep waiting */
@@ -827,32 +1154,43 @@ readahead(void *arg)
 				}
 			}
 
-			/* allocate a buffer for the piece */
-			boost::shared_array<char> buffer(new char[inst->piece_size]);
-			ASSERT(buffer != nullptr);
+			/* only map the bytes of our file. The last piece may
+			 * extend into the next file */
+			const int len = (int) MIN((int64_t) sz, inst->filesize - old_ra_pos);
+			boost::shared_ptr<struct piece_header> const piece(new struct piece_header());
+			ASSERT(piece != nullptr);
+			piece->start = buffer_offset;
+
+			/* don't map beyond the end of the file or we'll
+			 * get SIGBUS when reading */
+			if (fstat(fd, &st) == -1 || st.st_size < old_ra_pos + len) {
+				DEBUG_VPRINT(LOG_MODULE, "File is shorter than expected (st_size=%" PRIi64
+					" ra_pos=%" PRIi64 " len=%i). Will keep trying.",
+					(int64_t) st.st_size, old_ra_pos, len);
+				usleep(10LL * 1000LL);	/* throttle RT */
+				continue;
+			}
 
-			/* read the piece */
-			if ((bytes_read = pread(fd, &buffer[buffer_offset], sz, inst->ra_pos)) < sz) {
-				if (bytes_read == -1) {
-					LOG_VPRINT_INFO("Could not read piece from file (piece_index=%i offset=%" PRIi64 "): %s",
-						inst->next_piece, inst->ra_pos, strerror(errno));
+			/* map the piece. MAP_POPULATE makes us do the IO here
+			 * rather than in the reader thread */
+			const off_t map_offset = old_ra_pos & ~((off_t) page_size - 1);
+			piece->map_len = (old_ra_pos - map_offset) + len;
+			if ((piece->map = mmap(NULL, piece->map_len, PROT_READ,
+				MAP_SHARED | MAP_POPULATE, fd, map_offset)) != MAP_FAILED) {
+				piece->data = ((const char*) piece->map) + (old_ra_pos - map_offset);
+				bytes_read = len;
+			} else {
+				piece->map = nullptr;
+				if ((piece->heap = (char*) malloc(len)) == NULL) {
+					LOG_VPRINT_ERROR("Could not allocate piece buffer: %s",
+						strerror(errno));
 					usleep(10LL * 1000LL);	/* throttle RT */
 					continue;
-				} else if (inst->next_piece == offset_to_piece_index(inst, inst->filesize - 1) &&
-					bytes_read >= (inst->filesize - inst->ra_pos)) {
-
-					/* This is our last piece and we have read AT LEAST until what
-					 * we think the end-of-file should be. However we may have read
-					 * beyond that because the actual file may be bigger (an optimization
-					 * done by libtorrent). So adjust the result in case of over-read
-					 * to ensure that we don't set ra_pos beyond the end-of-file when
-					 * incrementing bellow. */
-					bytes_read = inst->filesize - inst->ra_pos;
-
-				} else {
-					DEBUG_VPRINT(LOG_MODULE, "pread() returned %d while expecting %d."
-						"(ra_pos=%" PRIi64 " filesize=%" PRIi64 " to_eof=%" PRIi64 ") Will keep trying.",
-						(int) bytes_read, (int) sz, inst->ra_pos, inst->filesize, inst->filesize - inst->ra_pos);
+				}
+				piece->data = piece->heap;
+				if ((bytes_read = pread(fd, piece->heap, len, old_ra_pos)) < len) {
+					LOG_VPRINT_INFO("Could not read piece from file (piece_index=%i offset=%" PRIi64 "): %s",
+						inst->next_piece, old_ra_pos, (bytes_read == -1) ? strerror(errno) : "Short read");
 					usleep(10LL * 1000LL);	/* throttle RT */
 					continue;
 				}
@@ -873,9 +1211,6 @@ readahead(void *arg)
 			}
 
 			/* save the piece in the queue */
-			boost::shared_ptr<struct piece_header> const piece(new struct piece_header());
-			ASSERT(piece != nullptr);
-			piece->buffer = buffer;
 			piece->size = real_sz;
 			piece->index = inst->next_piece;
 			inst->readahead_pieces.push(piece);
@@ -927,6 +1262,19 @@ control(void * const context, struct avbox_message * const msg)
 		}
 		return AVBOX_DISPATCH_OK;
 	}
+	case AVBOX_TORRENTMSG_CHECKED:
+	{
+		/* query the status before locking. The libtorrent
+		 * thread may be waiting for our lock */
+		if (find_stream(inst->handle) != nullptr && inst->have_metadata) {
+			const lt::torrent_status status =
+				inst->handle.status(lt::torrent_handle::query_pieces);
+			pthread_mutex_lock(&inst->lock);
+			load_pieces(inst, status.pieces);
+			pthread_mutex_unlock(&inst->lock);
+		}
+		return AVBOX_DISPATCH_OK;
+	}
 	case AVBOX_MESSAGETYPE_DESTROY:
 	{
 		DEBUG_PRINT(LOG_MODULE, "Deleting torrent");
@@ -987,6 +1335,7 @@ avbox_torrent_close(struct avbox_torrent * const inst)
 
 	/* remove the torrent */
 	if (inst->move_to.empty()) {
+		unlink(resume_file(inst->info_hash).c_str());
 		session->remove_torrent(inst->handle, lt::session::delete_files);
 	} else {
 		session->remove_torrent(inst->handle);
@@ -1073,7 +1422,9 @@ avbox_torrent_read(struct avbox_torrent * const inst,
 	const int bytes_to_read = (piece_index == offset_to_piece_index(inst, inst->filesize - 1)) ?
 		MIN(sz, inst->filesize - inst->pos) : MIN(sz, inst->readahead_pieces.front()->size - offset);
 	ASSERT(bytes_to_read <= sz);
-	memcpy(buf, &inst->readahead_pieces.front()->buffer[offset], bytes_to_read);
+	ASSERT(offset >= inst->readahead_pieces.front()->start);
+	memcpy(buf, inst->readahead_pieces.front()->data +
+		(offset - inst->readahead_pieces.front()->start), bytes_to_read);
 
 	/* signal the readahead thread if it may be waiting
 	 * for us */
@@ -1085,6 +1436,13 @@ avbox_torrent_read(struct avbox_torrent * const inst,
 	inst->pos += bytes_to_read;
 	ASSERT(inst->pos <= inst->filesize);
 
+	/* slide the deadlines window when we move to the next piece */
+	inst->read_bytes += bytes_to_read;
+	update_rates(inst);
+	if (offset_to_piece_index(inst, inst->pos) != piece_index) {
+		schedule_window(inst, 0);
+	}
+
 	/* DEBUG_VPRINT(LOG_MODULE, "Read %i bytes from piece %i at offset %i (pos=%" PRIi64 " offset=%" PRIi64 " piece_size=%" PRIi64
 		"ra_pos=%" PRIi64 " count=%" PRIi64 ")",
 		bytes_to_read, piece_index, offset, inst->pos - bytes_to_read, inst->file_offset, inst->piece_size,
@@ -1208,7 +1566,7 @@ avbox_torrent_seek(struct avbox_torrent * const inst,
 	/* update the position and priorities */
 	inst->pos = inst->ra_pos = pos;
 	if (inst->have_metadata) {
-		adjust_priorities(inst);
+		schedule_window(inst, 1);
 	}
 
 	/* wake the readahead thread */
@@ -1229,12 +1587,45 @@ avbox_torrent_setbitrate(struct avbox_torrent * const inst, const int bitrate)
 	inst->bitrate = bitrate;
 	if (inst->have_metadata) {
 		pthread_mutex_lock(&inst->lock);
-		adjust_priorities(inst);
+		schedule_window(inst, 1);
 		pthread_mutex_unlock(&inst->lock);
 	}
 }
 
 
+/**
+ * Prewarm the pieces at a likely seek target (ie. a container
+ * index entry or a chapter mark). These get a deadline right
+ * after the current window so they don't delay playback.
+ */
+EXPORT void
+avbox_torrent_prefetch(struct avbox_torrent * const inst,
+	const int64_t offset, const int64_t len)
+{
+	ASSERT(inst != NULL);
+
+	pthread_mutex_lock(&inst->lock);
+	if (!inst->closed && inst->have_metadata && offset >= 0 && offset < inst->filesize) {
+		const int first = offset_to_piece_index(inst, offset);
+		const int last = MIN(first + PREWARM_PIECES, offset_to_piece_index(inst,
+			MIN(inst->filesize, offset + MAX(1, len)) - 1) + 1);
+		for (int piece_index = first; piece_index < last; piece_index++) {
+			if (!have_piece(inst, piece_index) &&
+				(piece_index < inst->sched_first || piece_index >= inst->sched_last)) {
+				DEBUG_VPRINT(LOG_MODULE, "Prewarming piece %d", piece_index);
+				inst->handle.set_piece_deadline(piece_index,
+					piece_deadline(inst, inst->sched_last), 0);
+				if (std::find(inst->prewarmed_pieces.begin(), inst->prewarmed_pieces.end(),
+					piece_index) == inst->prewarmed_pieces.end()) {
+					inst->prewarmed_pieces.push_back(piece_index);
+				}
+			}
+		}
+	}
+	pthread_mutex_unlock(&inst->lock);
+}
+
+
 EXPORT struct avbox_torrent*
 avbox_torrent_next(struct avbox_torrent * const current)
 {
@@ -1406,10 +1797,30 @@ avbox_torrent_open(const char * const uri, const char * const file,
 			unlink(torrent_filename.c_str());
 			return NULL;
 		}
+	} else if (!strncmp("magnet:", uri, 7)) {
+		lt::parse_magnet_uri(suri, params, ec);
+		if (ec) {
+			LOG_VPRINT_ERROR("Could not parse magnet link: %s",
+				ec.message().c_str());
+			delete inst;
+			return NULL;
+		}
 	} else {
 		params.url = suri;
 	}
 
+	/* if we have resume data for this torrent use it. If the
+	 * torrent was added from a magnet link it also includes the
+	 * metadata */
+	if (!params.info_hash.is_all_zeros() || params.ti) {
+		const std::string info_hash = lt::to_hex((params.ti ?
+			params.ti->info_hash() : params.info_hash).to_string());
+		if (load_file(resume_file(info_hash), params.resume_data) == 0) {
+			DEBUG_VPRINT(LOG_MODULE, "Loaded resume data for %s",
+				info_hash.c_str());
+		}
+	}
+
 	/* create object */
 	if ((inst->object = avbox_object_new(&control, inst)) == NULL) {
 		LOG_VPRINT_ERROR("Could not create object: %s",
@@ -1452,10 +1863,13 @@ avbox_torrent_open(const char * const uri, const char * const file,
 	pthread_mutex_unlock(&inst->lock);
 
 	/* if this is a temporary torrent then unlink it
-	 * and call metadata_received */
+	 * and call metadata_received. We also have the metadata
+	 * already if it was in the resume data */
 	if (!torrent_filename.empty()) {
 		unlink(torrent_filename.c_str());
 		metadata_received(inst);
+	} else if (inst->handle.status().has_metadata) {
+		metadata_received(inst);
 	}
 
 	DEBUG_VPRINT(LOG_MODULE, "Torrent added: info_hash=%s",
@@ -1488,7 +1902,8 @@ avbox_torrent_init(void)
 
 	pthread_mutexattr_init(&lockattr);
 	pthread_mutexattr_setprotocol(&lockattr, PTHREAD_PRIO_INHERIT);
-	if (pthread_mutex_init(&session_lock, &lockattr) != 0) {
+	if (pthread_mutex_init(&session_lock, &lockattr) != 0 ||
+		pthread_cond_init(&resume_cond, nullptr) != 0) {
 		ABORT("Could not initialize pthread primitives!");
 	}
 	pthread_mutexattr_destroy(&lockattr);
@@ -1585,6 +2000,30 @@ avbox_torrent_init(void)
 	peer_classes.add(lt::peer_class_type_filter::ssl_utp_socket, lt::session::global_peer_class_id);
 	session->set_peer_class_type_filter(peer_classes);
 
+	/* restore the DHT state from the last session so we
+	 * don't have to bootstrap it again */
+	std::vector<char> state;
+	if (load_file(session_state_file, state) == 0) {
+		lt::bdecode_node node;
+		lt::error_code ec;
+		if (lt::bdecode(&state[0], &state[0] + state.size(), node, ec) != 0) {
+			LOG_VPRINT_ERROR("Could not load session state: %s",
+				ec.message().c_str());
+		} else {
+			session->load_state(node, lt::session::save_dht_state);
+			DEBUG_PRINT(LOG_MODULE, "Session state loaded");
+		}
+	}
+
+	/* save resume data periodically */
+	struct timespec tv;
+	tv.tv_sec = RESUME_INTERVAL;
+	tv.tv_nsec = 0;
+	if ((resume_timer = avbox_timer_register(&tv, AVBOX_TIMER_TYPE_AUTORELOAD,
+		NULL, resume_timer_handler, NULL)) == -1) {
+		LOG_PRINT_ERROR("Could not register resume data timer");
+	}
+
 #ifdef ENABLE_REALTIME
 	/* restore old scheduling policy */
 	if (have_old_policy) {
@@ -1602,13 +2041,44 @@ void
 avbox_torrent_shutdown(void)
 {
 	if (session != nullptr) {
+		struct timespec tv;
+
+		if (resume_timer != -1) {
+			avbox_timer_cancel(resume_timer);
+			resume_timer = -1;
+		}
+
+		/* stop all transfers and save the resume data of
+		 * any torrents that are still open */
+		session->pause();
+
 		pthread_mutex_lock(&session_lock);
 		if (LIST_SIZE(&torrents) != 0) {
 			DEBUG_VPRINT(LOG_MODULE, "There are still %i items in the list!",
 				LIST_SIZE(&torrents));
 		}
+		request_resume_data(lt::torrent_handle::save_info_dict |
+			lt::torrent_handle::flush_disk_cache);
+		clock_gettime(CLOCK_REALTIME, &tv);
+		tv.tv_sec += RESUME_TIMEOUT;
+		while (resume_pending > 0) {
+			if (pthread_cond_timedwait(&resume_cond, &session_lock, &tv) == ETIMEDOUT) {
+				LOG_VPRINT_ERROR("Timed out waiting for resume data (%i pending)",
+					resume_pending);
+				break;
+			}
+		}
+		resume_pending = 0;
 		pthread_mutex_unlock(&session_lock);
 
+		/* save the DHT state */
+		lt::entry state;
+		session->save_state(state, lt::session::save_dht_state);
+		if (save_entry(session_state_file, state) == -1) {
+			LOG_VPRINT_ERROR("Could not save session state: %s",
+				strerror(errno));
+		}
+
 		quit = 1;
 		delete session;
 		session = nullptr;
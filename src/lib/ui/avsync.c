@@ -0,0 +1,289 @@
+/**
+ * avbox - Toolkit for Embedded Multimedia Applications
+ * Copyright (C) 2016-2017 Fernando Rodriguez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License Version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#       include <libavbox/config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define LOG_MODULE "avsync"
+
+#include <libavbox/avbox.h>
+#include <libavbox/ui/avsync.h>
+
+
+/* a clock jump bigger than this is a discontinuity */
+#define AVBOX_AVSYNC_CLOCK_RESYNC	(100LL * 1000LL)
+
+/* how far the smoothed clock may run ahead of the master
+ * clock when it stops (pause, underrun) */
+#define AVBOX_AVSYNC_CLOCK_LEAD		(20LL * 1000LL)
+
+/* filter weights (1/n) */
+#define AVBOX_AVSYNC_CLOCK_WEIGHT	(16)
+#define AVBOX_AVSYNC_OFFSET_WEIGHT	(8)
+#define AVBOX_AVSYNC_LATENCY_WEIGHT	(8)
+#define AVBOX_AVSYNC_DURATION_WEIGHT	(8)
+
+#define AVBOX_AVSYNC_LATENCY_MAX	(100LL * 1000LL)
+#define AVBOX_AVSYNC_MIN_WAIT		(5LL * 1000LL)
+#define AVBOX_AVSYNC_FRAME_DEFAULT	(40LL * 1000LL)
+#define AVBOX_AVSYNC_FRAME_MAX		(250LL * 1000LL)
+#define AVBOX_AVSYNC_OFFSET_MAX		(10LL * 1000LL * 1000LL)
+
+/* we drop at most one frame every this many while
+ * correcting small drifts */
+#define AVBOX_AVSYNC_DROP_SPACING	(4)
+
+/* when we're this far behind (ie. after a seek) we drop
+ * consecutive frames to catch up */
+#define AVBOX_AVSYNC_CATCHUP		(400LL * 1000LL)
+#define AVBOX_AVSYNC_CATCHUP_MAX	(3)
+
+#define AVBOX_AVSYNC_NOTIME		(INT64_MIN)
+
+
+/**
+ * Gets the monotonic time in microseconds.
+ */
+int64_t
+avbox_avsync_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return SEC2USEC((int64_t) now.tv_sec) + NSEC2USEC(now.tv_nsec);
+}
+
+
+/**
+ * Initialize the sync controller.
+ */
+void
+avbox_avsync_init(struct avbox_avsync * const sync)
+{
+	memset(sync, 0, sizeof(struct avbox_avsync));
+	pthread_mutex_init(&sync->lock, NULL);
+	sync->stats.frame_duration = AVBOX_AVSYNC_FRAME_DEFAULT;
+	avbox_avsync_reset(sync);
+}
+
+
+/**
+ * Forget the clock and frame history (ie. after a seek). The
+ * statistics are kept.
+ */
+void
+avbox_avsync_reset(struct avbox_avsync * const sync)
+{
+	pthread_mutex_lock(&sync->lock);
+	sync->clock_valid = 0;
+	sync->last_frame_time = AVBOX_AVSYNC_NOTIME;
+	sync->wait_frame_time = AVBOX_AVSYNC_NOTIME;
+	sync->submit_pending = 0;
+	sync->drop_credit = AVBOX_AVSYNC_DROP_SPACING;
+	sync->consecutive_drops = 0;
+	sync->stats.offset = 0;
+	pthread_mutex_unlock(&sync->lock);
+}
+
+
+/**
+ * Smooth the master clock.
+ */
+int64_t
+avbox_avsync_clock(struct avbox_avsync * const sync,
+	const int64_t master_time, const int64_t now)
+{
+	int64_t clock;
+	const int64_t offset = master_time - now;
+
+	pthread_mutex_lock(&sync->lock);
+	if (UNLIKELY(!sync->clock_valid ||
+		llabs(offset - sync->clock_offset) > AVBOX_AVSYNC_CLOCK_RESYNC)) {
+		sync->clock_offset = offset;
+		sync->clock_valid = 1;
+	} else {
+		sync->clock_offset += (offset - sync->clock_offset) /
+			AVBOX_AVSYNC_CLOCK_WEIGHT;
+	}
+	clock = MIN(now + sync->clock_offset,
+		master_time + AVBOX_AVSYNC_CLOCK_LEAD);
+	pthread_mutex_unlock(&sync->lock);
+	return clock;
+}
+
+
+/**
+ * Gets the histogram bin for an offset.
+ */
+static inline int
+avbox_avsync_bin(const int64_t offset)
+{
+	const int64_t half = AVBOX_AVSYNC_HISTOGRAM_BINS / 2;
+	const int64_t range = (half * AVBOX_AVSYNC_HISTOGRAM_WIDTH) +
+		(AVBOX_AVSYNC_HISTOGRAM_WIDTH / 2);
+	if (offset < -range) {
+		return 0;
+	} else if (offset >= range) {
+		return AVBOX_AVSYNC_HISTOGRAM_BINS - 1;
+	}
+	return (offset + range) / AVBOX_AVSYNC_HISTOGRAM_WIDTH;
+}
+
+
+/**
+ * Decide what to do with a frame.
+ */
+enum avbox_avsync_action
+avbox_avsync_decide(struct avbox_avsync * const sync,
+	const int64_t frame_time, const int64_t clock, int64_t * const delay)
+{
+	int64_t offset;
+	enum avbox_avsync_action action = AVBOX_AVSYNC_PRESENT;
+	struct avbox_avsync_stats * const stats = &sync->stats;
+
+	pthread_mutex_lock(&sync->lock);
+
+	/* the frame shows up on screen latency uSecs after
+	 * we submit it.
+	 *
+	 * NOTE: frame_time may be a very large negative integer
+	 * so we compare before substracting */
+	if (clock + stats->latency < frame_time) {
+		offset = -(frame_time - clock - stats->latency);
+		if (offset < -AVBOX_AVSYNC_MIN_WAIT) {
+			/* if we'll hold the previous frame for more than
+			 * a frame period then we're repeating it */
+			if (sync->wait_frame_time != frame_time) {
+				if (-offset > stats->frame_duration + (stats->frame_duration >> 1)) {
+					stats->repeated++;
+				}
+				sync->wait_frame_time = frame_time;
+			}
+			*delay = -offset;
+			pthread_mutex_unlock(&sync->lock);
+			return AVBOX_AVSYNC_WAIT;
+		}
+	} else if (frame_time < clock - AVBOX_AVSYNC_OFFSET_MAX) {
+		offset = AVBOX_AVSYNC_OFFSET_MAX;
+	} else {
+		offset = clock + stats->latency - frame_time;
+	}
+
+	/* track the frame rate */
+	if (sync->last_frame_time != AVBOX_AVSYNC_NOTIME &&
+		frame_time > sync->last_frame_time &&
+		frame_time - sync->last_frame_time < AVBOX_AVSYNC_FRAME_MAX) {
+		stats->frame_duration += ((frame_time - sync->last_frame_time) -
+			stats->frame_duration) / AVBOX_AVSYNC_DURATION_WEIGHT;
+	}
+	sync->last_frame_time = frame_time;
+
+	stats->offset += (offset - stats->offset) / AVBOX_AVSYNC_OFFSET_WEIGHT;
+	stats->histogram[avbox_avsync_bin(offset)]++;
+	if (offset > (stats->frame_duration >> 1)) {
+		stats->late++;
+	}
+
+	/* If we're way behind drop a few frames in a row. Otherwise
+	 * only drop a frame when we've been behind by more than a frame
+	 * for a while, and then never more than one every few frames */
+	if (offset > AVBOX_AVSYNC_CATCHUP) {
+		if (sync->consecutive_drops < AVBOX_AVSYNC_CATCHUP_MAX) {
+			action = AVBOX_AVSYNC_DROP;
+		}
+	} else if (stats->offset > stats->frame_duration &&
+		offset > (stats->frame_duration >> 1) &&
+		sync->drop_credit >= AVBOX_AVSYNC_DROP_SPACING) {
+		action = AVBOX_AVSYNC_DROP;
+	}
+
+	if (action == AVBOX_AVSYNC_DROP) {
+		stats->dropped++;
+		sync->consecutive_drops++;
+		sync->drop_credit = 0;
+	} else {
+		stats->presented++;
+		sync->consecutive_drops = 0;
+		if (sync->drop_credit < AVBOX_AVSYNC_DROP_SPACING) {
+			sync->drop_credit++;
+		}
+	}
+
+	pthread_mutex_unlock(&sync->lock);
+	return action;
+}
+
+
+/**
+ * Record the time that a frame was handed to the display.
+ */
+void
+avbox_avsync_submitted(struct avbox_avsync * const sync, const int64_t time)
+{
+	pthread_mutex_lock(&sync->lock);
+	sync->submit_time = time;
+	sync->submit_pending = 1;
+	pthread_mutex_unlock(&sync->lock);
+}
+
+
+/**
+ * Record the time of a completed page flip.
+ */
+void
+avbox_avsync_flipped(struct avbox_avsync * const sync, const int64_t time)
+{
+	pthread_mutex_lock(&sync->lock);
+	if (sync->submit_pending && time >= sync->submit_time) {
+		const int64_t latency = MIN(time - sync->submit_time,
+			AVBOX_AVSYNC_LATENCY_MAX);
+		sync->stats.latency += (latency - sync->stats.latency) /
+			AVBOX_AVSYNC_LATENCY_WEIGHT;
+		sync->submit_pending = 0;
+	}
+	pthread_mutex_unlock(&sync->lock);
+}
+
+
+/**
+ * Get a copy of the statistics.
+ */
+void
+avbox_avsync_getstats(struct avbox_avsync * const sync,
+	struct avbox_avsync_stats * const stats)
+{
+	pthread_mutex_lock(&sync->lock);
+	memcpy(stats, &sync->stats, sizeof(struct avbox_avsync_stats));
+	pthread_mutex_unlock(&sync->lock);
+}
+
+
+/**
+ * Destroy the sync controller.
+ */
+void
+avbox_avsync_destroy(struct avbox_avsync * const sync)
+{
+	pthread_mutex_destroy(&sync->lock);
+}
@@ -125,6 +125,20 @@ avbox_listitem_paint(struct avbox_window * const window, void * const ctx)
 }
 
 
+/**
+ * Marks an item's row as damaged.
+ */
+static void
+avbox_listitem_damage(struct avbox_listitem * const item)
+{
+	int w, h;
+	if (item->window != NULL) {
+		avbox_window_getcanvassize(item->window, &w, &h);
+		avbox_window_damagerect(item->window, 0, 0, w, h);
+	}
+}
+
+
 /**
  * Changes the currently selected item.
  */
@@ -141,11 +155,13 @@ avbox_listview_setselected(struct avbox_listview *inst, struct avbox_listitem *i
 
 	if (inst->selected != NULL) {
 		inst->selected->dirty = 1;
+		avbox_listitem_damage(inst->selected);
 	}
 
 	/* select the new item */
 	inst->selected = item;
 	inst->selected->dirty = 1;
+	avbox_listitem_damage(inst->selected);
 
 	/* this is where we invoke the callback function. For now
 	 * we just SIGABRT if it's set since it's not implemented yet. */
@@ -238,6 +254,9 @@ avbox_listview_scrollitems(struct avbox_listview *inst, int direction)
 				item->dirty = 1;
 			}
 			item->window = inst->item_windows[j++];
+			if (item->dirty) {
+				avbox_listitem_damage(item);
+			}
 		} else {
 			item->window = NULL;
 		}
@@ -47,9 +47,6 @@
 #include <libavbox/avbox.h>
 #include <libavbox/ui/player_p.h>
 
-#ifdef ENABLE_MMAL
-#	include "mmaldecode.h"
-#endif
 
 /* Define to log missed deadlines */
 /* #define DEBUG_LATENCY	(1) */
@@ -58,13 +55,12 @@
 #define MB_VIDEO_BUFFER_PACKETS (1)
 #define MB_AUDIO_BUFFER_PACKETS (30)
 
-#define AVBOX_LATENCY_CORRECT_MAX 	(0)
-#define AVBOX_MIN_FRAME_WAIT_US		(5000LL)
-#define AVBOX_SKIP_FRAME_THRESHOLD	(400LL * 1000LL)
-#define AVBOX_SKIP_FRAME_MAX		(3)
+#define AVBOX_MAX_FRAME_WAIT_US		(250LL * 1000LL)
 #define AVBOX_BUFFER_MSECS		(300)
+#define AVBOX_SEEK_PREFETCH		(1024 * 1024)
+#define AVBOX_PREFETCH_CHAPTERS		(8)
 #define AVBOX_BUFFER_VIDEO		(30 / (1000 / decode_cache_size))
-#define AVBOX_BUFFER_AUDIO		(48000 / (1000 / decode_cache_size))
+#define AVBOX_BUFFER_AUDIO(s)		((avbox_audiostream_capacity(s) * 3) / 4)
 
 /* initial sizes for the pools */
 #define AVBOX_AVPACKET_POOL_SIZE	(MB_VIDEO_BUFFER_PACKETS + MB_AUDIO_BUFFER_PACKETS + 25)
@@ -452,6 +448,7 @@ avbox_player_draw(struct avbox_window * const window, void * const context)
 {
 	int target_width, target_height;
 	struct avbox_player * const inst = context;
+	int use_overlay = !inst->overlay_disabled, obscured;
 
 	if (inst->video_window == NULL) {
 		avbox_window_clear(window);
@@ -473,10 +470,81 @@ avbox_player_draw(struct avbox_window * const window, void * const context)
 			0, 0, target_width, y);
 	}
 
+	/* if no other window overlaps ours try to show the frame
+	 * on a hardware overlay. Otherwise convert and scale it
+	 * straight into the target window in a single pass */
+#ifdef ENABLE_DVD
+	/* menu highlights are drawn on the window so the
+	 * overlay would hide them */
+	if (UNLIKELY(inst->stream.self != NULL && inst->stream.highlight != NULL)) {
+		use_overlay = 0;
+	}
+#endif
+	obscured = avbox_window_obscured(window);
+	if (LIKELY(inst->last_video_frame != NULL && !obscured)) {
+		if (use_overlay) {
+			/* if the frame is already on the overlay
+			 * there's nothing to do */
+			if (inst->overlay_active && !inst->overlay_stale) {
+				goto draw_highlight;
+			}
+			if (avbox_window_overlaybuf(window,
+				inst->state_info.pix_fmt,
+				(void**) inst->last_video_frame->avframe->data,
+				inst->last_video_frame->avframe->linesize,
+				inst->state_info.video_res.w,
+				inst->state_info.video_res.h,
+				x, y, inst->state_info.scaled_res.w,
+				inst->state_info.scaled_res.h) == 0) {
+				inst->overlay_active = 1;
+				inst->overlay_stale = 0;
+				goto draw_highlight;
+			}
+			DEBUG_PRINT(LOG_MODULE, "Video overlay not available");
+			inst->overlay_disabled = 1;
+		}
+	}
+	if (inst->overlay_active) {
+		avbox_video_hideoverlay();
+		inst->overlay_active = 0;
+	}
+	if (LIKELY(inst->last_video_frame != NULL && !inst->direct_render_disabled &&
+		!obscured)) {
+		if (LIKELY(avbox_window_scaleblitbuf(window,
+			inst->state_info.pix_fmt,
+			(void**) inst->last_video_frame->avframe->data,
+			inst->last_video_frame->avframe->linesize,
+			inst->state_info.video_res.w,
+			inst->state_info.video_res.h,
+			x, y, inst->state_info.scaled_res.w,
+			inst->state_info.scaled_res.h) == 0)) {
+			goto draw_highlight;
+		}
+		if (errno == ENOTSUP) {
+			DEBUG_PRINT(LOG_MODULE, "Direct rendering not supported");
+			inst->direct_render_disabled = 1;
+		}
+	}
+
+	/* upload the frame to the offscreen window if it
+	 * hasn't been done yet */
+	if (inst->video_window_stale && inst->last_video_frame != NULL) {
+		avbox_window_blitbuf(inst->video_window,
+			inst->state_info.pix_fmt,
+			(void**) inst->last_video_frame->avframe->data,
+			inst->last_video_frame->avframe->linesize,
+			inst->state_info.video_res.w,
+			inst->state_info.video_res.h,
+			0, 0);
+		inst->video_window_stale = 0;
+	}
+
 	/* scale and show the frame */
 	avbox_window_scaleblit(window, inst->video_window, MBV_BLITFLAGS_NONE,
 		x, y, inst->state_info.scaled_res.w, inst->state_info.scaled_res.h);
 
+draw_highlight:
+
 #ifdef ENABLE_DVD
 	if (UNLIKELY(inst->stream.self != NULL && inst->stream.highlight != NULL)) {
 		struct avbox_rect *highlight;
@@ -502,6 +570,7 @@ struct avbox_player_updateargs
 {
 	struct avbox_player *inst;
 	struct avbox_av_frame *frame;
+	int64_t submit_time;
 };
 
 
@@ -528,33 +597,49 @@ avbox_player_doupdate(void *arg)
 				frame_time, current_time, current_time - frame_time);
 		}
 #endif
-		/* upload the frame to the window surface */
-		avbox_window_blitbuf(inst->video_window,
-			inst->state_info.pix_fmt,
-			(void**) frame->avframe->data,
-			frame->avframe->linesize,
-			inst->state_info.video_res.w,
-			inst->state_info.video_res.h,
-			0, 0);
+		/* Just because avbox_window_blitbuf() returned doesn't mean
+		 * that the blitting is complete. This is the case in an
+		 * accelerated scenario where the frame is in GPU memory. In
+		 * the case of MMAL this causes blinking (black frames whenever
+		 * the blitting doesn't happen fast enough). So we delay the
+		 * freeing of the frame until the next frame. */
+		struct avbox_av_frame * const previous_frame = inst->last_video_frame;
+		struct timespec vblank;
+		int flip_timestamps = 1;
+
+		/* if the driver timestamps page flips then by now the
+		 * previous frame is on the screen and we can tell how
+		 * long it took to get there */
+		if (avbox_video_getvblank(&vblank, NULL) == 0) {
+			avbox_avsync_flipped(&inst->avsync,
+				SEC2USEC((int64_t) vblank.tv_sec) + NSEC2USEC(vblank.tv_nsec));
+		} else if (errno != EAGAIN) {
+			flip_timestamps = 0;
+		}
+		avbox_avsync_submitted(&inst->avsync, args->submit_time);
 
+		/* the frame is uploaded by the draw handler, either directly
+		 * to the target window or through the offscreen window */
+		inst->last_video_frame = frame;
+		inst->video_window_stale = 1;
+		inst->overlay_stale = 1;
 		avbox_window_update(inst->window);
 
+		/* otherwise the best we can do is the time that
+		 * the update returned */
+		if (!flip_timestamps) {
+			avbox_avsync_flipped(&inst->avsync, avbox_avsync_now());
+		}
+
 		/* The GPU drivers may have another RT thread that needs
 		 * to run in order for the frames to be shown so yield
 		 * the CPU so it can do it right away */
 		/* sched_yield(); */
 
-		/* Just because avbox_window_blitbuf() returned doesn't mean
-		 * that the blitting is complete. This is the case in an
-		 * accelerated scenario where the frame is in GPU memory. In
-		 * the case of MMAL this causes blinking (black frames whenever
-		 * the blitting doesn't happen fast enough). So we delay the
-		 * freeing of the frame until the next frame. */
-		if (LIKELY(inst->last_video_frame != NULL)) {
-			av_frame_unref(inst->last_video_frame->avframe);
-			release_av_frame(inst, inst->last_video_frame);
+		if (LIKELY(previous_frame != NULL)) {
+			av_frame_unref(previous_frame->avframe);
+			release_av_frame(inst, previous_frame);
 		}
-		inst->last_video_frame = frame;
 	} else {
 		avbox_window_update(inst->window);
 	}
@@ -579,6 +664,9 @@ avbox_player_createwindow(void *arg)
 		LOG_PRINT_ERROR("Could not create video window!");
 	}
 
+	inst->overlay_disabled = 0;
+	inst->direct_render_disabled = 0;
+
 	/* clear the off-screen window and set a draw handler
 	 * for the target window */
 	avbox_window_setbgcolor(inst->video_window, AVBOX_COLOR(0x000000ff));
@@ -593,6 +681,10 @@ avbox_player_destroywindow(void *arg)
 	struct avbox_player * const inst = arg;
 	struct avbox_player_updateargs args;
 	ASSERT(inst->window != NULL);
+	if (inst->overlay_active) {
+		avbox_video_hideoverlay();
+		inst->overlay_active = 0;
+	}
 	avbox_window_destroy(inst->video_window);
 	inst->video_window = NULL;
 	args.inst = inst;
@@ -609,9 +701,9 @@ static void *
 avbox_player_video(void *arg)
 {
 	int delegate_waitable = 0;
-	int target_width, target_height, scaled = 0, skip_frame = 0;
-	int64_t last_latency = 0;
+	int target_width, target_height, scaled = 0;
 	struct avbox_player *inst = (struct avbox_player*) arg;
+	struct avbox_avsync_stats stats;
 	struct avbox_player_updateargs args = { .inst = inst, .frame = NULL };
 	struct avbox_player_packet *packet;
 	struct avbox_av_frame *frame;
@@ -639,6 +731,7 @@ avbox_player_video(void *arg)
 	avbox_window_getcanvassize(inst->window, &target_width, &target_height);
 
 	avbox_checkpoint_enable(&inst->video_output_checkpoint);
+	avbox_avsync_reset(&inst->avsync);
 
 	/* signal control thread that we're ready */
 	avbox_player_sendctl(inst, AVBOX_PLAYERCTL_VIDEOOUT_READY, NULL);
@@ -692,6 +785,7 @@ avbox_player_video(void *arg)
 				avbox_stopwatch_start(inst->video_time);
 			}
 			pthread_mutex_unlock(&inst->state_lock);
+			avbox_avsync_reset(&inst->avsync);
 
 			if (avbox_queue_get(inst->video_frames_q) != packet) {
 				LOG_PRINT_ERROR("Video packet went missing!!");
@@ -723,82 +817,59 @@ avbox_player_video(void *arg)
 			scaled = 1;
 		}
 
-		/* get the frame pts and wait */
+		/* get the frame pts and let the sync controller decide
+		 * whether to wait for it, show it or drop it */
 		if  (LIKELY(frame->avframe->pts != AV_NOPTS_VALUE)) {
-			int64_t current_time;
+			int64_t delay, current_time;
 			const int64_t frame_time = av_rescale_q(frame->avframe->pts,
 				inst->state_info.time_base, AV_TIME_BASE_Q);
 
-			#ifdef DEBUG_LATENCY
-			/* this takes under 100 uS */
-			struct timespec before_gettime, after_gettime;
-			clock_gettime(CLOCK_MONOTONIC, &before_gettime);
 			current_time = inst->getmastertime(inst);
-			clock_gettime(CLOCK_MONOTONIC, &after_gettime);
-			#else
-			current_time = inst->getmastertime(inst);
-			#endif
-
 			if (UNLIKELY(current_time < 0)) {
 				LOG_PRINT_ERROR("current_time is negative!");
 			}
+			current_time = avbox_avsync_clock(&inst->avsync,
+				current_time, avbox_avsync_now());
+
+			switch (avbox_avsync_decide(&inst->avsync, frame_time, current_time, &delay)) {
+			case AVBOX_AVSYNC_WAIT:
+				/* FIXME: The PCM stream is returning the wrong time
+				 * sometimes during a seek. That should not be allowed
+				 * to happen, it should just block */
+				if (UNLIKELY(delay > AVBOX_MAX_FRAME_WAIT_US)) {
+					LOG_VPRINT_WARN("Unreasonable delay of %" PRIi64
+						" (frame_time=%" PRIi64 " current_time=%" PRIi64 ")",
+						delay, frame_time, current_time);
+					delay = AVBOX_MAX_FRAME_WAIT_US;
+				}
 
-			/* NOTE: frame_time may be a very large negative interger that
-			 * can overflow so we need to check that current_time < frame_time
-			 * before substracting.
-			 *
-			 * This may be the most likely branch but we're optimizing for
-			 * the case when we're running late. */
-			if (UNLIKELY(current_time < frame_time)) {
-				const int64_t delay = frame_time - current_time -
-					MIN(last_latency, AVBOX_LATENCY_CORRECT_MAX);
-				if (LIKELY(delay > AVBOX_MIN_FRAME_WAIT_US)) {
-					tv.tv_sec = 0;
-					tv.tv_nsec = delay * 1000LL;
-
-					/* FIXME: The PCM stream is returning the wrong time
-					 * sometimes during a seek. That should not be allowed
-					 * to happen, it should just block */
-					if (UNLIKELY(delay > 250LL * 1000LL)) {
-						LOG_VPRINT_WARN("Unreasonable delay of %" PRIi64
-							" (frame_time=%" PRIi64 " current_time=%" PRIi64 ")",
-							delay, frame_time, current_time);
-						tv.tv_nsec = 250LL * 1000LL * 1000LL;
-					}
+				tv.tv_sec = 0;
+				tv.tv_nsec = delay * 1000LL;
+				delay2abstime(&tv);
+				pthread_mutex_lock(&sleep_lock);
+				pthread_cond_timedwait(&sleep_cond, &sleep_lock, &tv);
+				pthread_mutex_unlock(&sleep_lock);
 
-					delay2abstime(&tv);
-					pthread_mutex_lock(&sleep_lock);
-					pthread_cond_timedwait(&sleep_cond, &sleep_lock, &tv);
-					current_time = inst->getmastertime(inst);
-					pthread_mutex_unlock(&sleep_lock);
+				/* check again. We may wake up too early if playback is
+				 * paused or if the audio stream underruns */
+				continue;
 
-					/* We may wake up too early if playback is paused or
-					 * if the audio stream underruns */
-					if (UNLIKELY((current_time + (30LL * 1000LL)) < frame_time)) {
-						continue;
-					}
-				}
+			case AVBOX_AVSYNC_DROP:
+				av_frame_unref(frame->avframe);
+				release_av_frame(inst, frame);
+				goto next_frame;
+
+			case AVBOX_AVSYNC_PRESENT:
+				break;
 			}
 
 			#ifdef DEBUG_LATENCY
 			if (current_time > (frame_time + (15LL * 1000LL))) {
-				LOG_VPRINT_INFO("Woke up too late: (expected=%" PRIi64 " is=%" PRIi64
-					" diff=%" PRIi64 " gettime_duration=%" PRIi64 ")",
-					frame_time, current_time, current_time - frame_time,
-					utimediff(&after_gettime, &before_gettime));
+				LOG_VPRINT_INFO("Presenting late: (expected=%" PRIi64 " is=%" PRIi64
+					" diff=%" PRIi64 ")",
+					frame_time, current_time, current_time - frame_time);
 			}
 			#endif
-
-			/* if we're running late skip this frame */
-			last_latency = MAX(0, current_time - frame_time);
-			if (UNLIKELY(last_latency > AVBOX_SKIP_FRAME_THRESHOLD)) {
-				if (++skip_frame <= AVBOX_SKIP_FRAME_MAX) {
-					av_frame_unref(frame->avframe);
-					release_av_frame(inst, frame);
-					goto next_frame;
-				}
-				skip_frame = 0;
-			}
 		}
 
 		/* if there's an update pending wait for it */
@@ -817,6 +888,7 @@ avbox_player_video(void *arg)
 
 		/* send frame to the main thread for presentation */
 		args.frame = frame;
+		args.submit_time = avbox_avsync_now();
 		if (UNLIKELY(avbox_object_sendmsg(&main_thread_object,
 			AVBOX_MESSAGETYPE_DELEGATE, AVBOX_DISPATCH_UNICAST, del) == NULL)) {
 			LOG_VPRINT_ERROR("Could not delegate frame to main thread: %s",
@@ -837,6 +909,12 @@ next_frame:
 video_exit:
 	DEBUG_PRINT("player", "Video renderer exiting");
 
+	avbox_avsync_getstats(&inst->avsync, &stats);
+	LOG_VPRINT_INFO("A/V sync: %u presented, %u dropped, %u repeated, %u late "
+		"(offset=%" PRIi64 "us latency=%" PRIi64 "us)",
+		stats.presented, stats.dropped, stats.repeated, stats.late,
+		stats.offset, stats.latency);
+
 	avbox_checkpoint_disable(&inst->video_output_checkpoint);
 
 	DEBUG_PRINT(LOG_MODULE, "Freeing last frame");
@@ -914,12 +992,12 @@ avbox_player_destroy_filter_graph(AVFilterGraph *filter_graph,
 static void *
 avbox_player_video_decode(void *arg)
 {
-	int ret, just_flushed = 0, keep_going, time_set = 0, flush_graph = 0;
+	int ret, just_flushed = 0, keep_going, time_set = 0, flush_graph = 0, threads;
 	struct avbox_player *inst = (struct avbox_player*) arg;
 	struct avbox_player_packet *v_packet;
 	struct avbox_av_packet *av_packet = NULL;
+	struct avbox_videodec_state vdec;
 	char video_filters[512];
-	AVCodecContext *dec_ctx;
 	AVFrame *video_frame_nat = NULL;
 
 	AVFilterGraph *video_filter_graph = NULL;
@@ -933,29 +1011,45 @@ avbox_player_video_decode(void *arg)
 	ASSERT(inst->fmt_ctx != NULL);
 	ASSERT(inst->video_stream_index != -1);
 
-	/* open the video codec */
-	if ((dec_ctx = avbox_ffmpegutil_opencodeccontext(
-		&inst->video_stream_index, inst->fmt_ctx, AVMEDIA_TYPE_VIDEO)) == NULL) {
+	memset(&vdec, 0, sizeof(vdec));
+
+	/* open the video codec. Use a thread per core unless
+	 * the number of threads is capped in the settings */
+	threads = avbox_settings_getint("video_decoder_threads", 0);
+	if (threads > 0) {
+		threads = MIN(threads, sysconf(_SC_NPROCESSORS_ONLN));
+	}
+	threads = MAX(threads, 0);
+
+	/* open the video codec using the backend selected when
+	 * the decoder was started or the next one that works */
+	if (inst->video_decoder == NULL) {
+		inst->video_decoder = avbox_videodec_next(
+			inst->fmt_ctx->streams[inst->video_stream_index]->codecpar, NULL);
+	}
+	if (avbox_videodec_open(&vdec, inst->fmt_ctx, inst->video_stream_index,
+		inst->video_decoder, threads) == -1) {
 		LOG_PRINT_ERROR("Could not open video codec context");
 		goto decoder_exit;
 	}
+	inst->video_decoder = vdec.backend;
 
 #ifndef NDEBUG
 	char pix_fmt_string[256];
 	av_get_pix_fmt_string(pix_fmt_string, sizeof(pix_fmt_string),
-		dec_ctx->pix_fmt);
+		vdec.ctx->pix_fmt);
 	DEBUG_VPRINT(LOG_MODULE, "Video codec: %s (%s)",
-		dec_ctx->codec_descriptor->long_name, dec_ctx->codec_descriptor->name);
+		vdec.ctx->codec_descriptor->long_name, vdec.ctx->codec_descriptor->name);
 	DEBUG_VPRINT(LOG_MODULE, "Pixel format: %s (%s)",
-		pix_fmt_string, av_get_pix_fmt_name(dec_ctx->pix_fmt));
+		pix_fmt_string, av_get_pix_fmt_name(vdec.ctx->pix_fmt));
 	DEBUG_VPRINT(LOG_MODULE, "Resolution: %ix%x",
-		dec_ctx->width, dec_ctx->height);
-	DEBUG_VPRINT(LOG_MODULE, "Framerate: %d/%d", dec_ctx->framerate,
-		dec_ctx->framerate.num, dec_ctx->framerate.den);
+		vdec.ctx->width, vdec.ctx->height);
+	DEBUG_VPRINT(LOG_MODULE, "Framerate: %d/%d", vdec.ctx->framerate,
+		vdec.ctx->framerate.num, vdec.ctx->framerate.den);
 #endif
 
-	inst->state_info.video_res.w = dec_ctx->width;
-	inst->state_info.video_res.h = dec_ctx->height;
+	inst->state_info.video_res.w = vdec.ctx->width;
+	inst->state_info.video_res.h = vdec.ctx->height;
 	inst->state_info.time_base.num = inst->fmt_ctx->streams[inst->video_stream_index]->time_base.num;
 	inst->state_info.time_base.den = inst->fmt_ctx->streams[inst->video_stream_index]->time_base.den;
 
@@ -978,7 +1072,18 @@ avbox_player_video_decode(void *arg)
 
 		avbox_checkpoint_here(&inst->video_decoder_checkpoint);
 
-		if ((av_packet = avbox_queue_peek(inst->video_packets_q,
+		/* after falling back to software resend the packets
+		 * that the hardware decoder consumed before reading
+		 * more from the queue */
+		if (avbox_videodec_replaying(&vdec)) {
+			av_packet = NULL;
+			if ((ret = avbox_videodec_send(&vdec, NULL)) == AVERROR_EXIT) {
+				avbox_player_sendctl(inst, AVBOX_PLAYERCTL_THREADEXIT, NULL);
+				goto decoder_exit;
+			}
+			inst->video_decoder_flushed = 0;
+
+		} else if ((av_packet = avbox_queue_peek(inst->video_packets_q,
 			!(inst->flushing & AVBOX_PLAYER_FLUSH_VIDEO))) == NULL) {
 			if (errno == EAGAIN) {
 				if (inst->video_decoder_flushed ||
@@ -988,7 +1093,7 @@ avbox_player_video_decode(void *arg)
 				}
 
 				/* send the flush packet to the video codec */
-				if ((ret = avcodec_send_packet(dec_ctx, NULL)) < 0) {
+				if ((ret = avcodec_send_packet(vdec.ctx, NULL)) < 0) {
 					LOG_PRINT_ERROR("Error flushing video codec!!!");
 					avbox_player_sendctl(inst, AVBOX_PLAYERCTL_THREADEXIT, NULL);
 					goto decoder_exit;
@@ -999,7 +1104,7 @@ avbox_player_video_decode(void *arg)
 
 			} else if (errno == ESHUTDOWN) {
 				if (!inst->video_decoder_flushed) {
-					if ((ret = avcodec_send_packet(dec_ctx, NULL)) < 0) {
+					if ((ret = avcodec_send_packet(vdec.ctx, NULL)) < 0) {
 						LOG_PRINT_ERROR("Could not send flush packet to video decoder!");
 						avbox_player_sendctl(inst, AVBOX_PLAYERCTL_THREADEXIT, NULL);
 						goto decoder_exit;
@@ -1016,19 +1121,11 @@ avbox_player_video_decode(void *arg)
 			}
 		} else {
 			/* send packet to codec for decoding */
-			if (UNLIKELY((ret  = avcodec_send_packet(dec_ctx, av_packet->avpacket)) < 0)) {
+			if (UNLIKELY((ret = avbox_videodec_send(&vdec, av_packet->avpacket)) < 0)) {
 				if (ret == AVERROR(EAGAIN)) {
 					/* fall through */
 					av_packet = NULL;
-
-				} else if (ret == AVERROR_INVALIDDATA) {
-					LOG_PRINT_ERROR("Invalid data sent to video decoder");
-
 				} else {
-					char err[256];
-					av_strerror(ret, err, sizeof(err));
-					LOG_VPRINT_ERROR("Error decoding video packet (%i): %s",
-						ret, err);
 					avbox_player_sendctl(inst, AVBOX_PLAYERCTL_THREADEXIT, NULL);
 					goto decoder_exit;
 				}
@@ -1041,7 +1138,7 @@ avbox_player_video_decode(void *arg)
 		for (keep_going = 1; keep_going;) {
 
 			/* grab the next frame and add it to the filtergraph */
-			if (LIKELY((ret = avcodec_receive_frame(dec_ctx, video_frame_nat)) < 0)) {
+			if (LIKELY((ret = avbox_videodec_receive(&vdec, video_frame_nat)) < 0)) {
 				if (ret == AVERROR_EOF) {
 					/* send flush packet to filtergraph */
 					if (video_filter_graph != NULL) {
@@ -1058,9 +1155,9 @@ avbox_player_video_decode(void *arg)
 					if (just_flushed) {
 						continue;
 					}
-				} else {
-					LOG_VPRINT_ERROR("ERROR: avcodec_receive_frame() returned %d (video)",
-						ret);
+				} else if (ret == AVERROR_EXIT) {
+					avbox_player_sendctl(inst, AVBOX_PLAYERCTL_THREADEXIT, NULL);
+					goto decoder_exit;
 				}
 				keep_going = 0;
 
@@ -1077,23 +1174,24 @@ avbox_player_video_decode(void *arg)
 					/* if we support the pixel format of the decoder then
 					 * don't convert it. Otherwise convert to BGRA */
 					if ((inst->state_info.pix_fmt =
-						avbox_pixfmt_from_libav(dec_ctx->pix_fmt)) == AVBOX_PIXFMT_UNKNOWN) {
+						avbox_pixfmt_from_libav(video_frame_nat->format)) == AVBOX_PIXFMT_UNKNOWN) {
 						LOG_VPRINT_WARN("Pixel format not supported. Converting %s to BGRA!!",
-							av_get_pix_fmt_name(dec_ctx->pix_fmt));
+							av_get_pix_fmt_name(video_frame_nat->format));
 						inst->state_info.pix_fmt = AVBOX_PIXFMT_BGRA;
 						pix_fmt = AV_PIX_FMT_BGRA;
 					} else {
-						pix_fmt = dec_ctx->pix_fmt;
+						pix_fmt = video_frame_nat->format;
 					}
 
 					/* initialize video filter graph */
 					strcpy(video_filters, "null");
 					DEBUG_VPRINT("player", "Video width: %i height: %i",
-						dec_ctx->width, dec_ctx->height);
+						vdec.ctx->width, vdec.ctx->height);
 					DEBUG_VPRINT("player", "Video filters: %s", video_filters);
-					if (avbox_ffmpegutil_initvideofilters(inst->fmt_ctx, dec_ctx,
+					if (avbox_ffmpegutil_initvideofilters(inst->fmt_ctx, vdec.ctx,
 						&video_buffersink_ctx, &video_buffersrc_ctx, &video_filter_graph,
-						pix_fmt, video_filters, inst->video_stream_index) < 0) {
+						video_frame_nat->format, pix_fmt, video_filters,
+						inst->video_stream_index) < 0) {
 						LOG_PRINT_ERROR("Could not initialize filtergraph!");
 						goto decoder_exit;
 					}
@@ -1231,7 +1329,7 @@ avbox_player_video_decode(void *arg)
 		 * buffers so we can keep using it */
 		if (just_flushed) {
 			DEBUG_PRINT(LOG_MODULE, "Video decoder flushed");
-			avcodec_flush_buffers(dec_ctx);
+			avbox_videodec_flush(&vdec);
 			if (video_filter_graph != NULL) {
 				avbox_player_destroy_filter_graph(video_filter_graph,
 					video_buffersrc_ctx, video_buffersink_ctx, video_frame_nat);
@@ -1245,6 +1343,7 @@ avbox_player_video_decode(void *arg)
 decoder_exit:
 	DEBUG_PRINT("player", "Video decoder exiting");
 
+
 	avbox_checkpoint_disable(&inst->video_decoder_checkpoint);
 
 	/* signal the video thread to exit and join it */
@@ -1258,15 +1357,17 @@ decoder_exit:
 			video_buffersrc_ctx, video_buffersink_ctx, video_frame_nat);
 	}
 
-	if (dec_ctx != NULL) {
+	if (vdec.ctx != NULL) {
 		DEBUG_PRINT(LOG_MODULE, "Flushing video decoder");
-		while (avcodec_receive_frame(dec_ctx, video_frame_nat) == 0) {
+		while (avcodec_receive_frame(vdec.ctx, video_frame_nat) == 0) {
 			DEBUG_PRINT(LOG_MODULE, "There are still frames on video decoder!!!");
 			av_frame_unref(video_frame_nat);
 		}
-		avcodec_flush_buffers(dec_ctx);
-		avcodec_close(dec_ctx);
-		avcodec_free_context(&dec_ctx);
+		avcodec_flush_buffers(vdec.ctx);
+	}
+	avbox_videodec_close(&vdec);
+	if (vdec.backend != NULL) {
+		inst->video_decoder = vdec.backend;
 	}
 	if (video_frame_nat != NULL) {
 		av_frame_free(&video_frame_nat);
@@ -1278,6 +1379,343 @@ decoder_exit:
 }
 
 
+/**
+ * Sets the audio stream clock to the timestamp (in stream
+ * time base) of the first frame after a flush.
+ */
+static void
+avbox_player_audio_setclock(struct avbox_player * const inst,
+	int64_t pts)
+{
+	pts = av_rescale_q(pts,
+		inst->fmt_ctx->streams[inst->audio_stream_index]->time_base,
+		AV_TIME_BASE_Q);
+	avbox_audiostream_setclock(inst->audio_stream, pts);
+	inst->getmastertime = avbox_player_getaudiotime;
+}
+
+
+/**
+ * Copies S16 stereo frames to the audio stream. Blocks
+ * until all frames have been copied.
+ */
+static int
+avbox_player_audio_write(struct avbox_player * const inst,
+	const uint8_t * const data, const int nb_samples)
+{
+	int written;
+	for (written = 0; written < nb_samples;) {
+		const ssize_t n = avbox_audiostream_write(inst->audio_stream,
+			data + (written * 4), nb_samples - written);
+		if (n == -1) {
+			if (errno == EAGAIN) {
+				continue;
+			}
+			LOG_VPRINT_ERROR("Could not write audio frames: %s",
+				strerror(errno));
+			return -1;
+		}
+		written += n;
+	}
+	return 0;
+}
+
+
+/**
+ * Gets a resampler for the frame's format. The cached one is
+ * reused unless the format changed.
+ */
+static int
+avbox_player_audio_resampler(struct SwrContext ** const swr,
+	const AVFrame * const frame, const int async)
+{
+	int ret;
+	int64_t fmt, rate, layout;
+	const int64_t frame_layout = frame->channel_layout ?
+		frame->channel_layout : av_get_default_channel_layout(frame->channels);
+
+	if (LIKELY(*swr != NULL)) {
+		av_opt_get_int(*swr, "in_sample_fmt", 0, &fmt);
+		av_opt_get_int(*swr, "in_sample_rate", 0, &rate);
+		av_opt_get_int(*swr, "in_channel_layout", 0, &layout);
+		if (LIKELY(fmt == frame->format && rate == frame->sample_rate &&
+			layout == frame_layout)) {
+			return 0;
+		}
+		DEBUG_PRINT(LOG_MODULE, "Audio format changed. Reinitializing resampler");
+		swr_free(swr);
+	}
+
+	DEBUG_VPRINT(LOG_MODULE, "Initializing resampler (%s %iHz layout=0x%"PRIx64" async=%i)",
+		av_get_sample_fmt_name(frame->format), frame->sample_rate, frame_layout, async);
+
+	if ((*swr = swr_alloc_set_opts(NULL,
+		AV_CH_LAYOUT_STEREO, AV_SAMPLE_FMT_S16, 48000,
+		frame_layout, frame->format, frame->sample_rate, 0, NULL)) == NULL) {
+		LOG_PRINT_ERROR("Could not allocate resampler");
+		return -1;
+	}
+
+	/* With no video there are no frames to drop or repeat so let
+	 * the resampler stretch or squeeze the audio slightly (up to
+	 * ~1%) to follow the stream timestamps instead of dropping or
+	 * padding samples when they drift */
+	if (async) {
+		av_opt_set_double(*swr, "async", 480, 0);
+	}
+
+	if ((ret = swr_init(*swr)) < 0) {
+		char err[256];
+		av_strerror(ret, err, sizeof(err));
+		LOG_VPRINT_ERROR("Could not initialize resampler: %s", err);
+		swr_free(swr);
+		return -1;
+	}
+	return 0;
+}
+
+
+/**
+ * Converts a decoded frame and writes it straight into the
+ * audio stream's buffer. If frame is NULL the resampler
+ * is drained.
+ */
+static int
+avbox_player_audio_convert(struct avbox_player * const inst,
+	struct SwrContext * const swr, const AVFrame * const frame,
+	const int async)
+{
+	int ret, in_count = 0;
+	size_t n_frames;
+	uint8_t *buf;
+	const uint8_t **in = NULL;
+
+	if (frame != NULL) {
+		in = (const uint8_t**) frame->extended_data;
+		in_count = frame->nb_samples;
+
+		/* feed the timestamps to the resampler so it can
+		 * compensate for drift */
+		if (async) {
+			const AVRational time_base =
+				inst->fmt_ctx->streams[inst->audio_stream_index]->time_base;
+			const int64_t pts = av_frame_get_best_effort_timestamp(frame);
+			if (pts != AV_NOPTS_VALUE) {
+				swr_next_pts(swr, av_rescale(pts,
+					time_base.num * 48000LL * frame->sample_rate, time_base.den));
+			}
+		}
+	}
+
+	while (1) {
+		if ((buf = avbox_audiostream_getbuffer(inst->audio_stream, &n_frames)) == NULL) {
+			if (errno == EAGAIN) {
+				continue;
+			}
+			LOG_VPRINT_ERROR("Could not get audio buffer: %s",
+				strerror(errno));
+			return -1;
+		}
+		if ((ret = swr_convert(swr, &buf, n_frames, in, in_count)) < 0) {
+			char err[256];
+			av_strerror(ret, err, sizeof(err));
+			LOG_VPRINT_ERROR("Could not convert audio: %s", err);
+			return -1;
+		}
+		avbox_audiostream_commit(inst->audio_stream, ret);
+		if ((size_t) ret < n_frames) {
+			break;
+		}
+
+		/* whatever didn't fit is buffered by the resampler. Passing
+		 * no samples pulls it out (a NULL buffer would flush it) */
+		in_count = 0;
+	}
+	return 0;
+}
+
+
+/**
+ * Gets the IEC 61937 frame rate for an audio stream or 0 if
+ * it cannot be passed through. Only the codecs listed on the
+ * audio_passthrough setting (ie. "ac3,eac3,dts") are passed
+ * through.
+ */
+static unsigned int
+avbox_player_passthrough_rate(const AVCodecParameters * const codecpar)
+{
+	unsigned int rate;
+	char *codecs, *codec, *saveptr;
+
+	switch (codecpar->codec_id) {
+	case AV_CODEC_ID_AC3:
+	case AV_CODEC_ID_DTS:
+		rate = codecpar->sample_rate;
+		break;
+	case AV_CODEC_ID_EAC3:
+		/* E-AC-3 bursts are sent at 4x the rate */
+		rate = codecpar->sample_rate * 4;
+		break;
+	default:
+		return 0;
+	}
+
+	if ((codecs = avbox_settings_getstring("audio_passthrough")) == NULL) {
+		return 0;
+	}
+	for (codec = strtok_r(codecs, ",", &saveptr); codec != NULL;
+		codec = strtok_r(NULL, ",", &saveptr)) {
+		if (!strcmp(codec, avcodec_get_name(codecpar->codec_id))) {
+			break;
+		}
+	}
+	free(codecs);
+	return (codec != NULL) ? rate : 0;
+}
+
+
+/**
+ * Checks if the audio stream needs to be reopened for the
+ * current audio track. A passthrough rate that could not be
+ * configured before is not tried again.
+ */
+static int
+avbox_player_audio_mustreconfigure(struct avbox_player * const inst)
+{
+	unsigned int rate;
+
+	if (inst->audio_stream_index < 0 || inst->audio_stream == NULL) {
+		return 0;
+	}
+
+	rate = avbox_player_passthrough_rate(
+		inst->fmt_ctx->streams[inst->audio_stream_index]->codecpar);
+	return rate != inst->audio_passthrough &&
+		(rate == 0 || rate != inst->audio_passthrough_failed);
+}
+
+
+/**
+ * Receives IEC 61937 bursts from the spdif muxer and
+ * copies them to the audio stream.
+ */
+static int
+avbox_player_spdif_write(void *opaque, uint8_t *buf, int buf_size)
+{
+	struct avbox_player * const inst = opaque;
+	ASSERT((buf_size % 4) == 0);
+	if (avbox_player_audio_write(inst, buf, buf_size / 4) == -1) {
+		return AVERROR(EIO);
+	}
+	return buf_size;
+}
+
+
+/**
+ * Close the spdif muxer.
+ */
+static void
+avbox_player_spdif_close(AVFormatContext ** const spdif)
+{
+	ASSERT(spdif != NULL && *spdif != NULL);
+	av_write_trailer(*spdif);
+	if ((*spdif)->pb != NULL) {
+		av_freep(&(*spdif)->pb->buffer);
+		av_freep(&(*spdif)->pb);
+	}
+	avformat_free_context(*spdif);
+	*spdif = NULL;
+}
+
+
+/**
+ * Opens an spdif muxer that wraps the packets of an audio
+ * stream and writes them to the audio stream. Returns NULL
+ * if the stream cannot be sent with the format the audio
+ * stream was configured for.
+ */
+static AVFormatContext *
+avbox_player_spdif_open(struct avbox_player * const inst,
+	const AVCodecParameters * const codecpar)
+{
+	int ret;
+	uint8_t *buf;
+	AVStream *stream;
+	AVFormatContext *spdif = NULL;
+	const int buf_size = 4096 * 4;
+
+	if (avbox_player_passthrough_rate(codecpar) != inst->audio_passthrough) {
+		LOG_VPRINT_ERROR("Cannot pass %s stream through at %uHz",
+			avcodec_get_name(codecpar->codec_id), inst->audio_passthrough);
+		return NULL;
+	}
+
+	if ((ret = avformat_alloc_output_context2(&spdif, NULL, "spdif", NULL)) < 0) {
+		char err[256];
+		av_strerror(ret, err, sizeof(err));
+		LOG_VPRINT_ERROR("Could not create spdif muxer: %s", err);
+		return NULL;
+	}
+	if ((buf = av_malloc(buf_size)) == NULL ||
+		(spdif->pb = avio_alloc_context(buf, buf_size, 1, inst,
+			NULL, avbox_player_spdif_write, NULL)) == NULL) {
+		LOG_PRINT_ERROR("Could not allocate spdif IO context");
+		av_free(buf);
+		avformat_free_context(spdif);
+		return NULL;
+	}
+	if ((stream = avformat_new_stream(spdif, NULL)) == NULL ||
+		avcodec_parameters_copy(stream->codecpar, codecpar) < 0) {
+		LOG_PRINT_ERROR("Could not create spdif stream");
+		goto fail;
+	}
+	if ((ret = avformat_write_header(spdif, NULL)) < 0) {
+		char err[256];
+		av_strerror(ret, err, sizeof(err));
+		LOG_VPRINT_ERROR("Could not initialize spdif muxer: %s", err);
+		goto fail;
+	}
+
+	DEBUG_VPRINT(LOG_MODULE, "Passing %s stream through at %uHz",
+		avcodec_get_name(codecpar->codec_id), inst->audio_passthrough);
+
+	return spdif;
+fail:
+	av_freep(&spdif->pb->buffer);
+	av_freep(&spdif->pb);
+	avformat_free_context(spdif);
+	return NULL;
+}
+
+
+/**
+ * Wraps a compressed audio packet and writes it
+ * to the audio stream.
+ */
+static int
+avbox_player_spdif_writepacket(AVFormatContext * const spdif,
+	const AVPacket * const packet)
+{
+	int ret;
+	AVPacket pkt;
+
+	if ((ret = av_packet_ref(&pkt, packet)) < 0) {
+		return ret;
+	}
+	pkt.stream_index = 0;
+	ret = av_write_frame(spdif, &pkt);
+	av_packet_unref(&pkt);
+	if (ret < 0) {
+		return ret;
+	}
+
+	/* flush the bursts to the audio stream now
+	 * so they don't lag behind the clock */
+	avio_flush(spdif->pb);
+	return spdif->pb->error;
+}
+
+
 /**
  * Decodes the audio stream.
  */
@@ -1285,13 +1723,16 @@ static void *
 avbox_player_audio_decode(void * arg)
 {
 	int ret, keep_going, just_flushed = 0, time_set = 0, flush_graph = 0;
-	int stream_index = -1;
+	int stream_index = -1, async;
 	struct avbox_syncarg * const syncarg = arg;
 	struct avbox_player * const inst = avbox_syncarg_data(syncarg);
 	struct avbox_av_packet * av_packet = NULL;
-	const char *audio_filters ="aresample=48000,aformat=sample_fmts=s16:channel_layouts=stereo";
+	char audio_filters[512];
+	char *user_filters;
 	AVCodecContext *dec_ctx = NULL;
 	AVFrame *audio_frame_nat = NULL;
+	struct SwrContext *swr = NULL;
+	AVFormatContext *spdif = NULL;
 	AVFilterGraph *filter_graph = NULL;
 	AVFilterContext *audio_buffersink_ctx = NULL;
 	AVFilterContext *audio_buffersrc_ctx;
@@ -1314,8 +1755,27 @@ avbox_player_audio_decode(void * arg)
 		goto end;
 	}
 
-	/* initialize audio filter graph */
-	DEBUG_VPRINT("player", "Audio filters: %s", audio_filters);
+	/* only build a filtergraph if there are filters configured.
+	 * Otherwise frames that are already S16 stereo at 48KHz are
+	 * copied as they are and anything else goes through the
+	 * resampler */
+	async = (inst->video_stream_index == -1);
+	audio_filters[0] = '\0';
+	if ((user_filters = avbox_settings_getstring("audio_filters")) != NULL) {
+		/* an empty setting means no filters */
+		if (user_filters[strspn(user_filters, " \t")] != '\0') {
+			if ((size_t) snprintf(audio_filters, sizeof(audio_filters), "%s,aresample=48000%s,"
+				"aformat=sample_fmts=s16:channel_layouts=stereo",
+				user_filters, async ? ":async=480" : "") >= sizeof(audio_filters)) {
+				LOG_VPRINT_ERROR("The audio_filters setting is too long (%zu bytes). Ignoring it",
+					strlen(user_filters));
+				audio_filters[0] = '\0';
+			} else {
+				DEBUG_VPRINT("player", "Audio filters: %s", audio_filters);
+			}
+		}
+		free(user_filters);
+	}
 
 	avbox_checkpoint_enable(&inst->audio_decoder_checkpoint);
 	avbox_syncarg_return(syncarg, NULL);
@@ -1340,6 +1800,16 @@ avbox_player_audio_decode(void * arg)
 					!(inst->flushing & AVBOX_PLAYER_FLUSH_AUDIO)) {
 					usleep(50L * 1000L);
 					continue;
+				} else if (dec_ctx == NULL) {
+					/* passthrough. Nothing to drain */
+					if (spdif != NULL) {
+						avbox_player_spdif_close(&spdif);
+					}
+					DEBUG_PRINT(LOG_MODULE, "Audio decoder flushed");
+					inst->audio_decoder_flushed = 1;
+					stream_index = -1;
+					time_set = 0;
+					continue;
 				} else {
 					ret = avcodec_send_packet(dec_ctx, NULL);
 					just_flushed = 1;
@@ -1365,6 +1835,42 @@ avbox_player_audio_decode(void * arg)
 				avbox_player_sendctl(inst, AVBOX_PLAYERCTL_THREADEXIT, NULL);
 				goto end;
 			}
+		} else if (inst->audio_passthrough) {
+			/* wrap the compressed packets and send them to
+			 * the receiver without decoding */
+			if (av_packet->avpacket->stream_index != stream_index) {
+				if (spdif != NULL) {
+					avbox_player_spdif_close(&spdif);
+				}
+				stream_index = av_packet->avpacket->stream_index;
+				spdif = avbox_player_spdif_open(inst,
+					inst->fmt_ctx->streams[stream_index]->codecpar);
+				time_set = 0;
+
+				/* if the receiver cannot take this track have the
+				 * control thread reopen the audio stream for PCM */
+				if (spdif == NULL) {
+					avbox_player_sendctl(inst, AVBOX_PLAYERCTL_AUDIO_RECONFIGURE, NULL);
+				}
+			}
+			if (spdif != NULL) {
+				if (UNLIKELY(!time_set)) {
+					avbox_player_audio_setclock(inst,
+						(av_packet->avpacket->pts != AV_NOPTS_VALUE) ?
+						av_packet->avpacket->pts : av_packet->avpacket->dts);
+					time_set = 1;
+				}
+				if ((ret = avbox_player_spdif_writepacket(spdif, av_packet->avpacket)) < 0) {
+					char err[256];
+					av_strerror(ret, err, sizeof(err));
+					LOG_VPRINT_ERROR("Could not write audio packet: %s", err);
+					if (ret == AVERROR(EIO)) {
+						avbox_player_sendctl(inst, AVBOX_PLAYERCTL_THREADEXIT, NULL);
+						goto end;
+					}
+				}
+			}
+			inst->audio_decoder_flushed = 0;
 		} else {
 			if (dec_ctx == NULL || av_packet->avpacket->stream_index != stream_index) {
 				if (dec_ctx != NULL) {
@@ -1386,12 +1892,19 @@ avbox_player_audio_decode(void * arg)
 					DEBUG_VPRINT(LOG_MODULE, "Opening audio decoder for stream %i",
 						av_packet->avpacket->stream_index);
 					if ((dec_ctx = avbox_ffmpegutil_opencodeccontext(
-						&inst->audio_stream_index, inst->fmt_ctx, AVMEDIA_TYPE_AUDIO)) == NULL) {
+						&inst->audio_stream_index, inst->fmt_ctx, AVMEDIA_TYPE_AUDIO,
+						1, AVBOX_CODECFLAGS_NONE)) == NULL) {
 						LOG_PRINT_ERROR("Could not open audio codec!");
 						goto end;
 					}
 					stream_index = av_packet->avpacket->stream_index;
 					time_set = 0;
+
+					/* if the receiver can take this track have the
+					 * control thread reopen the audio stream for it */
+					if (avbox_player_audio_mustreconfigure(inst)) {
+						avbox_player_sendctl(inst, AVBOX_PLAYERCTL_AUDIO_RECONFIGURE, NULL);
+					}
 				}
 			}
 
@@ -1426,10 +1939,17 @@ avbox_player_audio_decode(void * arg)
 			}
 		}
 
-		for (keep_going = 1; keep_going;) {
+		for (keep_going = (dec_ctx != NULL); keep_going;) {
 			/* get the next frame from the decoder */
 			if ((ret = avcodec_receive_frame(dec_ctx, audio_frame_nat)) != 0) {
 				if (ret == AVERROR_EOF) {
+					if (swr != NULL) {
+						/* drain the resampler */
+						if (avbox_player_audio_convert(inst, swr, NULL, async) == -1) {
+							avbox_player_sendctl(inst, AVBOX_PLAYERCTL_THREADEXIT, NULL);
+							goto end;
+						}
+					}
 					if (filter_graph != NULL) {
 						/* tell the filtergraph to flush */
 						if ((ret = av_buffersrc_add_frame(audio_buffersrc_ctx, NULL)) < 0) {
@@ -1466,6 +1986,34 @@ avbox_player_audio_decode(void * arg)
 						dec_ctx->channels);
 				}
 
+				if (audio_filters[0] == '\0') {
+					/* if this is the first frame after a flush then set
+					 * the audio stream clock to it's pts */
+					if (UNLIKELY(!time_set)) {
+						avbox_player_audio_setclock(inst,
+							av_frame_get_best_effort_timestamp(audio_frame_nat));
+						time_set = 1;
+					}
+
+					if (!async && audio_frame_nat->format == AV_SAMPLE_FMT_S16 &&
+						audio_frame_nat->sample_rate == 48000 &&
+						audio_frame_nat->channels == 2) {
+						/* already in the output format */
+						ret = avbox_player_audio_write(inst,
+							audio_frame_nat->data[0], audio_frame_nat->nb_samples);
+					} else if ((ret = avbox_player_audio_resampler(&swr, audio_frame_nat, async)) == 0) {
+						ret = avbox_player_audio_convert(inst, swr, audio_frame_nat, async);
+					}
+
+					av_frame_unref(audio_frame_nat);
+
+					if (UNLIKELY(ret == -1)) {
+						avbox_player_sendctl(inst, AVBOX_PLAYERCTL_THREADEXIT, NULL);
+						goto end;
+					}
+					continue;
+				}
+
 				/* initialize the filtergraph is needed */
 				if (filter_graph == NULL) {
 					if ((sample_fmt_name = av_get_sample_fmt_name(dec_ctx->sample_fmt)) == NULL) {
@@ -1535,29 +2083,18 @@ avbox_player_audio_decode(void * arg)
 				/* if this is the first frame after a flush then set the audio stream
 				 * clock to it's pts */
 				if (UNLIKELY(!time_set)) {
-					int64_t pts;
-					pts = av_frame_get_best_effort_timestamp(frame->avframe);
-					pts = av_rescale_q(pts,
-						inst->fmt_ctx->streams[inst->audio_stream_index]->time_base,
-						AV_TIME_BASE_Q);
-					avbox_audiostream_setclock(inst->audio_stream, pts);
-					inst->getmastertime = avbox_player_getaudiotime;
+					avbox_player_audio_setclock(inst,
+						av_frame_get_best_effort_timestamp(frame->avframe));
 					time_set = 1;
 				}
 
-				/* write frame to audio stream and free it */
-				while (avbox_audiostream_write(inst->audio_stream,
-					frame->avframe->data[0], frame->avframe->nb_samples, frame) == -1) {
-					if (errno == EAGAIN) {
-						continue;
-					} else {
-						LOG_VPRINT_ERROR("Could not write audio frames: %s",
-							strerror(errno));
-						avbox_player_sendctl(inst, AVBOX_PLAYERCTL_THREADEXIT, NULL);
-						release_av_frame(inst, frame);
-						break;
-					}
+				/* copy the frame to the audio stream and free it */
+				if (avbox_player_audio_write(inst, frame->avframe->data[0],
+					frame->avframe->nb_samples) == -1) {
+					avbox_player_sendctl(inst, AVBOX_PLAYERCTL_THREADEXIT, NULL);
 				}
+				av_frame_unref(frame->avframe);
+				release_av_frame(inst, frame);
 				sched_yield();
 			}
 		}
@@ -1587,6 +2124,9 @@ avbox_player_audio_decode(void * arg)
 					audio_buffersrc_ctx, audio_buffersink_ctx, frame->avframe);
 				release_av_frame(inst, frame);
 			}
+			if (swr != NULL) {
+				swr_free(&swr);
+			}
 			inst->audio_decoder_flushed = 1;
 			filter_graph = NULL;
 			just_flushed = 0;
@@ -1609,6 +2149,12 @@ end:
 		}
 	}
 
+	if (swr != NULL) {
+		swr_free(&swr);
+	}
+	if (spdif != NULL) {
+		avbox_player_spdif_close(&spdif);
+	}
 	if (audio_frame_nat != NULL) {
 		av_frame_free(&audio_frame_nat);
 	}
@@ -1660,19 +2206,46 @@ avbox_player_audiostream_callback(struct avbox_audiostream * stream,
 		avbox_player_sendctl(inst, AVBOX_PLAYERCTL_THREADEXIT, NULL);
 		break;
 	}
-	case AVBOX_AUDIOSTREAM_PACKET_RELEASED:
-	{
-		struct avbox_av_frame * const frame = data;
-		av_frame_unref(frame->avframe);
-		release_av_frame(inst, frame);
-		break;
-	}
 	default:
 		ABORT("Unexepected audio message");
 	}
 }
 
 
+/**
+ * Asks the stream provider to fetch the data at a seek
+ * target. The byte offsets come from the container index
+ * so the audio and video streams may be far apart.
+ */
+static void
+avbox_player_prefetchts(struct avbox_player * const inst, const int64_t ts)
+{
+	int i;
+	const int streams[] = { inst->video_stream_index, inst->audio_stream_index };
+
+	for (i = 0; i < 2; i++) {
+		int idx;
+		AVStream *st;
+		if (streams[i] == -1) {
+			continue;
+		}
+		st = inst->fmt_ctx->streams[streams[i]];
+		if (st->nb_index_entries == 0) {
+			continue;
+		}
+		if ((idx = av_index_search_timestamp(st,
+			av_rescale_q(ts, AV_TIME_BASE_Q, st->time_base),
+			AVSEEK_FLAG_BACKWARD)) < 0) {
+			idx = 0;
+		}
+		DEBUG_VPRINT(LOG_MODULE, "Prefetching stream %i at %" PRIi64,
+			streams[i], st->index_entries[idx].pos);
+		inst->stream.prefetch(inst->stream.self,
+			st->index_entries[idx].pos, AVBOX_SEEK_PREFETCH);
+	}
+}
+
+
 /**
  * This is the main decoding loop. It reads the stream and feeds
  * encoded frames to the decoder threads.
@@ -1703,6 +2276,8 @@ avbox_player_stream_parse(void *arg)
 
 	inst->audio_decoder_flushed = 1;
 	inst->video_decoder_flushed = 1;
+	inst->audio_passthrough = 0;
+	inst->audio_passthrough_failed = 0;
 	inst->underrun = 0;
 	inst->getmastertime = avbox_player_getsystemtime;
 	inst->paused = 0;
@@ -1767,12 +2342,13 @@ avbox_player_stream_parse(void *arg)
 
 	/* create audio stream */
 	if ((inst->audio_stream = avbox_audiostream_new(
-		AVBOX_BUFFER_AUDIO,
+		decode_cache_size,
 		avbox_player_audiostream_callback, inst)) == NULL) {
 		goto decoder_exit;
 	}
 
-	if ((inst->audio_packets_q = avbox_queue_new(MB_AUDIO_BUFFER_PACKETS)) == NULL) {
+	if ((inst->audio_packets_q = avbox_queue_new(MB_AUDIO_BUFFER_PACKETS,
+		AVBOX_QUEUEFLAGS_SPSC)) == NULL) {
 		LOG_VPRINT_ERROR("Could not create audio packets queue: %s!",
 			strerror(errno));
 		goto decoder_exit;
@@ -1786,6 +2362,19 @@ avbox_player_stream_parse(void *arg)
 		DEBUG_VPRINT("player", "Audio stream found %i", inst->audio_stream_index);
 		inst->getmastertime = avbox_player_getaudiotime; /* video is slave to audio */
 
+		/* if the receiver can decode the stream configure
+		 * the audio stream for passthrough */
+		if ((inst->audio_passthrough = avbox_player_passthrough_rate(
+			inst->fmt_ctx->streams[inst->audio_stream_index]->codecpar)) != 0) {
+			if (avbox_audiostream_setformat(inst->audio_stream,
+				inst->audio_passthrough, AVBOX_AUDIOSTREAM_PASSTHROUGH) == -1) {
+				LOG_VPRINT_ERROR("Could not configure audio passthrough: %s",
+					strerror(errno));
+				inst->audio_passthrough_failed = inst->audio_passthrough;
+				inst->audio_passthrough = 0;
+			}
+		}
+
 	} else {
 		if (inst->audio_stream_index == AVERROR_DECODER_NOT_FOUND) {
 			LOG_PRINT_ERROR("Could not find decoder for audio stream!");
@@ -1801,14 +2390,16 @@ avbox_player_stream_parse(void *arg)
 		}
 
 		/* create a video packets queue */
-		if ((inst->video_packets_q = avbox_queue_new(MB_VIDEO_BUFFER_PACKETS)) == NULL) {
+		if ((inst->video_packets_q = avbox_queue_new(MB_VIDEO_BUFFER_PACKETS,
+			AVBOX_QUEUEFLAGS_SPSC)) == NULL) {
 			LOG_VPRINT_ERROR("Could not create video packets queue: %s!",
 				strerror(errno));
 			goto decoder_exit;
 		}
 
 		/* create a decoded frames queue */
-		if ((inst->video_frames_q = avbox_queue_new(AVBOX_BUFFER_VIDEO)) == NULL) {
+		if ((inst->video_frames_q = avbox_queue_new(AVBOX_BUFFER_VIDEO,
+			AVBOX_QUEUEFLAGS_SPSC)) == NULL) {
 			LOG_VPRINT_ERROR("Could not create frames queue: %s!",
 				strerror(errno));
 			goto decoder_exit;
@@ -1833,6 +2424,17 @@ avbox_player_stream_parse(void *arg)
 		goto decoder_exit;
 	}
 
+	/* chapter marks are likely seek targets so ask the
+	 * stream to get them ready */
+	if (inst->stream.self != NULL && inst->stream.prefetch != NULL) {
+		unsigned int i;
+		for (i = 0; i < MIN(inst->fmt_ctx->nb_chapters, AVBOX_PREFETCH_CHAPTERS); i++) {
+			const AVChapter * const ch = inst->fmt_ctx->chapters[i];
+			avbox_player_prefetchts(inst, av_rescale_q(ch->start,
+				ch->time_base, AV_TIME_BASE_Q));
+		}
+	}
+
 	/* enable checkpoint */
 	avbox_checkpoint_enable(&inst->stream_parser_checkpoint);
 	avbox_checkpoint_halt(&inst->stream_parser_checkpoint);
@@ -2312,6 +2914,18 @@ struct avbox_player_openstream_args
 };
 
 
+/**
+ * Checks if an URL points to a .torrent file.
+ */
+static int
+avbox_player_istorrent(const char * const path)
+{
+	const char * const query = strchr(path, '?');
+	const size_t len = (query != NULL) ? (size_t) (query - path) : strlen(path);
+	return len >= 8 && !strncasecmp(path + len - 8, ".torrent", 8);
+}
+
+
 static void*
 avbox_player_openstream(void *arg)
 {
@@ -2336,7 +2950,7 @@ avbox_player_openstream(void *arg)
 #endif
 
 	else if (!strncmp("magnet:", osa->path, 7) ||
-		(!strncmp("http", osa->path, 4))) {
+		(!strncmp("http", osa->path, 4) && avbox_player_istorrent(osa->path))) {
 		if (avbox_torrentin_open(osa->path, osa->inst, &osa->inst->stream) == NULL) {
 			LOG_VPRINT_ERROR("Could not open torrent stream: %s",
 				strerror(errno));
@@ -2345,6 +2959,19 @@ avbox_player_openstream(void *arg)
 		}
 	}
 
+	/* other network streams and (optionally) local files
+	 * go through the read-ahead cache */
+	else if (!strncmp("http://", osa->path, 7) || !strncmp("https://", osa->path, 8) ||
+		(strstr(osa->path, "://") == NULL &&
+		avbox_settings_getint("stream_cache_files", 0))) {
+		if (avbox_streamcache_open(osa->path, osa->inst, &osa->inst->stream) == NULL) {
+			LOG_VPRINT_ERROR("Could not open cached stream: %s",
+				strerror(errno));
+			ASSERT(osa->inst->stream.self == NULL);
+			return (void*) -1;
+		}
+	}
+
 	return (void*) 0;
 }
 
@@ -2456,6 +3083,62 @@ avbox_player_clear_still_frame(struct avbox_player * const inst)
 }
 
 
+/**
+ * Reopens the audio stream if the current audio track needs
+ * a different output format (ie. the user switched between an
+ * AC-3 track that is passed through and an AAC track that
+ * must be decoded). Must be called with the pipeline halted
+ * and the audio stream empty.
+ */
+static int
+avbox_player_audio_reconfigure(struct avbox_player * const inst)
+{
+	unsigned int rate;
+	struct avbox_audiostream *stream;
+
+	if (!avbox_player_audio_mustreconfigure(inst)) {
+		return 0;
+	}
+
+	rate = avbox_player_passthrough_rate(
+		inst->fmt_ctx->streams[inst->audio_stream_index]->codecpar);
+
+	DEBUG_VPRINT(LOG_MODULE, "Reopening audio stream (passthrough=%u)", rate);
+
+	if ((stream = avbox_audiostream_new(decode_cache_size,
+		avbox_player_audiostream_callback, inst)) == NULL) {
+		LOG_VPRINT_ERROR("Could not create audio stream: %s",
+			strerror(errno));
+		return -1;
+	}
+	if (rate != 0 && avbox_audiostream_setformat(stream,
+		rate, AVBOX_AUDIOSTREAM_PASSTHROUGH) == -1) {
+		LOG_VPRINT_ERROR("Could not configure audio passthrough: %s",
+			strerror(errno));
+		inst->audio_passthrough_failed = rate;
+		rate = 0;
+	}
+
+	/* the old stream must be closed first since the
+	 * digital output can only be opened once */
+	avbox_audiostream_destroy(inst->audio_stream);
+	inst->audio_stream = stream;
+	inst->audio_passthrough = rate;
+
+	if (inst->play_state >= AVBOX_PLAYER_PLAYSTATE_AUDIOOUT) {
+		if (avbox_audiostream_start(inst->audio_stream) == -1) {
+			LOG_PRINT_ERROR("Could not start audio stream");
+		}
+	}
+
+	/* avbox_player_continue() expects it paused */
+	if (inst->play_state >= AVBOX_PLAYER_PLAYSTATE_AUDIODEC) {
+		avbox_audiostream_pause(inst->audio_stream);
+	}
+	return 0;
+}
+
+
 static void
 avbox_player_drop(struct avbox_player * const inst)
 {
@@ -2531,6 +3214,13 @@ avbox_player_drop(struct avbox_player * const inst)
 		ASSERT(inst->audio_decoder_flushed);
 	}
 
+	/* the audio track may have changed. If we cannot
+	 * reopen the audio stream we cannot go on */
+	if (avbox_player_audio_reconfigure(inst) == -1) {
+		avbox_player_throwexception(inst, "Could not reopen audio stream");
+		avbox_player_sendctl(inst, AVBOX_PLAYERCTL_THREADEXIT, NULL);
+	}
+
 	DEBUG_VPRINT("player", "Audio time: %li",
 		(inst->audio_stream == NULL) ? -1 : avbox_audiostream_gettime(inst->audio_stream));
 
@@ -2588,7 +3278,7 @@ avbox_player_isunderrun(struct avbox_player * const inst)
 		if (!underrun) {
 			if (inst->underrun) {
 				if (inst->audio_stream_index != -1) {
-					if (avbox_audiostream_size(inst->audio_stream) < AVBOX_BUFFER_AUDIO) {
+					if (avbox_audiostream_size(inst->audio_stream) < AVBOX_BUFFER_AUDIO(inst->audio_stream)) {
 						underrun = 1;
 					}
 					if (inst->video_stream_index != -1) {
@@ -2855,6 +3545,13 @@ avbox_player_doseek(struct avbox_player * const inst,
 			}
 		} while (!avbox_checkpoint_wait(&inst->stream_parser_checkpoint, 10L * 1000L));
 
+		/* now that the parser is halted it's safe to look at the
+		 * index. Get the target fetched before av_seek_frame() and
+		 * the demuxer start reading */
+		if (inst->stream.self != NULL && inst->stream.prefetch != NULL) {
+			avbox_player_prefetchts(inst, seek_to);
+		}
+
 		DEBUG_VPRINT("player", "Seeking %s from %" PRIi64 " to %" PRIi64 "...",
 			(flags & AVSEEK_FLAG_BACKWARD) ? "BACKWARD" : "FORWARD",
 			seek_from, seek_to);
@@ -3116,16 +3813,24 @@ avbox_player_control(void * context, struct avbox_message * msg)
 			} else {
 				ASSERT(inst->video_decoder_worker == NULL);
 				ASSERT(inst->video_decoder_thread != NULL);
-#ifdef ENABLE_MMAL
-				if (AV_CODEC_ID_H264 ==
-					inst->fmt_ctx->streams[inst->video_stream_index]->codecpar->codec_id) {
+
+				/* pick a decoder backend for the stream. Backends that
+				 * have their own decoding loop are run directly, the
+				 * rest are driven by avbox_player_video_decode() */
+				const AVCodecParameters * const par =
+					inst->fmt_ctx->streams[inst->video_stream_index]->codecpar;
+				for (inst->video_decoder = avbox_videodec_next(par, NULL);
+					inst->video_decoder != NULL &&
+					inst->video_decoder->decode != NULL;
+					inst->video_decoder = avbox_videodec_next(par, inst->video_decoder)) {
 					if ((inst->video_decoder_worker = avbox_thread_delegate(
-						inst->video_decoder_thread, avbox_mmal_decode, inst)) == NULL) {
-						LOG_VPRINT_ERROR("Could not start MMAL video decoder: %s",
-							strerror(errno));
+						inst->video_decoder_thread, inst->video_decoder->decode, inst)) != NULL) {
+						break;
 					}
+					LOG_VPRINT_ERROR("Could not start %s video decoder: %s",
+						inst->video_decoder->name, strerror(errno));
 				}
-#endif
+
 				if (inst->video_decoder_worker == NULL) {
 					if ((inst->video_decoder_worker = avbox_thread_delegate(
 						inst->video_decoder_thread, avbox_player_video_decode, inst)) == NULL) {
@@ -3443,6 +4148,44 @@ avbox_player_control(void * context, struct avbox_message * msg)
 
 			break;
 		}
+		case AVBOX_PLAYERCTL_AUDIO_RECONFIGURE:
+		{
+			DEBUG_PRINT(LOG_MODULE, "AVBOX_PLAYERCTL_AUDIO_RECONFIGURE");
+
+			if (inst->play_state != AVBOX_PLAYER_PLAYSTATE_PLAYING ||
+				inst->stopping || inst->stream_exiting) {
+				break;
+			}
+
+			/* make sure the format actually changed or we could
+			 * end up here again after the flush */
+			if (!avbox_player_audio_mustreconfigure(inst)) {
+				break;
+			}
+
+			if (inst->status == MB_PLAYER_STATUS_PAUSED) {
+				avbox_player_doresume(inst);
+			}
+
+			/* the pipeline must be flushed to reopen the audio
+			 * stream (see avbox_player_drop()). If we can we seek
+			 * to where we are so the video restarts on a keyframe */
+			if (!inst->underrun && (inst->stream.self == NULL || inst->stream.seek == NULL)) {
+				avbox_player_doseek(inst, AVBOX_PLAYER_SEEK_ABSOLUTE,
+					inst->getmastertime(inst));
+			} else {
+				avbox_player_drop(inst);
+				if (!inst->underrun) {
+					inst->underrun = 1;
+					avbox_player_dopause(inst);
+					avbox_player_handle_underrun(inst);
+				} else {
+					/* keep it paused until the underrun is over */
+					avbox_audiostream_pause(inst->audio_stream);
+				}
+			}
+			break;
+		}
 		case AVBOX_PLAYERCTL_BUFFER_UNDERRUN:
 		{
 			if (inst->underrun) {
@@ -3772,6 +4515,19 @@ avbox_player_bufferstate(struct avbox_player *inst)
 }
 
 
+/**
+ * Get the A/V sync statistics.
+ */
+void
+avbox_player_getsyncstats(struct avbox_player * const inst,
+	struct avbox_avsync_stats * const stats)
+{
+	ASSERT(inst != NULL);
+	ASSERT(stats != NULL);
+	avbox_avsync_getstats(&inst->avsync, stats);
+}
+
+
 char *
 avbox_player_getmediafile(struct avbox_player *inst)
 {
@@ -4043,6 +4799,7 @@ avbox_player_handler(void * const context, struct avbox_message * const msg)
 			free(msg);
 		});
 
+		avbox_avsync_destroy(&inst->avsync);
 		free(inst);
 		break;
 	}
@@ -4205,6 +4962,7 @@ avbox_player_new(struct avbox_window *window)
 	}
 	pthread_mutexattr_destroy(&prio_inherit);
 
+	avbox_avsync_init(&inst->avsync);
 	prime_pools(inst);
 
 	/* initialize checkpoints */
@@ -30,6 +30,7 @@ struct avbox_progressview
 {
 	struct avbox_window *window;
 	int value;
+	int painted_value;
 	int min;
 	int max;
 };
@@ -71,6 +72,7 @@ avbox_progressview_paint(struct avbox_window *window, void *ctx)
 	avbox_window_getcanvassize(inst->window, &w, &h);
 
 	bar_width = (w * inst->value) / inst->max;
+	inst->painted_value = inst->value;
 
 	avbox_window_setbgcolor(inst->window, MBV_DEFAULT_BACKGROUND);
 	avbox_window_setcolor(inst->window, MBV_DEFAULT_FOREGROUND);
@@ -84,6 +86,17 @@ avbox_progressview_paint(struct avbox_window *window, void *ctx)
 int
 avbox_progressview_update(struct avbox_progressview *inst)
 {
+	int w, h, x1, x2;
+
+	/* only the part of the bar between the old and
+	 * new values needs to go to the screen */
+	avbox_window_getcanvassize(inst->window, &w, &h);
+	x1 = (w * MIN(inst->value, inst->painted_value)) / inst->max;
+	x2 = (w * MAX(inst->value, inst->painted_value)) / inst->max;
+	if (x1 == x2) {
+		return 0;
+	}
+	avbox_window_damagerect(inst->window, x1, 0, x2 - x1, h);
 	avbox_window_update(inst->window);
 	return 0;
 }
@@ -129,6 +142,7 @@ avbox_progressview_new(struct avbox_window *parent,
 	inst->min = min;
 	inst->max = max;
 	inst->value = value;
+	inst->painted_value = -1;
 	return inst;
 }
 
@@ -50,6 +50,13 @@ IDirectFB *dfb = NULL; /* global so input-directfb.c can see it */
 static IDirectFBDisplayLayer *layer = NULL;
 static struct mbv_surface *root = NULL;
 
+/* scratch buffer for converting 10 bit frames. It's
+ * reused across frames and protected by scratch_lock */
+static pthread_mutex_t scratch_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct avbox_video_scaler scratch_scaler;
+static uint8_t *scratch = NULL;
+static size_t scratch_sz = 0;
+
 #define ALIGNED(addr, bytes) \
     (((uintptr_t)(const void *)(addr)) % (bytes) == 0)
 
@@ -157,6 +164,7 @@ surface_blitbuf(
 {
 	DFBSurfaceDescription dsc;
 	static IDirectFBSurface *surface = NULL;
+	int scratch_locked = 0;
 
 	assert(inst != NULL);
 	assert(inst->surface != NULL);
@@ -187,6 +195,43 @@ surface_blitbuf(
 		dsc.preallocated[1].pitch = pitch[1];
 		dsc.preallocated[2].pitch = pitch[2];
 		break;
+	case AVBOX_PIXFMT_NV12:
+		dsc.pixelformat = DSPF_NV12;
+		dsc.preallocated[0].data = buf[0];
+		dsc.preallocated[1].data = buf[1];
+		dsc.preallocated[0].pitch = pitch[0];
+		dsc.preallocated[1].pitch = pitch[1];
+		break;
+	case AVBOX_PIXFMT_P010:
+	case AVBOX_PIXFMT_YUV420P10:
+	{
+		/* DirectFB has no 10 bit formats so convert
+		 * these to RGB32 ourselves */
+		const size_t sz = width * height * 4;
+
+		pthread_mutex_lock(&scratch_lock);
+		if (sz > scratch_sz) {
+			uint8_t * const tmp = realloc(scratch, sz);
+			if (tmp == NULL) {
+				pthread_mutex_unlock(&scratch_lock);
+				return -1;
+			}
+			scratch = tmp;
+			scratch_sz = sz;
+		}
+		if (avbox_video_simd_yuv2bgra(&scratch_scaler, scratch, width * 4, pix_fmt,
+			(const uint8_t * const *) buf, pitch, width, height) == -1) {
+			pthread_mutex_unlock(&scratch_lock);
+			return -1;
+		}
+		scratch_locked = 1;
+		dsc.pixelformat = DSPF_RGB32;
+		dsc.preallocated[0].data = scratch;
+		dsc.preallocated[0].pitch = width * 4;
+		dsc.preallocated[1].data = NULL;
+		dsc.preallocated[1].pitch = 0;
+		break;
+	}
 	default: abort();
 	}
 
@@ -196,6 +241,9 @@ surface_blitbuf(
 	DFBCHECK(inst->surface->Blit(inst->surface, surface, NULL, x, y));
 	pthread_mutex_unlock(&inst->lock);
 	surface->Release(surface);
+	if (scratch_locked) {
+		pthread_mutex_unlock(&scratch_lock);
+	}
 	return 0;
 }
 
@@ -419,6 +467,7 @@ init(struct mbv_drv_funcs * const driver,
 	int argc, char **argv, int * const w, int * const h)
 {
 	(void) driver;
+	avbox_video_scaler_init(&scratch_scaler);
 	DFBCHECK(DirectFBInit(&argc, &argv));
 	DFBCHECK(DirectFBCreate(&dfb));
 	DFBCHECK(dfb->SetCooperativeLevel(dfb, DFSCL_NORMAL));
@@ -474,6 +523,13 @@ __shutdown(void)
 	surface_destroy(root);
 	layer->Release(layer);
 	dfb->Release(dfb);
+
+	avbox_video_scaler_free(&scratch_scaler);
+	if (scratch != NULL) {
+		free(scratch);
+		scratch = NULL;
+		scratch_sz = 0;
+	}
 }
 
 
@@ -487,7 +543,9 @@ mbv_dfb_initft(struct mbv_drv_funcs * const funcs)
 	funcs->surface_blitbuf = &surface_blitbuf;
 	funcs->surface_blit = &surface_blit;
 	funcs->surface_scaleblit = NULL;
+	funcs->surface_scaleblitbuf = NULL;
 	funcs->surface_update = &surface_update;
+	funcs->surface_updaterect = NULL;
 	funcs->surface_doublebuffered = &surface_doublebuffered;
 	funcs->surface_destroy = &surface_destroy;
 	funcs->shutdown = &__shutdown;
@@ -29,14 +29,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <inttypes.h>
 #include <assert.h>
 #include <limits.h>
 #include <sys/mman.h>
 #include <time.h>
 #include <unistd.h>
+#include <poll.h>
 #include <pthread.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
+#include <drm_fourcc.h>
 
 #define LOG_MODULE "video-drm"
 
@@ -51,10 +54,48 @@ struct avbox_drm_surface
 	uint32_t dbo;
 	uint32_t fbo;
 	int pitch;
+	size_t size;
 	uint8_t *pixels;
 };
 
 
+/**
+ * Plane properties set by the overlay's atomic commits
+ */
+#define AVBOX_DRM_PROP_FB_ID	(0)
+#define AVBOX_DRM_PROP_CRTC_ID	(1)
+#define AVBOX_DRM_PROP_SRC_X	(2)
+#define AVBOX_DRM_PROP_SRC_Y	(3)
+#define AVBOX_DRM_PROP_SRC_W	(4)
+#define AVBOX_DRM_PROP_SRC_H	(5)
+#define AVBOX_DRM_PROP_CRTC_X	(6)
+#define AVBOX_DRM_PROP_CRTC_Y	(7)
+#define AVBOX_DRM_PROP_CRTC_W	(8)
+#define AVBOX_DRM_PROP_CRTC_H	(9)
+#define AVBOX_DRM_PROP_COUNT	(10)
+
+
+/**
+ * Overlay plane used to show video frames without
+ * converting or scaling them. If the driver supports atomic
+ * modesetting the plane is updated with non-blocking commits
+ * that complete on the page flip thread.
+ */
+struct avbox_drm_overlay
+{
+	uint32_t plane;
+	uint32_t format;
+	int w;
+	int h;
+	int index;
+	int visible;
+	int atomic;
+	int pending;
+	uint32_t props[AVBOX_DRM_PROP_COUNT];
+	struct avbox_drm_surface *buffers[3];
+};
+
+
 LISTABLE_STRUCT(mbv_drm_dev,
 	int fd;
 	uint32_t conn;
@@ -65,12 +106,25 @@ LISTABLE_STRUCT(mbv_drm_dev,
 	drmModeCrtc *saved_crtc;
 	struct avbox_drm_surface *front;
 	struct avbox_drm_surface *back;
+	struct avbox_drm_surface *spare;
+	struct avbox_drm_surface *pending;
+	struct timespec vblank_time;
+	unsigned int vblank_seq;
 );
 
 
 static LIST devices;
 static struct mbv_drm_dev *default_dev = NULL;
 
+/* page flipping for the dumb buffers path */
+static pthread_mutex_t flip_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flip_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t flip_thread;
+static int flip_thread_running = 0;
+static int flip_thread_quit = 0;
+
+static struct avbox_drm_overlay overlay;
+
 
 #ifdef ENABLE_OPENGL
 static struct gbm_device *gbm_dev;
@@ -88,22 +142,26 @@ static fd_set flip_fds;
 static void
 avbox_drm_free_framebuffer(struct mbv_drm_dev *dev)
 {
+	int i;
 	struct drm_mode_destroy_dumb dreq;
+	struct avbox_drm_surface * const surfaces[] =
+		{ dev->front, dev->back, dev->spare, dev->pending };
 
-	/* delete framebuffers */
-	drmModeRmFB(dev->fd, dev->front->fbo);
-	drmModeRmFB(dev->fd, dev->back->fbo);
+	for (i = 0; i < sizeof(surfaces) / sizeof(surfaces[0]); i++) {
+		if (surfaces[i] == NULL) {
+			continue;
+		}
 
-	/* delete dumb buffers */
-	memset(&dreq, 0, sizeof(dreq));
-	dreq.handle = dev->front->dbo;
-	drmIoctl(default_dev->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &dreq);
-	memset(&dreq, 0, sizeof(dreq));
-	dreq.handle = dev->back->dbo;
-	drmIoctl(default_dev->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &dreq);
+		/* delete framebuffer */
+		drmModeRmFB(dev->fd, surfaces[i]->fbo);
+
+		/* delete dumb buffer */
+		memset(&dreq, 0, sizeof(dreq));
+		dreq.handle = surfaces[i]->dbo;
+		drmIoctl(dev->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &dreq);
 
-	free(dev->front);
-	free(dev->back);
+		free(surfaces[i]);
+	}
 }
 
 
@@ -142,6 +200,7 @@ avbox_drm_create_framebuffer(struct mbv_drm_dev * const dev,
 	ASSERT(creq.pitch <= INT_MAX);
 	(*surface)->dbo = creq.handle;
 	(*surface)->pitch = creq.pitch;
+	(*surface)->size = creq.size;
 	sz = creq.size;
 
 	DEBUG_VPRINT("video-drm", "Dumb buffer handle: 0x%x", (*surface)->dbo);
@@ -406,30 +465,711 @@ mbv_drm_prepare(int fd, int mode_index)
 }
 
 
+/**
+ * Called by libdrm when a page flip completes. The buffer
+ * that was on the screen becomes the spare one.
+ */
 static void
-avbox_drm_wait_for_vsync(void)
+avbox_drm_flip_complete(int fd, unsigned int frame,
+	unsigned int sec, unsigned int usec, void *data)
 {
-	drmVBlank vb;
-	vb.request.type = DRM_VBLANK_RELATIVE;
-	vb.request.sequence = 1;
-	vb.request.signal = 0;
-	drmWaitVBlank(default_dev->fd, &vb);
+	struct mbv_drm_dev * const dev = data;
+
+	(void) fd;
+
+	pthread_mutex_lock(&flip_lock);
+
+	/* an overlay commit completed */
+	if (data == &overlay) {
+		ASSERT(overlay.pending);
+		overlay.pending = 0;
+		pthread_cond_signal(&flip_cond);
+		pthread_mutex_unlock(&flip_lock);
+		return;
+	}
+
+	ASSERT(dev->pending != NULL);
+	ASSERT(dev->spare == NULL);
+	dev->spare = dev->front;
+	dev->front = dev->pending;
+	dev->pending = NULL;
+	dev->vblank_time.tv_sec = sec;
+	dev->vblank_time.tv_nsec = usec * 1000;
+	dev->vblank_seq = frame;
+	pthread_cond_signal(&flip_cond);
+	pthread_mutex_unlock(&flip_lock);
 }
 
 
-static inline void
-avbox_drm_swap_buffers(void)
+/**
+ * Handles page flip events so that the thread that
+ * renders never has to wait for them.
+ */
+static void *
+avbox_drm_flip_thread(void *arg)
 {
-	struct avbox_drm_surface * const tmp = default_dev->front;
-	default_dev->front = default_dev->back;
-	default_dev->back = tmp;
+	struct pollfd fds;
+	drmEventContext evctx;
 
-	/* swap the front buffer in */
-	if (drmModeSetCrtc(default_dev->fd, default_dev->crtc,
-		default_dev->front->fbo, 0, 0, &default_dev->conn, 1, &default_dev->mode)) {
-		LOG_PRINT_ERROR("Could not swap buffers");
+	(void) arg;
+
+	DEBUG_PRINT(LOG_MODULE, "Starting page flip thread");
+
+	memset(&evctx, 0, sizeof(evctx));
+	evctx.version = 2;
+	evctx.page_flip_handler = avbox_drm_flip_complete;
+	fds.fd = default_dev->fd;
+	fds.events = POLLIN;
+
+	while (!flip_thread_quit) {
+		if (poll(&fds, 1, 250) > 0) {
+			drmHandleEvent(default_dev->fd, &evctx);
+		}
+	}
+
+	DEBUG_PRINT(LOG_MODULE, "Exiting page flip thread");
+	return NULL;
+}
+
+
+/**
+ * Queue the back buffer to be flipped in on the next
+ * vertical blank and return the next buffer to render to.
+ * We have three buffers so we only block if the last flip
+ * is still pending, which means we're rendering faster than
+ * the display refresh rate.
+ */
+static void
+avbox_drm_swap_buffers(uint8_t ** const front, uint8_t ** const back)
+{
+	struct mbv_drm_dev * const dev = default_dev;
+
+	pthread_mutex_lock(&flip_lock);
+
+	/* the CRTC takes one commit at a time so wait
+	 * for pending overlay commits too */
+	while (dev->pending != NULL || overlay.pending) {
+		pthread_cond_wait(&flip_cond, &flip_lock);
 	}
-	DEBUG_PRINT(LOG_MODULE, "Swapped buffers");
+
+	ASSERT(dev->spare != NULL);
+
+	if (flip_thread_running && drmModePageFlip(dev->fd, dev->crtc,
+		dev->back->fbo, DRM_MODE_PAGE_FLIP_EVENT, dev) == 0) {
+		dev->pending = dev->back;
+		dev->back = dev->spare;
+		dev->spare = NULL;
+		*front = dev->pending->pixels;
+	} else {
+		struct avbox_drm_surface * const tmp = dev->front;
+
+		/* if we cannot queue a flip fallback to
+		 * a blocking modeset */
+		if (drmModeSetCrtc(dev->fd, dev->crtc,
+			dev->back->fbo, 0, 0, &dev->conn, 1, &dev->mode)) {
+			LOG_PRINT_ERROR("Could not swap buffers");
+		}
+		dev->front = dev->back;
+		dev->back = dev->spare;
+		dev->spare = tmp;
+		*front = dev->front->pixels;
+	}
+	*back = dev->back->pixels;
+
+	pthread_mutex_unlock(&flip_lock);
+}
+
+
+/**
+ * Gets the time of the last completed page flip.
+ */
+static int
+avbox_drm_getvblank(struct timespec * const time, unsigned int * const seq)
+{
+	int ret = 0;
+	pthread_mutex_lock(&flip_lock);
+	if (default_dev->vblank_time.tv_sec == 0 &&
+		default_dev->vblank_time.tv_nsec == 0) {
+		errno = EAGAIN;
+		ret = -1;
+	} else {
+		if (time != NULL) {
+			*time = default_dev->vblank_time;
+		}
+		if (seq != NULL) {
+			*seq = default_dev->vblank_seq;
+		}
+	}
+	pthread_mutex_unlock(&flip_lock);
+	return ret;
+}
+
+
+/**
+ * Destroy an overlay buffer.
+ */
+static void
+avbox_drm_overlay_freebuffer(struct mbv_drm_dev * const dev,
+	struct avbox_drm_surface * const buf)
+{
+	struct drm_mode_destroy_dumb dreq;
+	drmModeRmFB(dev->fd, buf->fbo);
+	munmap(buf->pixels, buf->size);
+	memset(&dreq, 0, sizeof(dreq));
+	dreq.handle = buf->dbo;
+	drmIoctl(dev->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &dreq);
+	free(buf);
+}
+
+
+/**
+ * Create a planar YUV dumb buffer for the overlay. The
+ * chroma planes follow the luma plane on the same buffer.
+ */
+static struct avbox_drm_surface *
+avbox_drm_overlay_newbuffer(struct mbv_drm_dev * const dev,
+	const int w, const int h)
+{
+	struct drm_mode_create_dumb creq;
+	struct drm_mode_map_dumb mreq;
+	struct drm_mode_destroy_dumb dreq;
+	struct avbox_drm_surface *buf;
+	uint32_t handles[4] = { 0 }, pitches[4] = { 0 }, offsets[4] = { 0 };
+	const int aligned_h = (h + 1) & ~1;
+
+	if ((buf = malloc(sizeof(struct avbox_drm_surface))) == NULL) {
+		ASSERT(errno == ENOMEM);
+		return NULL;
+	}
+
+	/* allocate enough 8bpp lines for all planes */
+	memset(&creq, 0, sizeof(creq));
+	creq.width = (w + 1) & ~1;
+	creq.height = aligned_h + (aligned_h >> 1);
+	creq.bpp = 8;
+	if (drmIoctl(dev->fd, DRM_IOCTL_MODE_CREATE_DUMB, &creq) < 0) {
+		LOG_VPRINT_ERROR("Cannot create overlay buffer: %s",
+			strerror(errno));
+		free(buf);
+		return NULL;
+	}
+
+	buf->dbo = creq.handle;
+	buf->pitch = creq.pitch;
+	buf->size = creq.size;
+
+	handles[0] = handles[1] = buf->dbo;
+	pitches[0] = buf->pitch;
+	offsets[1] = buf->pitch * aligned_h;
+	if (overlay.format == DRM_FORMAT_NV12) {
+		pitches[1] = buf->pitch;
+	} else {
+		ASSERT(overlay.format == DRM_FORMAT_YUV420);
+		handles[2] = buf->dbo;
+		pitches[1] = pitches[2] = buf->pitch >> 1;
+		offsets[2] = offsets[1] + (pitches[1] * (aligned_h >> 1));
+	}
+
+	if (drmModeAddFB2(dev->fd, w, h, overlay.format,
+		handles, pitches, offsets, &buf->fbo, 0) != 0) {
+		LOG_VPRINT_ERROR("Cannot create overlay framebuffer: %s",
+			strerror(errno));
+		goto err_destroy;
+	}
+
+	memset(&mreq, 0, sizeof(mreq));
+	mreq.handle = buf->dbo;
+	if (drmIoctl(dev->fd, DRM_IOCTL_MODE_MAP_DUMB, &mreq)) {
+		LOG_VPRINT_ERROR("Cannot map overlay buffer: %s",
+			strerror(errno));
+		goto err_fb;
+	}
+	buf->pixels = mmap(0, buf->size, PROT_READ | PROT_WRITE,
+		MAP_SHARED, dev->fd, mreq.offset);
+	if (buf->pixels == MAP_FAILED) {
+		LOG_VPRINT_ERROR("Cannot mmap overlay buffer: %s",
+			strerror(errno));
+		goto err_fb;
+	}
+
+	return buf;
+
+err_fb:
+	drmModeRmFB(dev->fd, buf->fbo);
+err_destroy:
+	memset(&dreq, 0, sizeof(dreq));
+	dreq.handle = buf->dbo;
+	drmIoctl(dev->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &dreq);
+	free(buf);
+	return NULL;
+}
+
+
+/**
+ * Free all overlay buffers.
+ */
+static void
+avbox_drm_overlay_freebuffers(struct mbv_drm_dev * const dev)
+{
+	int i;
+	for (i = 0; i < 3; i++) {
+		if (overlay.buffers[i] != NULL) {
+			avbox_drm_overlay_freebuffer(dev, overlay.buffers[i]);
+			overlay.buffers[i] = NULL;
+		}
+	}
+	overlay.w = overlay.h = 0;
+}
+
+
+/**
+ * Hide the overlay plane.
+ */
+static void
+avbox_drm_overlay_hide(void)
+{
+	if (overlay.visible) {
+		/* don't let the pending commit show
+		 * a buffer after we free it */
+		pthread_mutex_lock(&flip_lock);
+		while (overlay.pending) {
+			pthread_cond_wait(&flip_cond, &flip_lock);
+		}
+		pthread_mutex_unlock(&flip_lock);
+
+		drmModeSetPlane(default_dev->fd, overlay.plane, default_dev->crtc,
+			0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+		overlay.visible = 0;
+	}
+}
+
+
+/**
+ * Copy a frame's chroma into an NV12 overlay buffer.
+ */
+static void
+avbox_drm_overlay_copynv12(uint8_t *dst, const int dst_pitch,
+	const unsigned int pix_fmt, void ** const buf, const int * const pitch,
+	const int chroma_w, const int chroma_h)
+{
+	int i, j;
+
+	switch (pix_fmt) {
+	case AVBOX_PIXFMT_YUV420P:
+		for (i = 0; i < chroma_h; i++, dst += dst_pitch) {
+			const uint8_t * const u = ((uint8_t*) buf[1]) + (i * pitch[1]);
+			const uint8_t * const v = ((uint8_t*) buf[2]) + (i * pitch[2]);
+			for (j = 0; j < chroma_w; j++) {
+				dst[(j << 1) + 0] = u[j];
+				dst[(j << 1) + 1] = v[j];
+			}
+		}
+		break;
+	case AVBOX_PIXFMT_NV12:
+		for (i = 0; i < chroma_h; i++, dst += dst_pitch) {
+			memcpy(dst, ((uint8_t*) buf[1]) + (i * pitch[1]), chroma_w << 1);
+		}
+		break;
+	case AVBOX_PIXFMT_P010:
+		avbox_video_simd_shift16(dst, dst_pitch, buf[1], pitch[1],
+			chroma_w << 1, chroma_h, 8);
+		break;
+	case AVBOX_PIXFMT_YUV420P10:
+		avbox_video_simd_mergeuv16(dst, dst_pitch, buf[1], pitch[1],
+			buf[2], pitch[2], chroma_w, chroma_h, 2);
+		break;
+	}
+}
+
+
+/**
+ * Copy a frame's chroma into a YUV420 overlay buffer.
+ */
+static void
+avbox_drm_overlay_copyyuv420(uint8_t *dst, const int dst_pitch,
+	const unsigned int pix_fmt, void ** const buf, const int * const pitch,
+	const int chroma_w, const int chroma_h)
+{
+	int i, j;
+	uint8_t * const dst_v = dst + (dst_pitch * chroma_h);
+
+	switch (pix_fmt) {
+	case AVBOX_PIXFMT_YUV420P:
+		for (j = 1; j < 3; j++) {
+			const uint8_t *src = buf[j];
+			for (i = 0; i < chroma_h; i++, dst += dst_pitch, src += pitch[j]) {
+				memcpy(dst, src, chroma_w);
+			}
+		}
+		break;
+	case AVBOX_PIXFMT_NV12:
+		avbox_video_simd_splituv(dst, dst_pitch, dst_v, dst_pitch,
+			buf[1], pitch[1], chroma_w, chroma_h);
+		break;
+	case AVBOX_PIXFMT_P010:
+		for (i = 0; i < chroma_h; i++) {
+			const uint16_t * const uv = (uint16_t*) (((uint8_t*) buf[1]) + (i * pitch[1]));
+			uint8_t * const u = dst + (i * dst_pitch);
+			uint8_t * const v = dst_v + (i * dst_pitch);
+			for (j = 0; j < chroma_w; j++) {
+				u[j] = uv[(j << 1) + 0] >> 8;
+				v[j] = uv[(j << 1) + 1] >> 8;
+			}
+		}
+		break;
+	case AVBOX_PIXFMT_YUV420P10:
+		avbox_video_simd_shift16(dst, dst_pitch, buf[1], pitch[1],
+			chroma_w, chroma_h, 2);
+		avbox_video_simd_shift16(dst_v, dst_pitch, buf[2], pitch[2],
+			chroma_w, chroma_h, 2);
+		break;
+	}
+}
+
+
+/**
+ * Point the overlay plane at a buffer. With atomic modesetting
+ * this only queues the update and the buffer is scanned out on the
+ * next vertical blank. Otherwise (or if a primary plane flip is in
+ * flight) we fall back to a blocking drmModeSetPlane().
+ */
+static int
+avbox_drm_overlay_commit(struct mbv_drm_dev * const dev,
+	struct avbox_drm_surface * const buf, const int src_w, const int src_h,
+	const int x, const int y, const int w, const int h)
+{
+#ifdef DRM_CLIENT_CAP_ATOMIC
+	if (overlay.atomic && flip_thread_running) {
+		int i, ret = 0;
+		drmModeAtomicReq *req;
+		const uint64_t values[AVBOX_DRM_PROP_COUNT] =
+		{
+			buf->fbo, dev->crtc, 0, 0,
+			((uint64_t) src_w) << 16, ((uint64_t) src_h) << 16,
+			x, y, w, h
+		};
+
+		if ((req = drmModeAtomicAlloc()) == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		for (i = 0; i < AVBOX_DRM_PROP_COUNT && ret >= 0; i++) {
+			ret = drmModeAtomicAddProperty(req, overlay.plane,
+				overlay.props[i], values[i]);
+		}
+
+		if (ret >= 0) {
+			/* wait until the last commit is on the screen */
+			pthread_mutex_lock(&flip_lock);
+			while (overlay.pending || dev->pending != NULL) {
+				pthread_cond_wait(&flip_cond, &flip_lock);
+			}
+			if ((ret = drmModeAtomicCommit(dev->fd, req,
+				DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT,
+				&overlay)) == 0) {
+				overlay.pending = 1;
+			}
+			pthread_mutex_unlock(&flip_lock);
+		}
+		drmModeAtomicFree(req);
+
+		if (ret == 0) {
+			return 0;
+		} else if (ret != -EBUSY) {
+			errno = -ret;
+			return -1;
+		}
+	}
+#endif
+	return drmModeSetPlane(dev->fd, overlay.plane, dev->crtc, buf->fbo, 0,
+		x, y, w, h, 0, 0, src_w << 16, src_h << 16);
+}
+
+
+/**
+ * Show a YUV 4:2:0 frame on the overlay plane. The planes are
+ * copied into the next buffer and the display controller does
+ * the conversion and scaling. 10 bit frames are reduced to 8 bits
+ * on the way since we only allocate 8 bit overlay buffers.
+ */
+static int
+avbox_drm_overlay_present(unsigned int pix_fmt, void **buf, int *pitch,
+	int src_w, int src_h, int x, int y, int w, int h)
+{
+	int i;
+	uint8_t *dst;
+	const uint8_t *src;
+	struct avbox_drm_surface *out;
+	struct mbv_drm_dev * const dev = default_dev;
+	const int chroma_w = (src_w + 1) >> 1;
+	const int chroma_h = (src_h + 1) >> 1;
+
+	if (pix_fmt != AVBOX_PIXFMT_YUV420P && pix_fmt != AVBOX_PIXFMT_NV12 &&
+		pix_fmt != AVBOX_PIXFMT_P010 && pix_fmt != AVBOX_PIXFMT_YUV420P10) {
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	/* (re)allocate the buffers if the frame size changed */
+	if (src_w != overlay.w || src_h != overlay.h) {
+		avbox_drm_overlay_hide();
+		avbox_drm_overlay_freebuffers(dev);
+		for (i = 0; i < 3; i++) {
+			if ((overlay.buffers[i] = avbox_drm_overlay_newbuffer(dev, src_w, src_h)) == NULL) {
+				avbox_drm_overlay_freebuffers(dev);
+				errno = ENOTSUP;
+				return -1;
+			}
+		}
+		overlay.w = src_w;
+		overlay.h = src_h;
+		overlay.index = 0;
+	}
+
+	/* with three buffers the one we write to is never
+	 * on the screen */
+	overlay.index = (overlay.index + 1) % 3;
+	out = overlay.buffers[overlay.index];
+
+	/* copy the luma plane */
+	dst = out->pixels;
+	if (pix_fmt == AVBOX_PIXFMT_P010) {
+		avbox_video_simd_shift16(dst, out->pitch, buf[0], pitch[0],
+			src_w, src_h, 8);
+	} else if (pix_fmt == AVBOX_PIXFMT_YUV420P10) {
+		avbox_video_simd_shift16(dst, out->pitch, buf[0], pitch[0],
+			src_w, src_h, 2);
+	} else {
+		src = buf[0];
+		for (i = 0; i < src_h; i++, dst += out->pitch, src += pitch[0]) {
+			memcpy(dst, src, src_w);
+		}
+	}
+
+	/* copy, interleave or split the chroma */
+	dst = out->pixels + (out->pitch * ((src_h + 1) & ~1));
+	if (overlay.format == DRM_FORMAT_NV12) {
+		avbox_drm_overlay_copynv12(dst, out->pitch, pix_fmt,
+			buf, pitch, chroma_w, chroma_h);
+	} else {
+		avbox_drm_overlay_copyyuv420(dst, out->pitch >> 1, pix_fmt,
+			buf, pitch, chroma_w, chroma_h);
+	}
+
+	/* show it. If the plane cannot scale the frame to the
+	 * requested size this fails and we leave it to the
+	 * software renderer */
+	if (avbox_drm_overlay_commit(dev, out, src_w, src_h, x, y, w, h) != 0) {
+		LOG_VPRINT_ERROR("Could not show overlay plane: %s",
+			strerror(errno));
+		avbox_drm_overlay_hide();
+		errno = ENOTSUP;
+		return -1;
+	}
+	overlay.visible = 1;
+	return 0;
+}
+
+
+/**
+ * Look up a plane property. Returns the property id or
+ * 0 if the plane doesn't have it. The value, flags and the
+ * upper limit of range properties are returned if requested.
+ */
+static uint32_t
+avbox_drm_plane_getprop(const int fd, const uint32_t plane_id,
+	const char * const name, uint64_t * const value,
+	uint32_t * const flags, uint64_t * const max)
+{
+	int i;
+	uint32_t id = 0;
+	drmModeObjectProperties *props;
+
+	if ((props = drmModeObjectGetProperties(fd,
+		plane_id, DRM_MODE_OBJECT_PLANE)) == NULL) {
+		return 0;
+	}
+	for (i = 0; i < props->count_props && id == 0; i++) {
+		drmModePropertyRes * const prop =
+			drmModeGetProperty(fd, props->props[i]);
+		if (prop == NULL) {
+			continue;
+		}
+		if (!strcmp(prop->name, name)) {
+			id = prop->prop_id;
+			if (value != NULL) {
+				*value = props->prop_values[i];
+			}
+			if (flags != NULL) {
+				*flags = prop->flags;
+			}
+			if (max != NULL) {
+				*max = ((prop->flags & DRM_MODE_PROP_RANGE) && prop->count_values == 2) ?
+					prop->values[1] : props->prop_values[i];
+			}
+		}
+		drmModeFreeProperty(prop);
+	}
+	drmModeFreeObjectProperties(props);
+	return id;
+}
+
+
+/**
+ * Make sure that an overlay plane is stacked above the primary
+ * plane, raising it if its zpos is mutable. If either plane has
+ * no zpos property the stacking is fixed by the driver, which puts
+ * overlays above the primary plane.
+ */
+static int
+avbox_drm_overlay_checkzpos(struct mbv_drm_dev * const dev,
+	const uint32_t plane_id, const int has_primary_zpos,
+	const uint64_t primary_zpos)
+{
+	uint32_t id, flags = 0;
+	uint64_t zpos = 0, max = 0;
+
+	if (!has_primary_zpos || (id = avbox_drm_plane_getprop(dev->fd,
+		plane_id, "zpos", &zpos, &flags, &max)) == 0) {
+		return 0;
+	}
+	if (zpos > primary_zpos) {
+		return 0;
+	}
+	if ((flags & DRM_MODE_PROP_IMMUTABLE) || primary_zpos >= max) {
+		DEBUG_VPRINT(LOG_MODULE, "Plane %u is below the primary plane (zpos=%" PRIu64 ")",
+			plane_id, zpos);
+		return -1;
+	}
+	if (drmModeObjectSetProperty(dev->fd, plane_id,
+		DRM_MODE_OBJECT_PLANE, id, primary_zpos + 1) != 0) {
+		LOG_VPRINT_ERROR("Could not raise plane %u above the primary plane: %s",
+			plane_id, strerror(errno));
+		return -1;
+	}
+	DEBUG_VPRINT(LOG_MODULE, "Raised plane %u to zpos %" PRIu64,
+		plane_id, primary_zpos + 1);
+	return 0;
+}
+
+
+/**
+ * Find an overlay plane that can scan out YUV frames
+ * on our CRTC and that is stacked above the primary plane.
+ */
+static int
+avbox_drm_overlay_init(struct mbv_drm_dev * const dev)
+{
+	int i, j, crtc_index = -1, has_primary_zpos = 0;
+	uint64_t primary_zpos = 0;
+	drmModeRes *res;
+	drmModePlaneRes *planes;
+
+	memset(&overlay, 0, sizeof(overlay));
+
+	if (drmSetClientCap(dev->fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1) != 0) {
+		DEBUG_PRINT(LOG_MODULE, "Universal planes not supported");
+		return -1;
+	}
+
+	/* find the index of our crtc */
+	if ((res = drmModeGetResources(dev->fd)) == NULL) {
+		return -1;
+	}
+	for (i = 0; i < res->count_crtcs; i++) {
+		if (res->crtcs[i] == dev->crtc) {
+			crtc_index = i;
+			break;
+		}
+	}
+	drmModeFreeResources(res);
+	if (crtc_index == -1) {
+		return -1;
+	}
+
+	if ((planes = drmModeGetPlaneResources(dev->fd)) == NULL) {
+		return -1;
+	}
+
+	/* find the primary plane's zpos */
+	for (i = 0; i < planes->count_planes && !has_primary_zpos; i++) {
+		uint64_t type = 0;
+		drmModePlane * const plane = drmModeGetPlane(dev->fd, planes->planes[i]);
+		if (plane == NULL) {
+			continue;
+		}
+		if ((plane->possible_crtcs & (1 << crtc_index)) &&
+			avbox_drm_plane_getprop(dev->fd, plane->plane_id, "type", &type, NULL, NULL) != 0 &&
+			type == DRM_PLANE_TYPE_PRIMARY) {
+			has_primary_zpos = avbox_drm_plane_getprop(dev->fd,
+				plane->plane_id, "zpos", &primary_zpos, NULL, NULL) != 0;
+		}
+		drmModeFreePlane(plane);
+	}
+
+	for (i = 0; i < planes->count_planes && overlay.plane == 0; i++) {
+		uint32_t format = 0;
+		uint64_t type = 0;
+		drmModePlane * const plane = drmModeGetPlane(dev->fd, planes->planes[i]);
+
+		if (plane == NULL) {
+			continue;
+		}
+		if (!(plane->possible_crtcs & (1 << crtc_index))) {
+			drmModeFreePlane(plane);
+			continue;
+		}
+
+		/* prefer planar YUV since it needs no interleaving */
+		for (j = 0; j < plane->count_formats; j++) {
+			if (plane->formats[j] == DRM_FORMAT_YUV420) {
+				format = DRM_FORMAT_YUV420;
+			} else if (plane->formats[j] == DRM_FORMAT_NV12 && format == 0) {
+				format = DRM_FORMAT_NV12;
+			}
+		}
+
+		/* check that it's an overlay plane above the primary */
+		avbox_drm_plane_getprop(dev->fd, plane->plane_id, "type", &type, NULL, NULL);
+
+		if (format != 0 && type == DRM_PLANE_TYPE_OVERLAY &&
+			avbox_drm_overlay_checkzpos(dev, plane->plane_id,
+				has_primary_zpos, primary_zpos) == 0) {
+			overlay.plane = plane->plane_id;
+			overlay.format = format;
+		}
+		drmModeFreePlane(plane);
+	}
+	drmModeFreePlaneResources(planes);
+
+	if (overlay.plane == 0) {
+		DEBUG_PRINT(LOG_MODULE, "No YUV overlay plane found");
+		return -1;
+	}
+
+	/* use atomic commits if we can so updating the
+	 * plane doesn't block until the next vblank */
+#ifdef DRM_CLIENT_CAP_ATOMIC
+	if (drmSetClientCap(dev->fd, DRM_CLIENT_CAP_ATOMIC, 1) == 0) {
+		static const char * const prop_names[AVBOX_DRM_PROP_COUNT] =
+		{
+			"FB_ID", "CRTC_ID", "SRC_X", "SRC_Y", "SRC_W", "SRC_H",
+			"CRTC_X", "CRTC_Y", "CRTC_W", "CRTC_H"
+		};
+		overlay.atomic = 1;
+		for (i = 0; i < AVBOX_DRM_PROP_COUNT; i++) {
+			if ((overlay.props[i] = avbox_drm_plane_getprop(dev->fd,
+				overlay.plane, prop_names[i], NULL, NULL, NULL)) == 0) {
+				overlay.atomic = 0;
+			}
+		}
+	}
+#endif
+
+	LOG_VPRINT_INFO("Using overlay plane %u (%s) for video%s",
+		overlay.plane, (overlay.format == DRM_FORMAT_NV12) ? "NV12" : "YUV420",
+		overlay.atomic ? " (atomic)" : "");
+	return 0;
 }
 
 
@@ -702,9 +1442,9 @@ init(struct mbv_drv_funcs * const driver,
 	int argc, char **argv, int * const w, int * const h)
 {
 	int i, ret, fd = -1;
-	int mode_index = 0, accel = 1;
+	int mode_index = 0, accel = 1, use_overlay = 1;
 	const char *card = "/dev/dri/card0";
-	uint64_t has_dumb;
+	uint64_t has_dumb, monotonic;
 	struct mbv_surface *root;
 
 	ASSERT(w != NULL);
@@ -721,6 +1461,8 @@ init(struct mbv_drv_funcs * const driver,
 
 		} else if (!strncmp(argv[i], "--no-accel", 10)) {
 			accel = 0;
+		} else if (!strcmp(argv[i], "--video:no-overlay")) {
+			use_overlay = 0;
 		}
 	}
 
@@ -783,6 +1525,14 @@ init(struct mbv_drv_funcs * const driver,
 		goto end;
 	}
 
+	/* and a spare one so that we can keep rendering
+	 * while a flip is pending */
+	if ((ret = avbox_drm_create_framebuffer(default_dev, &default_dev->spare)) != 0) {
+		LOG_VPRINT_ERROR("Cannot create framebuffers for connector %u",
+			default_dev->conn);
+		goto end;
+	}
+
 	/* swap the front buffer in */
 	if (drmModeSetCrtc(default_dev->fd, default_dev->crtc,
 		default_dev->front->fbo, 0, 0, &default_dev->conn, 1, &default_dev->mode)) {
@@ -790,15 +1540,37 @@ init(struct mbv_drv_funcs * const driver,
 		goto end;
 	}
 
-	/* initialize software renderer */
+	/* initialize software renderer. Page flips are synced to
+	 * the vertical blank so it doesn't need to wait for it */
 	if ((root = avbox_video_softinit(driver,
 		default_dev->front->pixels, default_dev->back->pixels,
 		default_dev->w, default_dev->h, default_dev->front->pitch,
-		avbox_drm_wait_for_vsync, avbox_drm_swap_buffers)) == NULL) {
+		NULL, avbox_drm_swap_buffers)) == NULL) {
 		LOG_PRINT_ERROR("Could not initialize software driver!");
 		goto end;
 	}
 
+	/* start the page flip thread. If we can't we'll just
+	 * use blocking modesets */
+	flip_thread_quit = 0;
+	if (pthread_create(&flip_thread, NULL, avbox_drm_flip_thread, NULL) != 0) {
+		LOG_PRINT_ERROR("Could not start page flip thread!");
+	} else {
+		flip_thread_running = 1;
+	}
+
+	/* vblank timestamps are only useful if they're monotonic */
+	if (drmGetCap(fd, DRM_CAP_TIMESTAMP_MONOTONIC, &monotonic) == 0 && monotonic) {
+		driver->getvblank = &avbox_drm_getvblank;
+	}
+
+	/* if there's an overlay plane that can show our
+	 * frames use it for video */
+	if (use_overlay && avbox_drm_overlay_init(default_dev) == 0) {
+		driver->overlay_present = &avbox_drm_overlay_present;
+		driver->overlay_hide = &avbox_drm_overlay_hide;
+	}
+
 	return root;
 
 end:
@@ -824,6 +1596,7 @@ shutdown()
 
 #ifdef ENABLE_OPENGL
 	if (egl_enabled) {
+		avbox_video_glshutdown();
 		gbm_surface_destroy(gbm_surface);
 		gbm_device_destroy(gbm_dev);
 		eglDestroyContext(egl_display, egl_ctx);
@@ -831,6 +1604,19 @@ shutdown()
 	}
 #endif
 
+	/* release the overlay plane */
+	if (overlay.plane != 0) {
+		avbox_drm_overlay_hide();
+		avbox_drm_overlay_freebuffers(default_dev);
+	}
+
+	/* stop the page flip thread */
+	if (flip_thread_running) {
+		flip_thread_quit = 1;
+		pthread_join(flip_thread, NULL);
+		flip_thread_running = 0;
+	}
+
 	LIST_FOREACH_SAFE(struct mbv_drm_dev*, iter, &devices, {
 		/* remove from global list */
 		LIST_REMOVE(iter);
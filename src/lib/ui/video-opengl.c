@@ -2,6 +2,7 @@
 #       include <libavbox/config.h>
 #endif
 #include <stdlib.h>
+#include <stdio.h>
 #include <errno.h>
 #include <string.h>
 #include <malloc.h>
@@ -50,10 +51,11 @@ struct mbv_surface
 
 
 /* GL driver */
-static GLuint bgra_program = 0, yuv420p_program = 0;
+static GLuint bgra_program = 0, yuv420p_program = 0, nv12_program = 0;
 static GLuint vertex_buffer;
 static GLint bgra_texcoords, bgra_pos, bgra_texture, bgra_target;
 static GLint yuv420p_y, yuv420p_u, yuv420p_v, yuv420p_pos, yuv420p_texcoords;
+static GLint nv12_y, nv12_uv, nv12_pos, nv12_texcoords;
 static struct mbv_surface *root_surface;
 static GLfloat texcoords[] = { 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.0f };
 static GLfloat texcoords_yuv[] = {
@@ -69,6 +71,40 @@ static GLuint mmal_program;
 static GLint mmal_texcoords, mmal_pos, mmal_texture;
 #endif
 
+/* GLES2 only has this with GL_EXT_unpack_subimage */
+#ifndef GL_UNPACK_ROW_LENGTH
+#define GL_UNPACK_ROW_LENGTH	(0x0CF2)
+#endif
+
+/* upload capabilities of the GL implementation */
+static int gl_has_unpack_row_length = 0;
+static int gl_has_pbo = 0;
+
+
+/**
+ * Textures for planar video frames. They are allocated once
+ * per layout and resolution and reused for every frame. If the GL
+ * supports pixel buffer objects the frames are uploaded through a pair
+ * of them so that one frame's upload overlaps the previous frame's draw.
+ *
+ * The layout is either YUV420P (three GL_ALPHA planes) or NV12
+ * (GL_ALPHA luma and GL_LUMINANCE_ALPHA chroma). 10 bit frames are
+ * reduced to 8 bits into the conv buffer and uploaded as one of those.
+ */
+static struct
+{
+	GLuint textures[3];
+	GLuint pbos[2];
+	int pbo_index;
+	unsigned int fmt;
+	int w;
+	int h;
+	uint8_t *scratch;
+	size_t scratch_sz;
+	uint8_t *conv;
+	size_t conv_sz;
+} planes;
+
 
 #define TARGET_SURFACE	(0)
 #define TARGET_DISPLAY	(1)
@@ -129,6 +165,258 @@ avbox_glTexImage2D(GLenum target, GLint level,
 }
 
 
+/**
+ * Checks if the GL implementation supports an extension.
+ */
+static int
+avbox_gl_hasext(const char * const ext)
+{
+	const size_t len = strlen(ext);
+	const char *exts = (const char*) glGetString(GL_EXTENSIONS);
+
+	while (exts != NULL && (exts = strstr(exts, ext)) != NULL) {
+		if (exts[len] == ' ' || exts[len] == '\0') {
+			return 1;
+		}
+		exts += len;
+	}
+	return 0;
+}
+
+
+/**
+ * Gets the number of planes in the current layout.
+ */
+static inline int
+avbox_gl_planes_count(void)
+{
+	return (planes.fmt == AVBOX_PIXFMT_NV12) ? 2 : 3;
+}
+
+
+/**
+ * Gets the texture format of a plane.
+ */
+static inline GLenum
+avbox_gl_planes_format(const int plane)
+{
+	return (planes.fmt == AVBOX_PIXFMT_NV12 && plane == 1) ?
+		GL_LUMINANCE_ALPHA : GL_ALPHA;
+}
+
+
+/**
+ * Make sure the plane textures match the frame
+ * layout and size.
+ */
+static void
+avbox_gl_planes_alloc(const unsigned int fmt, const int w, const int h)
+{
+	int i;
+
+	if (LIKELY(planes.fmt == fmt && planes.w == w && planes.h == h)) {
+		return;
+	}
+
+	DEBUG_VPRINT(LOG_MODULE, "Allocating plane textures (%s %ix%i)",
+		(fmt == AVBOX_PIXFMT_NV12) ? "nv12" : "yuv420p", w, h);
+
+	planes.fmt = fmt;
+
+	if (planes.textures[0] == 0) {
+		glGenTextures(3, planes.textures);
+		if (gl_has_pbo) {
+			glGenBuffers(2, planes.pbos);
+		}
+	}
+
+	for (i = 0; i < avbox_gl_planes_count(); i++) {
+		const GLenum format = avbox_gl_planes_format(i);
+		glBindTexture(GL_TEXTURE_2D, planes.textures[i]);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexImage2D(GL_TEXTURE_2D, 0, format,
+			(i == 0) ? w : w >> 1, (i == 0) ? h : h >> 1, 0,
+			format, GL_UNSIGNED_BYTE, NULL);
+	}
+	DEBUG_ERROR_CHECK();
+
+	planes.w = w;
+	planes.h = h;
+}
+
+
+/**
+ * Free the plane textures, pixel buffers and
+ * conversion buffers.
+ */
+static void
+avbox_gl_planes_free(void)
+{
+	if (planes.textures[0] != 0) {
+		glDeleteTextures(3, planes.textures);
+		if (gl_has_pbo) {
+			glDeleteBuffers(2, planes.pbos);
+		}
+	}
+	if (planes.scratch != NULL) {
+		free(planes.scratch);
+	}
+	if (planes.conv != NULL) {
+		free(planes.conv);
+	}
+	memset(&planes, 0, sizeof(planes));
+}
+
+
+/**
+ * Upload one plane from client memory.
+ */
+static void
+avbox_gl_planes_upload(const int plane, const uint8_t *buf,
+	const int pitch, const int w, const int h)
+{
+	const GLenum format = avbox_gl_planes_format(plane);
+	const int row_sz = (format == GL_LUMINANCE_ALPHA) ? w * 2 : w;
+
+	glBindTexture(GL_TEXTURE_2D, planes.textures[plane]);
+
+	if (pitch == row_sz) {
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, w, h,
+			format, GL_UNSIGNED_BYTE, buf);
+
+	} else if (gl_has_unpack_row_length && (pitch % (row_sz / w)) == 0) {
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, pitch / (row_sz / w));
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, w, h,
+			format, GL_UNSIGNED_BYTE, buf);
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+
+	} else {
+		/* pack the plane so we can upload it with one call */
+		int i;
+		const size_t sz = row_sz * h;
+		if (planes.scratch_sz < sz) {
+			uint8_t * const scratch = realloc(planes.scratch, sz);
+			if (scratch == NULL) {
+				LOG_PRINT_ERROR("Could not allocate scratch buffer!");
+				return;
+			}
+			planes.scratch = scratch;
+			planes.scratch_sz = sz;
+		}
+		for (i = 0; i < h; i++) {
+			memcpy(planes.scratch + (i * row_sz), buf + (i * pitch), row_sz);
+		}
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, w, h,
+			format, GL_UNSIGNED_BYTE, planes.scratch);
+	}
+}
+
+
+#ifndef ENABLE_GLES2
+/**
+ * Upload all planes of a frame through the next pixel
+ * buffer object. Returns -1 if the buffer cannot be mapped.
+ */
+static int
+avbox_gl_planes_upload_pbo(void ** const buf, const int * const pitch,
+	const int * const w, const int * const h)
+{
+	int i, y, row_sz[3];
+	uint8_t *dst;
+	size_t offsets[3], sz = 0;
+	const int n = avbox_gl_planes_count();
+
+	for (i = 0; i < n; i++) {
+		row_sz[i] = (avbox_gl_planes_format(i) == GL_LUMINANCE_ALPHA) ?
+			w[i] * 2 : w[i];
+		offsets[i] = sz;
+		sz += row_sz[i] * h[i];
+	}
+
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, planes.pbos[planes.pbo_index]);
+	planes.pbo_index ^= 1;
+
+	/* orphan the old storage so that we don't stall
+	 * if the GPU is still reading it */
+	glBufferData(GL_PIXEL_UNPACK_BUFFER, sz, NULL, GL_STREAM_DRAW);
+	if ((dst = glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY)) == NULL) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		const uint8_t *src = buf[i];
+		if (pitch[i] == row_sz[i]) {
+			memcpy(dst + offsets[i], src, row_sz[i] * h[i]);
+		} else {
+			for (y = 0; y < h[i]; y++) {
+				memcpy(dst + offsets[i] + (y * row_sz[i]), src, row_sz[i]);
+				src += pitch[i];
+			}
+		}
+	}
+	glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+	/* the data argument is now an offset into the buffer */
+	for (i = 0; i < n; i++) {
+		glBindTexture(GL_TEXTURE_2D, planes.textures[i]);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, w[i], h[i],
+			avbox_gl_planes_format(i), GL_UNSIGNED_BYTE,
+			(const GLvoid*) offsets[i]);
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	return 0;
+}
+#endif
+
+
+/**
+ * Reduce a 10 bit frame to 8 bits so it can be uploaded
+ * as NV12 (P010) or YUV420P (YUV420P10). Returns the layout
+ * of the converted frame or AVBOX_PIXFMT_UNKNOWN on failure.
+ */
+static unsigned int
+avbox_gl_planes_convert(const unsigned int pix_fmt,
+	void ** const buf, const int * const pitch, const int w, const int h,
+	void **out, int *out_pitch)
+{
+	const int cw = w >> 1, ch = h >> 1;
+	const size_t sz = (w * h) + (cw * ch * 2);
+
+	if (planes.conv_sz < sz) {
+		uint8_t * const conv = realloc(planes.conv, sz);
+		if (conv == NULL) {
+			LOG_PRINT_ERROR("Could not allocate conversion buffer!");
+			return AVBOX_PIXFMT_UNKNOWN;
+		}
+		planes.conv = conv;
+		planes.conv_sz = sz;
+	}
+
+	out[0] = planes.conv;
+	out_pitch[0] = w;
+	avbox_video_simd_shift16(out[0], w, buf[0], pitch[0], w, h,
+		(pix_fmt == AVBOX_PIXFMT_P010) ? 8 : 2);
+
+	if (pix_fmt == AVBOX_PIXFMT_P010) {
+		out[1] = planes.conv + (w * h);
+		out_pitch[1] = cw * 2;
+		avbox_video_simd_shift16(out[1], cw * 2, buf[1], pitch[1],
+			cw * 2, ch, 8);
+		return AVBOX_PIXFMT_NV12;
+	} else {
+		out[1] = planes.conv + (w * h);
+		out[2] = planes.conv + (w * h) + (cw * ch);
+		out_pitch[1] = out_pitch[2] = cw;
+		avbox_video_simd_shift16(out[1], cw, buf[1], pitch[1], cw, ch, 2);
+		avbox_video_simd_shift16(out[2], cw, buf[2], pitch[2], cw, ch, 2);
+		return AVBOX_PIXFMT_YUV420P;
+	}
+}
+
+
 static int
 surface_doublebuffered(const struct mbv_surface * const surface)
 {
@@ -265,88 +553,75 @@ surface_blitbuf(
 
 	switch (pix_fmt) {
 	case AVBOX_PIXFMT_YUV420P:
+	case AVBOX_PIXFMT_NV12:
+	case AVBOX_PIXFMT_P010:
+	case AVBOX_PIXFMT_YUV420P10:
 	{
-		GLuint planes[3];
-		const int uv_w = w >> 1, uv_h = h >> 1;
-
-		glVertexAttribPointer(yuv420p_texcoords, 2, GL_FLOAT, GL_FALSE, 0, texcoords_yuv);
-		glEnableVertexAttribArray(yuv420p_texcoords);
-
-		/* upload each plane to a texture */
-		glGenTextures(3, planes);
-		glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
-		glBindTexture(GL_TEXTURE_2D, planes[0]);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-		if (pitch[0] == w) {
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, w, h, 0,
-				GL_ALPHA, GL_UNSIGNED_BYTE, buf[0]);
-		} else {
-			int i;
-			uint8_t *pbuf = buf[0];
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, w, h, 0,
-				GL_ALPHA, GL_UNSIGNED_BYTE, NULL);
-			for (i = 0; i < h; i++) {
-				glTexSubImage2D(GL_TEXTURE_2D, 0, 0, i, w, 1,
-					GL_ALPHA, GL_UNSIGNED_BYTE, pbuf);
-				pbuf += pitch[0];
+		int i, conv_pitch[3];
+		void *conv_buf[3];
+		const int plane_w[3] = { w, w >> 1, w >> 1 };
+		const int plane_h[3] = { h, h >> 1, h >> 1 };
+
+		/* the shaders only take 8 bit samples */
+		if (pix_fmt == AVBOX_PIXFMT_P010 || pix_fmt == AVBOX_PIXFMT_YUV420P10) {
+			if ((pix_fmt = avbox_gl_planes_convert(pix_fmt, buf, pitch,
+				w, h, conv_buf, conv_pitch)) == AVBOX_PIXFMT_UNKNOWN) {
+				return -1;
 			}
+			buf = conv_buf;
+			pitch = conv_pitch;
 		}
+
+		/* upload each plane to its texture */
+		avbox_gl_planes_alloc(pix_fmt, w, h);
 		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-		glBindTexture(GL_TEXTURE_2D, planes[1]);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-		if (pitch[1] == uv_w) {
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, uv_w, uv_h, 0,
-				GL_ALPHA, GL_UNSIGNED_BYTE, buf[1]);
-		} else {
-			int i;
-			uint8_t *pbuf = buf[1];
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, uv_w, uv_h, 0,
-				GL_ALPHA, GL_UNSIGNED_BYTE, NULL);
-			for (i = 0; i < uv_h; i++) {
-				glTexSubImage2D(GL_TEXTURE_2D, 0, 0, i, uv_w, 1,
-					GL_ALPHA, GL_UNSIGNED_BYTE, pbuf);
-				pbuf += pitch[1];
+#ifndef ENABLE_GLES2
+		if (!gl_has_pbo || avbox_gl_planes_upload_pbo(buf, pitch, plane_w, plane_h) == -1)
+#endif
+		{
+			for (i = 0; i < avbox_gl_planes_count(); i++) {
+				avbox_gl_planes_upload(i, buf[i], pitch[i], plane_w[i], plane_h[i]);
 			}
 		}
 
 		DEBUG_ERROR_CHECK();
 
-		glBindTexture(GL_TEXTURE_2D, planes[2]);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-		if (pitch[2] == uv_w) {
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, uv_w, uv_h, 0,
-				GL_ALPHA, GL_UNSIGNED_BYTE, buf[2]);
+		/* prepare shaders */
+		if (pix_fmt == AVBOX_PIXFMT_NV12) {
+			glVertexAttribPointer(nv12_texcoords, 2, GL_FLOAT, GL_FALSE, 0, texcoords_yuv);
+			glEnableVertexAttribArray(nv12_texcoords);
+			glUseProgram(nv12_program);
+			glActiveTexture(GL_TEXTURE0);
+			glBindTexture(GL_TEXTURE_2D, planes.textures[0]);
+			glUniform1i(nv12_y, 0);
+			glActiveTexture(GL_TEXTURE1);
+			glBindTexture(GL_TEXTURE_2D, planes.textures[1]);
+			glUniform1i(nv12_uv, 1);
+			glActiveTexture(GL_TEXTURE0);
+
+			glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
+			glVertexAttribPointer(nv12_pos, 2, GL_FLOAT, GL_FALSE, 0, 0);
+			glEnableVertexAttribArray(nv12_pos);
 		} else {
-			int i;
-			uint8_t *pbuf = buf[2];
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, uv_w, uv_h, 0,
-				GL_ALPHA, GL_UNSIGNED_BYTE, NULL);
-			for (i = 0; i < uv_h; i++) {
-				glTexSubImage2D(GL_TEXTURE_2D, 0, 0, i, uv_w, 1,
-					GL_ALPHA, GL_UNSIGNED_BYTE, pbuf);
-				pbuf += pitch[2];
-			}
+			glVertexAttribPointer(yuv420p_texcoords, 2, GL_FLOAT, GL_FALSE, 0, texcoords_yuv);
+			glEnableVertexAttribArray(yuv420p_texcoords);
+			glUseProgram(yuv420p_program);
+			glActiveTexture(GL_TEXTURE0);
+			glBindTexture(GL_TEXTURE_2D, planes.textures[0]);
+			glUniform1i(yuv420p_y, 0);
+			glActiveTexture(GL_TEXTURE1);
+			glBindTexture(GL_TEXTURE_2D, planes.textures[1]);
+			glUniform1i(yuv420p_u, 1);
+			glActiveTexture(GL_TEXTURE2);
+			glBindTexture(GL_TEXTURE_2D, planes.textures[2]);
+			glUniform1i(yuv420p_v, 2);
+			glActiveTexture(GL_TEXTURE0);
+
+			glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
+			glVertexAttribPointer(yuv420p_pos, 2, GL_FLOAT, GL_FALSE, 0, 0);
+			glEnableVertexAttribArray(yuv420p_pos);
 		}
 
-		DEBUG_ERROR_CHECK();
-
-		/* prepare shaders */
-		glUseProgram(yuv420p_program);
-		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, planes[0]);
-		glUniform1i(yuv420p_y, 0);
-		glActiveTexture(GL_TEXTURE1);
-		glBindTexture(GL_TEXTURE_2D, planes[1]);
-		glUniform1i(yuv420p_u, 1);
-		glActiveTexture(GL_TEXTURE2);
-		glBindTexture(GL_TEXTURE_2D, planes[2]);
-		glUniform1i(yuv420p_v, 2);
-		glActiveTexture(GL_TEXTURE0);
-
-		glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
-		glVertexAttribPointer(yuv420p_pos, 2, GL_FLOAT, GL_FALSE, 0, 0);
-		glEnableVertexAttribArray(yuv420p_pos);
-
 		/* convert and render to texture */
 		glBindFramebuffer(GL_FRAMEBUFFER, surface_framebuffer(inst));
 		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
@@ -354,7 +629,6 @@ surface_blitbuf(
 		glViewport(inst->x, inst->h - (y + h), inst->w, inst->h);
 		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
 		glBindBuffer(GL_ARRAY_BUFFER, 0);
-		glDeleteTextures(3, planes);
 		DEBUG_ERROR_CHECK();
 		return 0;
 	}
@@ -564,7 +838,9 @@ init_func_table(struct mbv_drv_funcs * const funcs)
 	funcs->surface_blitbuf = &surface_blitbuf;
 	funcs->surface_blit = &surface_blit;
 	funcs->surface_scaleblit = &surface_scaleblit;
+	funcs->surface_scaleblitbuf = NULL;
 	funcs->surface_update = &surface_update;
+	funcs->surface_updaterect = NULL;
 	funcs->surface_doublebuffered = &surface_doublebuffered;
 	funcs->surface_destroy = &surface_destroy;
 }
@@ -703,6 +979,20 @@ avbox_video_opengl_prepare_shaders(void)
 			gl_FragColor = vec4(b,g,r,1);
 
 		});
+	const char * nv12_fragment_source = GLSL(130,
+		varying vec2 v_texcoords;
+		uniform sampler2D plane_y;
+		uniform sampler2D plane_uv;
+		void main() {
+			/* same as yuv420p but U and V come from the
+			 * luminance and alpha channels of one texture */
+			float y = texture2D(plane_y, v_texcoords).a - 0.0627;
+			vec2 uv = texture2D(plane_uv, v_texcoords).ra - 0.5;
+			float r = y + (uv.y * 1.402);
+			float g = y - (uv.x * 0.344) - (uv.y * 0.714);
+			float b = y + (uv.x * 1.772);
+			gl_FragColor = vec4(b,g,r,1);
+		});
 
 
 	DEBUG_PRINT(LOG_MODULE, "Compiling shaders...");
@@ -710,6 +1000,8 @@ avbox_video_opengl_prepare_shaders(void)
 		vertex_source, bgra_fragment_source);
 	yuv420p_program = avbox_video_opengl_compile_program("yuv420p",
 		yuv420p_vertex_source, yuv420p_fragment_source);
+	nv12_program = avbox_video_opengl_compile_program("nv12",
+		yuv420p_vertex_source, nv12_fragment_source);
 
 	/* get uniform and attribute locations */
 	yuv420p_y = glGetUniformLocation(yuv420p_program, "plane_y");
@@ -719,6 +1011,12 @@ avbox_video_opengl_prepare_shaders(void)
 	yuv420p_texcoords = glGetAttribLocation(yuv420p_program, "texcoords");
 	DEBUG_ERROR_CHECK();
 
+	nv12_y = glGetUniformLocation(nv12_program, "plane_y");
+	nv12_uv = glGetUniformLocation(nv12_program, "plane_uv");
+	nv12_pos = glGetAttribLocation(nv12_program, "pos");
+	nv12_texcoords = glGetAttribLocation(nv12_program, "texcoords");
+	DEBUG_ERROR_CHECK();
+
 	bgra_pos = glGetAttribLocation(bgra_program, "pos");
 	bgra_texcoords = glGetAttribLocation(bgra_program, "texcoords");
 	bgra_texture = glGetUniformLocation(bgra_program, "texture");
@@ -747,6 +1045,17 @@ avbox_video_opengl_prepare_shaders(void)
 }
 
 
+/**
+ * Release the resources used by the opengl driver.
+ */
+void
+avbox_video_glshutdown(void)
+{
+	DEBUG_THREAD_CHECK();
+	avbox_gl_planes_free();
+}
+
+
 /**
  * Initialize the opengl driver
  */
@@ -786,6 +1095,23 @@ avbox_video_glinit(struct mbv_drv_funcs * const funcs, int width, const int heig
 	LOG_VPRINT_INFO("GLSL:\t%s", glGetString(GL_SHADING_LANGUAGE_VERSION));
 #endif
 
+	/* check what we can use to upload video frames. Desktop GL has
+	 * always had GL_UNPACK_ROW_LENGTH and PBOs are core since 2.1 */
+#ifdef ENABLE_GLES2
+	gl_has_unpack_row_length = avbox_gl_hasext("GL_EXT_unpack_subimage") ||
+		!strncmp((const char*) glGetString(GL_VERSION), "OpenGL ES 3", 11);
+#else
+	{
+		int major = 0, minor = 0;
+		sscanf((const char*) glGetString(GL_VERSION), "%d.%d", &major, &minor);
+		gl_has_unpack_row_length = 1;
+		gl_has_pbo = (major > 2 || (major == 2 && minor >= 1)) ||
+			avbox_gl_hasext("GL_ARB_pixel_buffer_object");
+	}
+#endif
+	LOG_VPRINT_INFO("Frame uploads: %s%s", gl_has_pbo ? "PBO, " : "",
+		gl_has_unpack_row_length ? "row length" : "packed");
+
 #if 0
 	char *gl_exts;
 	LOG_PRINT_INFO("Extensions:");
@@ -0,0 +1,1249 @@
+/**
+ * avbox - Toolkit for Embedded Multimedia Applications
+ * Copyright (C) 2016-2017 Fernando Rodriguez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License Version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#       include <libavbox/config.h>
+#endif
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#	define AVBOX_SIMD_HAVE_X86
+#	include <immintrin.h>
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#	define AVBOX_SIMD_HAVE_NEON
+#	include <arm_neon.h>
+#	if !defined(__aarch64__)
+#		include <sys/auxv.h>
+#		include <asm/hwcap.h>
+#	endif
+#endif
+
+#define LOG_MODULE "video-simd"
+
+#include <libavbox/avbox.h>
+#include <libavbox/ui/video-simd.h>
+
+
+/*
+ * All kernels produce exactly the same output as the
+ * scalar versions. The colorspace conversion is BT.601 (limited
+ * range) in 6 bit fixed point:
+ *
+ *	Y' = (Y - 16) * 74.5 + 32
+ *	B = (Y' + 129 * (U - 128)) >> 6
+ *	G = (Y' - 25 * (U - 128) - 52 * (V - 128)) >> 6
+ *	R = (Y' + 102 * (V - 128)) >> 6
+ *
+ * The only intermediate that can overflow 16 bits is B, and
+ * only when the result is clipped to 255 anyway, so the vector
+ * versions use saturated adds for it.
+ *
+ * Scaling is bilinear with 8 bit weights. Each row is
+ * scaled horizontally and rounded to 8 bits before the
+ * vertical pass.
+ *
+ * NV12 and the 10 bit formats are brought to planar 8 bit
+ * one row at a time (splituv and shift16) and then go through
+ * the same conversion. The 10 bit samples are truncated, not
+ * rounded, and saturated like packus does.
+ */
+
+
+/**
+ * Row kernels.
+ */
+struct avbox_video_kernels
+{
+	const char *name;
+	void (*yuv2bgra)(uint8_t *dst, const uint8_t *y,
+		const uint8_t *u, const uint8_t *v, const int w);
+	void (*hscale)(uint8_t *dst, const uint8_t *src,
+		const int dst_w, const int src_w, const int xstep);
+	void (*vscale)(uint8_t *dst, const uint8_t *top,
+		const uint8_t *bottom, const int wy, const int n);
+	void (*blend)(uint8_t *dst, const uint8_t *src, const int w);
+	void (*splituv)(uint8_t *u, uint8_t *v, const uint8_t *uv, const int n);
+	void (*shift16)(uint8_t *dst, const uint16_t *src, const int n, const int shift);
+	void (*mergeuv16)(uint8_t *uv, const uint16_t *u, const uint16_t *v,
+		const int n, const int shift);
+};
+
+
+static inline uint8_t
+clip_uint8(const int value)
+{
+	return (value < 0) ? 0 : (value > 255) ? 255 : value;
+}
+
+
+/**
+ * Convert a single pixel.
+ */
+static inline void
+yuv2bgra_pixel(uint8_t * const dst, const int y, const int u, const int v)
+{
+	const int yy = ((y - 16) * 74) + ((y - 16) >> 1) + 32;
+	const int d = u - 128, e = v - 128;
+	dst[0] = clip_uint8((yy + (129 * d)) >> 6);
+	dst[1] = clip_uint8((yy - (25 * d) - (52 * e)) >> 6);
+	dst[2] = clip_uint8((yy + (102 * e)) >> 6);
+	dst[3] = 0xFF;
+}
+
+
+static void
+yuv2bgra_c(uint8_t *dst, const uint8_t *y,
+	const uint8_t *u, const uint8_t *v, const int w)
+{
+	int x;
+	for (x = 0; x < w; x++, dst += 4) {
+		yuv2bgra_pixel(dst, y[x], u[x >> 1], v[x >> 1]);
+	}
+}
+
+
+/**
+ * Scale a BGRA row horizontally starting at dst pixel x
+ * and source position pos.
+ */
+static inline void
+hscale_tail(uint8_t *dst, const uint8_t * const src, int x,
+	const int dst_w, const int src_w, int pos, const int xstep)
+{
+	for (dst += x * 4; x < dst_w; x++, pos += xstep, dst += 4) {
+		const int p = MAX(pos, 0);
+		const int ix = p >> 16;
+		const int ix1 = MIN(ix + 1, src_w - 1);
+		const int w1 = (p >> 8) & 0xFF, w0 = 256 - w1;
+		const uint8_t * const s0 = src + (ix * 4);
+		const uint8_t * const s1 = src + (ix1 * 4);
+		dst[0] = ((s0[0] * w0) + (s1[0] * w1) + 128) >> 8;
+		dst[1] = ((s0[1] * w0) + (s1[1] * w1) + 128) >> 8;
+		dst[2] = ((s0[2] * w0) + (s1[2] * w1) + 128) >> 8;
+		dst[3] = ((s0[3] * w0) + (s1[3] * w1) + 128) >> 8;
+	}
+}
+
+
+/**
+ * Gets the first dst pixel whose right neighbour
+ * falls outside the source row.
+ */
+static inline int
+hscale_edge(const int dst_w, const int src_w, const int xstep)
+{
+	int x;
+	const int pos = (xstep >> 1) - 0x8000;
+	const int edge = (src_w - 1) << 16;
+	if (src_w < 2 || pos >= edge) {
+		return 0;
+	}
+	x = ((edge - pos) + (xstep - 1)) / xstep;
+	return MIN(x, dst_w);
+}
+
+
+static void
+hscale_c(uint8_t *dst, const uint8_t *src,
+	const int dst_w, const int src_w, const int xstep)
+{
+	hscale_tail(dst, src, 0, dst_w, src_w, (xstep >> 1) - 0x8000, xstep);
+}
+
+
+static void
+vscale_c(uint8_t *dst, const uint8_t *top,
+	const uint8_t *bottom, const int wy, const int n)
+{
+	int i;
+	const int w0 = 256 - wy;
+	for (i = 0; i < n; i++) {
+		dst[i] = ((top[i] * w0) + (bottom[i] * wy) + 128) >> 8;
+	}
+}
+
+
+/**
+ * Divide by 255 with rounding. Exact for 0 <= x <= 65025.
+ */
+static inline int
+div255(const int x)
+{
+	const int t = x + 128;
+	return (t + (t >> 8)) >> 8;
+}
+
+
+static void
+blend_c(uint8_t *dst, const uint8_t *src, const int w)
+{
+	int x;
+	for (x = 0; x < w; x++, dst += 4, src += 4) {
+		const int ia = 255 - src[3];
+		dst[0] = MIN(255, src[0] + div255(dst[0] * ia));
+		dst[1] = MIN(255, src[1] + div255(dst[1] * ia));
+		dst[2] = MIN(255, src[2] + div255(dst[2] * ia));
+		dst[3] = MIN(255, src[3] + div255(dst[3] * ia));
+	}
+}
+
+
+/**
+ * Deinterleave n NV12 chroma pairs.
+ */
+static void
+splituv_c(uint8_t *u, uint8_t *v, const uint8_t *uv, const int n)
+{
+	int i;
+	for (i = 0; i < n; i++, uv += 2) {
+		u[i] = uv[0];
+		v[i] = uv[1];
+	}
+}
+
+
+/**
+ * Reduce n 16 bit samples to 8 bits.
+ */
+static void
+shift16_c(uint8_t *dst, const uint16_t *src, const int n, const int shift)
+{
+	int i;
+	for (i = 0; i < n; i++) {
+		dst[i] = clip_uint8(src[i] >> shift);
+	}
+}
+
+
+/**
+ * Reduce n pairs of 16 bit U and V samples to 8 bits
+ * and interleave them.
+ */
+static void
+mergeuv16_c(uint8_t *uv, const uint16_t *u, const uint16_t *v,
+	const int n, const int shift)
+{
+	int i;
+	for (i = 0; i < n; i++, uv += 2) {
+		uv[0] = clip_uint8(u[i] >> shift);
+		uv[1] = clip_uint8(v[i] >> shift);
+	}
+}
+
+
+static const struct avbox_video_kernels kernels_c =
+{
+	.name = "scalar",
+	.yuv2bgra = yuv2bgra_c,
+	.hscale = hscale_c,
+	.vscale = vscale_c,
+	.blend = blend_c,
+	.splituv = splituv_c,
+	.shift16 = shift16_c,
+	.mergeuv16 = mergeuv16_c
+};
+
+
+#ifdef AVBOX_SIMD_HAVE_X86
+
+/**
+ * Interleave 16 pixels worth of B, G and R bytes
+ * into BGRA and store them.
+ */
+__attribute__((target("sse2")))
+static inline void
+store_bgra_sse2(uint8_t * const dst, const __m128i b, const __m128i g, const __m128i r)
+{
+	const __m128i a = _mm_set1_epi8((char) 0xFF);
+	const __m128i bg_lo = _mm_unpacklo_epi8(b, g);
+	const __m128i bg_hi = _mm_unpackhi_epi8(b, g);
+	const __m128i ra_lo = _mm_unpacklo_epi8(r, a);
+	const __m128i ra_hi = _mm_unpackhi_epi8(r, a);
+	_mm_storeu_si128((__m128i*) (dst +  0), _mm_unpacklo_epi16(bg_lo, ra_lo));
+	_mm_storeu_si128((__m128i*) (dst + 16), _mm_unpackhi_epi16(bg_lo, ra_lo));
+	_mm_storeu_si128((__m128i*) (dst + 32), _mm_unpacklo_epi16(bg_hi, ra_hi));
+	_mm_storeu_si128((__m128i*) (dst + 48), _mm_unpackhi_epi16(bg_hi, ra_hi));
+}
+
+
+/**
+ * Convert 8 pixels to 16 bit B, G and R values.
+ */
+__attribute__((target("sse2")))
+static inline void
+yuv2bgra8_sse2(__m128i y, __m128i d, __m128i e,
+	__m128i * const b, __m128i * const g, __m128i * const r)
+{
+	y = _mm_sub_epi16(y, _mm_set1_epi16(16));
+	y = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(y, _mm_set1_epi16(74)),
+		_mm_srai_epi16(y, 1)), _mm_set1_epi16(32));
+	d = _mm_sub_epi16(d, _mm_set1_epi16(128));
+	e = _mm_sub_epi16(e, _mm_set1_epi16(128));
+	*b = _mm_srai_epi16(_mm_adds_epi16(y,
+		_mm_mullo_epi16(d, _mm_set1_epi16(129))), 6);
+	*g = _mm_srai_epi16(_mm_sub_epi16(_mm_sub_epi16(y,
+		_mm_mullo_epi16(d, _mm_set1_epi16(25))),
+		_mm_mullo_epi16(e, _mm_set1_epi16(52))), 6);
+	*r = _mm_srai_epi16(_mm_add_epi16(y,
+		_mm_mullo_epi16(e, _mm_set1_epi16(102))), 6);
+}
+
+
+__attribute__((target("sse2")))
+static void
+yuv2bgra_sse2(uint8_t *dst, const uint8_t *y,
+	const uint8_t *u, const uint8_t *v, const int w)
+{
+	int x;
+	const __m128i zero = _mm_setzero_si128();
+
+	for (x = 0; x + 16 <= w; x += 16, dst += 64) {
+		__m128i b_lo, g_lo, r_lo, b_hi, g_hi, r_hi;
+		const __m128i yy = _mm_loadu_si128((const __m128i*) (y + x));
+		const __m128i uu = _mm_unpacklo_epi8(
+			_mm_loadl_epi64((const __m128i*) (u + (x >> 1))), zero);
+		const __m128i vv = _mm_unpacklo_epi8(
+			_mm_loadl_epi64((const __m128i*) (v + (x >> 1))), zero);
+
+		yuv2bgra8_sse2(_mm_unpacklo_epi8(yy, zero),
+			_mm_unpacklo_epi16(uu, uu), _mm_unpacklo_epi16(vv, vv),
+			&b_lo, &g_lo, &r_lo);
+		yuv2bgra8_sse2(_mm_unpackhi_epi8(yy, zero),
+			_mm_unpackhi_epi16(uu, uu), _mm_unpackhi_epi16(vv, vv),
+			&b_hi, &g_hi, &r_hi);
+
+		store_bgra_sse2(dst,
+			_mm_packus_epi16(b_lo, b_hi),
+			_mm_packus_epi16(g_lo, g_hi),
+			_mm_packus_epi16(r_lo, r_hi));
+	}
+
+	for (; x < w; x++, dst += 4) {
+		yuv2bgra_pixel(dst, y[x], u[x >> 1], v[x >> 1]);
+	}
+}
+
+
+/**
+ * Load a pixel and it's right neighbour with
+ * their channels interleaved.
+ */
+__attribute__((target("sse2")))
+static inline __m128i
+hscale_load_sse2(const uint8_t * const src)
+{
+	const __m128i p = _mm_loadl_epi64((const __m128i*) src);
+	return _mm_unpacklo_epi8(p, _mm_srli_si128(p, 4));
+}
+
+
+__attribute__((target("sse2")))
+static void
+hscale_sse2(uint8_t *dst, const uint8_t *src,
+	const int dst_w, const int src_w, const int xstep)
+{
+	int x = 0, pos = (xstep >> 1) - 0x8000;
+	const int edge = hscale_edge(dst_w, src_w, xstep);
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i round = _mm_set1_epi32(128);
+
+	for (; x + 2 <= edge; x += 2, pos += xstep * 2) {
+		const int p0 = MAX(pos, 0), p1 = MAX(pos + xstep, 0);
+		const int w0 = (p0 >> 8) & 0xFF, w1 = (p1 >> 8) & 0xFF;
+		const __m128i s = _mm_unpacklo_epi64(
+			hscale_load_sse2(src + ((p0 >> 16) * 4)),
+			hscale_load_sse2(src + ((p1 >> 16) * 4)));
+		__m128i lo = _mm_madd_epi16(_mm_unpacklo_epi8(s, zero),
+			_mm_set1_epi32((w0 << 16) | (256 - w0)));
+		__m128i hi = _mm_madd_epi16(_mm_unpackhi_epi8(s, zero),
+			_mm_set1_epi32((w1 << 16) | (256 - w1)));
+		lo = _mm_srli_epi32(_mm_add_epi32(lo, round), 8);
+		hi = _mm_srli_epi32(_mm_add_epi32(hi, round), 8);
+		lo = _mm_packs_epi32(lo, hi);
+		_mm_storel_epi64((__m128i*) (dst + (x * 4)), _mm_packus_epi16(lo, lo));
+	}
+
+	hscale_tail(dst, src, x, dst_w, src_w, pos, xstep);
+}
+
+
+__attribute__((target("sse2")))
+static void
+vscale_sse2(uint8_t *dst, const uint8_t *top,
+	const uint8_t *bottom, const int wy, const int n)
+{
+	int i;
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i w0 = _mm_set1_epi16(256 - wy);
+	const __m128i w1 = _mm_set1_epi16(wy);
+	const __m128i round = _mm_set1_epi16(128);
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		const __m128i t = _mm_loadu_si128((const __m128i*) (top + i));
+		const __m128i b = _mm_loadu_si128((const __m128i*) (bottom + i));
+		__m128i lo = _mm_add_epi16(
+			_mm_mullo_epi16(_mm_unpacklo_epi8(t, zero), w0),
+			_mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), w1));
+		__m128i hi = _mm_add_epi16(
+			_mm_mullo_epi16(_mm_unpackhi_epi8(t, zero), w0),
+			_mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), w1));
+		lo = _mm_srli_epi16(_mm_add_epi16(lo, round), 8);
+		hi = _mm_srli_epi16(_mm_add_epi16(hi, round), 8);
+		_mm_storeu_si128((__m128i*) (dst + i), _mm_packus_epi16(lo, hi));
+	}
+
+	vscale_c(dst + i, top + i, bottom + i, wy, n - i);
+}
+
+
+/**
+ * Blend 2 pixels (unpacked to 16 bits).
+ */
+__attribute__((target("sse2")))
+static inline __m128i
+blend2_sse2(const __m128i s, const __m128i d)
+{
+	__m128i ia = _mm_shufflelo_epi16(s, _MM_SHUFFLE(3, 3, 3, 3));
+	ia = _mm_shufflehi_epi16(ia, _MM_SHUFFLE(3, 3, 3, 3));
+	ia = _mm_sub_epi16(_mm_set1_epi16(255), ia);
+	__m128i t = _mm_add_epi16(_mm_mullo_epi16(d, ia), _mm_set1_epi16(128));
+	return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+
+__attribute__((target("sse2")))
+static void
+blend_sse2(uint8_t *dst, const uint8_t *src, const int w)
+{
+	int x;
+	const __m128i zero = _mm_setzero_si128();
+
+	for (x = 0; x + 4 <= w; x += 4, dst += 16, src += 16) {
+		const __m128i s = _mm_loadu_si128((const __m128i*) src);
+		const __m128i d = _mm_loadu_si128((const __m128i*) dst);
+		const __m128i lo = blend2_sse2(_mm_unpacklo_epi8(s, zero),
+			_mm_unpacklo_epi8(d, zero));
+		const __m128i hi = blend2_sse2(_mm_unpackhi_epi8(s, zero),
+			_mm_unpackhi_epi8(d, zero));
+		_mm_storeu_si128((__m128i*) dst,
+			_mm_adds_epu8(s, _mm_packus_epi16(lo, hi)));
+	}
+
+	blend_c(dst, src, w - x);
+}
+
+
+__attribute__((target("sse2")))
+static void
+splituv_sse2(uint8_t *u, uint8_t *v, const uint8_t *uv, const int n)
+{
+	int i;
+	const __m128i mask = _mm_set1_epi16(0x00FF);
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		const __m128i lo = _mm_loadu_si128((const __m128i*) (uv + (i * 2)));
+		const __m128i hi = _mm_loadu_si128((const __m128i*) (uv + (i * 2) + 16));
+		_mm_storeu_si128((__m128i*) (u + i), _mm_packus_epi16(
+			_mm_and_si128(lo, mask), _mm_and_si128(hi, mask)));
+		_mm_storeu_si128((__m128i*) (v + i), _mm_packus_epi16(
+			_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8)));
+	}
+
+	splituv_c(u + i, v + i, uv + (i * 2), n - i);
+}
+
+
+/**
+ * The shift is at least 1 so packus never sees
+ * a negative value.
+ */
+__attribute__((target("sse2")))
+static void
+shift16_sse2(uint8_t *dst, const uint16_t *src, const int n, const int shift)
+{
+	int i;
+	const __m128i count = _mm_cvtsi32_si128(shift);
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		const __m128i lo = _mm_srl_epi16(
+			_mm_loadu_si128((const __m128i*) (src + i)), count);
+		const __m128i hi = _mm_srl_epi16(
+			_mm_loadu_si128((const __m128i*) (src + i + 8)), count);
+		_mm_storeu_si128((__m128i*) (dst + i), _mm_packus_epi16(lo, hi));
+	}
+
+	shift16_c(dst + i, src + i, n - i, shift);
+}
+
+
+__attribute__((target("sse2")))
+static void
+mergeuv16_sse2(uint8_t *uv, const uint16_t *u, const uint16_t *v,
+	const int n, const int shift)
+{
+	int i;
+	const __m128i count = _mm_cvtsi32_si128(shift);
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		const __m128i u8 = _mm_packus_epi16(
+			_mm_srl_epi16(_mm_loadu_si128((const __m128i*) (u + i)), count),
+			_mm_srl_epi16(_mm_loadu_si128((const __m128i*) (u + i + 8)), count));
+		const __m128i v8 = _mm_packus_epi16(
+			_mm_srl_epi16(_mm_loadu_si128((const __m128i*) (v + i)), count),
+			_mm_srl_epi16(_mm_loadu_si128((const __m128i*) (v + i + 8)), count));
+		_mm_storeu_si128((__m128i*) (uv + (i * 2)), _mm_unpacklo_epi8(u8, v8));
+		_mm_storeu_si128((__m128i*) (uv + (i * 2) + 16), _mm_unpackhi_epi8(u8, v8));
+	}
+
+	mergeuv16_c(uv + (i * 2), u + i, v + i, n - i, shift);
+}
+
+
+static const struct avbox_video_kernels kernels_sse2 =
+{
+	.name = "sse2",
+	.yuv2bgra = yuv2bgra_sse2,
+	.hscale = hscale_sse2,
+	.vscale = vscale_sse2,
+	.blend = blend_sse2,
+	.splituv = splituv_sse2,
+	.shift16 = shift16_sse2,
+	.mergeuv16 = mergeuv16_sse2
+};
+
+
+/**
+ * Convert 16 pixels to 16 bit B, G and R values.
+ */
+__attribute__((target("avx2")))
+static inline void
+yuv2bgra16_avx2(__m256i y, __m256i d, __m256i e,
+	__m256i * const b, __m256i * const g, __m256i * const r)
+{
+	y = _mm256_sub_epi16(y, _mm256_set1_epi16(16));
+	y = _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(y, _mm256_set1_epi16(74)),
+		_mm256_srai_epi16(y, 1)), _mm256_set1_epi16(32));
+	d = _mm256_sub_epi16(d, _mm256_set1_epi16(128));
+	e = _mm256_sub_epi16(e, _mm256_set1_epi16(128));
+	*b = _mm256_srai_epi16(_mm256_adds_epi16(y,
+		_mm256_mullo_epi16(d, _mm256_set1_epi16(129))), 6);
+	*g = _mm256_srai_epi16(_mm256_sub_epi16(_mm256_sub_epi16(y,
+		_mm256_mullo_epi16(d, _mm256_set1_epi16(25))),
+		_mm256_mullo_epi16(e, _mm256_set1_epi16(52))), 6);
+	*r = _mm256_srai_epi16(_mm256_add_epi16(y,
+		_mm256_mullo_epi16(e, _mm256_set1_epi16(102))), 6);
+}
+
+
+/**
+ * Load 8 chroma samples and duplicate each one.
+ */
+__attribute__((target("avx2")))
+static inline __m256i
+chroma16_avx2(const uint8_t * const src)
+{
+	const __m128i c = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i*) src));
+	return _mm256_inserti128_si256(_mm256_castsi128_si256(
+		_mm_unpacklo_epi16(c, c)), _mm_unpackhi_epi16(c, c), 1);
+}
+
+
+/**
+ * Pack 16 words into 16 bytes (in order).
+ */
+__attribute__((target("avx2")))
+static inline __m128i
+pack16_avx2(const __m256i x)
+{
+	return _mm_packus_epi16(_mm256_castsi256_si128(x),
+		_mm256_extracti128_si256(x, 1));
+}
+
+
+__attribute__((target("avx2")))
+static void
+yuv2bgra_avx2(uint8_t *dst, const uint8_t *y,
+	const uint8_t *u, const uint8_t *v, const int w)
+{
+	int x;
+
+	for (x = 0; x + 16 <= w; x += 16, dst += 64) {
+		__m256i b, g, r;
+		yuv2bgra16_avx2(
+			_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*) (y + x))),
+			chroma16_avx2(u + (x >> 1)), chroma16_avx2(v + (x >> 1)),
+			&b, &g, &r);
+		store_bgra_sse2(dst, pack16_avx2(b), pack16_avx2(g), pack16_avx2(r));
+	}
+
+	for (; x < w; x++, dst += 4) {
+		yuv2bgra_pixel(dst, y[x], u[x >> 1], v[x >> 1]);
+	}
+}
+
+
+__attribute__((target("avx2")))
+static void
+vscale_avx2(uint8_t *dst, const uint8_t *top,
+	const uint8_t *bottom, const int wy, const int n)
+{
+	int i;
+	const __m256i w0 = _mm256_set1_epi16(256 - wy);
+	const __m256i w1 = _mm256_set1_epi16(wy);
+	const __m256i round = _mm256_set1_epi16(128);
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		const __m256i t = _mm256_cvtepu8_epi16(
+			_mm_loadu_si128((const __m128i*) (top + i)));
+		const __m256i b = _mm256_cvtepu8_epi16(
+			_mm_loadu_si128((const __m128i*) (bottom + i)));
+		__m256i x = _mm256_add_epi16(_mm256_mullo_epi16(t, w0),
+			_mm256_mullo_epi16(b, w1));
+		x = _mm256_srli_epi16(_mm256_add_epi16(x, round), 8);
+		_mm_storeu_si128((__m128i*) (dst + i), pack16_avx2(x));
+	}
+
+	vscale_c(dst + i, top + i, bottom + i, wy, n - i);
+}
+
+
+__attribute__((target("avx2")))
+static void
+blend_avx2(uint8_t *dst, const uint8_t *src, const int w)
+{
+	int x;
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i max = _mm256_set1_epi16(255);
+	const __m256i round = _mm256_set1_epi16(128);
+
+	/* all operations stay within 128 bit lanes so the
+	 * pixels come out in the same order */
+	for (x = 0; x + 8 <= w; x += 8, dst += 32, src += 32) {
+		const __m256i s = _mm256_loadu_si256((const __m256i*) src);
+		const __m256i d = _mm256_loadu_si256((const __m256i*) dst);
+		__m256i s_lo = _mm256_unpacklo_epi8(s, zero);
+		__m256i s_hi = _mm256_unpackhi_epi8(s, zero);
+		__m256i ia_lo = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s_lo,
+			_MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+		__m256i ia_hi = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s_hi,
+			_MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+		__m256i lo = _mm256_add_epi16(_mm256_mullo_epi16(
+			_mm256_unpacklo_epi8(d, zero), _mm256_sub_epi16(max, ia_lo)), round);
+		__m256i hi = _mm256_add_epi16(_mm256_mullo_epi16(
+			_mm256_unpackhi_epi8(d, zero), _mm256_sub_epi16(max, ia_hi)), round);
+		lo = _mm256_srli_epi16(_mm256_add_epi16(lo, _mm256_srli_epi16(lo, 8)), 8);
+		hi = _mm256_srli_epi16(_mm256_add_epi16(hi, _mm256_srli_epi16(hi, 8)), 8);
+		_mm256_storeu_si256((__m256i*) dst,
+			_mm256_adds_epu8(s, _mm256_packus_epi16(lo, hi)));
+	}
+
+	blend_sse2(dst, src, w - x);
+}
+
+
+static const struct avbox_video_kernels kernels_avx2 =
+{
+	.name = "avx2",
+	.yuv2bgra = yuv2bgra_avx2,
+	.hscale = hscale_sse2,	/* gathers don't pay off here */
+	.vscale = vscale_avx2,
+	.blend = blend_avx2,
+	.splituv = splituv_sse2,	/* memory bound */
+	.shift16 = shift16_sse2,
+	.mergeuv16 = mergeuv16_sse2
+};
+
+#endif /* AVBOX_SIMD_HAVE_X86 */
+
+
+#ifdef AVBOX_SIMD_HAVE_NEON
+
+/**
+ * Convert 8 pixels.
+ */
+static inline uint8x8x4_t
+yuv2bgra8_neon(const uint8x8_t y8, const uint8x8_t u8, const uint8x8_t v8)
+{
+	uint8x8x4_t px;
+	int16x8_t y = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(y8)), vdupq_n_s16(16));
+	const int16x8_t d = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(u8)), vdupq_n_s16(128));
+	const int16x8_t e = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(v8)), vdupq_n_s16(128));
+
+	y = vaddq_s16(vaddq_s16(vmulq_n_s16(y, 74), vshrq_n_s16(y, 1)), vdupq_n_s16(32));
+	px.val[0] = vqmovun_s16(vshrq_n_s16(vqaddq_s16(y, vmulq_n_s16(d, 129)), 6));
+	px.val[1] = vqmovun_s16(vshrq_n_s16(vsubq_s16(vsubq_s16(y,
+		vmulq_n_s16(d, 25)), vmulq_n_s16(e, 52)), 6));
+	px.val[2] = vqmovun_s16(vshrq_n_s16(vaddq_s16(y, vmulq_n_s16(e, 102)), 6));
+	px.val[3] = vdup_n_u8(0xFF);
+	return px;
+}
+
+
+static void
+yuv2bgra_neon(uint8_t *dst, const uint8_t *y,
+	const uint8_t *u, const uint8_t *v, const int w)
+{
+	int x;
+
+	for (x = 0; x + 16 <= w; x += 16, dst += 64) {
+		const uint8x16_t yy = vld1q_u8(y + x);
+		const uint8x8_t u8 = vld1_u8(u + (x >> 1));
+		const uint8x8_t v8 = vld1_u8(v + (x >> 1));
+		const uint8x8x2_t uu = vzip_u8(u8, u8);
+		const uint8x8x2_t vv = vzip_u8(v8, v8);
+		vst4_u8(dst, yuv2bgra8_neon(vget_low_u8(yy), uu.val[0], vv.val[0]));
+		vst4_u8(dst + 32, yuv2bgra8_neon(vget_high_u8(yy), uu.val[1], vv.val[1]));
+	}
+
+	for (; x < w; x++, dst += 4) {
+		yuv2bgra_pixel(dst, y[x], u[x >> 1], v[x >> 1]);
+	}
+}
+
+
+/**
+ * Interpolate a pixel with it's right neighbour.
+ */
+static inline uint16x4_t
+hscale_pixel_neon(const uint8_t * const src, const int w1)
+{
+	const uint16x8_t p = vmovl_u8(vld1_u8(src));
+	const uint16x8_t w = vcombine_u16(vdup_n_u16(256 - w1), vdup_n_u16(w1));
+	const uint16x8_t x = vmulq_u16(p, w);
+	return vadd_u16(vget_low_u16(x), vget_high_u16(x));
+}
+
+
+static void
+hscale_neon(uint8_t *dst, const uint8_t *src,
+	const int dst_w, const int src_w, const int xstep)
+{
+	int x = 0, pos = (xstep >> 1) - 0x8000;
+	const int edge = hscale_edge(dst_w, src_w, xstep);
+
+	for (; x + 2 <= edge; x += 2, pos += xstep * 2) {
+		const int p0 = MAX(pos, 0), p1 = MAX(pos + xstep, 0);
+		const uint16x8_t s = vcombine_u16(
+			hscale_pixel_neon(src + ((p0 >> 16) * 4), (p0 >> 8) & 0xFF),
+			hscale_pixel_neon(src + ((p1 >> 16) * 4), (p1 >> 8) & 0xFF));
+		vst1_u8(dst + (x * 4), vrshrn_n_u16(s, 8));
+	}
+
+	hscale_tail(dst, src, x, dst_w, src_w, pos, xstep);
+}
+
+
+static void
+vscale_neon(uint8_t *dst, const uint8_t *top,
+	const uint8_t *bottom, const int wy, const int n)
+{
+	int i;
+	const uint16_t w0 = 256 - wy, w1 = wy;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		const uint8x16_t t = vld1q_u8(top + i);
+		const uint8x16_t b = vld1q_u8(bottom + i);
+		uint16x8_t lo = vmulq_n_u16(vmovl_u8(vget_low_u8(t)), w0);
+		uint16x8_t hi = vmulq_n_u16(vmovl_u8(vget_high_u8(t)), w0);
+		lo = vmlaq_n_u16(lo, vmovl_u8(vget_low_u8(b)), w1);
+		hi = vmlaq_n_u16(hi, vmovl_u8(vget_high_u8(b)), w1);
+		vst1q_u8(dst + i, vcombine_u8(vrshrn_n_u16(lo, 8), vrshrn_n_u16(hi, 8)));
+	}
+
+	vscale_c(dst + i, top + i, bottom + i, wy, n - i);
+}
+
+
+static void
+blend_neon(uint8_t *dst, const uint8_t *src, const int w)
+{
+	int x, c;
+
+	for (x = 0; x + 8 <= w; x += 8, dst += 32, src += 32) {
+		const uint8x8x4_t s = vld4_u8(src);
+		uint8x8x4_t d = vld4_u8(dst);
+		const uint8x8_t ia = vmvn_u8(s.val[3]);
+		for (c = 0; c < 4; c++) {
+			const uint16x8_t t = vmull_u8(d.val[c], ia);
+			d.val[c] = vqadd_u8(s.val[c], vraddhn_u16(t, vrshrq_n_u16(t, 8)));
+		}
+		vst4_u8(dst, d);
+	}
+
+	blend_c(dst, src, w - x);
+}
+
+
+static void
+splituv_neon(uint8_t *u, uint8_t *v, const uint8_t *uv, const int n)
+{
+	int i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		const uint8x16x2_t s = vld2q_u8(uv + (i * 2));
+		vst1q_u8(u + i, s.val[0]);
+		vst1q_u8(v + i, s.val[1]);
+	}
+
+	splituv_c(u + i, v + i, uv + (i * 2), n - i);
+}
+
+
+static void
+shift16_neon(uint8_t *dst, const uint16_t *src, const int n, const int shift)
+{
+	int i;
+	const int16x8_t count = vdupq_n_s16(-shift);
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		vst1_u8(dst + i, vqmovn_u16(vshlq_u16(vld1q_u16(src + i), count)));
+	}
+
+	shift16_c(dst + i, src + i, n - i, shift);
+}
+
+
+static void
+mergeuv16_neon(uint8_t *uv, const uint16_t *u, const uint16_t *v,
+	const int n, const int shift)
+{
+	int i;
+	uint8x8x2_t d;
+	const int16x8_t count = vdupq_n_s16(-shift);
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		d.val[0] = vqmovn_u16(vshlq_u16(vld1q_u16(u + i), count));
+		d.val[1] = vqmovn_u16(vshlq_u16(vld1q_u16(v + i), count));
+		vst2_u8(uv + (i * 2), d);
+	}
+
+	mergeuv16_c(uv + (i * 2), u + i, v + i, n - i, shift);
+}
+
+
+static const struct avbox_video_kernels kernels_neon =
+{
+	.name = "neon",
+	.yuv2bgra = yuv2bgra_neon,
+	.hscale = hscale_neon,
+	.vscale = vscale_neon,
+	.blend = blend_neon,
+	.splituv = splituv_neon,
+	.shift16 = shift16_neon,
+	.mergeuv16 = mergeuv16_neon
+};
+
+#endif /* AVBOX_SIMD_HAVE_NEON */
+
+
+static const struct avbox_video_kernels *kernels = &kernels_c;
+
+
+/**
+ * Pick the best pixel kernels supported by the CPU. Only
+ * the instruction sets in the allowed mask are considered.
+ * Returns the instruction set selected.
+ */
+unsigned int
+avbox_video_simd_init(const unsigned int allowed)
+{
+	unsigned int selected = AVBOX_SIMD_SCALAR;
+
+	kernels = &kernels_c;
+
+#ifdef AVBOX_SIMD_HAVE_X86
+	__builtin_cpu_init();
+	if ((allowed & AVBOX_SIMD_AVX2) && __builtin_cpu_supports("avx2")) {
+		kernels = &kernels_avx2;
+		selected = AVBOX_SIMD_AVX2;
+	} else if ((allowed & AVBOX_SIMD_SSE2) && __builtin_cpu_supports("sse2")) {
+		kernels = &kernels_sse2;
+		selected = AVBOX_SIMD_SSE2;
+	}
+#endif
+#ifdef AVBOX_SIMD_HAVE_NEON
+#	ifdef __aarch64__
+	const int have_neon = 1;
+#	else
+	const int have_neon = (getauxval(AT_HWCAP) & HWCAP_NEON) != 0;
+#	endif
+	if ((allowed & AVBOX_SIMD_NEON) && have_neon) {
+		kernels = &kernels_neon;
+		selected = AVBOX_SIMD_NEON;
+	}
+#endif
+
+	return selected;
+}
+
+
+/**
+ * Gets the name of the kernels in use.
+ */
+const char *
+avbox_video_simd_name(void)
+{
+	return kernels->name;
+}
+
+
+/**
+ * Convert a YUV420P image to BGRA.
+ */
+void
+avbox_video_simd_yuv420p2bgra(uint8_t *dst, const int dst_pitch,
+	const uint8_t * const * const planes, const int * const pitches,
+	const int w, const int h)
+{
+	int y;
+	for (y = 0; y < h; y++, dst += dst_pitch) {
+		kernels->yuv2bgra(dst,
+			planes[0] + (y * pitches[0]),
+			planes[1] + ((y >> 1) * pitches[1]),
+			planes[2] + ((y >> 1) * pitches[2]), w);
+	}
+}
+
+
+/**
+ * Reduce a plane of 16 bit samples to 8 bits.
+ */
+void
+avbox_video_simd_shift16(uint8_t *dst, const int dst_pitch,
+	const uint8_t *src, const int src_pitch, const int n, const int h,
+	const int shift)
+{
+	int y;
+	for (y = 0; y < h; y++, dst += dst_pitch, src += src_pitch) {
+		kernels->shift16(dst, (const uint16_t*) src, n, shift);
+	}
+}
+
+
+/**
+ * Reduce 16 bit U and V planes to an NV12 chroma plane.
+ */
+void
+avbox_video_simd_mergeuv16(uint8_t *uv, const int uv_pitch,
+	const uint8_t *u, const int u_pitch, const uint8_t *v, const int v_pitch,
+	const int n, const int h, const int shift)
+{
+	int y;
+	for (y = 0; y < h; y++, uv += uv_pitch, u += u_pitch, v += v_pitch) {
+		kernels->mergeuv16(uv, (const uint16_t*) u, (const uint16_t*) v, n, shift);
+	}
+}
+
+
+/**
+ * Deinterleave an NV12 chroma plane.
+ */
+void
+avbox_video_simd_splituv(uint8_t *u, const int u_pitch,
+	uint8_t *v, const int v_pitch, const uint8_t *uv, const int uv_pitch,
+	const int n, const int h)
+{
+	int y;
+	for (y = 0; y < h; y++, u += u_pitch, v += v_pitch, uv += uv_pitch) {
+		kernels->splituv(u, v, uv, n);
+	}
+}
+
+
+/**
+ * Alpha blend a premultiplied BGRA image into another.
+ */
+void
+avbox_video_simd_blend(uint8_t *dst, const int dst_pitch,
+	const uint8_t *src, const int src_pitch, const int w, const int h)
+{
+	int y;
+	for (y = 0; y < h; y++, dst += dst_pitch, src += src_pitch) {
+		kernels->blend(dst, src, w);
+	}
+}
+
+
+/**
+ * Initialize a scaler.
+ */
+void
+avbox_video_scaler_init(struct avbox_video_scaler * const scaler)
+{
+	memset(scaler, 0, sizeof(struct avbox_video_scaler));
+}
+
+
+/**
+ * Free the scaler's line buffers.
+ */
+void
+avbox_video_scaler_free(struct avbox_video_scaler * const scaler)
+{
+	if (scaler->buf != NULL) {
+		free(scaler->buf);
+	}
+	avbox_video_scaler_init(scaler);
+}
+
+
+/**
+ * Gets the size of the scratch buffer needed by
+ * avbox_video_simd_yuvrow() for a row of w pixels.
+ */
+static inline size_t
+avbox_video_simd_yuvrow_sz(const int w)
+{
+	return ((w + (((w + 1) >> 1) * 4)) + 31) & ~31;
+}
+
+
+/**
+ * Gets 8 bit planar Y, U and V rows for image row y. Formats
+ * other than YUV420P are converted into tmp. If chroma is not
+ * set the U and V rows from the previous call are reused.
+ */
+static void
+avbox_video_simd_yuvrow(const unsigned int pix_fmt,
+	const uint8_t * const * const planes, const int * const pitches,
+	const int y, const int w, uint8_t * const tmp, const int chroma,
+	const uint8_t **py, const uint8_t **pu, const uint8_t **pv)
+{
+	const int cw = (w + 1) >> 1;
+	const int cy = y >> 1;
+	uint8_t * const u = tmp + w;
+	uint8_t * const v = u + cw;
+	uint8_t * const uv = v + cw;
+
+	switch (pix_fmt) {
+	case AVBOX_PIXFMT_YUV420P:
+		*py = planes[0] + (y * pitches[0]);
+		*pu = planes[1] + (cy * pitches[1]);
+		*pv = planes[2] + (cy * pitches[2]);
+		return;
+	case AVBOX_PIXFMT_NV12:
+		*py = planes[0] + (y * pitches[0]);
+		if (chroma) {
+			kernels->splituv(u, v, planes[1] + (cy * pitches[1]), cw);
+		}
+		break;
+	case AVBOX_PIXFMT_P010:
+		kernels->shift16(tmp, (const uint16_t*)
+			(planes[0] + (y * pitches[0])), w, 8);
+		if (chroma) {
+			kernels->shift16(uv, (const uint16_t*)
+				(planes[1] + (cy * pitches[1])), cw * 2, 8);
+			kernels->splituv(u, v, uv, cw);
+		}
+		*py = tmp;
+		break;
+	case AVBOX_PIXFMT_YUV420P10:
+		kernels->shift16(tmp, (const uint16_t*)
+			(planes[0] + (y * pitches[0])), w, 2);
+		if (chroma) {
+			kernels->shift16(u, (const uint16_t*)
+				(planes[1] + (cy * pitches[1])), cw, 2);
+			kernels->shift16(v, (const uint16_t*)
+				(planes[2] + (cy * pitches[2])), cw, 2);
+		}
+		*py = tmp;
+		break;
+	default:
+		abort();
+	}
+	*pu = u;
+	*pv = v;
+}
+
+
+/**
+ * Checks if the format is one of the YUV 4:2:0
+ * formats we can convert.
+ */
+static inline int
+avbox_video_simd_isyuv(const unsigned int pix_fmt)
+{
+	return pix_fmt == AVBOX_PIXFMT_YUV420P || pix_fmt == AVBOX_PIXFMT_NV12 ||
+		pix_fmt == AVBOX_PIXFMT_P010 || pix_fmt == AVBOX_PIXFMT_YUV420P10;
+}
+
+
+/**
+ * Make sure the scaler's buffer can hold at least bufsz bytes.
+ */
+static int
+avbox_video_scaler_grow(struct avbox_video_scaler * const scaler,
+	const size_t bufsz)
+{
+	if (UNLIKELY(scaler->bufsz < bufsz)) {
+		if (scaler->buf != NULL) {
+			free(scaler->buf);
+			scaler->buf = NULL;
+			scaler->bufsz = 0;
+		}
+		if ((errno = posix_memalign((void**) &scaler->buf, 32, bufsz)) != 0) {
+			scaler->buf = NULL;
+			return -1;
+		}
+		scaler->bufsz = bufsz;
+	}
+	return 0;
+}
+
+
+/**
+ * Convert a YUV 4:2:0 image in any of the supported
+ * layouts to BGRA. The scaler is only used for it's
+ * scratch buffer. Returns -1 and sets errno to ENOTSUP if
+ * the pixel format is not supported.
+ */
+int
+avbox_video_simd_yuv2bgra(struct avbox_video_scaler * const scaler,
+	uint8_t *dst, const int dst_pitch, const unsigned int pix_fmt,
+	const uint8_t * const * const planes, const int * const pitches,
+	const int w, const int h)
+{
+	int y;
+	const uint8_t *py, *pu = NULL, *pv = NULL;
+
+	if (pix_fmt == AVBOX_PIXFMT_YUV420P) {
+		avbox_video_simd_yuv420p2bgra(dst, dst_pitch, planes, pitches, w, h);
+		return 0;
+	} else if (!avbox_video_simd_isyuv(pix_fmt)) {
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	if (avbox_video_scaler_grow(scaler, avbox_video_simd_yuvrow_sz(w)) == -1) {
+		return -1;
+	}
+
+	for (y = 0; y < h; y++, dst += dst_pitch) {
+		avbox_video_simd_yuvrow(pix_fmt, planes, pitches, y, w,
+			scaler->buf, !(y & 1), &py, &pu, &pv);
+		kernels->yuv2bgra(dst, py, pu, pv, w);
+	}
+	return 0;
+}
+
+
+/**
+ * Gets a horizontally scaled source row. Rows are requested
+ * in increasing order so we keep the last two around.
+ */
+static const uint8_t *
+avbox_video_scaler_row(struct avbox_video_scaler * const scaler,
+	const int sy, const unsigned int pix_fmt,
+	const uint8_t * const * const planes, const int * const pitches,
+	const int src_w, const int dst_w, const int xstep)
+{
+	int slot;
+	const uint8_t *src;
+
+	if (scaler->row_y[0] == sy) {
+		return scaler->rows[0];
+	} else if (scaler->row_y[1] == sy) {
+		return scaler->rows[1];
+	}
+
+	slot = (scaler->row_y[0] < scaler->row_y[1]) ? 0 : 1;
+
+	if (pix_fmt == AVBOX_PIXFMT_BGRA) {
+		src = planes[0] + (sy * pitches[0]);
+		if (src_w == dst_w) {
+			return src;
+		}
+	} else {
+		const uint8_t *py, *pu, *pv;
+		uint8_t * const row = (src_w == dst_w) ?
+			scaler->rows[slot] : scaler->src_row;
+		avbox_video_simd_yuvrow(pix_fmt, planes, pitches, sy, src_w,
+			scaler->yuv_row, 1, &py, &pu, &pv);
+		kernels->yuv2bgra(row, py, pu, pv, src_w);
+		src = row;
+	}
+
+	if (src_w != dst_w) {
+		kernels->hscale(scaler->rows[slot], src, dst_w, src_w, xstep);
+	}
+
+	scaler->row_y[slot] = sy;
+	return scaler->rows[slot];
+}
+
+
+/**
+ * Bilinear scale a BGRA or YUV 4:2:0 image into a BGRA
+ * buffer. Returns -1 and sets errno to ENOTSUP if the pixel
+ * format is not supported.
+ */
+int
+avbox_video_simd_scale(struct avbox_video_scaler * const scaler,
+	uint8_t *dst, const int dst_pitch, const int dst_w, const int dst_h,
+	const unsigned int pix_fmt, const uint8_t * const * const planes,
+	const int * const pitches, const int src_w, const int src_h)
+{
+	int y, pos;
+	const int xstep = (src_w << 16) / dst_w;
+	const int ystep = (src_h << 16) / dst_h;
+	const size_t row_sz = ((dst_w * 4) + 31) & ~31;
+	const size_t src_row_sz = ((src_w * 4) + 31) & ~31;
+	const size_t bufsz = (row_sz * 2) + src_row_sz +
+		avbox_video_simd_yuvrow_sz(src_w);
+
+	if (pix_fmt != AVBOX_PIXFMT_BGRA && !avbox_video_simd_isyuv(pix_fmt)) {
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	/* grow the line buffers if needed */
+	if (avbox_video_scaler_grow(scaler, bufsz) == -1) {
+		return -1;
+	}
+
+	scaler->rows[0] = scaler->buf;
+	scaler->rows[1] = scaler->buf + row_sz;
+	scaler->src_row = scaler->buf + (row_sz * 2);
+	scaler->yuv_row = scaler->src_row + src_row_sz;
+	scaler->row_y[0] = scaler->row_y[1] = -1;
+
+	for (y = 0, pos = (ystep >> 1) - 0x8000; y < dst_h; y++, pos += ystep, dst += dst_pitch) {
+		const int p = MAX(pos, 0);
+		const int sy = p >> 16;
+		const int wy = (p >> 8) & 0xFF;
+		const uint8_t * const top = avbox_video_scaler_row(scaler, sy,
+			pix_fmt, planes, pitches, src_w, dst_w, xstep);
+
+		if (wy == 0 || sy + 1 >= src_h) {
+			memcpy(dst, top, dst_w * 4);
+		} else {
+			const uint8_t * const bottom = avbox_video_scaler_row(scaler, sy + 1,
+				pix_fmt, planes, pitches, src_w, dst_w, xstep);
+			kernels->vscale(dst, top, bottom, wy, dst_w * 4);
+		}
+	}
+
+	return 0;
+}
@@ -57,6 +57,8 @@ struct mbv_surface
 	uint32_t y;
 	uint32_t realx;
 	uint32_t realy;
+	struct avbox_swscache scaler;
+	struct avbox_video_scaler simd_scaler;
 };
 
 
@@ -64,7 +66,7 @@ struct mbv_surface
 static struct mbv_surface *display_surface;
 static struct mbv_surface *root_surface;
 static void (*wait_for_vsync)(void);
-static void (*swap_buffers)(void);
+static void (*swap_buffers)(uint8_t ** const front, uint8_t ** const back);
 
 
 static int
@@ -93,6 +95,8 @@ surface_new(struct mbv_surface *parent,
 	inst->h = h;
 	inst->x = x;
 	inst->y = y;
+	avbox_ffmpegutil_swscache_init(&inst->scaler);
+	avbox_video_scaler_init(&inst->simd_scaler);
 
 	if (parent == NULL) {
 		inst->parent = NULL;
@@ -148,31 +152,26 @@ surface_blitbuf(struct mbv_surface * const surface,
 {
 	switch (pix_fmt) {
 	case AVBOX_PIXFMT_YUV420P:
+	case AVBOX_PIXFMT_NV12:
+	case AVBOX_PIXFMT_P010:
+	case AVBOX_PIXFMT_YUV420P10:
 	{
-		int dstpitch;
+		int dstpitch, ret;
 		uint8_t *surface_buf;
-		struct SwsContext *swscale;
-
-		if ((swscale = sws_getContext(
-			w, h, avbox_pixfmt_to_libav(pix_fmt),
-			w, h, AV_PIX_FMT_BGRA,
-			SWS_FAST_BILINEAR,
-			NULL, NULL, NULL)) == NULL) {
-			LOG_PRINT_ERROR("Could not create swscale context!");
-			return -1;
-		}
 
 		if ((surface_buf = surface_lock(surface, MBV_LOCKFLAGS_WRITE, &dstpitch)) == NULL) {
-			sws_freeContext(swscale);
 			return -1;
 		}
 
 		surface_buf += dstpitch * y;
 		surface_buf += x * 4;
-		sws_scale(swscale, (const uint8_t**) buf,
-			pitch, 0, h, &surface_buf, &dstpitch);
+		ret = avbox_video_simd_yuv2bgra(&surface->simd_scaler,
+			surface_buf, dstpitch, pix_fmt,
+			(const uint8_t * const *) buf, pitch, w, h);
 		surface_unlock(surface);
-		sws_freeContext(swscale);
+		if (ret == -1) {
+			return -1;
+		}
 		break;
 	}
 	case AVBOX_PIXFMT_BGRA:
@@ -194,7 +193,12 @@ surface_blitbuf(struct mbv_surface * const surface,
 
 		dst += y * dst_pitch;
 
-		if (0 && x == 0 && *pitch == dst_pitch && pitch[0] == (w * 4)) {
+		if (flags & MBV_BLITFLAGS_ALPHABLEND) {
+			/* cairo surfaces are premultiplied so we
+			 * composite with the OVER operator */
+			avbox_video_simd_blend(dst + (x * 4), dst_pitch,
+				*buf, pitch[0], w, h);
+		} else if (0 && x == 0 && *pitch == dst_pitch && pitch[0] == (w * 4)) {
 			/* both surfaces are in contiguos memory so we
 			 * can just memcpy() the whole thing */
 			memcpy(dst, buf, *pitch * h);
@@ -218,6 +222,77 @@ surface_blitbuf(struct mbv_surface * const surface,
 }
 
 
+/**
+ * Convert and scale a buffer into the surface in
+ * a single pass.
+ */
+static int
+surface_scaleblitbuf(struct mbv_surface * const surface,
+	unsigned int pix_fmt, void **buf, int *pitch, unsigned int flags,
+	int src_w, int src_h, int x, int y, int w, int h)
+{
+	int dstpitch, ret = 0;
+	uint8_t *surface_buf;
+	struct SwsContext *swscale;
+	const enum AVPixelFormat src_fmt = avbox_pixfmt_to_libav(pix_fmt);
+
+	(void) flags;
+
+	if ((surface_buf = surface_lock(surface, MBV_LOCKFLAGS_WRITE, &dstpitch)) == NULL) {
+		return -1;
+	}
+
+	surface_buf += dstpitch * y;
+	surface_buf += x * 4;
+
+	/* use our own kernels if they support the format. If they
+	 * don't fallback to swscale */
+	if (avbox_video_simd_scale(&surface->simd_scaler,
+		surface_buf, dstpitch, w, h, pix_fmt,
+		(const uint8_t * const *) buf, pitch, src_w, src_h) == -1) {
+		if (errno != ENOTSUP) {
+			ret = -1;
+		} else if (src_fmt == AV_PIX_FMT_NONE) {
+			ret = -1;
+		} else if ((swscale = avbox_ffmpegutil_swscache_get(&surface->scaler,
+			src_w, src_h, src_fmt,
+			w, h, AV_PIX_FMT_BGRA,
+			SWS_FAST_BILINEAR)) == NULL) {
+			ret = -1;
+		} else {
+			sws_scale(swscale, (const uint8_t**) buf,
+				pitch, 0, src_h, &surface_buf, &dstpitch);
+		}
+	}
+
+	surface_unlock(surface);
+	return ret;
+}
+
+
+/**
+ * Scale and blit a surface unto another.
+ */
+static int
+surface_scaleblit(struct mbv_surface * const dst,
+	struct mbv_surface * const src,
+	unsigned int flags, int x, int y, int w, int h)
+{
+	void *buf;
+	int pitch, ret;
+
+	if ((buf = surface_lock(src, MBV_LOCKFLAGS_READ, &pitch)) == NULL) {
+		LOG_PRINT_ERROR("Could not lock surface!");
+		return -1;
+	}
+
+	ret = surface_scaleblitbuf(dst, AVBOX_PIXFMT_BGRA, &buf, &pitch, flags,
+		src->w, src->h, x, y, w, h);
+	surface_unlock(src);
+	return ret;
+}
+
+
 static int
 surface_blit(struct mbv_surface * const dst,
 	struct mbv_surface * const src,
@@ -253,16 +328,14 @@ surface_update(struct mbv_surface * const surface,
 	}
 
 	if (surface == root_surface) {
-		if (surface == root_surface) {
+		if (wait_for_vsync != NULL) {
 			wait_for_vsync();
 		}
 		if (ALWAYS_SWAP || swap_buffers != NULL) {
-			/* if the driver supports page flipping just
-			 * swap buffers and request a page flip */
-			uint8_t * const tmp = root_surface->pixels;
-			root_surface->pixels = display_surface->pixels;
-			display_surface->pixels = tmp;
-			swap_buffers();
+			/* if the driver supports page flipping let it
+			 * flip the back buffer in and give us the next
+			 * one. It may have more than two buffers */
+			swap_buffers(&display_surface->pixels, &root_surface->pixels);
 		} else {
 			/* no page flipping support so we need to copy our
 			 * back buffer to the framebuffer manually */
@@ -283,11 +356,68 @@ surface_update(struct mbv_surface * const surface,
 }
 
 
+/**
+ * Update a rectangle of the surface. The root surface
+ * is copied to the screen without flipping, the others are
+ * blitted to the root surface.
+ */
+static void
+surface_updaterect(struct mbv_surface * const surface,
+	int blitflags, int x, int y, int w, int h)
+{
+	ASSERT(surface != NULL);
+
+	if (surface->real != surface) {
+		return;
+	}
+
+	/* clip the rectangle to the surface */
+	if (x < 0) {
+		w += x;
+		x = 0;
+	}
+	if (y < 0) {
+		h += y;
+		y = 0;
+	}
+	w = MIN(w, (int) surface->w - x);
+	h = MIN(h, (int) surface->h - y);
+	if (w <= 0 || h <= 0) {
+		return;
+	}
+
+	if (surface == root_surface) {
+		const uint8_t *src = root_surface->pixels +
+			(y * root_surface->pitch) + (x * 4);
+		uint8_t *dst = display_surface->pixels +
+			(y * display_surface->pitch) + (x * 4);
+		const uint8_t * const end = src + (root_surface->pitch * h);
+
+		/* copy the rectangle straight into the front
+		 * buffer. The rest of the back buffer may be stale
+		 * but it's fully repainted before the next flip */
+		if (wait_for_vsync != NULL) {
+			wait_for_vsync();
+		}
+		for (; src < end; src += root_surface->pitch, dst += display_surface->pitch) {
+			memcpy(dst, src, w * 4);
+		}
+	} else {
+		void *buf = surface->pixels + (y * surface->pitch) + (x * 4);
+		int pitch = surface->pitch;
+		surface_blitbuf(root_surface, AVBOX_PIXFMT_BGRA, &buf, &pitch,
+			blitflags, w, h, surface->x + x, surface->y + y);
+	}
+}
+
+
 static void
 surface_destroy(struct mbv_surface *inst)
 {
 	ASSERT(inst != NULL);
 	ASSERT(inst->pixels != NULL);
+	avbox_ffmpegutil_swscache_free(&inst->scaler);
+	avbox_video_scaler_free(&inst->simd_scaler);
 	if (inst->parent == NULL) {
 		free(inst->pixels);
 	}
@@ -301,10 +431,16 @@ surface_destroy(struct mbv_surface *inst)
 struct mbv_surface *
 avbox_video_softinit(struct mbv_drv_funcs * const funcs,
 	uint8_t *front_pixels, uint8_t *back_pixels, const int w, const int h, const int pitch,
-	void (*wait_for_vsync_fn)(void), void (*swap_buffers_fn)(void))
+	void (*wait_for_vsync_fn)(void),
+	void (*swap_buffers_fn)(uint8_t ** const front, uint8_t ** const back))
 {
 	DEBUG_PRINT(LOG_MODULE, "Initializing software renderer");
 
+	/* pick the pixel kernels for this CPU */
+	avbox_video_simd_init(AVBOX_SIMD_ALL);
+	LOG_VPRINT_INFO("Using %s pixel kernels",
+		avbox_video_simd_name());
+
 	if ((display_surface = malloc(sizeof(struct mbv_surface))) == NULL) {
 		ASSERT(errno == ENOMEM);
 		return NULL;
@@ -350,8 +486,10 @@ avbox_video_softinit(struct mbv_drv_funcs * const funcs,
 	funcs->surface_unlock = &surface_unlock;
 	funcs->surface_blitbuf = &surface_blitbuf;
 	funcs->surface_blit = &surface_blit;
-	funcs->surface_scaleblit = NULL;
+	funcs->surface_scaleblit = &surface_scaleblit;
+	funcs->surface_scaleblitbuf = &surface_scaleblitbuf;
 	funcs->surface_update = &surface_update;
+	funcs->surface_updaterect = &surface_updaterect;
 	funcs->surface_doublebuffered = &surface_doublebuffered;
 	funcs->surface_destroy = &surface_destroy;
 
@@ -198,6 +198,7 @@ end:
 static void
 shutdown(void)
 {
+	avbox_video_glshutdown();
 }
 
 
@@ -127,6 +127,7 @@ init(struct mbv_drv_funcs * const driver, int argc, char **argv, int * const w,
 		goto end;
 	} else {
 		DEBUG_PRINT(LOG_MODULE, "GL Driver Initialized");
+		initialized = 1;
 	}
 
 end:
@@ -138,6 +139,7 @@ static void
 shutdown(void)
 {
 	if (initialized) {
+		avbox_video_glshutdown();
 		glXMakeCurrent(xdisplay, None, NULL);
 		glXDestroyContext(xdisplay, xgl);
 		XDestroyWindow(xdisplay, xwindow);
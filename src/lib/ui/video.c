@@ -69,11 +69,14 @@ struct avbox_window
 	int flags;
 	int damaged;
 	int decor_dirty;
+	int damage_pending;
+	struct avbox_rect damage_rect;
 	int dirty;
 	uint32_t foreground_color;
 	uint32_t background_color;
 	void *user_context;
 	void *draw_context;
+	struct avbox_swscache scaler;
 	LIST_DECLARE(children);
 };
 
@@ -109,7 +112,10 @@ static int
 avbox_rect_overlaps(const struct avbox_rect * const rect1,
 	const struct avbox_rect * const rect2)
 {
-	return 1;
+	return rect1->x < (rect2->x + rect2->w) &&
+		rect2->x < (rect1->x + rect1->w) &&
+		rect1->y < (rect2->y + rect2->h) &&
+		rect2->y < (rect1->y + rect1->h);
 }
 
 
@@ -130,6 +136,95 @@ avbox_rect_covers(const struct avbox_rect * const rect1,
 }
 
 
+/**
+ * Gets the intersection of two rectangles. The rectangles
+ * must overlap.
+ */
+static void
+avbox_rect_intersect(const struct avbox_rect * const rect1,
+	const struct avbox_rect * const rect2, struct avbox_rect * const out)
+{
+	out->x = MAX(rect1->x, rect2->x);
+	out->y = MAX(rect1->y, rect2->y);
+	out->w = MIN(rect1->x + rect1->w, rect2->x + rect2->w) - out->x;
+	out->h = MIN(rect1->y + rect1->h, rect2->y + rect2->h) - out->y;
+}
+
+
+/**
+ * Checks if a rectangle is completely hidden by the opaque
+ * windows on the stack starting at node. The parts not covered
+ * by the first opaque window that overlaps the rectangle are
+ * checked against the windows above it, so a rectangle covered
+ * by several windows is also detected.
+ */
+static int
+avbox_rect_occluded(const struct avbox_rect * const rect,
+	struct avbox_window_node *node)
+{
+	struct avbox_rect part;
+	const struct avbox_rect *cover;
+	int top, bottom;
+
+	while (!LIST_ISNULL(&window_stack, node)) {
+		if (!(node->window->flags & AVBOX_WNDFLAGS_ALPHABLEND) &&
+			avbox_rect_overlaps(&node->window->rect, rect)) {
+			break;
+		}
+		node = LIST_NEXT(struct avbox_window_node*, node);
+	}
+	if (LIST_ISNULL(&window_stack, node)) {
+		return 0;
+	}
+
+	cover = &node->window->rect;
+	node = LIST_NEXT(struct avbox_window_node*, node);
+	top = MAX(rect->y, cover->y);
+	bottom = MIN(rect->y + rect->h, cover->y + cover->h);
+
+	/* check the strips above and bellow the window */
+	if (cover->y > rect->y) {
+		part.x = rect->x;
+		part.y = rect->y;
+		part.w = rect->w;
+		part.h = cover->y - rect->y;
+		if (!avbox_rect_occluded(&part, node)) {
+			return 0;
+		}
+	}
+	if (bottom < (rect->y + rect->h)) {
+		part.x = rect->x;
+		part.y = bottom;
+		part.w = rect->w;
+		part.h = (rect->y + rect->h) - bottom;
+		if (!avbox_rect_occluded(&part, node)) {
+			return 0;
+		}
+	}
+
+	/* and the ones to the left and right */
+	if (cover->x > rect->x) {
+		part.x = rect->x;
+		part.y = top;
+		part.w = cover->x - rect->x;
+		part.h = bottom - top;
+		if (!avbox_rect_occluded(&part, node)) {
+			return 0;
+		}
+	}
+	if ((cover->x + cover->w) < (rect->x + rect->w)) {
+		part.x = cover->x + cover->w;
+		part.y = top;
+		part.w = (rect->x + rect->w) - part.x;
+		part.h = bottom - top;
+		if (!avbox_rect_occluded(&part, node)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+
 /**
  * Gets the cairo context for a window. This is the
  * internal version that works directly on the surface
@@ -384,6 +479,69 @@ avbox_window_damaged(struct avbox_window * const window)
 }
 
 
+/**
+ * Translates a point in the window's canvas to the
+ * coordinates of it's toplevel window and returns the
+ * toplevel window.
+ */
+static struct avbox_window *
+avbox_window_totoplevel(struct avbox_window * const window,
+	int * const x, int * const y)
+{
+	struct avbox_window *toplevel = window->content_window;
+
+	/* subwindows are positioned relative to their
+	 * parent's content window */
+	while (toplevel->parent != NULL && toplevel->parent != &root_window) {
+		struct avbox_window * const parent = toplevel->parent;
+		*x += toplevel->rect.x;
+		*y += toplevel->rect.y;
+		toplevel = (parent->content_window == toplevel) ?
+			parent : parent->content_window;
+	}
+	return toplevel;
+}
+
+
+/**
+ * Marks a rectangle of the window's canvas as changed. When
+ * the window is next updated only the damaged area is
+ * flipped to the screen. If the window is updated without
+ * damage the whole window is updated.
+ */
+void
+avbox_window_damagerect(struct avbox_window * const window,
+	int x, int y, int w, int h)
+{
+	struct avbox_window * const toplevel =
+		avbox_window_totoplevel(window, &x, &y);
+	struct avbox_rect *rect;
+
+	/* the root window is always fully updated */
+	if (toplevel == &root_window) {
+		return;
+	}
+
+	/* merge it with any pending damage */
+	rect = &toplevel->damage_rect;
+	if (toplevel->damage_pending) {
+		const int x2 = MAX(x + w, rect->x + rect->w);
+		const int y2 = MAX(y + h, rect->y + rect->h);
+		x = MIN(x, rect->x);
+		y = MIN(y, rect->y);
+		w = x2 - x;
+		h = y2 - y;
+	}
+
+	/* clip it to the window */
+	rect->x = MAX(x, 0);
+	rect->y = MAX(y, 0);
+	rect->w = MIN(x + w, toplevel->rect.w) - rect->x;
+	rect->h = MIN(y + h, toplevel->rect.h) - rect->y;
+	toplevel->damage_pending = (rect->w > 0 && rect->h > 0);
+}
+
+
 /**
  * Fills a rectangle inside a window.
  */
@@ -478,6 +636,68 @@ avbox_window_blitbuf(
 }
 
 
+/**
+ * Convert and scale a buffer into a window in a single
+ * pass. If the driver cannot do it it returns -1 and sets
+ * errno to ENOTSUP.
+ */
+int
+avbox_window_scaleblitbuf(
+	struct avbox_window *window,
+	unsigned int pix_fmt, void **buf, int *pitch, int src_w, int src_h,
+	int x, int y, int w, int h)
+{
+	if (driver.surface_scaleblitbuf == NULL) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	return driver.surface_scaleblitbuf(
+		window->content_window->surface,
+		pix_fmt, buf, pitch, MBV_BLITFLAGS_NONE,
+		src_w, src_h, x, y, w, h);
+}
+
+
+/**
+ * Show a video frame on the hardware overlay.
+ */
+int
+avbox_window_overlaybuf(
+	struct avbox_window * const window,
+	unsigned int pix_fmt, void **buf, int *pitch, int src_w, int src_h,
+	int x, int y, int w, int h)
+{
+	struct avbox_window *toplevel;
+
+	if (driver.overlay_present == NULL) {
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	/* the overlay is positioned in screen coordinates */
+	toplevel = avbox_window_totoplevel(window, &x, &y);
+	if (toplevel != &root_window) {
+		x += toplevel->rect.x;
+		y += toplevel->rect.y;
+	}
+
+	return driver.overlay_present(pix_fmt, buf, pitch,
+		src_w, src_h, x, y, w, h);
+}
+
+
+/**
+ * Hide the hardware video overlay.
+ */
+void
+avbox_video_hideoverlay(void)
+{
+	if (driver.overlay_hide != NULL) {
+		driver.overlay_hide();
+	}
+}
+
+
 /**
  * Blit a window to another window
  */
@@ -501,27 +721,26 @@ avbox_window_scaleblit(
 		int dstpitch, srcpitch;
 		struct SwsContext *swscale;
 
-		if ((swscale = sws_getContext(
+		/* the scaler is cached on the source window so
+		 * it's only recreated when the size changes */
+		if ((swscale = avbox_ffmpegutil_swscache_get(
+			&src->content_window->scaler,
 			src->content_window->rect.w,
 			src->content_window->rect.h,
 			MB_DECODER_PIX_FMT,
 			w,
 			h,
 			MB_DECODER_PIX_FMT,
-			SWS_FAST_BILINEAR,
-			NULL, NULL, NULL)) == NULL) {
-			LOG_PRINT_ERROR("Could not create swscale context!");
+			SWS_FAST_BILINEAR)) == NULL) {
 			return -1;
 		}
 
 		if ((bufdst = avbox_window_lock(dst, MBV_LOCKFLAGS_WRITE, &dstpitch)) == NULL) {
-			sws_freeContext(swscale);
 			return -1;
 		}
 
 		if ((bufsrc = avbox_window_lock(src, MBV_LOCKFLAGS_READ, &srcpitch)) == NULL) {
 			avbox_window_unlock(dst);
-			sws_freeContext(swscale);
 			return -1;
 		}
 
@@ -531,7 +750,6 @@ avbox_window_scaleblit(
 			&srcpitch, 0, src->content_window->rect.h, &bufdst, &dstpitch);
 		avbox_window_unlock(dst);
 		avbox_window_unlock(src);
-		sws_freeContext(swscale);
 		return 0;
 	} else {
 		return driver.surface_scaleblit(
@@ -546,26 +764,44 @@ static int
 avbox_window_reallyvisible(struct avbox_window * const window)
 {
 	if (window->parent == &root_window) {
-		struct avbox_window_node *damaging_window =
-			LIST_NEXT(struct avbox_window_node*, &window->stack_node);
-
-		/* for now we return 0 only when one or more windows cover
-		 * the whole window. If the window is partially covered by several
-		 * windows so that the entire window is cover it will still be painted.
-		 * TODO: We need to do better */
-		while (!LIST_ISNULL(&window_stack, damaging_window)) {
-			if (avbox_rect_covers(&damaging_window->window->rect, &window->rect)) {
-				return 0;
-			}
-			damaging_window = LIST_NEXT(struct avbox_window_node*,
-				damaging_window);
-		}
+		return !avbox_rect_occluded(&window->rect,
+			LIST_NEXT(struct avbox_window_node*, &window->stack_node));
 	}
-
 	return 1;
 }
 
 
+/**
+ * Checks if any visible window stacked above this
+ * one overlaps it.
+ */
+int
+avbox_window_obscured(struct avbox_window * const window)
+{
+	struct avbox_window *toplevel = window;
+	struct avbox_window_node *node;
+
+	/* subwindows are not on the stack so we check
+	 * their toplevel window instead */
+	while (toplevel->parent != NULL && toplevel->parent != &root_window) {
+		toplevel = toplevel->parent;
+	}
+
+	if (!toplevel->visible) {
+		return 0;
+	}
+
+	node = LIST_NEXT(struct avbox_window_node*, &toplevel->stack_node);
+	while (!LIST_ISNULL(&window_stack, node)) {
+		if (avbox_rect_overlaps(&node->window->rect, &toplevel->rect)) {
+			return 1;
+		}
+		node = LIST_NEXT(struct avbox_window_node*, node);
+	}
+	return 0;
+}
+
+
 /**
  * This is the internal repaint handler
  */
@@ -600,6 +836,7 @@ avbox_window_paint(struct avbox_window * const window, int update)
 
 	/* blit window */
 	driver.surface_update(window->surface, blitflags, update);
+	window->damage_pending = 0;
 
 	/* if this is the root window we need to paint all
 	 * visible windows */
@@ -612,9 +849,9 @@ avbox_window_paint(struct avbox_window * const window, int update)
 				if (avbox_rect_covers(&damaged_window->window->rect, &window->rect)) {
 					break;
 				}
-				damaged_window = LIST_NEXT(struct avbox_window_node*,
-					damaged_window);
 			}
+			damaged_window = LIST_NEXT(struct avbox_window_node*,
+				damaged_window);
 		}
 	}
 	return 0;
@@ -732,6 +969,7 @@ __avbox_window_cleanup(struct avbox_window * const window)
 	if (window->identifier) {
 		free((void*) window->identifier);
 	}
+	avbox_ffmpegutil_swscache_free(&window->scaler);
 	driver.surface_destroy(window->surface);
 	free(window);
 }
@@ -891,8 +1129,10 @@ avbox_window_subwindow(struct avbox_window * const window,
 	new_window->background_color = window->background_color;
 	new_window->decor_dirty = 1;
 	new_window->damaged = 0;
+	new_window->damage_pending = 0;
 	new_window->dirty = 1;
 	new_window->stack_node.window = new_window;
+	avbox_ffmpegutil_swscache_init(&new_window->scaler);
 	LIST_INIT(&new_window->children);
 
 	/* save a copy of the identifier for debugging */
@@ -1017,7 +1257,9 @@ avbox_window_new(
 	window->decor_dirty = 1;
 	window->dirty = 1;
 	window->damaged = 0;
+	window->damage_pending = 0;
 	window->stack_node.window = window;
+	avbox_ffmpegutil_swscache_init(&window->scaler);
 
 	LIST_INIT(&window->children);
 
@@ -1106,6 +1348,17 @@ avbox_window_setdrawfunc(struct avbox_window * const window, avbox_video_draw_fn
 }
 
 
+int
+avbox_video_getvblank(struct timespec * const time, unsigned int * const seq)
+{
+	if (driver.getvblank == NULL) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	return driver.getvblank(time, seq);
+}
+
+
 struct avbox_window*
 avbox_video_getrootwindow(int screen)
 {
@@ -1114,6 +1367,66 @@ avbox_video_getrootwindow(int screen)
 }
 
 
+/**
+ * Repaints the damaged area of a toplevel window and flips
+ * it to the screen. The windows stacked above are recomposited
+ * from their surfaces but only inside the damaged area.
+ */
+static void
+avbox_window_updaterect(struct avbox_window * const window)
+{
+	struct avbox_rect rect, clip;
+	struct avbox_window_node *node;
+
+	ASSERT(window->parent == &root_window);
+	ASSERT(!(window->flags & AVBOX_WNDFLAGS_ALPHABLEND));
+
+	/* get the damaged area in screen coordinates */
+	rect = window->damage_rect;
+	rect.x += window->rect.x;
+	rect.y += window->rect.y;
+	window->damage_pending = 0;
+
+	/* if it's hidden there's nothing to do. The window
+	 * will get repainted when it's uncovered */
+	if (avbox_rect_occluded(&rect,
+		LIST_NEXT(struct avbox_window_node*, &window->stack_node))) {
+		return;
+	}
+
+	/* repaint the window and it's subwindows */
+	if (window->paint != NULL && window->dirty) {
+		window->paint(window, window->draw_context);
+	}
+	LIST_FOREACH(struct avbox_window_node *, node, &window->children) {
+		avbox_window_paint(node->window, 0);
+	}
+
+	/* blit the damaged area and whatever is on top
+	 * of it to the back buffer */
+	driver.surface_updaterect(window->surface, MBV_BLITFLAGS_NONE,
+		window->damage_rect.x, window->damage_rect.y,
+		window->damage_rect.w, window->damage_rect.h);
+
+	node = LIST_NEXT(struct avbox_window_node*, &window->stack_node);
+	while (!LIST_ISNULL(&window_stack, node)) {
+		if (avbox_rect_overlaps(&rect, &node->window->rect)) {
+			avbox_rect_intersect(&rect, &node->window->rect, &clip);
+			driver.surface_updaterect(node->window->surface,
+				(node->window->flags & AVBOX_WNDFLAGS_ALPHABLEND) ?
+					MBV_BLITFLAGS_ALPHABLEND : MBV_BLITFLAGS_NONE,
+				clip.x - node->window->rect.x, clip.y - node->window->rect.y,
+				clip.w, clip.h);
+		}
+		node = LIST_NEXT(struct avbox_window_node*, node);
+	}
+
+	/* and flip it to the screen */
+	driver.surface_updaterect(root_window.surface, MBV_BLITFLAGS_NONE,
+		rect.x, rect.y, rect.w, rect.h);
+}
+
+
 /**
  * Causes the window to be repainted.
  */
@@ -1127,12 +1440,30 @@ avbox_window_update(struct avbox_window *window)
 	 * windows get blitted. When we call driver.surface_update()
 	 * bellow the whole back-buffer will be flipped */
 	const int update = (window != &root_window);
+	struct avbox_window *toplevel = window;
 
 	if (!window->visible) {
 		DEBUG_PRINT("video", "Not updating invisible window");
 		return;
 	}
 
+	if (update) {
+		while (toplevel->parent != &root_window) {
+			toplevel = toplevel->parent;
+		}
+
+		/* if only part of an opaque window changed and the driver
+		 * can do it update just that part */
+		if (toplevel->damage_pending) {
+			if (toplevel->visible && driver.surface_updaterect != NULL &&
+				!(toplevel->flags & AVBOX_WNDFLAGS_ALPHABLEND)) {
+				avbox_window_updaterect(toplevel);
+				return;
+			}
+			toplevel->damage_pending = 0;
+		}
+	}
+
 #ifdef FORCE_FULL_SCREEN_REPAINTS
 	if (update) {
 		avbox_window_paint(&root_window, 0);
@@ -1582,6 +1913,8 @@ avbox_video_init(int argc, char **argv)
 	root_window.flags = AVBOX_WNDFLAGS_NONE;
 	root_window.stack_node.window = &root_window;
 	root_window.dirty = 1;
+	root_window.damage_pending = 0;
+	avbox_ffmpegutil_swscache_init(&root_window.scaler);
 
 	if ((root_window.identifier = strdup("root_window")) == NULL) {
 		ASSERT(errno == ENOMEM);
@@ -1639,6 +1972,7 @@ avbox_video_shutdown()
 	LIST_REMOVE(&root_window.stack_node);
 
 	/* free root window resources */
+	avbox_ffmpegutil_swscache_free(&root_window.scaler);
 	free((void*)root_window.identifier);
 
 	/* If any windows are still visible then
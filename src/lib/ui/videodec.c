@@ -0,0 +1,772 @@
+/**
+ * avbox - Toolkit for Embedded Multimedia Applications
+ * Copyright (C) 2016-2017 Fernando Rodriguez
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License Version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#       include <libavbox/config.h>
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#define LOG_MODULE "videodec"
+
+/* number of /dev/videoN nodes searched for M2M decoders */
+#define AVBOX_VIDEODEC_V4L2_MAXDEV	(64)
+
+#include <libavbox/avbox.h>
+#include <libavbox/ui/videodec.h>
+
+#ifdef ENABLE_MMAL
+#	include "mmaldecode.h"
+#endif
+
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(58, 18, 100)
+#	define HAVE_LAVC_HWCONFIG	(1)
+#	include <libavutil/hwcontext.h>
+#	include <libavutil/pixdesc.h>
+#	include <linux/videodev2.h>
+#endif
+
+
+#ifdef HAVE_LAVC_HWCONFIG
+/**
+ * Allocates and opens a codec context for a stream
+ * using the given decoder.
+ */
+static AVCodecContext *
+avbox_videodec_opencodec(AVFormatContext * const fmt_ctx,
+	const int stream_idx, AVCodec * const codec,
+	AVBufferRef * const hw_device_ctx,
+	enum AVPixelFormat (*get_format)(AVCodecContext*, const enum AVPixelFormat*))
+{
+	int ret;
+	AVCodecContext *ctx;
+
+	if ((ctx = avcodec_alloc_context3(codec)) == NULL) {
+		LOG_PRINT_ERROR("Could not allocate decoder context!");
+		return NULL;
+	}
+	if ((ret = avcodec_parameters_to_context(ctx,
+		fmt_ctx->streams[stream_idx]->codecpar)) < 0) {
+		LOG_VPRINT_ERROR("Could not convert decoder params to context: %d!",
+			ret);
+		avcodec_free_context(&ctx);
+		return NULL;
+	}
+
+	ctx->thread_count = 1;
+	if (hw_device_ctx != NULL) {
+		if ((ctx->hw_device_ctx = av_buffer_ref(hw_device_ctx)) == NULL) {
+			avcodec_free_context(&ctx);
+			return NULL;
+		}
+		ctx->get_format = get_format;
+	}
+
+	if ((ret = avcodec_open2(ctx, codec, NULL)) < 0) {
+		char err[256];
+		av_strerror(ret, err, sizeof(err));
+		LOG_VPRINT_INFO("Could not open %s decoder: %s",
+			codec->name, err);
+		avcodec_free_context(&ctx);
+		return NULL;
+	}
+	return ctx;
+}
+#endif
+
+
+#ifdef ENABLE_MMAL
+/**
+ * The MMAL decoder only handles H264.
+ */
+static int
+avbox_videodec_mmal_supported(const AVCodecParameters * const par)
+{
+	return par->codec_id == AV_CODEC_ID_H264;
+}
+#endif
+
+
+#ifdef HAVE_LAVC_HWCONFIG
+/**
+ * Gets the name of the V4L2 memory-to-memory decoder
+ * for a codec.
+ */
+static const char *
+avbox_videodec_v4l2m2m_name(const enum AVCodecID codec_id)
+{
+	switch (codec_id) {
+	case AV_CODEC_ID_H264: return "h264_v4l2m2m";
+	case AV_CODEC_ID_HEVC: return "hevc_v4l2m2m";
+	case AV_CODEC_ID_MPEG1VIDEO: return "mpeg1_v4l2m2m";
+	case AV_CODEC_ID_MPEG2VIDEO: return "mpeg2_v4l2m2m";
+	case AV_CODEC_ID_MPEG4: return "mpeg4_v4l2m2m";
+	case AV_CODEC_ID_H263: return "h263_v4l2m2m";
+	case AV_CODEC_ID_VC1: return "vc1_v4l2m2m";
+	case AV_CODEC_ID_VP8: return "vp8_v4l2m2m";
+	case AV_CODEC_ID_VP9: return "vp9_v4l2m2m";
+	default: return NULL;
+	}
+}
+
+
+/**
+ * Gets the V4L2 pixel format of the compressed stream.
+ */
+static uint32_t
+avbox_videodec_v4l2m2m_fourcc(const enum AVCodecID codec_id)
+{
+	switch (codec_id) {
+	case AV_CODEC_ID_H264: return V4L2_PIX_FMT_H264;
+	case AV_CODEC_ID_HEVC: return V4L2_PIX_FMT_HEVC;
+	case AV_CODEC_ID_MPEG1VIDEO: return V4L2_PIX_FMT_MPEG1;
+	case AV_CODEC_ID_MPEG2VIDEO: return V4L2_PIX_FMT_MPEG2;
+	case AV_CODEC_ID_MPEG4: return V4L2_PIX_FMT_MPEG4;
+	case AV_CODEC_ID_H263: return V4L2_PIX_FMT_H263;
+	case AV_CODEC_ID_VC1: return V4L2_PIX_FMT_VC1_ANNEX_G;
+	case AV_CODEC_ID_VP8: return V4L2_PIX_FMT_VP8;
+	case AV_CODEC_ID_VP9: return V4L2_PIX_FMT_VP9;
+	default: return 0;
+	}
+}
+
+
+/**
+ * Checks if a queue of a V4L2 device takes the given format.
+ */
+static int
+avbox_videodec_v4l2m2m_hasfmt(const int fd, const enum v4l2_buf_type type,
+	const uint32_t fourcc)
+{
+	struct v4l2_fmtdesc desc;
+
+	memset(&desc, 0, sizeof(desc));
+	desc.type = type;
+	while (ioctl(fd, VIDIOC_ENUM_FMT, &desc) == 0) {
+		if (desc.pixelformat == fourcc) {
+			return 1;
+		}
+		desc.index++;
+	}
+	return 0;
+}
+
+
+/**
+ * Checks if there's a V4L2 memory-to-memory device that
+ * can decode the stream. The M2M decoders only output 8-bit
+ * 4:2:0 so streams with deeper or wider pixel formats (ie.
+ * H.264 High 10 or HEVC Main 10) are left to other backends.
+ */
+static int
+avbox_videodec_v4l2m2m_supported(const AVCodecParameters * const par)
+{
+	int i, fd, ret = 0;
+	char path[32];
+	struct v4l2_capability cap;
+	enum v4l2_buf_type type;
+	const AVPixFmtDescriptor *desc;
+	const char * const name = avbox_videodec_v4l2m2m_name(par->codec_id);
+	const uint32_t fourcc = avbox_videodec_v4l2m2m_fourcc(par->codec_id);
+
+	if (name == NULL || avcodec_find_decoder_by_name(name) == NULL) {
+		return 0;
+	}
+
+	if (par->format != AV_PIX_FMT_NONE) {
+		if ((desc = av_pix_fmt_desc_get(par->format)) == NULL ||
+			desc->comp[0].depth > 8 || desc->log2_chroma_w != 1 ||
+			desc->log2_chroma_h != 1) {
+			DEBUG_VPRINT(LOG_MODULE, "%s cannot decode %s streams",
+				name, (desc == NULL) ? "unknown" : desc->name);
+			return 0;
+		}
+	}
+
+	for (i = 0; i < AVBOX_VIDEODEC_V4L2_MAXDEV && !ret; i++) {
+		snprintf(path, sizeof(path), "/dev/video%i", i);
+		if ((fd = open(path, O_RDWR | O_NONBLOCK)) == -1) {
+			continue;
+		}
+
+		memset(&cap, 0, sizeof(cap));
+		if (ioctl(fd, VIDIOC_QUERYCAP, &cap) == 0) {
+			const uint32_t caps = (cap.capabilities & V4L2_CAP_DEVICE_CAPS) ?
+				cap.device_caps : cap.capabilities;
+			if (caps & V4L2_CAP_VIDEO_M2M_MPLANE) {
+				type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+			} else if (caps & V4L2_CAP_VIDEO_M2M) {
+				type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+			} else {
+				close(fd);
+				continue;
+			}
+
+			/* the compressed stream goes in the output queue */
+			if (avbox_videodec_v4l2m2m_hasfmt(fd, type, fourcc)) {
+				DEBUG_VPRINT(LOG_MODULE, "%s (%s) can decode the stream",
+					path, (char*) cap.card);
+				ret = 1;
+			}
+		}
+		close(fd);
+	}
+	return ret;
+}
+
+
+/**
+ * Opens the V4L2 M2M decoder. This fails if there's
+ * no capable device on the system.
+ */
+static AVCodecContext *
+avbox_videodec_v4l2m2m_open(AVFormatContext * const fmt_ctx,
+	const int stream_idx, const int threads)
+{
+	AVCodec *codec;
+	(void) threads;
+
+	if ((codec = avcodec_find_decoder_by_name(avbox_videodec_v4l2m2m_name(
+		fmt_ctx->streams[stream_idx]->codecpar->codec_id))) == NULL) {
+		errno = ENOTSUP;
+		return NULL;
+	}
+	return avbox_videodec_opencodec(fmt_ctx, stream_idx, codec, NULL, NULL);
+}
+#endif
+
+
+#if defined(ENABLE_VAAPI) && defined(HAVE_LAVC_HWCONFIG)
+/**
+ * Checks if the native decoder for the stream
+ * can use VAAPI.
+ */
+static int
+avbox_videodec_vaapi_supported(const AVCodecParameters * const par)
+{
+	int i;
+	const AVCodecHWConfig *config;
+	const AVCodec * const codec = avcodec_find_decoder(par->codec_id);
+
+	if (codec == NULL) {
+		return 0;
+	}
+	for (i = 0; (config = avcodec_get_hw_config(codec, i)) != NULL; i++) {
+		if (config->device_type == AV_HWDEVICE_TYPE_VAAPI &&
+			(config->methods & AV_CODEC_HW_CONFIG_METHOD_HW_DEVICE_CTX)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+/**
+ * Pick VAAPI surfaces when offered. If the hwaccel cannot handle
+ * the stream (ie. unsupported profile) libavcodec only offers
+ * software formats and we take the first one.
+ */
+static enum AVPixelFormat
+avbox_videodec_vaapi_getformat(AVCodecContext *ctx, const enum AVPixelFormat *fmts)
+{
+	const enum AVPixelFormat *fmt;
+	for (fmt = fmts; *fmt != AV_PIX_FMT_NONE; fmt++) {
+		if (*fmt == AV_PIX_FMT_VAAPI) {
+			return *fmt;
+		}
+	}
+	LOG_PRINT_WARN("VAAPI cannot decode stream. Using software decoder");
+	return fmts[0];
+}
+
+
+static AVCodecContext *
+avbox_videodec_vaapi_open(AVFormatContext * const fmt_ctx,
+	const int stream_idx, const int threads)
+{
+	int ret;
+	AVCodec *codec;
+	AVCodecContext *ctx;
+	AVBufferRef *device = NULL;
+	char * const device_name = avbox_settings_getstring("vaapi_device");
+	(void) threads;
+
+	if ((codec = avcodec_find_decoder(
+		fmt_ctx->streams[stream_idx]->codecpar->codec_id)) == NULL) {
+		free(device_name);
+		errno = ENOTSUP;
+		return NULL;
+	}
+
+	if ((ret = av_hwdevice_ctx_create(&device, AV_HWDEVICE_TYPE_VAAPI,
+		device_name, NULL, 0)) < 0) {
+		char err[256];
+		av_strerror(ret, err, sizeof(err));
+		LOG_VPRINT_INFO("Could not open VAAPI device: %s", err);
+		free(device_name);
+		errno = ENODEV;
+		return NULL;
+	}
+	free(device_name);
+
+	ctx = avbox_videodec_opencodec(fmt_ctx, stream_idx, codec,
+		device, avbox_videodec_vaapi_getformat);
+	av_buffer_unref(&device);
+	return ctx;
+}
+
+
+/**
+ * Downloads VAAPI surfaces to system memory.
+ */
+static int
+avbox_videodec_vaapi_getframe(AVCodecContext * const ctx, AVFrame * const frame)
+{
+	int ret;
+	AVFrame *sw_frame;
+	(void) ctx;
+
+	if (frame->format != AV_PIX_FMT_VAAPI) {
+		return 0;
+	}
+	if ((sw_frame = av_frame_alloc()) == NULL) {
+		return AVERROR(ENOMEM);
+	}
+	if ((ret = av_hwframe_transfer_data(sw_frame, frame, 0)) < 0 ||
+		(ret = av_frame_copy_props(sw_frame, frame)) < 0) {
+		av_frame_free(&sw_frame);
+		return ret;
+	}
+	av_frame_unref(frame);
+	av_frame_move_ref(frame, sw_frame);
+	av_frame_free(&sw_frame);
+	return 0;
+}
+#endif
+
+
+static int
+avbox_videodec_software_supported(const AVCodecParameters * const par)
+{
+	return 1;
+}
+
+
+static AVCodecContext *
+avbox_videodec_software_open(AVFormatContext * const fmt_ctx,
+	const int stream_idx, const int threads)
+{
+	int idx = stream_idx;
+	return avbox_ffmpegutil_opencodeccontext(&idx, fmt_ctx,
+		AVMEDIA_TYPE_VIDEO, threads, AVBOX_CODECFLAGS_NONE);
+}
+
+
+/**
+ * Decoder backends in order of preference.
+ */
+static const struct avbox_videodec backends[] =
+{
+#ifdef ENABLE_MMAL
+	{ "mmal", avbox_videodec_mmal_supported, avbox_mmal_decode, NULL, NULL },
+#endif
+#ifdef HAVE_LAVC_HWCONFIG
+	{ "v4l2m2m", avbox_videodec_v4l2m2m_supported, NULL,
+		avbox_videodec_v4l2m2m_open, NULL },
+#endif
+#if defined(ENABLE_VAAPI) && defined(HAVE_LAVC_HWCONFIG)
+	{ "vaapi", avbox_videodec_vaapi_supported, NULL,
+		avbox_videodec_vaapi_open, avbox_videodec_vaapi_getframe },
+#endif
+	{ "software", avbox_videodec_software_supported, NULL,
+		avbox_videodec_software_open, NULL }
+};
+
+#define AVBOX_VIDEODEC_COUNT	(sizeof(backends) / sizeof(backends[0]))
+
+
+/**
+ * Gets the software decoder backend.
+ */
+const struct avbox_videodec *
+avbox_videodec_software(void)
+{
+	return &backends[AVBOX_VIDEODEC_COUNT - 1];
+}
+
+
+/**
+ * Gets the next backend that can decode the stream.
+ */
+const struct avbox_videodec *
+avbox_videodec_next(const AVCodecParameters * const par,
+	const struct avbox_videodec * const prev)
+{
+	int i = (prev == NULL) ? 0 : (prev - backends) + 1;
+	char *forced = avbox_settings_getstring("video_decoder");
+
+	ASSERT(par != NULL);
+	ASSERT(prev == NULL || (prev >= backends && prev < backends + AVBOX_VIDEODEC_COUNT));
+
+	if (forced != NULL && !strcmp(forced, "auto")) {
+		free(forced);
+		forced = NULL;
+	}
+
+	for (; i < AVBOX_VIDEODEC_COUNT; i++) {
+		if (forced != NULL && i != (AVBOX_VIDEODEC_COUNT - 1) &&
+			strcmp(forced, backends[i].name)) {
+			continue;
+		}
+		if (backends[i].supported(par)) {
+			DEBUG_VPRINT(LOG_MODULE, "Selected %s decoder for %s stream",
+				backends[i].name, avcodec_get_name(par->codec_id));
+			break;
+		}
+	}
+
+	if (forced != NULL) {
+		free(forced);
+	}
+	return (i < AVBOX_VIDEODEC_COUNT) ? &backends[i] : NULL;
+}
+
+
+/**
+ * Opens the decoder using the first backend, starting with
+ * the one given, that can be opened.
+ */
+int
+avbox_videodec_open(struct avbox_videodec_state * const state,
+	AVFormatContext * const fmt_ctx, const int stream_idx,
+	const struct avbox_videodec *backend, const int threads)
+{
+	const AVCodecParameters * const par = fmt_ctx->streams[stream_idx]->codecpar;
+
+	memset(state, 0, sizeof(struct avbox_videodec_state));
+	state->fmt_ctx = fmt_ctx;
+	state->stream_idx = stream_idx;
+	state->threads = threads;
+
+	for (; backend != NULL; backend = avbox_videodec_next(par, backend)) {
+		if (backend->open == NULL) {
+			continue;
+		}
+		if ((state->ctx = backend->open(fmt_ctx, stream_idx, threads)) != NULL) {
+			LOG_VPRINT_INFO("Using %s video decoder", backend->name);
+			state->backend = backend;
+			return 0;
+		}
+		LOG_VPRINT_WARN("Could not open %s video decoder", backend->name);
+	}
+
+	errno = ENODEV;
+	return -1;
+}
+
+
+/**
+ * Checks if we can still fall back to software.
+ */
+static inline int
+avbox_videodec_canfallback(const struct avbox_videodec_state * const state)
+{
+	return !state->got_frame && state->backend != avbox_videodec_software();
+}
+
+
+/**
+ * Replaces a hardware decoder that failed before producing
+ * any frames with the software decoder and starts resending
+ * the packets that the hardware decoder consumed.
+ */
+static int
+avbox_videodec_fallback(struct avbox_videodec_state * const state)
+{
+	struct avbox_videodec_replay replay;
+
+	LOG_VPRINT_WARN("The %s video decoder failed. Falling back to software",
+		state->backend->name);
+
+	avcodec_free_context(&state->ctx);
+
+	replay = state->replay;
+	if (avbox_videodec_open(state, state->fmt_ctx, state->stream_idx,
+		avbox_videodec_software(), state->threads) == -1) {
+		state->replay = replay;
+		return -1;
+	}
+	state->replay = replay;
+	avbox_videodec_replay_start(&state->replay);
+	return 0;
+}
+
+
+/**
+ * Checks if there are packets waiting to be resent.
+ */
+int
+avbox_videodec_replaying(struct avbox_videodec_state * const state)
+{
+	return avbox_videodec_replay_peek(&state->replay) != NULL;
+}
+
+
+/**
+ * Sends a packet to the decoder.
+ */
+int
+avbox_videodec_send(struct avbox_videodec_state * const state,
+	const AVPacket * const packet)
+{
+	int ret;
+	AVPacket *replayed;
+	char err[256];
+
+	/* after falling back to software resend the packets that
+	 * the hardware decoder consumed before taking new ones */
+	if ((replayed = avbox_videodec_replay_peek(&state->replay)) != NULL) {
+		ASSERT(packet == NULL);
+		if ((ret = avcodec_send_packet(state->ctx, replayed)) == AVERROR(EAGAIN)) {
+			return ret;
+		}
+		avbox_videodec_replay_pop(&state->replay);
+		if (ret < 0 && ret != AVERROR_INVALIDDATA) {
+			av_strerror(ret, err, sizeof(err));
+			LOG_VPRINT_ERROR("Error decoding video packet (%i): %s",
+				ret, err);
+			return AVERROR_EXIT;
+		}
+		return 0;
+	}
+
+	ASSERT(packet != NULL);
+
+	/* if the replay overflowed the software decoder
+	 * must start at the next keyframe */
+	if (state->replay.active && state->replay.needs_key) {
+		if (!(packet->flags & AV_PKT_FLAG_KEY)) {
+			return 0;
+		}
+		avbox_videodec_replay_clear(&state->replay);
+	}
+
+	if ((ret = avcodec_send_packet(state->ctx, packet)) == AVERROR(EAGAIN)) {
+		return ret;
+	}
+
+	/* until a hardware decoder outputs a frame keep the
+	 * packets since the last keyframe in case it fails */
+	if (avbox_videodec_canfallback(state) &&
+		avbox_videodec_replay_add(&state->replay, packet) == -1) {
+		LOG_PRINT_ERROR("Could not save video packet!");
+		return AVERROR_EXIT;
+	}
+
+	if (UNLIKELY(ret < 0)) {
+		if (ret == AVERROR_INVALIDDATA) {
+			LOG_PRINT_ERROR("Invalid data sent to video decoder");
+			return 0;
+		}
+
+		av_strerror(ret, err, sizeof(err));
+		LOG_VPRINT_ERROR("Error decoding video packet (%i): %s",
+			ret, err);
+
+		/* if the hardware decoder fails before we get the first
+		 * frame start over with the software decoder. This packet
+		 * has been saved so it counts as consumed */
+		if (!avbox_videodec_canfallback(state) ||
+			avbox_videodec_fallback(state) == -1) {
+			return AVERROR_EXIT;
+		}
+	}
+	return 0;
+}
+
+
+/**
+ * Gets a decoded frame in system memory.
+ */
+int
+avbox_videodec_receive(struct avbox_videodec_state * const state,
+	AVFrame * const frame)
+{
+	int ret;
+
+	while (1) {
+		if ((ret = avcodec_receive_frame(state->ctx, frame)) < 0) {
+			if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+				return ret;
+			}
+			LOG_VPRINT_ERROR("ERROR: avcodec_receive_frame() returned %d (video)",
+				ret);
+			if (avbox_videodec_canfallback(state)) {
+				return (avbox_videodec_fallback(state) == 0) ?
+					AVERROR(EAGAIN) : AVERROR_EXIT;
+			}
+			return ret;
+		}
+
+		/* download the frame if the decoder output
+		 * is not in system memory */
+		if (state->backend->getframe != NULL &&
+			UNLIKELY((ret = state->backend->getframe(state->ctx, frame)) < 0)) {
+			LOG_VPRINT_ERROR("Could not transfer %s video frame (%i)",
+				state->backend->name, ret);
+			av_frame_unref(frame);
+			continue;
+		}
+
+		/* the hardware decoder is working */
+		if (avbox_videodec_canfallback(state)) {
+			avbox_videodec_replay_clear(&state->replay);
+		}
+		state->got_frame = 1;
+		return 0;
+	}
+}
+
+
+/**
+ * Resets the decoder after it has been drained.
+ */
+void
+avbox_videodec_flush(struct avbox_videodec_state * const state)
+{
+	avcodec_flush_buffers(state->ctx);
+	avbox_videodec_replay_clear(&state->replay);
+}
+
+
+/**
+ * Closes the decoder.
+ */
+void
+avbox_videodec_close(struct avbox_videodec_state * const state)
+{
+	avbox_videodec_replay_clear(&state->replay);
+	if (state->ctx != NULL) {
+		avcodec_close(state->ctx);
+		avcodec_free_context(&state->ctx);
+	}
+}
+
+
+/**
+ * Initialize a replay buffer.
+ */
+void
+avbox_videodec_replay_init(struct avbox_videodec_replay * const replay)
+{
+	memset(replay, 0, sizeof(struct avbox_videodec_replay));
+}
+
+
+/**
+ * Records a packet before it is sent to the decoder. A
+ * keyframe discards everything before it.
+ */
+int
+avbox_videodec_replay_add(struct avbox_videodec_replay * const replay,
+	const AVPacket * const packet)
+{
+	AVPacket *copy;
+
+	ASSERT(!replay->active);
+
+	if (packet->flags & AV_PKT_FLAG_KEY) {
+		avbox_videodec_replay_clear(replay);
+	} else if (replay->needs_key) {
+		return 0;
+	} else if (replay->count == AVBOX_VIDEODEC_REPLAY_MAX) {
+		avbox_videodec_replay_clear(replay);
+		replay->needs_key = 1;
+		return 0;
+	}
+
+	if ((copy = av_packet_clone((AVPacket*) packet)) == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	replay->packets[replay->count++] = copy;
+	return 0;
+}
+
+
+/**
+ * Starts resending the recorded packets. needs_key is left
+ * alone so the caller knows to wait for a keyframe once they
+ * have all been sent.
+ */
+void
+avbox_videodec_replay_start(struct avbox_videodec_replay * const replay)
+{
+	replay->active = 1;
+	replay->pos = 0;
+}
+
+
+/**
+ * Gets the next packet to resend.
+ */
+AVPacket *
+avbox_videodec_replay_peek(struct avbox_videodec_replay * const replay)
+{
+	if (!replay->active || replay->pos == replay->count) {
+		return NULL;
+	}
+	return replay->packets[replay->pos];
+}
+
+
+/**
+ * Frees the packet returned by avbox_videodec_replay_peek()
+ * and moves on to the next one.
+ */
+void
+avbox_videodec_replay_pop(struct avbox_videodec_replay * const replay)
+{
+	ASSERT(replay->active && replay->pos < replay->count);
+	av_packet_free(&replay->packets[replay->pos++]);
+}
+
+
+/**
+ * Frees all recorded packets.
+ */
+void
+avbox_videodec_replay_clear(struct avbox_videodec_replay * const replay)
+{
+	int i;
+	for (i = 0; i < replay->count; i++) {
+		av_packet_free(&replay->packets[i]);
+	}
+	replay->count = 0;
+	replay->pos = 0;
+	replay->active = 0;
+	replay->needs_key = 0;
+}
@@ -25,6 +25,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <inttypes.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -65,6 +67,16 @@
 #define MBOX_STORE_MOUNTPOINT	STRINGIZE(LOCALSTATEDIR) "/lib/mediabox/store"
 #define MBOX_STORE_VIDEO	STRINGIZE(LOCALSTATEDIR) "/lib/mediabox/store/Video"
 #define MBOX_STORE_AUDIO	STRINGIZE(LOCALSTATEDIR) "/lib/mediabox/store/Audio"
+#define CONTENT_DB		"content.db"
+#define CONTENT_DB_VERSION	2
+
+#define MBOX_LIBRARY_VIDEO_PATTERNS	(2)
+
+/* number of files added per transaction while scanning. The
+ * transaction blocks other writers so we also commit every
+ * MBOX_LIBRARY_SCAN_BATCH_TIME usecs */
+#define MBOX_LIBRARY_SCAN_BATCH		(256)
+#define MBOX_LIBRARY_SCAN_BATCH_TIME	(1000LL * 1000LL)
 
 
 #define MBOX_LIBRARY_LOCAL_DIRECTORY_AUDIO	(1)
@@ -107,6 +119,8 @@ static int local_inotify_quit = 0;
 static char *store;
 static pthread_t local_inotify_thread;
 static LIST local_inotify_watches;
+static regex_t video_patterns[MBOX_LIBRARY_VIDEO_PATTERNS];
+static pthread_once_t video_patterns_once = PTHREAD_ONCE_INIT;
 
 #if defined(ENABLE_DVD) || defined(ENABLE_USB)
 static struct udev *udev = NULL;
@@ -690,7 +704,7 @@ mbox_library_local_open_database(sqlite3 **db, const int flags)
 	int ret = -1;
 	char *filename = NULL;
 
-	if ((filename = avbox_dbutil_getdbfile("content.db")) == NULL) {
+	if ((filename = avbox_dbutil_getdbfile(CONTENT_DB)) == NULL) {
 		ASSERT(errno == ENOMEM);
 		goto end;
 	}
@@ -713,112 +727,60 @@ end:
 }
 
 
+/**
+ * Gets a cached statement on this thread's connection to
+ * the content database.
+ */
+static sqlite3_stmt *
+mbox_library_local_prepare(const char * const sql)
+{
+	return avbox_dbutil_prepare(CONTENT_DB, sql);
+}
+
+
 /**
  * Get the id of a library path if it exists.
  */
 static int64_t
 mbox_library_local_getid(const char * const path, int64_t start_at)
 {
-	int64_t ret = -1;
-	int res;
-	size_t len = 0;
-	sqlite3 *db = NULL;
-	sqlite3_stmt *stmt = NULL;
-	const char *ppath;
-	char *name = NULL, *pname;
-	const char * const sql = "SELECT id FROM local_objects WHERE parent_id = ? AND name = ?";
+	int64_t ret = start_at;
+	size_t len;
+	sqlite3_stmt *stmt;
+	const char *ppath = path, *name;
 
-	ppath = (*path == '/') ?  path + 1 : path;
-	while (*ppath != '/' && *ppath != '\0') {
-		ppath++;
-		len++;
-	}
-
-	/* this is the root directory */
-	if (len == 0) {
-		return start_at;
-	}
-
-	if ((name = malloc(len + 1)) == NULL) {
-		ASSERT(errno == ENOMEM);
+	if ((stmt = mbox_library_local_prepare(
+		"SELECT id FROM local_objects WHERE parent_id = ? AND name = ?")) == NULL) {
 		return -1;
 	}
 
-	/* copy name */
-	ppath = (*path == '/') ?  path + 1 : path;
-	pname = name;
-	while (len > 0) {
-		*pname++ = *ppath++;
-		len--;
-	}
-	*pname = '\0';
-
-	ASSERT(*ppath == '/' || *ppath == '\0');
-
-	/* open db connection */
-	if (mbox_library_local_open_database(&db, SQLITE_OPEN_READONLY) == -1) {
-		LOG_VPRINT_ERROR("Could not open database: %s",
-			sqlite3_errmsg(db));
-		goto end;
-	}
-
-	/* prepare the query */
-	while ((res = sqlite3_prepare_v2(db, sql, -1, &stmt, 0)) != SQLITE_OK) {
-		if (res == SQLITE_LOCKED) {
-			usleep(100L * 1000L);
-			continue;
-		} else {
-			errno = EFAULT;
+	/* resolve the path one level at a time */
+	while (1) {
+		if (*ppath == '/') {
+			ppath++;
+		}
+		name = ppath;
+		len = 0;
+		while (*ppath != '/' && *ppath != '\0') {
+			ppath++;
+			len++;
 		}
-		LOG_VPRINT_ERROR("Could not prepare SQL statement: %s", sql);
-		LOG_VPRINT_ERROR("SQL Error: %s", sqlite3_errmsg(db));
-		goto end;
-	}
-
-	/* bind parameters */
-	if (sqlite3_bind_int(stmt, 1, start_at) != SQLITE_OK ||
-		sqlite3_bind_text(stmt, 2, name, strlen(name), NULL) != SQLITE_OK) {
-		LOG_VPRINT_ERROR("Binding failed: %s", sqlite3_errmsg(db));
-		goto end;
-	}
 
-	/* execute the query and do it again until
-	 * we resolve the path */
-	while (1) {
-		if ((res = sqlite3_step(stmt)) == SQLITE_ROW) {
-			ret = sqlite3_column_int(stmt, 0);
-			if (strlen(ppath) > 1) {
-				ret = mbox_library_local_getid(ppath, ret);
-			}
-			break;
-		} else if (res == SQLITE_BUSY) {
-			usleep(100L * 1000L);
-			continue;
-		} else if (res == SQLITE_DONE) {
-			ret = -1;
-			break;
-		} else if (res == SQLITE_MISUSE) {
-			DEBUG_ABORT(LOG_MODULE, "sqlite misuse");
-		} else if (res == SQLITE_ERROR) {
-			LOG_VPRINT_ERROR("Sqlite error: %s", sqlite3_errmsg(db));
-			ret = -1;
-			break;
-		} else {
-			DEBUG_VPRINT(LOG_MODULE, "Step failed: %i", res);
-			ret = -1;
+		/* we're done */
+		if (len == 0) {
 			break;
 		}
-	}
 
-end:
-	if (stmt != NULL) {
-		sqlite3_finalize(stmt);
-	}
-	if (db != NULL) {
-		sqlite3_close(db);
-	}
-	if (name != NULL) {
-		free(name);
+		if (sqlite3_bind_int64(stmt, 1, ret) != SQLITE_OK ||
+			sqlite3_bind_text(stmt, 2, name, len, SQLITE_STATIC) != SQLITE_OK) {
+			LOG_VPRINT_ERROR("Binding failed: %s",
+				sqlite3_errmsg(sqlite3_db_handle(stmt)));
+			avbox_dbutil_done(stmt);
+			return -1;
+		}
+		if (avbox_dbutil_getint64(stmt, &ret) == -1) {
+			return -1;
+		}
 	}
 
 	return ret;
@@ -828,136 +790,71 @@ end:
 static int64_t
 mbox_library_local_getid_by_uri(const char * const uri)
 {
-	int64_t ret = -1;
-	int res;
-	sqlite3 *db = NULL;
-	sqlite3_stmt *stmt = NULL;
-	const char * const sql = "SELECT id FROM local_objects WHERE path = ? LIMIT 1";
-
-	/* open db connection */
-	if (mbox_library_local_open_database(&db, SQLITE_OPEN_READONLY) == -1) {
-		LOG_VPRINT_ERROR("Could not open database: %s",
-			sqlite3_errmsg(db));
-		goto end;
-	}
-
-	/* prepare the query */
-	while ((res = sqlite3_prepare_v2(db, sql, -1, &stmt, 0)) != SQLITE_OK) {
-		if (res == SQLITE_LOCKED) {
-			usleep(100L * 1000L);
-			continue;
-		} else {
-			errno = EFAULT;
-		}
-		LOG_VPRINT_ERROR("Could not prepare SQL statement: %s", sql);
-		LOG_VPRINT_ERROR("SQL Error: %s", sqlite3_errmsg(db));
-		goto end;
-	}
-
-	/* bind parameters */
-	if (sqlite3_bind_text(stmt, 1, uri, strlen(uri), NULL) != SQLITE_OK) {
-		LOG_VPRINT_ERROR("Binding failed: %s", sqlite3_errmsg(db));
-		goto end;
-	}
+	int64_t ret;
+	sqlite3_stmt *stmt;
 
-	/* execute the query and do it again until
-	 * we resolve the path */
-	while (1) {
-		if ((res = sqlite3_step(stmt)) == SQLITE_ROW) {
-			ret = sqlite3_column_int(stmt, 0);
-			break;
-		} else if (res == SQLITE_BUSY) {
-			usleep(100L * 1000L);
-			continue;
-		} else if (res == SQLITE_DONE) {
-			ret = -1;
-			break;
-		} else if (res == SQLITE_MISUSE) {
-			DEBUG_ABORT(LOG_MODULE, "sqlite misuse");
-		} else if (res == SQLITE_ERROR) {
-			LOG_VPRINT_ERROR("Sqlite error: %s", sqlite3_errmsg(db));
-			ret = -1;
-			break;
-		} else {
-			DEBUG_VPRINT(LOG_MODULE, "Step failed: %i", res);
-			ret = -1;
-			break;
-		}
+	if ((stmt = mbox_library_local_prepare(
+		"SELECT id FROM local_objects WHERE path = ? LIMIT 1")) == NULL) {
+		return -1;
 	}
-
-end:
-	if (stmt != NULL) {
-		sqlite3_finalize(stmt);
+	if (sqlite3_bind_text(stmt, 1, uri, -1, SQLITE_STATIC) != SQLITE_OK) {
+		LOG_VPRINT_ERROR("Binding failed: %s",
+			sqlite3_errmsg(sqlite3_db_handle(stmt)));
+		avbox_dbutil_done(stmt);
+		return -1;
 	}
-	if (db != NULL) {
-		sqlite3_close(db);
+	if (avbox_dbutil_getint64(stmt, &ret) == -1) {
+		return -1;
 	}
-
 	return ret;
-
 }
 
 
 static int64_t
 mbox_library_local_mkdir(const char * const name, const int64_t parent_id)
 {
-	int res, ret = -1;
-	sqlite3 *db = NULL;
-	sqlite3_stmt *stmt = NULL;
-	const char * const sql = "INSERT INTO local_objects (parent_id, name, path) VALUES (?, ?, '')";
+	sqlite3_stmt *stmt;
 
 	ASSERT(name != NULL);
 	ASSERT(strlen(name) > 0);
 
-	/* open db connection */
-	if (mbox_library_local_open_database(&db, SQLITE_OPEN_READWRITE) == -1) {
-		LOG_VPRINT_ERROR("Could not open database: %s",
-			sqlite3_errmsg(db));
-		goto end;
+	if ((stmt = mbox_library_local_prepare(
+		"INSERT INTO local_objects (parent_id, name, path) VALUES (?, ?, '')")) == NULL) {
+		return -1;
 	}
-
-	/* prepare the query */
-	while ((res = sqlite3_prepare_v2(db, sql, -1, &stmt, 0)) != SQLITE_OK) {
-		if (res == SQLITE_LOCKED) {
-			usleep(100L * 1000L);
-			continue;
-		}
-		errno = EFAULT;
-		LOG_VPRINT_ERROR("Could not prepare SQL statement: %s", sql);
-		LOG_VPRINT_ERROR("SQL Error: %s", sqlite3_errmsg(db));
-		goto end;
+	if (sqlite3_bind_int64(stmt, 1, parent_id) != SQLITE_OK ||
+		sqlite3_bind_text(stmt, 2, name, -1, SQLITE_STATIC) != SQLITE_OK) {
+		LOG_VPRINT_ERROR("Binding failed: %s",
+			sqlite3_errmsg(sqlite3_db_handle(stmt)));
+		avbox_dbutil_done(stmt);
+		return -1;
 	}
-
-	/* bind parameters */
-	if (sqlite3_bind_int(stmt, 1, parent_id) != SQLITE_OK ||
-		sqlite3_bind_text(stmt, 2, name, strlen(name), NULL) != SQLITE_OK) {
-		LOG_VPRINT_ERROR("Binding failed: %s", sqlite3_errmsg(db));
-		goto end;
+	if (avbox_dbutil_exec(stmt) == -1) {
+		return -1;
 	}
+	return sqlite3_last_insert_rowid(sqlite3_db_handle(stmt));
+}
 
-	/* execute the statement */
-	while ((res = sqlite3_step(stmt)) != SQLITE_DONE) {
-		if (res == SQLITE_BUSY) {
-			usleep(100L * 1000L);
-			continue;
-		} else if (res == SQLITE_ERROR) {
-			LOG_VPRINT_ERROR("SQLite Error: %s", sqlite3_errmsg(db));
-			goto end;
-		} else if (res == SQLITE_MISUSE) {
-			DEBUG_ABORT(LOG_MODULE, "Sqlite misuse!");
-		}
-	}
 
-	/* get the row id */
-	ret = sqlite3_last_insert_rowid(db);
-end:
-	if (stmt != NULL) {
-		sqlite3_finalize(stmt);
-	}
-	if (db != NULL) {
-		sqlite3_close(db);
+/**
+ * Compiles the patterns used to recognize TV episodes. They
+ * are compiled once and shared by all threads.
+ */
+static void
+mbox_library_local_compile_patterns(void)
+{
+	int i;
+	const char * const patterns[MBOX_LIBRARY_VIDEO_PATTERNS] =
+	{
+		"(.*)S([0-9][0-9])E([0-9][0-9])(.*)",
+		"(.*)S([0-9][0-9])(.*)"
+	};
+
+	for (i = 0; i < MBOX_LIBRARY_VIDEO_PATTERNS; i++) {
+		if (regcomp(&video_patterns[i], patterns[i], REG_EXTENDED | REG_ICASE) != 0) {
+			DEBUG_ABORT(LOG_MODULE, "Could not compile regexp!");
+		}
 	}
-	return ret;
 }
 
 
@@ -966,11 +863,8 @@ mbox_library_local_video_name(const char * const path, int64_t * const parent_id
 {
 	int ret, i;
 	char *name = NULL, *tmp = NULL, *res = NULL;
-	const char *patterns[] =
-	{
-		"(.*)S([0-9][0-9])E([0-9][0-9])(.*)",
-		"(.*)S([0-9][0-9])(.*)"
-	};
+
+	pthread_once(&video_patterns_once, mbox_library_local_compile_patterns);
 
 	if ((tmp = strdup(path)) == NULL) {
 		ASSERT(errno == ENOMEM);
@@ -983,17 +877,12 @@ mbox_library_local_video_name(const char * const path, int64_t * const parent_id
 
 	mbox_library_stripext(name);
 
-	for (i = 0; i < (sizeof(patterns) / sizeof(char*)); i++) {
-		regex_t regex;
+	for (i = 0; i < MBOX_LIBRARY_VIDEO_PATTERNS; i++) {
 		int nmatches = 5;
 		regmatch_t matches[nmatches];
 
-		if ((ret = regcomp(&regex, patterns[i], REG_EXTENDED | REG_ICASE)) != 0) {
-			DEBUG_ABORT(LOG_MODULE, "Could not compile regexp!");
-		}
-
 		/* if the name looks like a TV serie... */
-		if ((ret = regexec(&regex, name, nmatches, matches, 0)) == 0) {
+		if ((ret = regexec(&video_patterns[i], name, nmatches, matches, 0)) == 0) {
 
 			char buf[1024] = "", *pbuf;
 			char *serie_name, *season, *episode;
@@ -1077,11 +966,9 @@ serie_end:
 			/* nothing */
 		} else {
 			char buf[256];
-			regerror(ret, &regex, buf, sizeof(buf));
+			regerror(ret, &video_patterns[i], buf, sizeof(buf));
 			LOG_VPRINT_ERROR("Regex error: %s", buf);
 		}
-
-		regfree(&regex);
 	}
 
 	/* this is not a serie */
@@ -1107,19 +994,121 @@ mbox_library_local_audio_name(const char * const path, int64_t * const parent_id
 
 
 /**
- * Add content to the local media library.
+ * Check if a file has changed since it was added to
+ * the library or found not to be media.
  */
-static int64_t
-mbox_library_addcontent(const char * const path)
+static int
+mbox_library_local_unchanged(const char * const path, const struct stat * const st)
+{
+	int64_t ret;
+	sqlite3_stmt *stmt;
+
+	if ((stmt = mbox_library_local_prepare(
+		"SELECT EXISTS (SELECT 1 FROM local_objects WHERE path = ?3 AND "
+		"date_modified = ?1 AND size = ?2) OR EXISTS (SELECT 1 FROM local_ignored "
+		"WHERE path = ?3 AND date_modified = ?1 AND size = ?2)")) == NULL) {
+		return 0;
+	}
+	if (sqlite3_bind_int64(stmt, 1, st->st_mtime) != SQLITE_OK ||
+		sqlite3_bind_int64(stmt, 2, st->st_size) != SQLITE_OK ||
+		sqlite3_bind_text(stmt, 3, path, -1, SQLITE_STATIC) != SQLITE_OK) {
+		LOG_VPRINT_ERROR("Binding failed: %s",
+			sqlite3_errmsg(sqlite3_db_handle(stmt)));
+		avbox_dbutil_done(stmt);
+		return 0;
+	}
+	if (avbox_dbutil_getint64(stmt, &ret) == -1) {
+		return 0;
+	}
+	return ret != 0;
+}
+
+
+/**
+ * Remembers a file that is not media so the next scan
+ * can skip it without looking at its contents.
+ */
+static int
+mbox_library_local_ignore(const char * const path, const struct stat * const st)
+{
+	sqlite3_stmt *stmt;
+
+	if ((stmt = mbox_library_local_prepare(
+		"INSERT OR REPLACE INTO local_ignored (path, date_modified, size) "
+		"VALUES (?, ?, ?)")) == NULL) {
+		return -1;
+	}
+	if (sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC) != SQLITE_OK ||
+		sqlite3_bind_int64(stmt, 2, st->st_mtime) != SQLITE_OK ||
+		sqlite3_bind_int64(stmt, 3, st->st_size) != SQLITE_OK) {
+		LOG_VPRINT_ERROR("Binding failed: %s",
+			sqlite3_errmsg(sqlite3_db_handle(stmt)));
+		avbox_dbutil_done(stmt);
+		return -1;
+	}
+	return avbox_dbutil_exec(stmt);
+}
+
+
+/**
+ * Removes a path and everything under it from the
+ * library.
+ */
+static void
+mbox_library_local_forget(const char * const path)
+{
+	size_t i;
+	sqlite3_stmt *stmt;
+
+	/* the range ('/' + 1 == '0') lets sqlite use the path index */
+	const char * const sql[] = {
+		"DELETE FROM local_objects WHERE path = ?1 OR "
+		"(path > ?1 || '/' AND path < ?1 || '0')",
+		"DELETE FROM local_ignored WHERE path = ?1 OR "
+		"(path > ?1 || '/' AND path < ?1 || '0')"
+	};
+
+	for (i = 0; i < sizeof(sql) / sizeof(sql[0]); i++) {
+		if ((stmt = mbox_library_local_prepare(sql[i])) == NULL) {
+			continue;
+		}
+		if (sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC) != SQLITE_OK) {
+			LOG_VPRINT_ERROR("Binding failed: %s",
+				sqlite3_errmsg(sqlite3_db_handle(stmt)));
+			avbox_dbutil_done(stmt);
+		} else {
+			avbox_dbutil_exec(stmt);
+		}
+	}
+}
+
+
+/**
+ * Runs an SQL statement on the library database.
+ */
+static int
+mbox_library_local_exec(const char * const sql)
+{
+	sqlite3_stmt *stmt;
+	if ((stmt = mbox_library_local_prepare(sql)) == NULL) {
+		return -1;
+	}
+	return avbox_dbutil_exec(stmt);
+}
+
+
+/**
+ * Opens a magic cookie for identifying content.
+ */
+static magic_t
+mbox_library_local_openmagic(void)
 {
-	int ret = -1;
 	magic_t magic;
-	const char *mime = NULL;
 
 	if ((magic = magic_open(MAGIC_MIME)) == NULL) {
 		LOG_PRINT_ERROR("Could not create magic cookie");
 		errno = EFAULT;
-		return -1;
+		return NULL;
 	}
 
 	if (magic_load(magic, NULL) != 0) {
@@ -1127,24 +1116,33 @@ mbox_library_addcontent(const char * const path)
 			magic_error(magic));
 		magic_close(magic);
 		errno = EFAULT;
-		return -1;
+		return NULL;
 	}
 
+	return magic;
+}
+
+
+/**
+ * Add content to the local media library.
+ */
+static int64_t
+mbox_library_local_addcontent(magic_t magic, const char * const path,
+	const struct stat * const st)
+{
+	int ret = -1;
+	const char *mime = NULL;
+
 	if ((mime = magic_file(magic, path)) == NULL) {
 		LOG_PRINT_ERROR("Could not get file magic");
-		magic_close(magic);
 		errno = EFAULT;
 		return -1;
 	}
 
 	if ((!strncmp(mime, "video/", 6) && strcmp(mime, "video/subtitle")) || !strncmp(mime, "video/", 6)) {
-		int res, retries = 0;
 		int64_t id, parent_id;
-		sqlite3 *db = NULL;
 		sqlite3_stmt *stmt = NULL;
 		char * name = NULL;
-		const char * const sql_insert = "INSERT INTO local_objects (parent_id, name, path) VALUES (?, ?, ?)";
-		const char * const sql_update = "UPDATE local_objects SET name = ? WHERE id = ?";
 
 		if (!strcmp(path + (strlen(path) - 3), "sub")) {
 			errno = EINVAL;
@@ -1183,165 +1181,240 @@ mbox_library_addcontent(const char * const path)
 		}
 		#endif
 
-		/* open db connection */
-		if (mbox_library_local_open_database(&db, SQLITE_OPEN_READWRITE) == -1) {
-			LOG_VPRINT_ERROR("Could not open database: %s",
-				sqlite3_errmsg(db));
-			goto end;
-		}
-
 		if (id == -1) {
-			/* prepare the query */
-			while ((res = sqlite3_prepare_v2(db, sql_insert, -1, &stmt, 0)) != SQLITE_OK) {
-				if (res == SQLITE_LOCKED) {
-					if (retries < 3) {
-						usleep(100L * 1000L);
-						retries++;
-						continue;
-					}
-					errno = EAGAIN;
-				} else {
-					errno = EFAULT;
-				}
-				LOG_VPRINT_ERROR("Could not prepare SQL statement: %s", sql_insert);
-				LOG_VPRINT_ERROR("SQL Error: %s", sqlite3_errmsg(db));
+			if ((stmt = mbox_library_local_prepare(
+				"INSERT INTO local_objects (parent_id, name, path, date_added, date_modified, size) "
+				"VALUES (?, ?, ?, strftime('%s', 'now'), ?, ?)")) == NULL) {
 				goto end;
 			}
-
-			/* bind parameters */
-			if (sqlite3_bind_int(stmt, 1, parent_id) != SQLITE_OK ||
-				sqlite3_bind_text(stmt, 2, name, strlen(name), NULL) != SQLITE_OK ||
-				sqlite3_bind_text(stmt, 3, path, strlen(path), NULL) != SQLITE_OK) {
-				LOG_VPRINT_ERROR("Binding failed: %s", sqlite3_errmsg(db));
+			if (sqlite3_bind_int64(stmt, 1, parent_id) != SQLITE_OK ||
+				sqlite3_bind_text(stmt, 2, name, -1, SQLITE_STATIC) != SQLITE_OK ||
+				sqlite3_bind_text(stmt, 3, path, -1, SQLITE_STATIC) != SQLITE_OK ||
+				sqlite3_bind_int64(stmt, 4, st->st_mtime) != SQLITE_OK ||
+				sqlite3_bind_int64(stmt, 5, st->st_size) != SQLITE_OK) {
+				LOG_VPRINT_ERROR("Binding failed: %s",
+					sqlite3_errmsg(sqlite3_db_handle(stmt)));
+				avbox_dbutil_done(stmt);
 				goto end;
 			}
 		} else {
-			/* prepare the query */
-			while ((res = sqlite3_prepare_v2(db, sql_update, -1, &stmt, 0)) != SQLITE_OK) {
-				if (res == SQLITE_LOCKED) {
-					if (retries < 3) {
-						usleep(100L * 1000L);
-						retries++;
-						continue;
-					}
-					errno = EAGAIN;
-				} else {
-					errno = EFAULT;
-				}
-				LOG_VPRINT_ERROR("Could not prepare SQL statement: %s", sql_insert);
-				LOG_VPRINT_ERROR("SQL Error: %s", sqlite3_errmsg(db));
+			if ((stmt = mbox_library_local_prepare(
+				"UPDATE local_objects SET name = ?, date_modified = ?, size = ? WHERE id = ?")) == NULL) {
 				goto end;
 			}
-
-			/* bind parameters */
-			if (sqlite3_bind_text(stmt, 1, name, strlen(name), NULL) != SQLITE_OK ||
-				sqlite3_bind_int(stmt, 2, id) != SQLITE_OK) {
-				LOG_VPRINT_ERROR("Binding failed: %s", sqlite3_errmsg(db));
+			if (sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC) != SQLITE_OK ||
+				sqlite3_bind_int64(stmt, 2, st->st_mtime) != SQLITE_OK ||
+				sqlite3_bind_int64(stmt, 3, st->st_size) != SQLITE_OK ||
+				sqlite3_bind_int64(stmt, 4, id) != SQLITE_OK) {
+				LOG_VPRINT_ERROR("Binding failed: %s",
+					sqlite3_errmsg(sqlite3_db_handle(stmt)));
+				avbox_dbutil_done(stmt);
 				goto end;
 			}
 		}
 
 		/* execute the statement */
-		while ((res = sqlite3_step(stmt)) != SQLITE_DONE) {
-			if (res == SQLITE_BUSY) {
-				usleep(100L * 1000L);
-				continue;
-			} else if (res == SQLITE_ERROR) {
-				LOG_VPRINT_ERROR("SQLite Error: %s", sqlite3_errmsg(db));
-				break;
-			} else if (res == SQLITE_MISUSE) {
-				DEBUG_ABORT(LOG_MODULE, "Sqlite misuse!");
-			}
+		if (avbox_dbutil_exec(stmt) == 0) {
+			ret = (id == -1) ? sqlite3_last_insert_rowid(sqlite3_db_handle(stmt)) : id;
 		}
-
-		ret = sqlite3_last_insert_rowid(db);
 end:
 		if (name != NULL) {
 			free(name);
 		}
-		if (stmt != NULL) {
-			sqlite3_finalize(stmt);
-		}
-		if (db != NULL) {
-			sqlite3_close(db);
-		}
 	} else {
 		errno = EINVAL;
 	}
 
-	magic_close(magic);
+	return ret;
+}
+
 
+/**
+ * Add a single file to the local media library.
+ */
+static int64_t
+mbox_library_addcontent(const char * const path)
+{
+	int64_t ret;
+	magic_t magic;
+	struct stat st;
+
+	if (stat(path, &st) == -1) {
+		return -1;
+	}
+	if ((magic = mbox_library_local_openmagic()) == NULL) {
+		return -1;
+	}
+	ret = mbox_library_local_addcontent(magic, path, &st);
+	magic_close(magic);
 	return ret;
 }
 
 
 /**
- * Add a directory to the watch list.
+ * Library scan state.
  */
-int
-mbox_library_scandir(const char * const path)
+struct mbox_library_scan
+{
+	magic_t magic;
+	int pending;
+	struct timespec batch_start;
+};
+
+
+/**
+ * Commits the files added so far.
+ */
+static void
+mbox_library_scan_commit(struct mbox_library_scan * const scan, const int begin)
+{
+	if (mbox_library_local_exec("COMMIT") == -1) {
+		LOG_VPRINT_ERROR("Could not commit scan batch: %s",
+			strerror(errno));
+	}
+	if (begin && mbox_library_local_exec("BEGIN IMMEDIATE") == -1) {
+		LOG_VPRINT_ERROR("Could not start scan batch: %s",
+			strerror(errno));
+	}
+	clock_gettime(CLOCK_MONOTONIC, &scan->batch_start);
+	scan->pending = 0;
+}
+
+
+/**
+ * Commits the current batch if it's full or has been
+ * open for too long.
+ */
+static void
+mbox_library_scan_checkpoint(struct mbox_library_scan * const scan)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (scan->pending >= MBOX_LIBRARY_SCAN_BATCH ||
+		utimediff(&now, &scan->batch_start) >= MBOX_LIBRARY_SCAN_BATCH_TIME) {
+		mbox_library_scan_commit(scan, 1);
+	}
+}
+
+
+/**
+ * Scans a directory. Takes ownership of fd.
+ */
+static int
+mbox_library_scanfd(struct mbox_library_scan * const scan,
+	const int fd, const char * const path)
 {
 	DIR *dir;
 	struct dirent *ent;
-	int ret = -1;
-
-	DEBUG_VPRINT(LOG_MODULE, "Scanning '%s'...", path);
+	char *entpath = NULL;
+	size_t pathlen = strlen(path), entpathsz = 0;
 
-	if ((dir = opendir(path)) == NULL) {
-		LOG_VPRINT_ERROR("Could not watch path (%s): %s",
+	if ((dir = fdopendir(fd)) == NULL) {
+		LOG_VPRINT_ERROR("Could not open directory (%s): %s",
 			path, strerror(errno));
+		close(fd);
 		return -1;
 	}
 
 	while ((ent = readdir(dir)) != NULL) {
-		char *entpath;
 		struct stat st;
+		const size_t len = pathlen + 1 + strlen(ent->d_name) + 1;
 
 		if (ent->d_name[0] == '.') {
 			continue;
 		}
 
-		entpath = malloc(strlen(path) + 1 + strlen(ent->d_name) + 1);
-		if (entpath == NULL) {
-			ASSERT(errno == ENOMEM);
-			DEBUG_PRINT(LOG_MODULE, "Library scan aborted. Out of memory");
-			goto end;
+		if (len > entpathsz) {
+			char * const tmp = realloc(entpath, len);
+			if (tmp == NULL) {
+				ASSERT(errno == ENOMEM);
+				DEBUG_PRINT(LOG_MODULE, "Library scan aborted. Out of memory");
+				break;
+			}
+			entpath = tmp;
+			entpathsz = len;
 		}
 
 		strcpy(entpath, path);
-		strcat(entpath, "/");
-		strcat(entpath, ent->d_name);
+		entpath[pathlen] = '/';
+		strcpy(entpath + pathlen + 1, ent->d_name);
 
-		if (stat(entpath, &st) == -1) {
+		if (ent->d_type == DT_DIR) {
+			st.st_mode = S_IFDIR;
+		} else if (fstatat(fd, ent->d_name, &st, 0) == -1) {
 			LOG_VPRINT_ERROR("Could not stat %s: %s",
 				entpath, strerror(errno));
-			free(entpath);
 			continue;
 		}
 
 		if (S_ISDIR(st.st_mode)) {
-			if (mbox_library_scandir(entpath) == -1) {
+			const int subdir = openat(fd, ent->d_name,
+				O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			if (subdir == -1 || mbox_library_scanfd(scan, subdir, entpath) == -1) {
 				LOG_VPRINT_ERROR("Could not scan directory '%s': %s",
-					entpath, strerror);
+					entpath, strerror(errno));
 			}
-		} else {
-			if (mbox_library_addcontent(entpath) == -1) {
-				if (errno != EINVAL) {
-					LOG_VPRINT_ERROR("Could not add content '%s': %s",
-						entpath, strerror(errno));
+		} else if (S_ISREG(st.st_mode)) {
+			if (!mbox_library_local_unchanged(entpath, &st)) {
+				if (mbox_library_local_addcontent(scan->magic, entpath, &st) == -1) {
+					if (errno != EINVAL) {
+						LOG_VPRINT_ERROR("Could not add content '%s': %s",
+							entpath, strerror(errno));
+					} else if (mbox_library_local_ignore(entpath, &st) == 0) {
+						scan->pending++;
+					}
+				} else {
+					scan->pending++;
 				}
 			}
+			mbox_library_scan_checkpoint(scan);
 		}
+	}
 
+	if (entpath != NULL) {
 		free(entpath);
 	}
+	closedir(dir);
+	return 0;
+}
 
-	ret = 0;
-end:
-	if (dir != NULL) {
-		closedir(dir);
+
+/**
+ * Scan a directory and add any new or modified content
+ * to the library.
+ */
+int
+mbox_library_scandir(const char * const path)
+{
+	int fd, ret;
+	struct mbox_library_scan scan;
+
+	DEBUG_VPRINT(LOG_MODULE, "Scanning '%s'...", path);
+
+	if ((fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+		LOG_VPRINT_ERROR("Could not watch path (%s): %s",
+			path, strerror(errno));
+		return -1;
+	}
+
+	if ((scan.magic = mbox_library_local_openmagic()) == NULL) {
+		close(fd);
+		return -1;
+	}
+
+	/* files are added in batches */
+	scan.pending = 0;
+	clock_gettime(CLOCK_MONOTONIC, &scan.batch_start);
+	if (mbox_library_local_exec("BEGIN IMMEDIATE") == -1) {
+		LOG_VPRINT_ERROR("Could not start scan batch: %s",
+			strerror(errno));
 	}
 
+	ret = mbox_library_scanfd(&scan, fd, path);
+
+	mbox_library_scan_commit(&scan, 0);
+	magic_close(scan.magic);
+
 	return ret;
 }
 
@@ -1357,6 +1430,63 @@ mbox_library_local_scan_library(void * const arg)
 }
 
 
+/**
+ * Upgrades the library database schema.
+ */
+static int
+mbox_library_local_migrate(void)
+{
+	int64_t version;
+	sqlite3_stmt *stmt;
+
+	if ((stmt = mbox_library_local_prepare("PRAGMA user_version")) == NULL ||
+		avbox_dbutil_getint64(stmt, &version) == -1) {
+		return -1;
+	}
+	if (version >= CONTENT_DB_VERSION) {
+		return 0;
+	}
+
+	DEBUG_VPRINT(LOG_MODULE, "Upgrading content database (version %" PRIi64 ")",
+		version);
+
+	if (mbox_library_local_exec("BEGIN IMMEDIATE") == -1) {
+		return -1;
+	}
+
+	/* version 1: file size for change detection and indexes
+	 * for directory listings and path lookups */
+	if (version < 1) {
+		if (mbox_library_local_exec("ALTER TABLE local_objects ADD COLUMN size INTEGER") == -1 ||
+			mbox_library_local_exec("CREATE INDEX IF NOT EXISTS local_objects_parent "
+				"ON local_objects (parent_id, name)") == -1 ||
+			mbox_library_local_exec("CREATE INDEX IF NOT EXISTS local_objects_path "
+				"ON local_objects (path)") == -1) {
+			mbox_library_local_exec("ROLLBACK");
+			return -1;
+		}
+	}
+
+	/* version 2: files that are not media so rescans
+	 * can skip them */
+	if (version < 2) {
+		if (mbox_library_local_exec("CREATE TABLE IF NOT EXISTS local_ignored ("
+				"path TEXT PRIMARY KEY, date_modified INTEGER, size INTEGER)") == -1) {
+			mbox_library_local_exec("ROLLBACK");
+			return -1;
+		}
+	}
+
+	if (mbox_library_local_exec("PRAGMA user_version = " STRINGIZE(CONTENT_DB_VERSION)) == -1 ||
+		mbox_library_local_exec("COMMIT") == -1) {
+		mbox_library_local_exec("ROLLBACK");
+		return -1;
+	}
+
+	return 0;
+}
+
+
 /**
  * Check if the local database exists and create it if it
  * doesn't.
@@ -1369,7 +1499,7 @@ mbox_library_create_db_if_not_exist()
 	struct stat st;
 	struct avbox_delegate *del;
 
-	if ((filename = avbox_dbutil_getdbfile("content.db")) == NULL) {
+	if ((filename = avbox_dbutil_getdbfile(CONTENT_DB)) == NULL) {
 		ASSERT(errno == ENOMEM);
 		return ret;
 	}
@@ -1421,17 +1551,23 @@ mbox_library_create_db_if_not_exist()
 		}
 
 		sqlite3_close(db);
+		break;
+	}
 
-		/* scan the internal storage in background thread */
-		if ((del = avbox_workqueue_delegate(
-			mbox_library_local_scan_library, NULL)) == NULL) {
-			LOG_VPRINT_ERROR("Could not start scan worker: %s",
-				strerror(errno));
-		} else {
-			avbox_delegate_dettach(del);
-		}
+	if (mbox_library_local_migrate() == -1) {
+		LOG_VPRINT_ERROR("Could not upgrade content database: %s",
+			strerror(errno));
+		goto end;
+	}
 
-		break;
+	/* scan the internal storage in background thread. Files
+	 * that haven't changed since the last scan are skipped */
+	if ((del = avbox_workqueue_delegate(
+		mbox_library_local_scan_library, NULL)) == NULL) {
+		LOG_VPRINT_ERROR("Could not start scan worker: %s",
+			strerror(errno));
+	} else {
+		avbox_delegate_dettach(del);
 	}
 
 	ret = 0;
@@ -2307,10 +2443,8 @@ mbox_library_local_inotify(void * const arg)
 				continue;
 			}
 
-			/* build the full path
-			 * Note that we are allocating an extra byte in case
-			 * we need to append a % for the sql statement */
-			if ((path = malloc(strlen(dir_path) + 1 + strlen(event->name) + 2)) == NULL) {
+			/* build the full path */
+			if ((path = malloc(strlen(dir_path) + 1 + strlen(event->name) + 1)) == NULL) {
 				abort();
 			}
 			strcpy(path, dir_path);
@@ -2373,64 +2507,9 @@ mbox_library_local_inotify(void * const arg)
 
 
 			} else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
-				int res;
-				sqlite3 *db = NULL;
-				sqlite3_stmt *stmt = NULL;
-				const char * const sql = "DELETE FROM local_objects WHERE path LIKE ?";
-
 				DEBUG_VPRINT(LOG_MODULE, "File deleted/moved out: %s",
 					path);
-
-				/* append wildcard to path */
-				strcat(path, "%");
-
-				/* open db connection */
-				if (mbox_library_local_open_database(&db, SQLITE_OPEN_READWRITE) == -1) {
-					LOG_VPRINT_ERROR("Could not open database: %s",
-						sqlite3_errmsg(db));
-					errno = EIO;
-					goto remove_end;
-				}
-
-
-				/* prepare the query */
-				while ((res = sqlite3_prepare_v2(db, sql, -1, &stmt, 0)) != SQLITE_OK) {
-					if (res == SQLITE_LOCKED) {
-						usleep(100L * 1000L);
-						continue;
-					} else {
-						errno = EFAULT;
-					}
-					LOG_VPRINT_ERROR("Could not prepare SQL statement: %s", sql);
-					LOG_VPRINT_ERROR("SQL Error: %s", sqlite3_errmsg(db));
-					goto remove_end;
-				}
-
-				/* bind parameters */
-				if (sqlite3_bind_text(stmt, 1, path, strlen(path), NULL) != SQLITE_OK) {
-					LOG_VPRINT_ERROR("Binding failed: %s", sqlite3_errmsg(db));
-					goto remove_end;
-				}
-
-				/* execute the statement */
-				while ((res = sqlite3_step(stmt)) != SQLITE_DONE) {
-					if (res == SQLITE_BUSY) {
-						usleep(100L * 1000L);
-						continue;
-					} else if (res == SQLITE_ERROR) {
-						LOG_VPRINT_ERROR("SQLite Error: %s", sqlite3_errmsg(db));
-						break;
-					} else if (res == SQLITE_MISUSE) {
-						DEBUG_ABORT(LOG_MODULE, "Sqlite misuse!");
-					}
-				}
-remove_end:
-				if (stmt != NULL) {
-					sqlite3_finalize(stmt);
-				}
-				if (db != NULL) {
-					sqlite3_close(db);
-				}
+				mbox_library_local_forget(path);
 
 			} else if (event->mask & (IN_CLOSE_WRITE)) {
 				DEBUG_VPRINT(LOG_MODULE, "File closed: %s",
@@ -54,6 +54,7 @@ static int volumebar_timer_id = -1;
 static int clock_timer_id = -1;
 static char time_string[256] = "";
 static char date_string[256] = "";
+static int clock_height = 10 + 128 + 48;
 static char* ip_addresses = NULL;
 
 
@@ -121,10 +122,20 @@ mbox_shell_draw(struct avbox_window *window, void * const ctx)
 		cairo_set_source_rgba(context, 1.0, 1.0, 1.0, 1.0);
 
 		if (layout_time != NULL && layout_date != NULL) {
+			PangoRectangle ink, logical;
 			cairo_translate(context, 0, (h / 2) - (10 + 128 + 48));
 			pango_cairo_show_layout(context, layout_time);
 			cairo_translate(context, 0, 128 + 10);
 			pango_cairo_show_layout(context, layout_date);
+
+			/* save the height of the clock so the timer can
+			 * damage all of it (including descenders) */
+			pango_layout_get_pixel_extents(layout_date, &ink, &logical);
+			clock_height = 10 + 128 + MAX(48,
+				MAX(ink.y + ink.height, logical.y + logical.height));
+			pango_layout_get_pixel_extents(layout_time, &ink, &logical);
+			clock_height = MAX(clock_height,
+				MAX(ink.y + ink.height, logical.y + logical.height));
 		}
 
 		if (layout_time != NULL) {
@@ -205,6 +216,7 @@ mbox_shell_shutdowndraw(struct avbox_window *window, void * const ctx)
 static enum avbox_timer_result
 mbox_shell_welcomescreen(int id, void *data)
 {
+	int w, h;
 	time_t now;
 	static time_t earlier = 0, one_min = 0;
 
@@ -242,7 +254,11 @@ mbox_shell_welcomescreen(int id, void *data)
 	strftime(date_string, sizeof(time_string), "%B %d, %Y",
 		localtime(&now));
 
-	/* redraw the window */
+	/* redraw the clock. Only the clock changes so we
+	 * don't need to flip the whole window */
+	avbox_window_getcanvassize(main_window, &w, &h);
+	avbox_window_damagerect(main_window, 0, (h / 2) - (10 + 128 + 48),
+		w, clock_height);
         avbox_window_update(main_window);
 
 	return AVBOX_TIMER_CALLBACK_RESULT_CONTINUE;
@@ -338,7 +354,7 @@ mbox_shell_volumechanged(int volume)
 	}
 
 	/* draw the progress bar */
-	avbox_window_update(volumebar_window);
+	avbox_progressview_update(volumebar);
 
 	/* Register timer to dismiss volume bar */
 	tv.tv_sec = 5;
@@ -493,7 +509,6 @@ mbox_shell_playerstatuschanged(struct avbox_player *inst,
 				/* update the progress bar */
 				avbox_progressview_setvalue(progressbar, avbox_player_bufferstate(inst));
 				avbox_progressview_update(progressbar);
-				avbox_window_update(progress);
 			}
 			break;
 
@@ -0,0 +1,157 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <libavbox/avbox.h>
+#include <libavbox/audioclock.h>
+
+
+#define TEST_ASSERT(expr) \
+	do { if (!(expr)) { abort(); } } while(0)
+
+#define BENCH_READS	(2000000)
+
+/* the audio thread writes a 1024 frames period at 48KHz
+ * and holds the io lock for BENCH_WRITE_TIME while doing it */
+#define BENCH_PERIOD		(21333LL)
+#define BENCH_WRITE_TIME	(50LL)
+
+/* the audio clock runs this far ahead of the system clock */
+#define BENCH_CLOCK_OFFSET	(123456789LL)
+
+/* latency histogram bins (100ns each) */
+#define BENCH_BINS		(100000)
+
+
+static pthread_mutex_t bench_lock;
+static struct avbox_audioclock bench_clock;
+static int bench_quit;
+static uint32_t bench_histogram[BENCH_BINS];
+
+
+static int64_t
+bench_nsecs(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec * 1000000000LL) + now.tv_nsec;
+}
+
+
+/**
+ * Emulates the audio thread. It writes a period to the
+ * PCM under the io lock and publishes a clock sample.
+ */
+static void *
+bench_writer(void *arg)
+{
+	(void) arg;
+	while (!ATOMIC_LOAD_ACQUIRE(&bench_quit)) {
+		int64_t now;
+		pthread_mutex_lock(&bench_lock);
+		now = avbox_audioclock_now();
+		while (avbox_audioclock_now() - now < BENCH_WRITE_TIME);
+		now = avbox_audioclock_now();
+		avbox_audioclock_set(&bench_clock, now + BENCH_CLOCK_OFFSET,
+			now, now + BENCH_CLOCK_OFFSET + (BENCH_PERIOD * 4));
+		pthread_mutex_unlock(&bench_lock);
+		usleep(BENCH_PERIOD);
+	}
+	return NULL;
+}
+
+
+/**
+ * The old avbox_audiostream_gettime(). Takes the io lock and
+ * queries the PCM. There's no sound card here so the
+ * snd_pcm_avail() and snd_pcm_status() ioctls are stood in
+ * for by two trivial syscalls.
+ */
+static int64_t
+bench_gettime_locked(void)
+{
+	int64_t time;
+	pthread_mutex_lock(&bench_lock);
+	syscall(SYS_getppid);
+	syscall(SYS_getppid);
+	time = avbox_audioclock_now() + BENCH_CLOCK_OFFSET;
+	pthread_mutex_unlock(&bench_lock);
+	return time;
+}
+
+
+static int64_t
+bench_gettime_seqlock(void)
+{
+	return avbox_audioclock_gettime(&bench_clock,
+		avbox_audioclock_now());
+}
+
+
+/**
+ * Reads the clock BENCH_READS times while the writer is
+ * running and prints the average cost, the latency
+ * percentiles and the worst clock error.
+ */
+static void
+bench_clock_read(const char * const name, int64_t (*gettime)(void))
+{
+	int i;
+	int64_t start, end, p50 = -1, p99 = -1, max = 0, max_error = 0, count = 0;
+	pthread_t writer;
+	pthread_mutexattr_t attr;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT);
+	TEST_ASSERT(pthread_mutex_init(&bench_lock, &attr) == 0);
+	memset(bench_histogram, 0, sizeof(bench_histogram));
+	ATOMIC_STORE_RELEASE(&bench_quit, 0);
+
+	start = avbox_audioclock_now();
+	avbox_audioclock_set(&bench_clock, start + BENCH_CLOCK_OFFSET,
+		start, start + BENCH_CLOCK_OFFSET + (BENCH_PERIOD * 4));
+	TEST_ASSERT(pthread_create(&writer, NULL, bench_writer, NULL) == 0);
+
+	start = bench_nsecs();
+	for (i = 0; i < BENCH_READS; i++) {
+		const int64_t before = bench_nsecs();
+		const int64_t time = gettime();
+		const int64_t after = bench_nsecs();
+		const int64_t error = llabs((after / 1000LL) + BENCH_CLOCK_OFFSET - time);
+		bench_histogram[MIN((after - before) / 100, BENCH_BINS - 1)]++;
+		max = MAX(max, after - before);
+		max_error = MAX(max_error, error);
+	}
+	end = bench_nsecs();
+
+	ATOMIC_STORE_RELEASE(&bench_quit, 1);
+	pthread_join(writer, NULL);
+	pthread_mutex_destroy(&bench_lock);
+
+	for (i = 0; i < BENCH_BINS; i++) {
+		count += bench_histogram[i];
+		if (p50 == -1 && count >= BENCH_READS / 2) {
+			p50 = i * 100;
+		}
+		if (p99 == -1 && count >= (BENCH_READS / 100) * 99) {
+			p99 = i * 100;
+		}
+	}
+
+	fprintf(stderr, "bench-audioclock: %-7s %7.1f ns/read  p50=%" PRIi64 "ns "
+		"p99=%" PRIi64 "ns max=%" PRIi64 "ns max_error=%" PRIi64 "us\n",
+		name, (double) (end - start) / BENCH_READS, p50, p99, max, max_error);
+}
+
+
+int
+main()
+{
+	bench_clock_read("locked", bench_gettime_locked);
+	bench_clock_read("seqlock", bench_gettime_seqlock);
+	return 0;
+}
@@ -0,0 +1,75 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <libavbox/avbox.h>
+
+
+#define TEST_ASSERT(expr) \
+	do { if (!(expr)) { abort(); } } while(0)
+
+#define BENCH_ITEMS	(2000000)
+
+
+static void *
+bench_producer(void *arg)
+{
+	intptr_t i;
+	struct avbox_queue * const q = arg;
+	for (i = 1; i <= BENCH_ITEMS; i++) {
+		while (avbox_queue_put(q, (void*) i) == -1) {
+			TEST_ASSERT(errno == EAGAIN);
+		}
+	}
+	return NULL;
+}
+
+
+/**
+ * Move BENCH_ITEMS items between two threads and
+ * print the average time per item.
+ */
+static void
+bench_queue(const char * const name, const size_t sz, const int flags)
+{
+	intptr_t i, item;
+	pthread_t producer;
+	struct timespec start, end;
+	int64_t elapsed;
+	struct avbox_queue * const q = avbox_queue_new(sz, flags);
+
+	TEST_ASSERT(q != NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	TEST_ASSERT(pthread_create(&producer, NULL, bench_producer, q) == 0);
+	for (i = 1; i <= BENCH_ITEMS; i++) {
+		while ((item = (intptr_t) avbox_queue_get(q)) == 0) {
+			TEST_ASSERT(errno == EAGAIN);
+		}
+		TEST_ASSERT(item == i);
+	}
+	pthread_join(producer, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	elapsed = ((end.tv_sec - start.tv_sec) * 1000000000LL) +
+		(end.tv_nsec - start.tv_nsec);
+	fprintf(stderr, "bench-queue: %-6s size=%-4zu %8.1f ns/item\n",
+		name, sz, (double) elapsed / BENCH_ITEMS);
+
+	avbox_queue_destroy(q);
+}
+
+
+int
+main()
+{
+	const size_t sizes[] = { 1, 30, 256 };
+	int i;
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		bench_queue("mutex", sizes[i], AVBOX_QUEUEFLAGS_NONE);
+		bench_queue("spsc", sizes[i], AVBOX_QUEUEFLAGS_SPSC);
+	}
+	return 0;
+}
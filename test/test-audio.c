@@ -0,0 +1,108 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <libavbox/avbox.h>
+
+
+#define TEST_ASSERT(expr) \
+	do { if (!(expr)) { abort(); } } while(0)
+
+/* 2 channels of S16_LE */
+#define TEST_FRAMESZ	(4)
+#define TEST_FRAMES	(48000 + 1234)
+#define TEST_CHUNK	(1152)
+
+
+static char test_dir[] = "/tmp/test-audioXXXXXX";
+
+
+/**
+ * Plays TEST_FRAMES frames through the ALSA file plugin
+ * (backed by the null device) and checks that they all
+ * made it to the file.
+ */
+static void
+test_play(const unsigned int framerate, const int flags)
+{
+	FILE *f;
+	size_t len;
+	uint32_t i, n = 0, buf[TEST_CHUNK];
+	char path[PATH_MAX], device[PATH_MAX + 16];
+	struct avbox_audiostream *stream;
+
+	snprintf(path, sizeof(path), "%s/out.raw", test_dir);
+	snprintf(device, sizeof(device), "file:'%s',raw", path);
+	TEST_ASSERT(setenv((flags & AVBOX_AUDIOSTREAM_PASSTHROUGH) ?
+		"ALSA_PASSTHROUGH_DEVICE" : "ALSA_DEVICE", device, 1) == 0);
+
+	TEST_ASSERT((stream = avbox_audiostream_new(100, NULL, NULL)) != NULL);
+	TEST_ASSERT(avbox_audiostream_setformat(stream, framerate, flags) == 0);
+	TEST_ASSERT(avbox_audiostream_capacity(stream) == framerate / 10);
+	TEST_ASSERT(avbox_audiostream_start(stream) == 0);
+
+	/* the format cannot change once started */
+	TEST_ASSERT(avbox_audiostream_setformat(stream, 48000, 0) == -1);
+	TEST_ASSERT(errno == EBUSY);
+	TEST_ASSERT(avbox_audiostream_setclock(stream, 0) == 0);
+
+	while (n < TEST_FRAMES) {
+		size_t written = 0;
+		len = MIN(TEST_CHUNK, TEST_FRAMES - n);
+		for (i = 0; i < len; i++) {
+			buf[i] = n + i;
+		}
+		while (written < len) {
+			const ssize_t ret = avbox_audiostream_write(stream,
+				(uint8_t*) (buf + written), len - written);
+			TEST_ASSERT(ret != -1 || errno == EAGAIN);
+			if (ret > 0) {
+				written += ret;
+			}
+		}
+		n += len;
+	}
+
+	TEST_ASSERT(avbox_audiostream_drain(stream) == 0);
+	avbox_audiostream_destroy(stream);
+
+	/* the file holds every frame in order */
+	TEST_ASSERT((f = fopen(path, "r")) != NULL);
+	for (n = 0; n < TEST_FRAMES; n += len) {
+		len = MIN(TEST_CHUNK, TEST_FRAMES - n);
+		TEST_ASSERT(fread(buf, TEST_FRAMESZ, len, f) == len);
+		for (i = 0; i < len; i++) {
+			TEST_ASSERT(buf[i] == n + i);
+		}
+	}
+	fclose(f);
+	TEST_ASSERT(unlink(path) == 0);
+}
+
+
+int
+main()
+{
+	log_setfile(stderr);
+	TEST_ASSERT(mkdtemp(test_dir) != NULL);
+
+	/* mmap access */
+	test_play(48000, 0);
+	test_play(44100, 0);
+
+	/* IEC 61937 bursts (ie. E-AC-3) go to the passthrough
+	 * device untouched */
+	test_play(192000, AVBOX_AUDIOSTREAM_PASSTHROUGH);
+
+	/* RW fallback */
+	TEST_ASSERT(setenv("ALSA_NO_MMAP", "1", 1) == 0);
+	test_play(48000, 0);
+	test_play(192000, AVBOX_AUDIOSTREAM_PASSTHROUGH);
+
+	avbox_audiostream_shutdown();
+	rmdir(test_dir);
+	return 0;
+}
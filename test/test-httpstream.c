@@ -0,0 +1,329 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <curl/curl.h>
+#include <libavbox/avbox.h>
+#include <libavbox/stream.h>
+
+
+#define TEST_ASSERT(expr) \
+	do { if (!(expr)) { abort(); } } while(0)
+
+#define TEST_SIZE	(3 * 1024 * 1024 + 1234)
+#define TEST_LATENCY	(20 * 1000)
+
+
+/* local HTTP server */
+static int server_fd = -1;
+static int server_port;
+static int server_ranges = 1;
+static int server_requests = 0;
+static pthread_mutex_t server_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static uint8_t
+test_byte(const int64_t i)
+{
+	return (uint8_t) ((i * 31) + (i / 251));
+}
+
+
+static int
+test_check(const uint8_t * const buf, const int64_t offset, const size_t len)
+{
+	size_t i;
+	for (i = 0; i < len; i++) {
+		if (buf[i] != test_byte(offset + i)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+
+static int
+test_sendall(const int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	while (len > 0) {
+		const ssize_t ret = send(fd, p, len, MSG_NOSIGNAL);
+		if (ret <= 0) {
+			return -1;
+		}
+		p += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+
+/**
+ * Serves one request. Supports HEAD and single
+ * byte ranges (bytes=a-b and bytes=a-).
+ */
+static void *
+test_server_conn(void *arg)
+{
+	char req[4096], hdr[512], *range;
+	int64_t start = 0, end = TEST_SIZE - 1;
+	size_t len = 0;
+	int partial = 0;
+	const int fd = (int) (intptr_t) arg;
+
+	/* read the headers */
+	while (len < sizeof(req) - 1) {
+		const ssize_t ret = recv(fd, req + len, sizeof(req) - 1 - len, 0);
+		if (ret <= 0) {
+			close(fd);
+			return NULL;
+		}
+		len += ret;
+		req[len] = '\0';
+		if (strstr(req, "\r\n\r\n") != NULL) {
+			break;
+		}
+	}
+
+	pthread_mutex_lock(&server_lock);
+	server_requests++;
+	pthread_mutex_unlock(&server_lock);
+
+	usleep(TEST_LATENCY);
+
+	if (server_ranges && (range = strstr(req, "Range: bytes=")) != NULL) {
+		char *p;
+		start = strtoll(range + 13, &p, 10);
+		if (*p == '-' && p[1] >= '0' && p[1] <= '9') {
+			end = MIN(strtoll(p + 1, NULL, 10), TEST_SIZE - 1);
+		}
+		partial = 1;
+	}
+
+	if (start >= TEST_SIZE) {
+		snprintf(hdr, sizeof(hdr), "HTTP/1.1 416 Range Not Satisfiable\r\n"
+			"Content-Length: 0\r\nConnection: close\r\n\r\n");
+		test_sendall(fd, hdr, strlen(hdr));
+		close(fd);
+		return NULL;
+	}
+
+	if (partial) {
+		snprintf(hdr, sizeof(hdr), "HTTP/1.1 206 Partial Content\r\n"
+			"Content-Length: %" PRIi64 "\r\n"
+			"Content-Range: bytes %" PRIi64 "-%" PRIi64 "/%d\r\n"
+			"Connection: close\r\n\r\n",
+			end - start + 1, start, end, TEST_SIZE);
+	} else {
+		snprintf(hdr, sizeof(hdr), "HTTP/1.1 200 OK\r\n"
+			"Content-Length: %d\r\nAccept-Ranges: %s\r\n"
+			"Connection: close\r\n\r\n", TEST_SIZE,
+			server_ranges ? "bytes" : "none");
+	}
+
+	if (test_sendall(fd, hdr, strlen(hdr)) == 0 && strncmp(req, "HEAD", 4)) {
+		uint8_t buf[16 * 1024];
+		while (start <= end) {
+			const size_t n = MIN(sizeof(buf), end - start + 1);
+			size_t i;
+			for (i = 0; i < n; i++) {
+				buf[i] = test_byte(start + i);
+			}
+			if (test_sendall(fd, buf, n) == -1) {
+				break;
+			}
+			start += n;
+		}
+	}
+	close(fd);
+	return NULL;
+}
+
+
+static void *
+test_server(void *arg)
+{
+	int fd;
+	pthread_t thread;
+	(void) arg;
+
+	while ((fd = accept(server_fd, NULL, NULL)) != -1) {
+		if (pthread_create(&thread, NULL, test_server_conn, (void*) (intptr_t) fd) != 0) {
+			close(fd);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+	return NULL;
+}
+
+
+static void
+test_server_start(void)
+{
+	pthread_t thread;
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	const int one = 1;
+
+	TEST_ASSERT((server_fd = socket(AF_INET, SOCK_STREAM, 0)) != -1);
+	setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = 0;
+	TEST_ASSERT(bind(server_fd, (struct sockaddr*) &addr, sizeof(addr)) == 0);
+	TEST_ASSERT(listen(server_fd, 16) == 0);
+	TEST_ASSERT(getsockname(server_fd, (struct sockaddr*) &addr, &addrlen) == 0);
+	server_port = ntohs(addr.sin_port);
+	TEST_ASSERT(pthread_create(&thread, NULL, test_server, NULL) == 0);
+	pthread_detach(thread);
+}
+
+
+static struct avbox_httpstream *
+test_open(void)
+{
+	char url[64];
+	snprintf(url, sizeof(url), "http://127.0.0.1:%i/test.mp4", server_port);
+	return avbox_httpstream_open(url);
+}
+
+
+static int
+test_requests(void)
+{
+	int ret;
+	pthread_mutex_lock(&server_lock);
+	ret = server_requests;
+	pthread_mutex_unlock(&server_lock);
+	return ret;
+}
+
+
+/**
+ * Reads prefetched data until the range ends.
+ */
+static size_t
+test_pread(struct avbox_httpstream * const file,
+	uint8_t * const buf, const size_t len, const int64_t offset)
+{
+	ssize_t ret;
+	size_t done = 0;
+	while (done < len && (ret = avbox_httpstream_pread(file,
+		buf + done, len - done, offset + done)) > 0) {
+		done += ret;
+	}
+	return done;
+}
+
+
+static void
+test_read(void)
+{
+	static uint8_t buf[256 * 1024];
+	ssize_t ret;
+	size_t len = 0;
+	struct avbox_httpstream * const file = test_open();
+	TEST_ASSERT(file != NULL);
+
+	TEST_ASSERT(avbox_httpstream_size(file) == TEST_SIZE);
+
+	while (len < sizeof(buf)) {
+		TEST_ASSERT((ret = avbox_httpstream_read(file, buf + len, sizeof(buf) - len)) > 0);
+		len += ret;
+	}
+	TEST_ASSERT(test_check(buf, 0, sizeof(buf)));
+
+	/* seek forward and back */
+	TEST_ASSERT(avbox_httpstream_seek(file, 1536 * 1024) == 0);
+	TEST_ASSERT((ret = avbox_httpstream_read(file, buf, 65536)) > 0);
+	TEST_ASSERT(test_check(buf, 1536 * 1024, ret));
+	TEST_ASSERT(avbox_httpstream_seek(file, 100) == 0);
+	TEST_ASSERT((ret = avbox_httpstream_read(file, buf, 65536)) > 0);
+	TEST_ASSERT(test_check(buf, 100, ret));
+
+	avbox_httpstream_close(file);
+}
+
+
+static void
+test_prefetch(void)
+{
+	uint8_t buf[64 * 1024];
+	int requests;
+	const int64_t tail = TEST_SIZE - (512 * 1024);
+	const int64_t target = 2 * 1024 * 1024;
+	struct avbox_httpstream * const file = test_open();
+	TEST_ASSERT(file != NULL);
+
+	/* head, tail and a seek target in parallel */
+	TEST_ASSERT(avbox_httpstream_prefetch(file, 0, 64 * 1024) == 0);
+	TEST_ASSERT(avbox_httpstream_prefetch(file, tail, 1024 * 1024) == 0);
+	TEST_ASSERT(avbox_httpstream_prefetch(file, target, 256 * 1024) == 0);
+
+	/* the tail range is cut short at EOF */
+	TEST_ASSERT(avbox_httpstream_pread(file, buf, sizeof(buf), TEST_SIZE - 100) == 100);
+	TEST_ASSERT(test_check(buf, TEST_SIZE - 100, 100));
+	TEST_ASSERT(avbox_httpstream_prefetched(file, tail) >= TEST_SIZE);
+
+	TEST_ASSERT(test_pread(file, buf, sizeof(buf), target + 1000) == sizeof(buf));
+	TEST_ASSERT(test_check(buf, target + 1000, sizeof(buf)));
+	TEST_ASSERT(test_pread(file, buf, sizeof(buf), 10) == sizeof(buf) - 10);
+	TEST_ASSERT(test_check(buf, 10, sizeof(buf) - 10));
+
+	/* served from memory without hitting the server */
+	requests = test_requests();
+	TEST_ASSERT(avbox_httpstream_prefetch(file, tail + 4096, 4096) == 0);
+	TEST_ASSERT(avbox_httpstream_pread(file, buf, 4096, tail + 4096) == 4096);
+	TEST_ASSERT(test_check(buf, tail + 4096, 4096));
+	TEST_ASSERT(test_requests() == requests);
+
+	/* nothing there */
+	TEST_ASSERT(avbox_httpstream_prefetched(file, 1024 * 1024) == -1);
+	TEST_ASSERT(avbox_httpstream_pread(file, buf, sizeof(buf), 1024 * 1024) == 0);
+
+	/* the stream position is not affected */
+	TEST_ASSERT(avbox_httpstream_read(file, buf, 4096) == 4096);
+	TEST_ASSERT(test_check(buf, 0, 4096));
+
+	avbox_httpstream_close(file);
+}
+
+
+static void
+test_noranges(void)
+{
+	uint8_t buf[4096];
+	struct avbox_httpstream * const file = test_open();
+	TEST_ASSERT(file != NULL);
+
+	/* if the server ignores the range the prefetch fails */
+	server_ranges = 0;
+	TEST_ASSERT(avbox_httpstream_prefetch(file, 1024 * 1024, 64 * 1024) == 0);
+	TEST_ASSERT(avbox_httpstream_pread(file, buf, sizeof(buf), 1024 * 1024) == 0);
+	TEST_ASSERT(avbox_httpstream_prefetched(file, 1024 * 1024) == -1);
+	server_ranges = 1;
+
+	avbox_httpstream_close(file);
+}
+
+
+int
+main()
+{
+	log_setfile(stderr);
+	curl_global_init(CURL_GLOBAL_ALL);
+	test_server_start();
+	test_read();
+	test_prefetch();
+	test_noranges();
+	curl_global_cleanup();
+	return 0;
+}
@@ -1,7 +1,10 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
 #include <libavbox/avbox.h>
+#include <libavbox/audioclock.h>
 
 
 #define TEST_ASSERT(expr) \
@@ -11,7 +14,7 @@
 void
 test_queue()
 {
-	struct avbox_queue*const q = avbox_queue_new(100);
+	struct avbox_queue*const q = avbox_queue_new(100, AVBOX_QUEUEFLAGS_NONE);
 	TEST_ASSERT(q != NULL);
 
 	avbox_queue_put(q, (void*)1);
@@ -28,9 +31,171 @@ test_queue()
 }
 
 
+static void *
+test_queue_producer(void *arg)
+{
+	intptr_t i;
+	struct avbox_queue * const q = arg;
+	for (i = 1; i <= 100000; i++) {
+		while (avbox_queue_put(q, (void*) i) == -1) {
+			TEST_ASSERT(errno == EAGAIN);
+		}
+	}
+	avbox_queue_close(q);
+	return NULL;
+}
+
+
+static intptr_t test_queue_n;
+
+
+static void *
+test_queue_closer(void *arg)
+{
+	intptr_t i;
+	struct avbox_queue * const q = arg;
+	for (i = 1; i <= test_queue_n; i++) {
+		while (avbox_queue_put(q, (void*) i) == -1) {
+			TEST_ASSERT(errno == EAGAIN);
+		}
+	}
+	avbox_queue_close(q);
+	return NULL;
+}
+
+
+/**
+ * The producer closes the queue right after its last put.
+ * The consumer must still get every item.
+ */
+static void
+test_queue_spsc_close()
+{
+	int round;
+	intptr_t i, item;
+	pthread_t producer;
+	struct avbox_queue *q;
+
+	for (round = 0; round < 2000; round++) {
+		test_queue_n = 1 + (round % 13);
+		q = avbox_queue_new(4, AVBOX_QUEUEFLAGS_SPSC);
+		TEST_ASSERT(q != NULL);
+		TEST_ASSERT(pthread_create(&producer, NULL, test_queue_closer, q) == 0);
+		for (i = 0; 1;) {
+			if ((item = (intptr_t) avbox_queue_get(q)) == 0) {
+				if (errno == ESHUTDOWN) {
+					break;
+				}
+				TEST_ASSERT(errno == EAGAIN);
+				continue;
+			}
+			TEST_ASSERT(item == ++i);
+		}
+		TEST_ASSERT(i == test_queue_n);
+		pthread_join(producer, NULL);
+		avbox_queue_destroy(q);
+	}
+}
+
+
+void
+test_queue_spsc()
+{
+	intptr_t i, item;
+	pthread_t producer;
+	struct avbox_queue *q;
+
+	/* SPSC queues must be bounded */
+	TEST_ASSERT(avbox_queue_new(0, AVBOX_QUEUEFLAGS_SPSC) == NULL);
+
+	q = avbox_queue_new(100, AVBOX_QUEUEFLAGS_SPSC);
+	TEST_ASSERT(q != NULL);
+	TEST_ASSERT(avbox_queue_peek(q, 0) == NULL && errno == EAGAIN);
+
+	avbox_queue_put(q, (void*)1);
+	avbox_queue_put(q, (void*)2);
+	avbox_queue_put(q, (void*)3);
+	TEST_ASSERT(avbox_queue_count(q) == 3);
+
+	TEST_ASSERT((intptr_t)avbox_queue_peek(q, 0) == 1);
+	TEST_ASSERT((intptr_t)avbox_queue_get(q) == 1);
+	TEST_ASSERT((intptr_t)avbox_queue_get(q) == 2);
+	TEST_ASSERT((intptr_t)avbox_queue_get(q) == 3);
+	TEST_ASSERT(avbox_queue_timedpeek(q, 1000) == NULL && errno == EAGAIN);
+	avbox_queue_destroy(q);
+
+	/* a small queue so that both sides block */
+	q = avbox_queue_new(4, AVBOX_QUEUEFLAGS_SPSC);
+	TEST_ASSERT(q != NULL);
+	TEST_ASSERT(pthread_create(&producer, NULL, test_queue_producer, q) == 0);
+	for (i = 1; i <= 100000; i++) {
+		while ((item = (intptr_t) avbox_queue_get(q)) == 0) {
+			TEST_ASSERT(errno == EAGAIN);
+		}
+		TEST_ASSERT(item == i);
+	}
+	pthread_join(producer, NULL);
+	TEST_ASSERT(avbox_queue_get(q) == NULL && errno == ESHUTDOWN);
+	avbox_queue_destroy(q);
+
+	test_queue_spsc_close();
+}
+
+
+#define TEST_CLOCK_NOW		(1LL << 40)
+#define TEST_CLOCK_SAMPLES	(1000000)
+
+static int test_clock_done;
+
+
+static void *
+test_audioclock_writer(void *arg)
+{
+	int64_t i;
+	struct avbox_audioclock * const clock = arg;
+	for (i = 1; i <= TEST_CLOCK_SAMPLES; i++) {
+		avbox_audioclock_set(clock, i, i, 2 * TEST_CLOCK_NOW);
+	}
+	ATOMIC_STORE_RELEASE(&test_clock_done, 1);
+	return NULL;
+}
+
+
+void
+test_audioclock()
+{
+	pthread_t writer;
+	struct avbox_audioclock clock;
+
+	avbox_audioclock_init(&clock, 100);
+	TEST_ASSERT(avbox_audioclock_gettime(&clock, 5000) == 100);
+
+	/* runs from the anchor up to the limit */
+	avbox_audioclock_set(&clock, 1000, 5000, 1500);
+	TEST_ASSERT(avbox_audioclock_gettime(&clock, 4000) == 1000);
+	TEST_ASSERT(avbox_audioclock_gettime(&clock, 5200) == 1200);
+	TEST_ASSERT(avbox_audioclock_gettime(&clock, 9000) == 1500);
+
+	avbox_audioclock_stop(&clock, 1300);
+	TEST_ASSERT(avbox_audioclock_gettime(&clock, 9000) == 1300);
+
+	/* every sample has time == anchor so if we ever see a
+	 * torn one the result will be off */
+	test_clock_done = 0;
+	avbox_audioclock_set(&clock, 0, 0, 2 * TEST_CLOCK_NOW);
+	TEST_ASSERT(pthread_create(&writer, NULL, test_audioclock_writer, &clock) == 0);
+	while (!ATOMIC_LOAD_ACQUIRE(&test_clock_done)) {
+		TEST_ASSERT(avbox_audioclock_gettime(&clock, TEST_CLOCK_NOW) == TEST_CLOCK_NOW);
+	}
+	pthread_join(writer, NULL);
+}
+
+
 int
 main()
 {
 	test_queue();
+	test_queue_spsc();
+	test_audioclock();
 	return 0;
 }
@@ -0,0 +1,332 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <libavformat/avio.h>
+#include <libavbox/avbox.h>
+#include <libavbox/streamcache.h>
+
+
+#define TEST_ASSERT(expr) \
+	do { if (!(expr)) { abort(); } } while(0)
+
+/* a little over 1MiB of RAM and 2MiB of spill file */
+#define TEST_SIZE	(5 * 1024 * 1024 + 1234)
+#define TEST_LATENCY	(200)
+
+
+static char test_dir[] = "/tmp/test-streamcacheXXXXXX";
+static int test_seeks;
+static int test_closed;
+static pthread_mutex_t test_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*
+ * The cache reads its limits from the settings database and
+ * spills to the state directory. Point them somewhere small.
+ */
+int
+avbox_settings_getint(const char * key, const int defvalue)
+{
+	if (!strcmp(key, "stream_cache_ram")) {
+		return 1;
+	} else if (!strcmp(key, "stream_cache_disk")) {
+		return 2;
+	} else if (!strcmp(key, "stream_cache_prebuffer")) {
+		return 64;
+	}
+	return defvalue;
+}
+
+
+char *
+getstatedir()
+{
+	return strdup(test_dir);
+}
+
+
+int
+mkdir_p(const char * const path, mode_t mode)
+{
+	return (mkdir(path, mode) == -1 && errno != EEXIST) ? -1 : 0;
+}
+
+
+static uint8_t
+test_byte(const int64_t i)
+{
+	return (uint8_t) ((i * 31) + (i / 251));
+}
+
+
+static int
+test_check(const uint8_t * const buf, const int64_t offset, const size_t len)
+{
+	size_t i;
+	for (i = 0; i < len; i++) {
+		if (buf[i] != test_byte(offset + i)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+
+/**
+ * A slow source that makes up the data.
+ */
+struct test_source
+{
+	int64_t pos;
+};
+
+
+static ssize_t
+test_source_read(void *self, void *buf, size_t bufsz)
+{
+	size_t i;
+	struct test_source * const src = self;
+	usleep(TEST_LATENCY);
+	bufsz = MIN(bufsz, (size_t) (TEST_SIZE - src->pos));
+	for (i = 0; i < bufsz; i++) {
+		((uint8_t*) buf)[i] = test_byte(src->pos + i);
+	}
+	src->pos += bufsz;
+	return bufsz;
+}
+
+
+static int
+test_source_seek(void *self, int64_t pos)
+{
+	struct test_source * const src = self;
+	pthread_mutex_lock(&test_lock);
+	test_seeks++;
+	pthread_mutex_unlock(&test_lock);
+	src->pos = pos;
+	return 0;
+}
+
+
+static int64_t
+test_source_size(void *self)
+{
+	(void) self;
+	return TEST_SIZE;
+}
+
+
+static void
+test_source_close(void *self)
+{
+	pthread_mutex_lock(&test_lock);
+	test_closed++;
+	pthread_mutex_unlock(&test_lock);
+	free(self);
+}
+
+
+static struct avbox_player_stream *
+test_open(struct avbox_player_stream * const stream)
+{
+	struct avbox_streamcache_source source;
+	struct test_source * const src = calloc(1, sizeof(struct test_source));
+	TEST_ASSERT(src != NULL);
+	memset(&source, 0, sizeof(source));
+	source.self = src;
+	source.read = test_source_read;
+	source.seek = test_source_seek;
+	source.size = test_source_size;
+	source.close = test_source_close;
+	return avbox_streamcache_opensource(&source, NULL, stream);
+}
+
+
+static int
+test_getseeks(void)
+{
+	int ret;
+	pthread_mutex_lock(&test_lock);
+	ret = test_seeks;
+	pthread_mutex_unlock(&test_lock);
+	return ret;
+}
+
+
+/**
+ * Finds the (unlinked) spill file among our open
+ * files and returns its size.
+ */
+static int64_t
+test_spillsize(void)
+{
+	DIR *dir;
+	struct dirent *ent;
+	struct stat st;
+	int64_t size = -1;
+	char path[PATH_MAX], target[PATH_MAX], prefix[PATH_MAX];
+
+	snprintf(prefix, sizeof(prefix), "%s/cache/stream", test_dir);
+	TEST_ASSERT((dir = opendir("/proc/self/fd")) != NULL);
+	while ((ent = readdir(dir)) != NULL) {
+		ssize_t len;
+		snprintf(path, sizeof(path), "/proc/self/fd/%s", ent->d_name);
+		if ((len = readlink(path, target, sizeof(target) - 1)) == -1) {
+			continue;
+		}
+		target[len] = '\0';
+		if (!strncmp(target, prefix, strlen(prefix))) {
+			TEST_ASSERT(stat(path, &st) == 0);
+			size = st.st_size;
+		}
+	}
+	closedir(dir);
+	return size;
+}
+
+
+/**
+ * Reads len bytes at offset and checks them.
+ */
+static void
+test_readat(AVIOContext * const avio, const int64_t offset, const int len)
+{
+	static uint8_t buf[256 * 1024];
+	TEST_ASSERT(len <= (int) sizeof(buf));
+	TEST_ASSERT(avio_seek(avio, offset, SEEK_SET) == offset);
+	TEST_ASSERT(avio_read(avio, buf, len) == len);
+	TEST_ASSERT(test_check(buf, offset, len));
+}
+
+
+static void
+test_read(void)
+{
+	static uint8_t buf[64 * 1024];
+	int ret, seeks;
+	int64_t offset = 0;
+	struct avbox_player_stream stream;
+	AVIOContext *avio;
+
+	TEST_ASSERT(test_open(&stream) != NULL);
+	avio = stream.avio;
+	TEST_ASSERT(avio_size(avio) == TEST_SIZE);
+
+	/* read it all sequentially */
+	while ((ret = avio_read(avio, buf, sizeof(buf))) > 0) {
+		TEST_ASSERT(test_check(buf, offset, ret));
+		offset += ret;
+	}
+	TEST_ASSERT(offset == TEST_SIZE);
+	TEST_ASSERT(avio_feof(avio));
+
+	/* the spill file wraps instead of growing */
+	TEST_ASSERT(test_spillsize() > 0);
+	TEST_ASSERT(test_spillsize() <= 2 * 1024 * 1024);
+
+	/* the last 1MiB is in RAM and the 2MiB before
+	 * that in the spill file */
+	seeks = test_getseeks();
+	test_readat(avio, TEST_SIZE - (512 * 1024), 128 * 1024);
+	test_readat(avio, TEST_SIZE - (2048 * 1024), 256 * 1024);
+	test_readat(avio, TEST_SIZE - (2048 * 1024) + 100, 1000);
+	TEST_ASSERT(test_getseeks() == seeks);
+
+	/* outside the window the source is restarted */
+	test_readat(avio, 1000, 200 * 1024);
+	TEST_ASSERT(test_getseeks() == seeks + 1);
+
+	/* short forward skips read through */
+	test_readat(avio, 1000 + (300 * 1024), 1000);
+	TEST_ASSERT(test_getseeks() == seeks + 1);
+
+	/* once closed reads fail */
+	stream.close(stream.self);
+	TEST_ASSERT(avio_seek(avio, 0, SEEK_SET) == 0);
+	TEST_ASSERT(avio_read(avio, buf, sizeof(buf)) <= 0);
+	stream.destroy(stream.self);
+	TEST_ASSERT(test_closed == 1);
+}
+
+
+/**
+ * Opens and destroys streams before the filler gets
+ * going to shake out startup races.
+ */
+static void
+test_openclose(void)
+{
+	int i;
+	uint8_t buf[1024];
+	struct avbox_player_stream stream;
+
+	test_closed = 0;
+	for (i = 0; i < 100; i++) {
+		TEST_ASSERT(test_open(&stream) != NULL);
+		if (i & 1) {
+			TEST_ASSERT(avio_read(stream.avio, buf, sizeof(buf)) == sizeof(buf));
+			TEST_ASSERT(test_check(buf, 0, sizeof(buf)));
+		}
+		stream.destroy(stream.self);
+	}
+	TEST_ASSERT(test_closed == 100);
+}
+
+
+/**
+ * Opens a local file through the cache.
+ */
+static void
+test_file(void)
+{
+	int fd;
+	int64_t offset;
+	char path[PATH_MAX];
+	static uint8_t buf[64 * 1024];
+	struct avbox_player_stream stream;
+
+	snprintf(path, sizeof(path), "%s/test.bin", test_dir);
+	TEST_ASSERT((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)) != -1);
+	for (offset = 0; offset < TEST_SIZE; offset += sizeof(buf)) {
+		const size_t n = MIN(sizeof(buf), TEST_SIZE - offset);
+		size_t i;
+		for (i = 0; i < n; i++) {
+			buf[i] = test_byte(offset + i);
+		}
+		TEST_ASSERT(write(fd, buf, n) == (ssize_t) n);
+	}
+	close(fd);
+
+	TEST_ASSERT(avbox_streamcache_open(path, NULL, &stream) != NULL);
+	TEST_ASSERT(avio_size(stream.avio) == TEST_SIZE);
+	test_readat(stream.avio, 0, 256 * 1024);
+	test_readat(stream.avio, TEST_SIZE - 1000, 1000);
+	test_readat(stream.avio, 4096, 4096);
+	stream.destroy(stream.self);
+
+	TEST_ASSERT(unlink(path) == 0);
+}
+
+
+int
+main()
+{
+	char path[PATH_MAX];
+	log_setfile(stderr);
+	TEST_ASSERT(mkdtemp(test_dir) != NULL);
+	test_read();
+	test_openclose();
+	test_file();
+	snprintf(path, sizeof(path), "%s/cache", test_dir);
+	rmdir(path);
+	rmdir(test_dir);
+	return 0;
+}
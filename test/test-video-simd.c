@@ -0,0 +1,331 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <libavbox/avbox.h>
+
+
+#define TEST_ASSERT(expr) \
+	do { if (!(expr)) { abort(); } } while(0)
+
+/* max difference allowed against swscale output */
+#define SWSCALE_TOLERANCE	(3)
+
+/* odd sizes so that the scalar tails get exercised */
+#define TEST_W	(1918)
+#define TEST_H	(37)
+
+
+static unsigned int seed = 1;
+
+
+static uint8_t
+test_rand(void)
+{
+	seed = (seed * 1103515245) + 12345;
+	return (seed >> 16) & 0xFF;
+}
+
+
+static uint8_t *
+test_image(const int pitch, const int h)
+{
+	int i;
+	uint8_t * const buf = malloc(pitch * h);
+	TEST_ASSERT(buf != NULL);
+	for (i = 0; i < pitch * h; i++) {
+		buf[i] = test_rand();
+	}
+	return buf;
+}
+
+
+/**
+ * Run all kernels with the current instruction set
+ * and return the output in one buffer.
+ */
+static uint8_t *
+test_run_kernels(uint8_t * const * const yuv, const int * const yuv_pitch,
+	uint8_t * const bgra, uint8_t * const overlay)
+{
+	int pitch = TEST_W * 4;
+	const size_t sz = pitch * TEST_H;
+	uint8_t * const out = malloc(sz * 6);
+	struct avbox_video_scaler scaler;
+
+	TEST_ASSERT(out != NULL);
+	memset(out, 0, sz * 6);
+	avbox_video_scaler_init(&scaler);
+
+	/* colorspace conversion */
+	avbox_video_simd_yuv420p2bgra(out, pitch,
+		(const uint8_t * const *) yuv, yuv_pitch, TEST_W, TEST_H);
+
+	/* upscale, downscale and convert+scale */
+	TEST_ASSERT(avbox_video_simd_scale(&scaler, out + sz, pitch,
+		TEST_W, TEST_H, AVBOX_PIXFMT_BGRA,
+		(const uint8_t * const *) &bgra, &pitch, 853, 17) == 0);
+	TEST_ASSERT(avbox_video_simd_scale(&scaler, out + (sz * 2), pitch,
+		1001, 19, AVBOX_PIXFMT_BGRA,
+		(const uint8_t * const *) &bgra, &pitch, TEST_W, TEST_H) == 0);
+	TEST_ASSERT(avbox_video_simd_scale(&scaler, out + (sz * 3), pitch,
+		TEST_W, TEST_H, AVBOX_PIXFMT_YUV420P,
+		(const uint8_t * const *) yuv, yuv_pitch, 1279, 23) == 0);
+	TEST_ASSERT(avbox_video_simd_scale(&scaler, out + (sz * 4), pitch,
+		TEST_W, TEST_H, AVBOX_PIXFMT_YUV420P,
+		(const uint8_t * const *) yuv, yuv_pitch, TEST_W, TEST_H) == 0);
+
+	/* alpha blending */
+	memcpy(out + (sz * 5), bgra, sz);
+	avbox_video_simd_blend(out + (sz * 5), pitch, overlay, pitch, TEST_W, TEST_H);
+
+	avbox_video_scaler_free(&scaler);
+	return out;
+}
+
+
+/**
+ * Check that all kernels produce the same output as
+ * the scalar code.
+ */
+static void
+test_kernels(uint8_t * const * const yuv, const int * const yuv_pitch,
+	uint8_t * const bgra, uint8_t * const overlay)
+{
+	int i;
+	const size_t sz = TEST_W * 4 * TEST_H * 6;
+	const unsigned int isets[] = { AVBOX_SIMD_SSE2, AVBOX_SIMD_AVX2, AVBOX_SIMD_NEON };
+	uint8_t *ref, *out;
+
+	TEST_ASSERT(avbox_video_simd_init(AVBOX_SIMD_SCALAR) == AVBOX_SIMD_SCALAR);
+	ref = test_run_kernels(yuv, yuv_pitch, bgra, overlay);
+
+	for (i = 0; i < sizeof(isets) / sizeof(isets[0]); i++) {
+		if (avbox_video_simd_init(isets[i]) != isets[i]) {
+			fprintf(stderr, "test-video-simd: Skipping instruction set 0x%x\n",
+				isets[i]);
+			continue;
+		}
+		out = test_run_kernels(yuv, yuv_pitch, bgra, overlay);
+		if (memcmp(ref, out, sz)) {
+			fprintf(stderr, "test-video-simd: %s output differs!\n",
+				avbox_video_simd_name());
+			abort();
+		}
+		free(out);
+	}
+	free(ref);
+}
+
+
+/**
+ * Convert and scale the image as YUV420P and in the given
+ * layout and check that both come out the same.
+ */
+static void
+test_layout(const unsigned int pix_fmt,
+	uint8_t * const * const yuv, const int * const yuv_pitch,
+	uint8_t * const * const planes, const int * const pitches)
+{
+	int pitch = TEST_W * 4;
+	const size_t sz = pitch * TEST_H;
+	uint8_t * const ref = malloc(sz * 2);
+	uint8_t * const out = malloc(sz * 2);
+	struct avbox_video_scaler scaler;
+
+	TEST_ASSERT(ref != NULL && out != NULL);
+	memset(ref, 0, sz * 2);
+	memset(out, 0, sz * 2);
+	avbox_video_scaler_init(&scaler);
+
+	TEST_ASSERT(avbox_video_simd_yuv2bgra(&scaler, ref, pitch,
+		AVBOX_PIXFMT_YUV420P, (const uint8_t * const *) yuv, yuv_pitch,
+		TEST_W, TEST_H) == 0);
+	TEST_ASSERT(avbox_video_simd_scale(&scaler, ref + sz, pitch,
+		TEST_W, TEST_H, AVBOX_PIXFMT_YUV420P,
+		(const uint8_t * const *) yuv, yuv_pitch, 1279, 23) == 0);
+
+	TEST_ASSERT(avbox_video_simd_yuv2bgra(&scaler, out, pitch,
+		pix_fmt, (const uint8_t * const *) planes, pitches,
+		TEST_W, TEST_H) == 0);
+	TEST_ASSERT(avbox_video_simd_scale(&scaler, out + sz, pitch,
+		TEST_W, TEST_H, pix_fmt,
+		(const uint8_t * const *) planes, pitches, 1279, 23) == 0);
+
+	if (memcmp(ref, out, sz * 2)) {
+		fprintf(stderr, "test-video-simd: %s output differs for format %u!\n",
+			avbox_video_simd_name(), pix_fmt);
+		abort();
+	}
+
+	avbox_video_scaler_free(&scaler);
+	free(ref);
+	free(out);
+}
+
+
+/**
+ * Reduce YUV420P10 chroma to NV12 and check that it comes
+ * out the same as the 8 bit NV12 plane.
+ */
+static void
+test_mergeuv16(uint8_t * const * const p10, const int * const p10_pitch,
+	const uint8_t * const nv12, const int nv12_pitch, const int cw, const int ch)
+{
+	int y;
+	const int pitch = (cw * 2) + 3;
+	uint8_t * const out = malloc(pitch * ch);
+
+	TEST_ASSERT(out != NULL);
+	avbox_video_simd_mergeuv16(out, pitch, p10[1], p10_pitch[1],
+		p10[2], p10_pitch[2], cw, ch, 2);
+	for (y = 0; y < ch; y++) {
+		if (memcmp(out + (y * pitch), nv12 + (y * nv12_pitch), cw * 2)) {
+			fprintf(stderr, "test-video-simd: %s mergeuv16 output differs!\n",
+				avbox_video_simd_name());
+			abort();
+		}
+	}
+	free(out);
+}
+
+
+/**
+ * Check that NV12, P010 and YUV420P10 images holding the
+ * same samples as the YUV420P one convert the same with
+ * all instruction sets. The extra bits of the 10 bit formats
+ * are random since they should be dropped.
+ */
+static void
+test_layouts(uint8_t * const * const yuv, const int * const yuv_pitch)
+{
+	int i, x, y;
+	const int cw = (TEST_W + 1) >> 1, ch = (TEST_H + 1) >> 1;
+	const unsigned int isets[] = { AVBOX_SIMD_SCALAR,
+		AVBOX_SIMD_SSE2, AVBOX_SIMD_AVX2, AVBOX_SIMD_NEON };
+	uint8_t *nv12[2], *p010[2], *p10[3];
+	const int nv12_pitch[2] = { yuv_pitch[0], (cw * 2) + 5 };
+	const int p010_pitch[2] = { (TEST_W * 2) + 6, (cw * 4) + 2 };
+	const int p10_pitch[3] = { (TEST_W * 2) + 4, (cw * 2) + 8, (cw * 2) + 8 };
+
+	nv12[0] = yuv[0];
+	nv12[1] = test_image(nv12_pitch[1], ch);
+	p010[0] = test_image(p010_pitch[0], TEST_H);
+	p010[1] = test_image(p010_pitch[1], ch);
+	p10[0] = test_image(p10_pitch[0], TEST_H);
+	p10[1] = test_image(p10_pitch[1], ch);
+	p10[2] = test_image(p10_pitch[2], ch);
+
+	for (y = 0; y < TEST_H; y++) {
+		const uint8_t * const src = yuv[0] + (y * yuv_pitch[0]);
+		uint16_t * const hi = (uint16_t*) (p010[0] + (y * p010_pitch[0]));
+		uint16_t * const lo = (uint16_t*) (p10[0] + (y * p10_pitch[0]));
+		for (x = 0; x < TEST_W; x++) {
+			hi[x] = (src[x] << 8) | (test_rand() & 0xC0);
+			lo[x] = (src[x] << 2) | (test_rand() & 0x03);
+		}
+	}
+	for (y = 0; y < ch; y++) {
+		const uint8_t * const u = yuv[1] + (y * yuv_pitch[1]);
+		const uint8_t * const v = yuv[2] + (y * yuv_pitch[2]);
+		uint8_t * const uv = nv12[1] + (y * nv12_pitch[1]);
+		uint16_t * const uv16 = (uint16_t*) (p010[1] + (y * p010_pitch[1]));
+		uint16_t * const u16 = (uint16_t*) (p10[1] + (y * p10_pitch[1]));
+		uint16_t * const v16 = (uint16_t*) (p10[2] + (y * p10_pitch[2]));
+		for (x = 0; x < cw; x++) {
+			uv[(x * 2) + 0] = u[x];
+			uv[(x * 2) + 1] = v[x];
+			uv16[(x * 2) + 0] = (u[x] << 8) | (test_rand() & 0xC0);
+			uv16[(x * 2) + 1] = (v[x] << 8) | (test_rand() & 0xC0);
+			u16[x] = (u[x] << 2) | (test_rand() & 0x03);
+			v16[x] = (v[x] << 2) | (test_rand() & 0x03);
+		}
+	}
+
+	for (i = 0; i < sizeof(isets) / sizeof(isets[0]); i++) {
+		if (avbox_video_simd_init(isets[i]) != isets[i]) {
+			continue;
+		}
+		test_layout(AVBOX_PIXFMT_NV12, yuv, yuv_pitch, nv12, nv12_pitch);
+		test_layout(AVBOX_PIXFMT_P010, yuv, yuv_pitch, p010, p010_pitch);
+		test_layout(AVBOX_PIXFMT_YUV420P10, yuv, yuv_pitch, p10, p10_pitch);
+		test_mergeuv16(p10, p10_pitch, nv12[1], nv12_pitch[1], cw, ch);
+	}
+
+	free(nv12[1]);
+	free(p010[0]);
+	free(p010[1]);
+	free(p10[0]);
+	free(p10[1]);
+	free(p10[2]);
+}
+
+
+/**
+ * Compare the colorspace conversion against swscale.
+ */
+static void
+test_swscale(uint8_t * const * const yuv, const int * const yuv_pitch)
+{
+	int i, pitch = TEST_W * 4, maxdiff = 0;
+	const size_t sz = pitch * TEST_H;
+	uint8_t * const ref = malloc(sz);
+	uint8_t * const out = malloc(sz);
+	struct SwsContext *sws;
+
+	TEST_ASSERT(ref != NULL && out != NULL);
+
+	sws = sws_getContext(TEST_W, TEST_H, AV_PIX_FMT_YUV420P,
+		TEST_W, TEST_H, AV_PIX_FMT_BGRA, SWS_FAST_BILINEAR,
+		NULL, NULL, NULL);
+	TEST_ASSERT(sws != NULL);
+	sws_scale(sws, (const uint8_t * const *) yuv, yuv_pitch,
+		0, TEST_H, (uint8_t * const *) &ref, &pitch);
+	sws_freeContext(sws);
+
+	avbox_video_simd_init(AVBOX_SIMD_ALL);
+	avbox_video_simd_yuv420p2bgra(out, pitch,
+		(const uint8_t * const *) yuv, yuv_pitch, TEST_W, TEST_H);
+
+	for (i = 0; i < sz; i++) {
+		maxdiff = MAX(maxdiff, abs(ref[i] - out[i]));
+	}
+	fprintf(stderr, "test-video-simd: Max difference from swscale: %i\n",
+		maxdiff);
+	TEST_ASSERT(maxdiff <= SWSCALE_TOLERANCE);
+
+	free(ref);
+	free(out);
+}
+
+
+int
+main()
+{
+	int i;
+	uint8_t *yuv[3];
+	const int yuv_pitch[3] = { TEST_W + 2, (TEST_W >> 1) + 3, (TEST_W >> 1) + 3 };
+	uint8_t * const bgra = test_image(TEST_W * 4, TEST_H);
+	uint8_t * const overlay = test_image(TEST_W * 4, TEST_H);
+
+	yuv[0] = test_image(yuv_pitch[0], TEST_H);
+	yuv[1] = test_image(yuv_pitch[1], (TEST_H + 1) >> 1);
+	yuv[2] = test_image(yuv_pitch[2], (TEST_H + 1) >> 1);
+
+	/* make the overlay premultiplied */
+	for (i = 0; i < TEST_W * TEST_H * 4; i += 4) {
+		overlay[i + 0] = (overlay[i + 0] * overlay[i + 3]) / 255;
+		overlay[i + 1] = (overlay[i + 1] * overlay[i + 3]) / 255;
+		overlay[i + 2] = (overlay[i + 2] * overlay[i + 3]) / 255;
+	}
+
+	test_kernels(yuv, yuv_pitch, bgra, overlay);
+	test_layouts(yuv, yuv_pitch);
+	test_swscale(yuv, yuv_pitch);
+
+	free(yuv[0]);
+	free(yuv[1]);
+	free(yuv[2]);
+	free(bgra);
+	free(overlay);
+	return 0;
+}
@@ -0,0 +1,224 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <libavformat/avformat.h>
+#include <libavutil/imgutils.h>
+#include <libavbox/avbox.h>
+#include <libavbox/ui/videodec.h>
+
+
+#define TEST_ASSERT(expr) \
+	do { if (!(expr)) { abort(); } } while(0)
+
+#define TEST_W		(16)
+#define TEST_H		(16)
+#define TEST_MAXFRAMES	(AVBOX_VIDEODEC_REPLAY_MAX * 2)
+
+
+/* number of packets the fake hardware decoder takes before failing */
+static int test_hw_fail_at;
+static int test_hw_packets;
+
+
+char *
+avbox_settings_getstring(const char * const key)
+{
+	(void) key;
+	return NULL;
+}
+
+
+/**
+ * A hardware decoder that buffers every packet without
+ * outputing anything and then fails.
+ */
+static int
+test_hw_decode(AVCodecContext *ctx, void *data, int *got_frame, AVPacket *pkt)
+{
+	(void) ctx;
+	(void) data;
+	*got_frame = 0;
+	if (test_hw_packets++ == test_hw_fail_at) {
+		return AVERROR(EIO);
+	}
+	return pkt->size;
+}
+
+
+static AVCodec test_hw_codec =
+{
+	.name = "test_hw",
+	.type = AVMEDIA_TYPE_VIDEO,
+	.id = AV_CODEC_ID_RAWVIDEO,
+	.decode = test_hw_decode,
+};
+
+
+static int
+test_hw_supported(const AVCodecParameters * const par)
+{
+	(void) par;
+	return 1;
+}
+
+
+static AVCodecContext *
+test_hw_open(AVFormatContext * const fmt_ctx,
+	const int stream_idx, const int threads)
+{
+	AVCodecContext *ctx;
+	(void) threads;
+	TEST_ASSERT((ctx = avcodec_alloc_context3(&test_hw_codec)) != NULL);
+	TEST_ASSERT(avcodec_parameters_to_context(ctx,
+		fmt_ctx->streams[stream_idx]->codecpar) >= 0);
+	TEST_ASSERT(avcodec_open2(ctx, &test_hw_codec, NULL) == 0);
+	return ctx;
+}
+
+
+static const struct avbox_videodec test_hw =
+{
+	"test_hw", test_hw_supported, NULL, test_hw_open, NULL
+};
+
+
+static AVFormatContext *
+test_format(void)
+{
+	AVStream *st;
+	AVFormatContext *fmt_ctx;
+	TEST_ASSERT((fmt_ctx = avformat_alloc_context()) != NULL);
+	TEST_ASSERT((st = avformat_new_stream(fmt_ctx, NULL)) != NULL);
+	st->time_base = (AVRational) { 1, 25 };
+	st->codecpar->codec_type = AVMEDIA_TYPE_VIDEO;
+	st->codecpar->codec_id = AV_CODEC_ID_RAWVIDEO;
+	st->codecpar->format = AV_PIX_FMT_YUV420P;
+	st->codecpar->width = TEST_W;
+	st->codecpar->height = TEST_H;
+	return fmt_ctx;
+}
+
+
+/**
+ * Makes a frame filled with its number.
+ */
+static AVPacket *
+test_packet(const int i, const int key)
+{
+	AVPacket *pkt;
+	const int sz = av_image_get_buffer_size(AV_PIX_FMT_YUV420P, TEST_W, TEST_H, 1);
+	TEST_ASSERT((pkt = av_packet_alloc()) != NULL);
+	TEST_ASSERT(av_new_packet(pkt, sz) == 0);
+	memset(pkt->data, i & 0xff, sz);
+	pkt->pts = pkt->dts = i;
+	pkt->flags = key ? AV_PKT_FLAG_KEY : 0;
+	return pkt;
+}
+
+
+/**
+ * Feeds n packets to the fake hardware decoder through the
+ * same functions that the player uses and returns the number
+ * of frames that came out. Their timestamps are stored in out.
+ */
+static int
+test_decode(const int n, const int key_interval, int64_t * const out)
+{
+	int i = 0, ret, n_out = 0;
+	struct avbox_videodec_state vdec;
+	AVFormatContext * const fmt_ctx = test_format();
+	AVFrame *frame;
+	AVPacket *packet;
+
+	TEST_ASSERT((frame = av_frame_alloc()) != NULL);
+	test_hw_packets = 0;
+
+	TEST_ASSERT(avbox_videodec_open(&vdec, fmt_ctx, 0, &test_hw, 1) == 0);
+	TEST_ASSERT(vdec.backend == &test_hw);
+
+	while (i < n || avbox_videodec_replaying(&vdec)) {
+		if (avbox_videodec_replaying(&vdec)) {
+			ret = avbox_videodec_send(&vdec, NULL);
+		} else {
+			packet = test_packet(i, (i % key_interval) == 0);
+			ret = avbox_videodec_send(&vdec, packet);
+			av_packet_free(&packet);
+			i++;
+		}
+		TEST_ASSERT(ret == 0);
+
+		while ((ret = avbox_videodec_receive(&vdec, frame)) == 0) {
+			TEST_ASSERT(vdec.backend == avbox_videodec_software());
+			TEST_ASSERT(n_out < TEST_MAXFRAMES);
+			TEST_ASSERT(frame->data[0][0] == (frame->pkt_dts & 0xff));
+			out[n_out++] = frame->pkt_dts;
+			av_frame_unref(frame);
+		}
+		TEST_ASSERT(ret == AVERROR(EAGAIN));
+	}
+
+	TEST_ASSERT(vdec.backend == avbox_videodec_software());
+	avbox_videodec_close(&vdec);
+	avformat_free_context(fmt_ctx);
+	av_frame_free(&frame);
+	return n_out;
+}
+
+
+/**
+ * The hardware decoder fails mid-GOP. The software decoder
+ * must start at the last keyframe.
+ */
+static void
+test_fallback(void)
+{
+	int i;
+	int64_t out[TEST_MAXFRAMES];
+
+	test_hw_fail_at = 6;
+	TEST_ASSERT(test_decode(10, 4, out) == 6);
+	for (i = 0; i < 6; i++) {
+		TEST_ASSERT(out[i] == 4 + i);
+	}
+
+	/* failing on the first packet */
+	test_hw_fail_at = 0;
+	TEST_ASSERT(test_decode(10, 4, out) == 10);
+	for (i = 0; i < 10; i++) {
+		TEST_ASSERT(out[i] == i);
+	}
+}
+
+
+/**
+ * The hardware decoder takes more packets than can be kept.
+ * The software decoder must wait for the next keyframe.
+ */
+static void
+test_overflow(void)
+{
+	int i;
+	int64_t out[TEST_MAXFRAMES];
+	const int key = AVBOX_VIDEODEC_REPLAY_MAX + 10;
+
+	test_hw_fail_at = AVBOX_VIDEODEC_REPLAY_MAX + 5;
+	TEST_ASSERT(test_decode(key + 5, key, out) == 5);
+	for (i = 0; i < 5; i++) {
+		TEST_ASSERT(out[i] == key + i);
+	}
+}
+
+
+int
+main()
+{
+	log_setfile(stderr);
+#if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(58, 9, 100)
+	avcodec_register_all();
+#endif
+	test_fallback();
+	test_overflow();
+	return 0;
+}